@@ -0,0 +1,81 @@
+/* This file was generated automatically */
+#include "qe.h"
+#undef qe_module_init
+#define qe_module_init(fn)  extern int module_##fn(void)
+qe_module_init(search_init);
+qe_module_init(hex_init);
+qe_module_init(parser_init);
+qe_module_init(extras_init);
+qe_module_init(vars_init);
+qe_module_init(tty_init);
+qe_module_init(charset_jis_init);
+qe_module_init(charset_more_init);
+qe_module_init(unihex_init);
+qe_module_init(bufed_init);
+qe_module_init(mkd_init);
+qe_module_init(c_init);
+qe_module_init(xml_init);
+qe_module_init(htmlsrc_init);
+qe_module_init(arm_modes_init);
+qe_module_init(lisp_init);
+qe_module_init(makefile_init);
+qe_module_init(sql_init);
+qe_module_init(ocaml_init);
+qe_module_init(ini_init);
+qe_module_init(shell_script_init);
+qe_module_init(rust_init);
+qe_module_init(swift_init);
+qe_module_init(groovy_init);
+qe_module_init(haskell_init);
+qe_module_init(lua_init);
+qe_module_init(python_init);
+qe_module_init(ruby_init);
+qe_module_init(extra_modes_init);
+qe_module_init(shell_init);
+qe_module_init(dired_init);
+qe_module_init(archive_compress_init);
+qe_module_init(latex_init);
+qe_module_init(html_init);
+qe_module_init(docbook_init);
+qe_module_init(stb_init);
+#undef qe_module_init
+void init_all_modules(void) {
+#define qe_module_init(fn)  module_##fn()
+qe_module_init(search_init);
+qe_module_init(hex_init);
+qe_module_init(parser_init);
+qe_module_init(extras_init);
+qe_module_init(vars_init);
+qe_module_init(tty_init);
+qe_module_init(charset_jis_init);
+qe_module_init(charset_more_init);
+qe_module_init(unihex_init);
+qe_module_init(bufed_init);
+qe_module_init(mkd_init);
+qe_module_init(c_init);
+qe_module_init(xml_init);
+qe_module_init(htmlsrc_init);
+qe_module_init(arm_modes_init);
+qe_module_init(lisp_init);
+qe_module_init(makefile_init);
+qe_module_init(sql_init);
+qe_module_init(ocaml_init);
+qe_module_init(ini_init);
+qe_module_init(shell_script_init);
+qe_module_init(rust_init);
+qe_module_init(swift_init);
+qe_module_init(groovy_init);
+qe_module_init(haskell_init);
+qe_module_init(lua_init);
+qe_module_init(python_init);
+qe_module_init(ruby_init);
+qe_module_init(extra_modes_init);
+qe_module_init(shell_init);
+qe_module_init(dired_init);
+qe_module_init(archive_compress_init);
+qe_module_init(latex_init);
+qe_module_init(html_init);
+qe_module_init(docbook_init);
+qe_module_init(stb_init);
+#undef qe_module_init
+}
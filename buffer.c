@@ -27,106 +27,742 @@
 #ifdef CONFIG_MMAP
 #include <sys/mman.h>
 #endif
+#ifndef CONFIG_WIN32
+#include <sys/uio.h>
+#endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size);
+                      qe_off_t offset, qe_off_t size);
+static void eb_load_stop(EditBuffer *b, int err);
 
 /************************************************************/
 /* basic access to the edit buffer */
 
+/* mark pages from index 'lo' up to 'hi' (excluded) for reindexing */
+static inline void eb_invalidate_pages(EditBuffer *b, int lo, int hi)
+{
+    if (b->page_tree_lo > lo)
+        b->page_tree_lo = lo;
+    if (b->page_tree_hi < hi)
+        b->page_tree_hi = hi;
+}
+
+/* page lookup criteria for page_tree_find() and map_pos_find() */
+enum {
+    PAGE_FIND_OFFSET,   /* page containing byte offset n1 */
+    PAGE_FIND_CHAR,     /* page containing char number n1 */
+    PAGE_FIND_POS,      /* page where position line n1, column n2 ends */
+};
+
+/* Positions in the read-only extents of file mappings: lookups in
+ * large extents scan from the closest known position, and remember
+ * the positions passed every MAP_POS_STEP bytes.
+ */
+#define MAP_POS_CACHE_SIZE  64
+#define MAP_POS_STEP        (16 * 1024)
+
+/* find the closest known position of page 'p' before the target
+ * described by 'what' and 'n' with the statistics 'flags', or the
+ * start of the page.
+ */
+static void map_pos_find(EditBuffer *b, const Page *p, int flags,
+                         int what, int n, QEMapPos *pos)
+{
+    const QEMapPos *q;
+    int i, found;
+
+    memset(pos, 0, sizeof(*pos));
+    pos->data = p->data;
+    pos->charset = b->charset;
+    pos->eol_type = b->eol_type;
+    pos->flags = flags;
+    if (!(p->flags & PG_READ_ONLY) || !p->map || !p->map->pos_cache)
+        return;
+
+    for (i = 0; i < MAP_POS_CACHE_SIZE; i++) {
+        q = &p->map->pos_cache[i];
+        if (q->data != p->data || q->offset <= pos->offset
+        ||  q->offset > p->size || (q->flags & flags) != flags
+        ||  q->charset != b->charset || q->eol_type != b->eol_type)
+            continue;
+        switch (what) {
+        case PAGE_FIND_OFFSET:
+            found = (q->offset <= n);
+            break;
+        case PAGE_FIND_CHAR:
+            found = (q->nb_chars <= n);
+            break;
+        default:
+            found = (q->nb_lines < n);
+            break;
+        }
+        if (found) {
+            *pos = *q;
+            pos->flags = flags;
+        }
+    }
+}
+
+/* remember a position in a read-only extent of mapping 'm' */
+static void map_pos_add(QEMapping *m, const QEMapPos *pos)
+{
+    if (!m->pos_cache) {
+        m->pos_cache = qe_mallocz_array(QEMapPos, MAP_POS_CACHE_SIZE);
+        if (!m->pos_cache)
+            return;
+    }
+    m->pos_cache[m->pos_next] = *pos;
+    m->pos_next = (m->pos_next + 1) % MAP_POS_CACHE_SIZE;
+}
+
+/* advance 'pos' to byte offset 'offset' of page 'p' */
+static void map_pos_advance(EditBuffer *b, const Page *p, QEMapPos *pos,
+                            int offset)
+{
+    int len, line, col;
+    int cache = (p->flags & PG_READ_ONLY) && p->map
+        && offset - pos->offset > MAP_POS_STEP;
+
+    while (pos->offset < offset) {
+        len = min_int(offset - pos->offset, MAP_POS_STEP);
+        if (pos->flags & PG_VALID_POS) {
+            b->charset_state.get_pos_func(&b->charset_state,
+                                          p->data + pos->offset, len,
+                                          &line, &col);
+            if (line)
+                pos->col = 0;
+            pos->col += col;
+            pos->nb_lines += line;
+        }
+        if (pos->flags & PG_VALID_CHAR) {
+            pos->nb_chars += b->charset->get_chars_func(&b->charset_state,
+                p->data + pos->offset, len);
+        }
+        pos->offset += len;
+        if (cache)
+            map_pos_add(p->map, pos);
+    }
+}
+
+/* compute the statistics 'flags' of page 'p' up to byte offset 'offset' */
+static void eb_page_scan(EditBuffer *b, const Page *p, int flags,
+                         int offset, QEMapPos *pos)
+{
+    map_pos_find(b, p, flags, PAGE_FIND_OFFSET, offset, pos);
+    map_pos_advance(b, p, pos, offset);
+}
+
+/* compute the line and column counts of a page if needed */
+static inline void eb_page_get_pos(EditBuffer *b, Page *p)
+{
+    QEMapPos pos;
+
+    if (!(p->flags & PG_VALID_POS)) {
+        p->flags |= PG_VALID_POS;
+        eb_page_scan(b, p, PG_VALID_POS, p->size, &pos);
+        p->nb_lines = pos.nb_lines;
+        p->col = pos.col;
+    }
+}
+
+/* compute the char count of a page if needed */
+static inline void eb_page_get_chars(EditBuffer *b, Page *p)
+{
+    QEMapPos pos;
+
+    if (!(p->flags & PG_VALID_CHAR)) {
+        p->flags |= PG_VALID_CHAR;
+        eb_page_scan(b, p, PG_VALID_CHAR, p->size, &pos);
+        p->nb_chars = pos.nb_chars;
+    }
+}
+
+/* accumulate the statistics of node 'q' into 'acc' */
+static inline void page_node_add(PageNode *acc, const PageNode *q)
+{
+    acc->size += q->size;
+    if (q->nb_lines)
+        acc->col = 0;
+    acc->col += q->col;
+    acc->nb_lines += q->nb_lines;
+    acc->nb_chars += q->nb_chars;
+}
+
+/* bring the page index up to date with the page table.
+ * 'flags' tells which of the line / char statistics are needed in
+ * addition to page sizes.  Once requested, these statistics are
+ * maintained for the pages touched by subsequent edits, but only
+ * recomputed when needed: offset lookups between edits, such as
+ * appending process output, do not rescan the modified pages.
+ */
+static int page_tree_update(EditBuffer *b, int flags)
+{
+    PageNode *t;
+    int i, lo, hi, cap, stats, stale_lo, stale_hi;
+
+    stats = flags & (PG_VALID_POS | PG_VALID_CHAR);
+    if (b->page_tree_lo >= b->page_tree_hi && b->page_tree
+    &&  !(flags & ~b->page_tree_flags)
+    &&  (!stats || b->page_stats_lo >= b->page_stats_hi))
+        return 0;
+
+    lo = b->page_tree_lo;
+    hi = b->page_tree_hi;
+    cap = b->page_tree_cap;
+    if (flags & ~b->page_tree_flags) {
+        /* statistics were not indexed yet: reindex all pages */
+        lo = 0;
+        hi = cap;
+    }
+    flags |= b->page_tree_flags;
+    if (stats) {
+        /* refresh all indexed statistics of the stale pages */
+        stats = flags & (PG_VALID_POS | PG_VALID_CHAR);
+        if (b->page_stats_lo < b->page_stats_hi) {
+            lo = min_int(lo, b->page_stats_lo);
+            hi = max_int(hi, b->page_stats_hi);
+        }
+    }
+    if (b->nb_pages > cap || !b->page_tree) {
+        /* grow the tree and reindex all pages */
+        for (cap = max_int(cap, 16); cap < b->nb_pages; cap *= 2)
+            continue;
+        t = qe_realloc(&b->page_tree, 2 * cap * sizeof(PageNode));
+        if (!t) {
+            b->page_tree_cap = 0;
+            b->page_tree_flags = 0;
+            return -1;
+        }
+        memset(t, 0, 2 * cap * sizeof(PageNode));
+        b->page_tree_cap = cap;
+        lo = 0;
+        hi = cap;
+    }
+    t = b->page_tree;
+    if (hi > cap)
+        hi = cap;
+    stale_lo = lo;
+    stale_hi = hi;
+
+    /* update the leaves, pages past the end count as empty */
+    for (i = lo; i < hi; i++) {
+        PageNode *q = &t[cap + i];
+        if (i < b->nb_pages) {
+            Page *p = &b->page_table[i];
+            q->size = p->size;
+            if (stats & PG_VALID_POS) {
+                eb_page_get_pos(b, p);
+                q->nb_lines = p->nb_lines;
+                q->col = p->col;
+            }
+            if (stats & PG_VALID_CHAR) {
+                eb_page_get_chars(b, p);
+                q->nb_chars = p->nb_chars;
+            }
+        } else {
+            memset(q, 0, sizeof(*q));
+        }
+    }
+    /* update the parent nodes of the modified range */
+    for (lo += cap, hi += cap - 1; lo > 1;) {
+        lo >>= 1;
+        hi >>= 1;
+        for (i = lo; i <= hi; i++) {
+            t[i] = t[2 * i];
+            page_node_add(&t[i], &t[2 * i + 1]);
+        }
+    }
+    if (stats) {
+        b->page_stats_lo = INT_MAX;
+        b->page_stats_hi = 0;
+    } else
+    if (flags && stale_lo < stale_hi) {
+        /* the statistics of the reindexed leaves are stale */
+        if (b->page_stats_lo < b->page_stats_hi) {
+            stale_lo = min_int(stale_lo, b->page_stats_lo);
+            stale_hi = max_int(stale_hi, b->page_stats_hi);
+        }
+        b->page_stats_lo = stale_lo;
+        b->page_stats_hi = stale_hi;
+    }
+    b->page_tree_lo = INT_MAX;
+    b->page_tree_hi = 0;
+    b->page_tree_flags = flags;
+    return 0;
+}
+
+/* return true if position is reached by adding 'q' to 'acc' */
+static inline int page_node_reach(const PageNode *acc, const PageNode *q,
+                                  int what, qe_off_t n1, int n2)
+{
+    PageNode t;
+
+    switch (what) {
+    case PAGE_FIND_OFFSET:
+        return acc->size + q->size > n1;
+    case PAGE_FIND_CHAR:
+        return acc->nb_chars + q->nb_chars > n1;
+    default:
+        t = *acc;
+        page_node_add(&t, q);
+        return t.nb_lines > n1 || (t.nb_lines == n1 && t.col >= n2);
+    }
+}
+
+/* find the first page reaching the position described by 'what',
+ * 'n1' and 'n2'.  Return the page index, or b->nb_pages if position
+ * is beyond the end of buffer, and store the cumulative statistics
+ * of the preceding pages in '*acc'.  'flags' tells which statistics
+ * are needed in addition to the page sizes.
+ */
+static int page_tree_find(EditBuffer *b, int what, int flags,
+                          qe_off_t n1, int n2, PageNode *acc)
+{
+    const PageNode *t;
+    int i, node;
+
+    memset(acc, 0, sizeof(*acc));
+    if (page_tree_update(b, flags)) {
+        /* fallback to linear scan if index cannot be allocated */
+        for (i = 0; i < b->nb_pages; i++) {
+            Page *p = &b->page_table[i];
+            PageNode q = { p->size, 0, 0, 0 };
+            if (flags & PG_VALID_POS) {
+                eb_page_get_pos(b, p);
+                q.nb_lines = p->nb_lines;
+                q.col = p->col;
+            }
+            if (flags & PG_VALID_CHAR) {
+                eb_page_get_chars(b, p);
+                q.nb_chars = p->nb_chars;
+            }
+            if (page_node_reach(acc, &q, what, n1, n2))
+                break;
+            page_node_add(acc, &q);
+        }
+        return i;
+    }
+    t = b->page_tree;
+    if (!page_node_reach(acc, &t[1], what, n1, n2)) {
+        *acc = t[1];
+        return b->nb_pages;
+    }
+    /* descend the page index from the root */
+    for (node = 1; node < b->page_tree_cap;) {
+        node *= 2;
+        if (!page_node_reach(acc, &t[node], what, n1, n2)) {
+            page_node_add(acc, &t[node]);
+            node++;
+        }
+    }
+    return node - b->page_tree_cap;
+}
+
 /* find a page at a given offset */
-static inline Page *find_page(EditBuffer *b, int offset, int *page_offset_ptr)
+static Page *find_page(EditBuffer *b, qe_off_t offset, int *page_offset_ptr)
 {
-    Page *p = b->page_table;
-    int page_offset = offset;
+    Page *p;
+    PageNode acc;
+    qe_off_t page_offset;
 
     if (b->cur_page && offset >= b->cur_offset) {
+        /* fast path for sequential access */
         p = b->cur_page;
-        page_offset -= b->cur_offset;
+        page_offset = offset - b->cur_offset;
         if (page_offset < p->size) {
             *page_offset_ptr = page_offset;
             return p;
         }
-    }
-    while (page_offset >= p->size) {
         page_offset -= p->size;
-        p++;
+        if (p + 1 < b->page_table + b->nb_pages && page_offset < p[1].size) {
+            b->cur_offset += p->size;
+            b->cur_page = ++p;
+            *page_offset_ptr = page_offset;
+            return p;
+        }
     }
+    p = b->page_table + page_tree_find(b, PAGE_FIND_OFFSET, 0,
+                                       offset, 0, &acc);
+    page_offset = offset - acc.size;
     *page_offset_ptr = page_offset;
-    b->cur_offset = offset - page_offset;
+    b->cur_offset = acc.size;
     b->cur_page = p;
     return p;
 }
 
-/* prepare a page to be written */
-static void update_page(Page *p)
+/* add a reference to a file mapping */
+static QEMapping *qe_map_ref(QEMapping *m)
+{
+    if (m)
+        m->ref_count++;
+    return m;
+}
+
+/* release a reference to a file mapping, unmap the file upon the last */
+static void qe_map_unref(QEMapping **mp)
+{
+    QEMapping *m = *mp;
+
+    if (m && --m->ref_count <= 0) {
+#ifdef CONFIG_MMAP
+        munmap(m->address, m->length);
+#endif
+        qe_free(&m->pos_cache);
+        qe_free(&m);
+    }
+    *mp = NULL;
+}
+
+/* free the data of a page, or release the mapping it points into */
+static void free_page_data(Page *p)
+{
+    if (p->flags & PG_READ_ONLY) {
+        qe_map_unref(&p->map);
+        p->data = NULL;
+        p->flags &= ~PG_READ_ONLY;
+    } else {
+        qe_free(&p->data);
+    }
+}
+
+/* prepare a page to be written, return -1 if a read-only page cannot
+ * be copied.
+ */
+static int update_page(EditBuffer *b, Page *p)
 {
     u8 *buf;
 
     /* if the page is read only, copy it */
     if (p->flags & PG_READ_ONLY) {
         buf = qe_malloc_dup(p->data, p->size);
-        /* XXX: should return an error */
         if (!buf)
-            return;
+            return -1;
+        qe_map_unref(&p->map);
         p->data = buf;
         p->flags &= ~PG_READ_ONLY;
     }
     p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    eb_invalidate_pages(b, p - b->page_table, p - b->page_table + 1);
+    return 0;
+}
+
+/* Split the pages larger than MAX_PAGE_SIZE that overlap the range
+ * [offset, offset + size) so this range is covered by pages of at
+ * most MAX_PAGE_SIZE bytes.  Large pages are the read-only extents of
+ * mmapped files and the pages of buffers with a large page size.  The
+ * parts of these pages outside the range are kept as is, so the page
+ * table only grows with the number and size of the modified areas.
+ * Return -1 if the page table cannot be grown.
+ */
+static int eb_split_pages(EditBuffer *b, qe_off_t offset, qe_off_t size)
+{
+    Page *p, pg;
+    QEMapPos pos_start, pos_end;
+    int page_index, page_offset, start, end, len, pos, n, i, flags;
+
+    while (size > 0 && offset < b->total_size) {
+        p = find_page(b, offset, &page_offset);
+        len = min_offset(p->size - page_offset, size);
+        if (p->size <= MAX_PAGE_SIZE) {
+            offset += len;
+            size -= len;
+            continue;
+        }
+        /* cut the page at MAX_PAGE_SIZE boundaries around the range */
+        start = page_offset - page_offset % MAX_PAGE_SIZE;
+        end = min_int(p->size, page_offset + len + MAX_PAGE_SIZE - 1 -
+                      (page_offset + len - 1) % MAX_PAGE_SIZE);
+        n = (start > 0) + (end - start + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE +
+            (end < p->size);
+        page_index = p - b->page_table;
+        pg = *p;
+        /* the statistics of the parts kept as is are derived from the
+         * known positions in the page instead of scanning them.
+         */
+        flags = pg.flags & (PG_VALID_POS | PG_VALID_CHAR);
+        if (flags) {
+            eb_page_scan(b, &pg, flags, start, &pos_start);
+            pos_end = pos_start;
+            map_pos_advance(b, &pg, &pos_end, end);
+        }
+        if (!qe_realloc(&b->page_table, (b->nb_pages + n - 1) * sizeof(Page)))
+            return -1;
+        p = b->page_table + page_index;
+        blockmove(p + n, p + 1, b->nb_pages - page_index - 1);
+        b->nb_pages += n - 1;
+        for (i = 0, pos = 0; i < n; i++, pos += len) {
+            if (pos < start)
+                len = start - pos;
+            else
+            if (pos < end)
+                len = min_int(end - pos, MAX_PAGE_SIZE);
+            else
+                len = pg.size - pos;
+            p[i].data = pg.data + pos;
+            if (!(pg.flags & PG_READ_ONLY) && i > 0) {
+                /* the first part keeps the data of a writable page */
+                p[i].data = qe_malloc_dup(pg.data + pos, len);
+                if (!p[i].data) {
+                    while (--i > 0)
+                        qe_free(&p[i].data);
+                    b->nb_pages -= n - 1;
+                    blockmove(p + 1, p + n, b->nb_pages - page_index - 1);
+                    *p = pg;
+                    b->cur_page = NULL;
+                    return -1;
+                }
+            }
+            p[i].size = len;
+            p[i].flags = pg.flags & PG_READ_ONLY;
+            p[i].map = pg.map;
+        }
+        if (!(pg.flags & PG_READ_ONLY))
+            qe_realloc(&p->data, p->size);
+        if (flags && start > 0) {
+            p[0].flags |= flags;
+            p[0].nb_lines = pos_start.nb_lines;
+            p[0].col = pos_start.col;
+            p[0].nb_chars = pos_start.nb_chars;
+        }
+        if (flags && end < pg.size) {
+            p[n - 1].flags |= flags;
+            p[n - 1].nb_lines = pg.nb_lines - pos_end.nb_lines;
+            p[n - 1].col = p[n - 1].nb_lines ? pg.col : pg.col - pos_end.col;
+            p[n - 1].nb_chars = pg.nb_chars - pos_end.nb_chars;
+        }
+        if ((pg.flags & PG_READ_ONLY) && pg.map)
+            pg.map->ref_count += n - 1;
+        eb_invalidate_pages(b, page_index, INT_MAX);
+        /* the page cache is no longer valid */
+        b->cur_page = NULL;
+        /* the range is now scanned again in pages of MAX_PAGE_SIZE */
+    }
+    return 0;
 }
 
 /* Read one raw byte from the buffer:
  * We should have: 0 <= offset < b->total_size
  * Returns the byte or -1 upon failure.
  */
-int eb_read_one_byte(EditBuffer *b, int offset)
+int eb_read_one_byte(EditBuffer *b, qe_off_t offset)
 {
     const Page *p;
+    int page_offset;
 
     /* We clip the request for safety */
     if (offset < 0 || offset >= b->total_size)
         return -1;
 
-    p = find_page(b, offset, &offset);
-    return p->data[offset];
+    p = find_page(b, offset, &page_offset);
+    return p->data[page_offset];
 }
 
 /* Read raw data from the buffer:
  * We should have: 0 <= offset < b->total_size, size >= 0
  */
-int eb_read(EditBuffer *b, int offset, void *buf, int size)
+int eb_read(EditBuffer *b, qe_off_t offset, void *buf, int size)
 {
-    int len, remain;
+    int len, remain, page_offset;
     const Page *p;
 
     /* We carefully clip the request, avoiding integer overflow */
     if (offset < 0 || size <= 0 || offset >= b->total_size)
         return 0;
 
-    len = b->total_size - offset;
-    if (size > len)
-        size = len;
+    if (size > b->total_size - offset)
+        size = b->total_size - offset;
 
-    p = find_page(b, offset, &offset);
+    p = find_page(b, offset, &page_offset);
     for (remain = size;;) {
-        len = p->size - offset;
+        len = p->size - page_offset;
         if (len > remain)
             len = remain;
-        memcpy(buf, p->data + offset, len);
+        memcpy(buf, p->data + page_offset, len);
         if ((remain -= len) <= 0)
             break;
         buf = (u8*)buf + len;
         p++;
-        offset = 0;
+        page_offset = 0;
     }
     return size;
 }
 
+/* Search a block of memory for a byte pattern: return the index of the
+ * first (dir > 0) or last (dir < 0) match entirely inside the block,
+ * or -1 if none. Bytes from the block are mapped through `fold` when
+ * comparing, `pat` should already be folded.
+ */
+static int mem_search_bytes(const u8 *data, int n, int dir,
+                            const u8 *pat, int len,
+                            const u8 *fold, const int *skip)
+{
+    const u8 *q, *end;
+    int i, j;
+
+    if (n < len)
+        return -1;
+
+    if (dir > 0) {
+        if (!fold) {
+            /* memchr is vectorized in most C libraries */
+            end = data + n - len + 1;
+            for (q = data; q < end; q++) {
+                q = memchr(q, pat[0], end - q);
+                if (!q)
+                    break;
+                if (!memcmp(q + 1, pat + 1, len - 1))
+                    return q - data;
+            }
+            return -1;
+        }
+        /* Boyer-Moore-Horspool, keyed on the last byte of the window */
+        for (i = 0; i <= n - len; i += skip[fold[data[i + len - 1]]]) {
+            for (j = len - 1; j >= 0 && fold[data[i + j]] == pat[j]; j--)
+                continue;
+            if (j < 0)
+                return i;
+        }
+    } else {
+        /* reverse Horspool, keyed on the first byte of the window */
+        for (i = n - len; i >= 0; i -= skip[fold[data[i]]]) {
+            for (j = 0; j < len && fold[data[i + j]] == pat[j]; j++)
+                continue;
+            if (j == len)
+                return i;
+        }
+    }
+    return -1;
+}
+
+/* Search the buffer for a byte pattern.
+ * Return the offset of the first (dir > 0) or last (dir < 0) match
+ * starting in the range [start, end) and ending before the end of the
+ * buffer, or -1 if there is none.
+ * `fold`, if not NULL, is a 256 byte table applied to buffer contents
+ * for comparison, the pattern must already be folded.
+ * Matches are found directly in the page data, without decoding
+ * characters, so the pattern must be encoded in the buffer charset.
+ */
+qe_off_t eb_search_bytes(EditBuffer *b, int dir, qe_off_t start, qe_off_t end,
+                         const u8 *pat, int len, const u8 *fold)
+{
+    u8 fold_idem[256];
+    u8 tmp_buf[256], *tmp = tmp_buf;
+    int skip[256];
+    const Page *p;
+    int i, n;
+    qe_off_t pos, stop, page_start, page_end, found = -1;
+
+    if (len <= 0)
+        return -1;
+    if (start < 0)
+        start = 0;
+    if (end > b->total_size - len + 1)
+        end = b->total_size - len + 1;
+    if (start >= end)
+        return -1;
+
+    if (fold || dir < 0) {
+        if (!fold) {
+            for (i = 0; i < 256; i++)
+                fold_idem[i] = i;
+            fold = fold_idem;
+        }
+        /* skip distances for the Horspool variants */
+        for (i = 0; i < 256; i++)
+            skip[i] = len;
+        if (dir > 0) {
+            for (i = 0; i < len - 1; i++)
+                skip[pat[i]] = len - 1 - i;
+        } else {
+            for (i = len - 1; i > 0; i--)
+                skip[pat[i]] = i;
+        }
+    }
+    /* matches straddling page boundaries are searched in a copy */
+    if (2 * len > ssizeof(tmp_buf)) {
+        tmp = qe_malloc_bytes(2 * len);
+        if (!tmp)
+            return -1;
+    }
+
+    if (dir > 0) {
+        p = find_page(b, start, &i);
+        page_start = start - i;
+        for (pos = start;;) {
+            page_end = page_start + p->size;
+            /* matches inside the page */
+            stop = min_offset(end, page_end - len + 1);
+            if (pos < stop) {
+                i = mem_search_bytes(p->data + (pos - page_start),
+                                     stop - pos + len - 1, dir,
+                                     pat, len, fold, skip);
+                if (i >= 0) {
+                    found = pos + i;
+                    break;
+                }
+                pos = stop;
+            }
+            /* matches across the end of the page */
+            stop = min_offset(end, page_end);
+            if (pos < stop) {
+                n = eb_read(b, pos, tmp, stop - pos + len - 1);
+                i = mem_search_bytes(tmp, n, dir, pat, len, fold, skip);
+                if (i >= 0) {
+                    found = pos + i;
+                    break;
+                }
+                pos = stop;
+            }
+            if (pos >= end)
+                break;
+            page_start = page_end;
+            p++;
+        }
+    } else {
+        p = find_page(b, end - 1, &i);
+        page_start = end - 1 - i;
+        for (pos = end;;) {
+            page_end = page_start + p->size;
+            /* matches across the end of the page */
+            stop = max_offset(max_offset(start, page_start), page_end - len + 1);
+            if (stop < pos) {
+                n = eb_read(b, stop, tmp, pos - stop + len - 1);
+                i = mem_search_bytes(tmp, n, dir, pat, len, fold, skip);
+                if (i >= 0) {
+                    found = stop + i;
+                    break;
+                }
+                pos = stop;
+            }
+            /* matches inside the page */
+            stop = max_offset(start, page_start);
+            if (stop < pos) {
+                i = mem_search_bytes(p->data + (stop - page_start),
+                                     pos - stop + len - 1, dir,
+                                     pat, len, fold, skip);
+                if (i >= 0) {
+                    found = stop + i;
+                    break;
+                }
+                pos = stop;
+            }
+            if (pos <= start)
+                break;
+            p--;
+            page_start -= p->size;
+        }
+    }
+    if (tmp != tmp_buf)
+        qe_free(&tmp);
+    return found;
+}
+
 /* Write raw data into the buffer.
  * We should have 0 <= offset <= b->total_size, size >= 0.
  * Note: eb_write can be used to append data at the end of the buffer
  */
-int eb_write(EditBuffer *b, int offset, const void *buf, int size)
+int eb_write(EditBuffer *b, qe_off_t offset, const void *buf, int size)
 {
     int len, remain, write_size, page_offset;
     Page *p;
@@ -139,19 +775,31 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
         return 0;
 
     write_size = size;
-    len = b->total_size - offset;
-    if (write_size > len)
-        write_size = len;
+    if (write_size > b->total_size - offset)
+        write_size = b->total_size - offset;
 
     if (write_size > 0) {
+        if (eb_split_pages(b, offset, write_size))
+            return 0;
+
+        /* log the write before copying the read-only pages, so the
+         * undo data shares them.  If a page cannot be copied, the
+         * logged write restores the unchanged contents.
+         */
         eb_addlog(b, LOGOP_WRITE, offset, write_size);
 
+        p = find_page(b, offset, &page_offset);
+        for (remain = write_size + page_offset; remain > 0; p++) {
+            if (update_page(b, p))
+                return 0;
+            remain -= p->size;
+        }
+
         p = find_page(b, offset, &page_offset);
         for (remain = write_size;;) {
             len = p->size - page_offset;
             if (len > remain)
                 len = remain;
-            update_page(p);
             memcpy(p->data + page_offset, buf, len);
             buf = (const u8*)buf + len;
             if ((remain -= len) <= 0)
@@ -160,8 +808,9 @@ int eb_write(EditBuffer *b, int offset, const void *buf, int size)
             page_offset = 0;
         }
     }
-    if (size > write_size)
-        eb_insert(b, offset + write_size, buf, size - write_size);
+    if (size > write_size
+    &&  eb_insert(b, offset + write_size, buf, size - write_size) < 0)
+        return write_size;
     return size;
 }
 
@@ -174,11 +823,10 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
 
     if (page_index < b->nb_pages) {
         p = &b->page_table[page_index];
-        len = MAX_PAGE_SIZE - p->size;
+        len = b->page_size - p->size;
         if (len > size)
             len = size;
-        if (len > 0) {
-            update_page(p);
+        if (len > 0 && !update_page(b, p)) {
             /* CG: probably faster with qe_malloc + qe_free */
             qe_realloc(&p->data, p->size + len);
             memmove(p->data + len, p->data, p->size);
@@ -189,18 +837,20 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
     }
 
     /* now add new pages if necessary */
-    n = (size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
+    n = (size + b->page_size - 1) / b->page_size;
     if (n > 0) {
+        eb_invalidate_pages(b, page_index, INT_MAX);
         b->nb_pages += n;
         qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
         p = &b->page_table[page_index];
         blockmove(p + n, p, b->nb_pages - n - page_index);
         while (size > 0) {
             len = size;
-            if (len > MAX_PAGE_SIZE)
-                len = MAX_PAGE_SIZE;
+            if (len > b->page_size)
+                len = b->page_size;
             p->size = len;
             p->data = qe_malloc_dup(buf, len);
+            p->map = NULL;
             p->flags = 0;
             buf += len;
             size -= len;
@@ -209,58 +859,78 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
     }
 }
 
-/* We must have : 0 <= offset <= b->total_size */
-static void eb_insert_lowlevel(EditBuffer *b, int offset,
-                               const u8 *buf, int size)
+/* Log and perform the insertion of 'size' bytes from 'buf' at
+ * 'offset'.  We must have : 0 <= offset <= b->total_size
+ * Return -1 if the page before 'offset' cannot be made writable: the
+ * buffer is left unchanged.
+ */
+static int eb_insert_lowlevel(EditBuffer *b, qe_off_t offset,
+                              const u8 *buf, int size)
 {
-    int len, len_out, page_index;
+    int len, len_out, page_index, page_offset;
     Page *p;
 
+    /* split large pages around the insertion point, but let the last
+     * page grow up to the buffer page size when appending.
+     */
+    if (offset < b->total_size) {
+        if (eb_split_pages(b, max_offset(offset - 1, 0), 2))
+            return -1;
+    } else
+    if (offset > 0 && find_page(b, offset - 1, &page_offset)->size > b->page_size) {
+        if (eb_split_pages(b, offset - 1, 1))
+            return -1;
+    }
+    if (offset > 0 && update_page(b, find_page(b, offset - 1, &page_offset)))
+        return -1;
+
+    eb_addlog(b, LOGOP_INSERT, offset, size);
+
     b->total_size += size;
 
     /* find the correct page */
     p = b->page_table;
     if (offset > 0) {
-        offset--;
-        p = find_page(b, offset, &offset);
-        offset++;
+        p = find_page(b, offset - 1, &page_offset);
+        page_offset++;
     retry:
         /* compute what we can insert in current page */
-        len = MAX_PAGE_SIZE - offset;
+        len = b->page_size - page_offset;
         if (len > size)
             len = size;
         /* number of bytes to put in next pages */
-        len_out = p->size + len - MAX_PAGE_SIZE;
+        len_out = p->size + len - b->page_size;
         page_index = p - b->page_table;
         if (len_out > 0) {
 #if 1
             /* First try and shift some of these bytes to the previous pages */
-            if (page_index > 0 && p[-1].size < MAX_PAGE_SIZE) {
+            if (page_index > 0 && p[-1].size < b->page_size
+            &&  !update_page(b, p - 1)) {
                 int chunk;
-                update_page(p - 1);
-                update_page(p);
-                chunk = min_offset(MAX_PAGE_SIZE - p[-1].size, offset);
+                update_page(b, p);
+                chunk = min_int(b->page_size - p[-1].size, page_offset);
                 qe_realloc(&p[-1].data, p[-1].size + chunk);
                 memcpy(p[-1].data + p[-1].size, p->data, chunk);
                 p[-1].size += chunk;
                 p->size -= chunk;
                 if (p->size == 0) {
                     /* if page was completely fused with previous one */
+                    eb_invalidate_pages(b, page_index, INT_MAX);
                     b->nb_pages -= 1;
                     qe_free(&p->data);
                     blockmove(p, p + 1, b->nb_pages - page_index);
                     qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
                     p = b->page_table + page_index - 1;
-                    offset = p->size;
+                    page_offset = p->size;
                     goto retry;
                 }
                 memmove(p->data, p->data + chunk, p->size);
                 qe_realloc(&p->data, p->size);
-                offset -= chunk;
-                if (offset == 0 && p[-1].size < MAX_PAGE_SIZE) {
+                page_offset -= chunk;
+                if (page_offset == 0 && p[-1].size < b->page_size) {
                     /* restart from previous page */
                     p--;
-                    offset = p->size;
+                    page_offset = p->size;
                 }
                 goto retry;
             }
@@ -274,12 +944,12 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
         if (len > 0) {
             /* reload p because page_table may have been reallocated */
             p = b->page_table + page_index;
-            update_page(p);
+            update_page(b, p);
             p->size += len - len_out;
             qe_realloc(&p->data, p->size);
-            memmove(p->data + offset + len,
-                    p->data + offset, p->size - (offset + len));
-            memcpy(p->data + offset, buf, len);
+            memmove(p->data + page_offset + len,
+                    p->data + page_offset, p->size - (page_offset + len));
+            memcpy(p->data + page_offset, buf, len);
             buf += len;
             size -= len;
         }
@@ -290,20 +960,111 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
     if (size > 0)
         eb_insert1(b, page_index + 1, buf, size);
 
+    /* the page cache is no longer valid */
+    b->cur_page = NULL;
+    return 0;
+}
+
+/* Insert a read-only page 'p0' at 'offset' in buffer 'b', sharing its
+ * data and a reference to its mapping.  The page at 'offset' is split
+ * if needed.  We must have : 0 <= offset <= b->total_size
+ */
+static void eb_insert_page(EditBuffer *b, qe_off_t offset, const Page *p0)
+{
+    int page_index, page_offset;
+    Page *p;
+
+    page_index = b->nb_pages;
+    if (offset < b->total_size) {
+        p = find_page(b, offset, &page_offset);
+        page_index = p - b->page_table;
+        if (page_offset > 0) {
+            /* split the page at offset */
+            page_index++;
+            if (p->flags & PG_READ_ONLY) {
+                /* the tail of a read-only page is shared too */
+                Page tail = *p;
+                tail.data += page_offset;
+                tail.size -= page_offset;
+                tail.flags = PG_READ_ONLY;
+                p->size = page_offset;
+                p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+                eb_invalidate_pages(b, page_index - 1, page_index);
+                b->total_size -= tail.size;
+                eb_insert_page(b, offset, &tail);
+            } else {
+                eb_insert1(b, page_index, p->data + page_offset,
+                           p->size - page_offset);
+                /* reload p because page_table may have been reallocated */
+                p = b->page_table + page_index - 1;
+                update_page(b, p);
+                p->size = page_offset;
+                qe_realloc(&p->data, page_offset);
+            }
+        }
+    }
+    b->nb_pages += 1;
+    qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
+    p = &b->page_table[page_index];
+    blockmove(p + 1, p, b->nb_pages - 1 - page_index);
+    p->size = p0->size;
+    p->data = p0->data;
+    p->map = qe_map_ref(p0->map);
+    /* line and char statistics depend on the buffer charset */
+    p->flags = PG_READ_ONLY;
+    b->total_size += p0->size;
+    eb_invalidate_pages(b, page_index, INT_MAX);
+
     /* the page cache is no longer valid */
     b->cur_page = NULL;
 }
 
+/* Return true if 'len' bytes of page 'p' can be inserted in another
+ * buffer by reference: mapped pages are shared if complete or large.
+ */
+static inline int page_is_shareable(const Page *p, int len)
+{
+    return (p->flags & PG_READ_ONLY) && p->map
+        && (len == p->size || len >= MAX_PAGE_SIZE);
+}
+
+/* Return the number of bytes eb_insert_buffer() would copy to insert
+ * 'size' bytes of buffer 'b' from 'offset' in another buffer.
+ */
+static qe_off_t eb_copy_cost(EditBuffer *b, qe_off_t offset, qe_off_t size)
+{
+    const Page *p;
+    int len, page_offset;
+    qe_off_t cost = 0;
+
+    if (offset < 0 || offset >= b->total_size || size <= 0)
+        return 0;
+    if (size > b->total_size - offset)
+        size = b->total_size - offset;
+
+    p = find_page(b, offset, &page_offset);
+    for (; size > 0; p++, page_offset = 0) {
+        len = min_offset(p->size - page_offset, size);
+        if (!page_is_shareable(p, len))
+            cost += len;
+        size -= len;
+    }
+    return cost;
+}
+
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Raw insertion performed, encoding is ignored.
+ * Read-only pages and large parts of read-only extents are shared
+ * instead of copied.  Return the number of bytes inserted.
  */
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size)
+qe_off_t eb_insert_buffer(EditBuffer *dest, qe_off_t dest_offset,
+                          EditBuffer *src, qe_off_t src_offset,
+                          qe_off_t size)
 {
     Page *p;
-    int len, size0;
+    int len, page_offset;
+    qe_off_t size0;
 
     if (dest->flags & BF_READONLY)
         return 0;
@@ -323,29 +1084,29 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
 
     size0 = size;
 
-    eb_addlog(dest, LOGOP_INSERT, dest_offset, size);
 #if 1
     /* Much simpler algorithm with fewer pathological cases */
-    p = find_page(src, src_offset, &src_offset);
+    p = find_page(src, src_offset, &page_offset);
     while (size > 0) {
-        len = p->size - src_offset;
+        len = p->size - page_offset;
         if (len > size)
             len = size;
-        if ((p->flags & PG_READ_ONLY) && src_offset == 0 && len == MAX_PAGE_SIZE) {
-            /* XXX: should share complete read-only pages.  This is
-             * actually a little tricky: the mapping may be removed
-             * upon buffer close. We need a ref count scheme to keep
-             * track of these pages.
-             * A brute force approach may prove best: upon unmapping a
-             * file, scan all buffers for shared pages and delay
-             * unmapping until these get freed.  We may keep a global
-             * and a buffer based count of shared pages and a list of
-             * mappings to accelerate this phase.
+        if (page_is_shareable(p, len)) {
+            /* share read-only pages and large parts of extents: the
+             * mapping is reference counted and stays valid until the
+             * last page is freed.
              */
+            Page part = *p;
+            part.data += page_offset;
+            part.size = len;
+            eb_addlog(dest, LOGOP_INSERT, dest_offset, len);
+            eb_insert_page(dest, dest_offset, &part);
+        } else
+        if (eb_insert_lowlevel(dest, dest_offset, p->data + page_offset, len)) {
+            return size0 - size;
         }
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
         dest_offset += len;
-        src_offset = 0;
+        page_offset = 0;
         p++;
         size -= len;
     }
@@ -381,7 +1142,7 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
             /* must reload q because page_table may have been
                realloced */
             q = dest->page_table + page_index - 1;
-            update_page(q);
+            update_page(dest, q);
             qe_realloc(&q->data, dest_offset);
             q->size = dest_offset;
         }
@@ -414,6 +1175,7 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
                 /* simply copy the reference */
                 q->flags = PG_READ_ONLY;
                 q->data = p->data;
+                q->map = qe_map_ref(p->map);
             } else {
                 /* allocate a new page */
                 q->flags = 0;
@@ -438,8 +1200,8 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
 
 /* Insert 'size' bytes from 'buf' into 'b' at offset 'offset'. We must
    have : 0 <= offset <= b->total_size */
-/* Return number of bytes inserted */
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
+/* Return number of bytes inserted, -1 if the buffer cannot be modified */
+int eb_insert(EditBuffer *b, qe_off_t offset, const void *buf, int size)
 {
     if (b->flags & BF_READONLY)
         return 0;
@@ -451,9 +1213,8 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
     if (offset < 0 || size <= 0)
         return 0;
 
-    eb_addlog(b, LOGOP_INSERT, offset, size);
-
-    eb_insert_lowlevel(b, offset, buf, size);
+    if (eb_insert_lowlevel(b, offset, buf, size))
+        return -1;
 
     /* the page cache is no longer valid */
     b->cur_page = NULL;
@@ -463,9 +1224,10 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
 /* We must have : 0 <= offset <= b->total_size,
  * return actual number of bytes removed.
  */
-int eb_delete(EditBuffer *b, int offset, int size)
+qe_off_t eb_delete(EditBuffer *b, qe_off_t offset, qe_off_t size)
 {
-    int n, len, size0;
+    int n, len, page_offset;
+    qe_off_t size0;
     Page *del_start, *p;
 
     if (b->flags & BF_READONLY)
@@ -479,39 +1241,50 @@ int eb_delete(EditBuffer *b, int offset, int size)
 
     size0 = size;
 
+    /* only the pages at both ends of the range are partially deleted:
+     * make them writable before logging the deletion.
+     */
+    if (eb_split_pages(b, offset, 1)
+    ||  eb_split_pages(b, offset + size - 1, 1))
+        return 0;
+    p = find_page(b, offset, &page_offset);
+    if ((page_offset > 0 || size < p->size) && update_page(b, p))
+        return 0;
+    p = find_page(b, offset + size - 1, &page_offset);
+    if (page_offset + 1 < p->size && update_page(b, p))
+        return 0;
+
     /* dispatch callbacks before buffer update */
     eb_addlog(b, LOGOP_DELETE, offset, size);
 
     b->total_size -= size;
 
     /* find the correct page */
-    p = find_page(b, offset, &offset);
+    p = find_page(b, offset, &page_offset);
     n = 0;
     del_start = NULL;
     while (size > 0) {
-        len = p->size - offset;
+        len = p->size - page_offset;
         if (len > size)
             len = size;
         if (len == p->size) {
             if (!del_start)
                 del_start = p;
-            /* we cannot free if read only */
-            if (!(p->flags & PG_READ_ONLY))
-                qe_free(&p->data);
+            free_page_data(p);
             p++;
-            offset = 0;
+            page_offset = 0;
             n++;
         } else {
-            update_page(p);
-            memmove(p->data + offset, p->data + offset + len,
-                    p->size - offset - len);
+            update_page(b, p);
+            memmove(p->data + page_offset, p->data + page_offset + len,
+                    p->size - page_offset - len);
             p->size -= len;
             qe_realloc(&p->data, p->size);
-            offset += len;
+            page_offset += len;
             /* XXX: should merge with adjacent pages if size becomes small? */
-            if (offset >= p->size) {
+            if (page_offset >= p->size) {
                 p++;
-                offset = 0;
+                page_offset = 0;
             }
         }
         size -= len;
@@ -519,6 +1292,7 @@ int eb_delete(EditBuffer *b, int offset, int size)
 
     /* now delete the requested pages */
     if (n > 0) {
+        eb_invalidate_pages(b, del_start - b->page_table, INT_MAX);
         b->nb_pages -= n;
         blockmove(del_start, del_start + n,
                   b->page_table + b->nb_pages - del_start);
@@ -647,9 +1421,12 @@ EditBuffer *eb_find(const char *name)
 void eb_free_log_buffer(EditBuffer *b)
 {
     eb_free(&b->log_buffer);
-    b->log_new_index = 0;
-    b->log_current = 0;
+    qe_free(&b->undo_records);
+    b->undo_mask = -1;
+    b->undo_first = 0;
     b->nb_logs = 0;
+    b->undo_size = 0;
+    b->log_current = 0;
 }
 
 /* rename a buffer: modify name to ensure uniqueness */
@@ -707,12 +1484,18 @@ EditBuffer *eb_new(const char *name, int flags)
 
     /* initial value of save_log: 0 or 1 */
     b->save_log = ((flags & BF_SAVELOG) != 0);
+    b->undo_mask = -1;
 
     /* initialize default mode stuff */
     b->tab_width = qs->default_tab_width;
     b->fill_column = qs->default_fill_column;
     b->eol_type = qs->default_eol_type;
 
+    /* log and shell buffers are mostly appended to */
+    b->page_size = MAX_PAGE_SIZE;
+    if (flags & (BF_IS_LOG | BF_SHELL))
+        b->page_size = LARGE_PAGE_SIZE;
+
     /* add buffer in global buffer list (at end for system buffers) */
     pb = &qs->first_buffer;
     if (*b->name == '*') {
@@ -742,6 +1525,17 @@ EditBuffer *eb_new(const char *name, int flags)
     return b;
 }
 
+/* Set the size of the pages created by subsequent insertions into
+ * buffer 'b'.  Large pages speed up sequential access and reduce the
+ * page table size, they are split to MAX_PAGE_SIZE where modified.
+ * Return the actual page size.
+ */
+int eb_set_page_size(EditBuffer *b, int page_size)
+{
+    b->page_size = clamp_int(page_size, MAX_PAGE_SIZE, MAX_BUFFER_PAGE_SIZE);
+    return b->page_size;
+}
+
 /* Return an empty scratch buffer, create one if necessary */
 EditBuffer *eb_scratch(const char *name, int flags)
 {
@@ -756,6 +1550,7 @@ EditBuffer *eb_scratch(const char *name, int flags)
 
 void eb_clear(EditBuffer *b)
 {
+    eb_load_stop(b, 0);
     b->flags &= ~BF_READONLY;
 
     /* XXX: should just reset logging instead of disabling it */
@@ -763,6 +1558,8 @@ void eb_clear(EditBuffer *b)
     b->last_log = 0;
     eb_delete(b, 0, b->total_size);
     eb_free_log_buffer(b);
+    qe_free(&b->page_tree);
+    b->page_tree_cap = 0;
 
 #ifdef CONFIG_MMAP
     eb_munmap_buffer(b);
@@ -804,7 +1601,7 @@ void eb_free(EditBuffer **bp)
             qe_free(&cb);
         }
 
-        eb_delete_properties(b, 0, INT_MAX);
+        eb_delete_properties(b, 0, QE_OFF_MAX);
         eb_cache_remove(b);
         eb_clear(b);
 
@@ -814,9 +1611,6 @@ void eb_free(EditBuffer **bp)
             if (b1->log_buffer == b) {
                 b1->log_buffer = NULL;
             }
-            if (b1->b_styles == b) {
-                b1->b_styles = NULL;
-            }
             if (b1 == b)
                 *pb = b1->next;
             else
@@ -1011,9 +1805,9 @@ void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
 
 /* standard callback to move offsets */
 void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size)
+                        enum LogOperation op, qe_off_t offset, qe_off_t size)
 {
-    int *offset_ptr = opaque;
+    qe_off_t *offset_ptr = opaque;
 
     switch (op) {
     case LOGOP_INSERT:
@@ -1036,18 +1830,113 @@ void eb_offset_callback(qe__unused__ EditBuffer *b, void *opaque, int edge,
     }
 }
 
+/* find the index of the run containing offset, 0 <= offset < sr->size */
+static int style_find_run(QEStyleRuns *sr, qe_off_t offset)
+{
+    QEStyleRun *runs = sr->runs;
+    int lo, hi, mid, i = sr->cache;
+
+    /* sequential accesses stay in the same run or move to the next one */
+    if (i < sr->nb_runs && runs[i].offset <= offset) {
+        if (i + 1 == sr->nb_runs || offset < runs[i + 1].offset)
+            return i;
+        if (i + 2 == sr->nb_runs || offset < runs[i + 2].offset)
+            return sr->cache = i + 1;
+    }
+    lo = 0;
+    hi = sr->nb_runs - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) >> 1;
+        if (runs[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return sr->cache = lo;
+}
+
+/* remove runs [i, j) */
+static void style_remove_runs(QEStyleRuns *sr, int i, int j)
+{
+    if (j > i) {
+        memmove(sr->runs + i, sr->runs + j,
+                (sr->nb_runs - j) * sizeof(*sr->runs));
+        sr->nb_runs -= j - i;
+    }
+}
+
+/* insert a run at index i, return 0 if OK */
+static int style_insert_run(QEStyleRuns *sr, int i, qe_off_t offset,
+                            QETermStyle style)
+{
+    if (sr->nb_runs == sr->max_runs) {
+        int n = sr->max_runs + (sr->max_runs >> 1) + 16;
+        if (!qe_realloc(&sr->runs, n * sizeof(*sr->runs)))
+            return -1;
+        sr->max_runs = n;
+    }
+    memmove(sr->runs + i + 1, sr->runs + i,
+            (sr->nb_runs - i) * sizeof(*sr->runs));
+    sr->runs[i].offset = offset;
+    sr->runs[i].style = style;
+    sr->nb_runs++;
+    return 0;
+}
+
+/* make sure a run starts at offset, return its index or -1 if error */
+static int style_split_run(QEStyleRuns *sr, qe_off_t offset)
+{
+    int i;
+
+    if (offset >= sr->size)
+        return sr->nb_runs;
+    i = style_find_run(sr, offset);
+    if (sr->runs[i].offset == offset)
+        return i;
+    if (style_insert_run(sr, i + 1, offset, sr->runs[i].style))
+        return -1;
+    return i + 1;
+}
+
+/* merge run i with its neighbours if they have the same style */
+static void style_merge_runs(QEStyleRuns *sr, int i)
+{
+    if (i + 1 < sr->nb_runs && sr->runs[i + 1].style == sr->runs[i].style)
+        style_remove_runs(sr, i + 1, i + 2);
+    if (i > 0 && i < sr->nb_runs && sr->runs[i - 1].style == sr->runs[i].style)
+        style_remove_runs(sr, i, i + 1);
+}
+
+static void style_shift_runs(QEStyleRuns *sr, int i, qe_off_t delta)
+{
+    for (; i < sr->nb_runs; i++) {
+        sr->runs[i].offset += delta;
+    }
+}
+
 int eb_create_style_buffer(EditBuffer *b, int flags)
 {
+    int shift = ((unsigned)(flags & BF_STYLES) / BF_STYLE1) - 1;
+
     if (b->b_styles) {
-        /* XXX: should extend style width if needed */
+        /* extend style width if needed, runs store full styles */
+        if (shift > b->style_shift) {
+            b->flags = (b->flags & ~BF_STYLES) | (flags & BF_STYLES);
+            b->style_shift = shift;
+            b->style_bytes = 1 << shift;
+            b->b_styles->mask = (shift >= 3) ? (QETermStyle)-1 :
+                (QETermStyle)((1ULL << (8 << shift)) - 1);
+        }
         return 0;
     } else {
-        char name[MAX_BUFFERNAME_SIZE];
-        snprintf(name, sizeof(name), "*S<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
-        b->b_styles = eb_new(name, BF_SYSTEM | BF_IS_STYLE | BF_RAW);
+        b->b_styles = qe_mallocz(QEStyleRuns);
+        if (!b->b_styles)
+            return 0;
         b->flags |= flags & BF_STYLES;
-        b->style_shift = ((unsigned)(flags & BF_STYLES) / BF_STYLE1) - 1;
-        b->style_bytes = 1 << b->style_shift;
+        b->style_shift = shift;
+        b->style_bytes = 1 << shift;
+        b->b_styles->mask = (shift >= 3) ? (QETermStyle)-1 :
+            (QETermStyle)((1ULL << (8 << shift)) - 1);
         eb_set_style(b, 0, LOGOP_INSERT, 0, b->total_size);
         eb_add_callback(b, eb_style_callback, NULL, 0);
         return 1;
@@ -1056,72 +1945,84 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
 
 void eb_free_style_buffer(EditBuffer *b)
 {
-    eb_free(&b->b_styles);
+    if (b->b_styles) {
+        qe_free(&b->b_styles->runs);
+        qe_free(&b->b_styles);
+    }
     b->style_shift = b->style_bytes = 0;
     eb_free_callback(b, eb_style_callback, NULL);
 }
 
-/* XXX: should compress styles buffer with run length encoding */
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size)
-{
-    union {
-        uint64_t buf8[256 / 8];
-        uint32_t buf4[256 / 4];
-        uint16_t buf2[256 / 2];
-        unsigned char buf[256];
-        QETermStyle align;
-    } s;
-    int i, len;
-
-    if (!b->b_styles || !size)
+                  qe_off_t offset, qe_off_t size)
+{
+    QEStyleRuns *sr = b->b_styles;
+    int i, j;
+
+    if (!sr || size <= 0 || offset < 0 || offset > sr->size)
         return;
 
-    offset = (offset >> b->char_shift) << b->style_shift;
-    size = (size >> b->char_shift) << b->style_shift;
+    style &= sr->mask;
 
     switch (op) {
     case LOGOP_WRITE:
+        if (size > sr->size - offset) {
+            /* eb_write extends the buffer with an insertion */
+            size = sr->size - offset;
+            if (size <= 0)
+                break;
+        }
+        i = style_split_run(sr, offset);
+        if (i < 0)
+            break;
+        j = style_split_run(sr, offset + size);
+        if (j < 0)
+            break;
+        /* reuse run i for the written range */
+        sr->runs[i].style = style;
+        style_remove_runs(sr, i + 1, j);
+        style_merge_runs(sr, i);
+        break;
     case LOGOP_INSERT:
-        /* XXX: should use a single loop to initialize buf */
-        /* XXX: should initialize buf just once */
-        while (size > 0) {
-            len = min_offset(size, ssizeof(s.buf));
-            if (b->style_shift == 3) {
-                for (i = 0; i < len >> 3; i++) {
-                    s.buf8[i] = style;
-                }
-            } else
-            if (b->style_shift == 2) {
-                for (i = 0; i < len >> 2; i++) {
-                    s.buf4[i] = style;
-                }
-            } else
-            if (b->style_shift == 1) {
-                for (i = 0; i < len >> 1; i++) {
-                    s.buf2[i] = style;
-                }
-            } else {
-                memset(s.buf, style, len);
+        if (offset > 0) {
+            i = style_find_run(sr, offset - 1);
+            if (sr->runs[i].style == style) {
+                /* extend the previous run: the most common case */
+                style_shift_runs(sr, i + 1, size);
+                sr->size += size;
+                break;
             }
-            if (op == LOGOP_WRITE)
-                eb_write(b->b_styles, offset, s.buf, len);
-            else
-                eb_insert(b->b_styles, offset, s.buf, len);
-            size -= len;
-            offset += len;
         }
+        i = style_split_run(sr, offset);
+        if (i < 0 || style_insert_run(sr, i, offset, style))
+            break;
+        style_shift_runs(sr, i + 1, size);
+        sr->size += size;
+        style_merge_runs(sr, i);
         break;
     case LOGOP_DELETE:
-        eb_delete(b->b_styles, offset, size);
+        if (size > sr->size - offset)
+            size = sr->size - offset;
+        i = style_split_run(sr, offset);
+        if (i < 0)
+            break;
+        j = style_split_run(sr, offset + size);
+        if (j < 0)
+            break;
+        style_remove_runs(sr, i, j);
+        style_shift_runs(sr, i, -size);
+        sr->size -= size;
+        style_merge_runs(sr, i);
         break;
     default:
         break;
     }
+    if (sr->cache >= sr->nb_runs)
+        sr->cache = 0;
 }
 
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size)
+                       enum LogOperation op, qe_off_t offset, qe_off_t size)
 {
     eb_set_style(b, b->cur_style, op, offset, size);
 }
@@ -1130,11 +2031,86 @@ void eb_style_callback(EditBuffer *b, void *opaque, int arg,
 /************************************************************/
 /* undo buffer */
 
+static inline UndoRecord *eb_undo_record(EditBuffer *b, int n)
+{
+    return &b->undo_records[n & b->undo_mask];
+}
+
+/* Allocate the next undo record, growing the ring if it is full */
+static UndoRecord *eb_new_undo_record(EditBuffer *b)
+{
+    UndoRecord *records;
+    int n, size;
+
+    if (b->nb_logs > b->undo_mask) {
+        size = max_int(256, 2 * (b->undo_mask + 1));
+        records = qe_malloc_array(UndoRecord, size);
+        if (!records)
+            return NULL;
+        for (n = b->undo_first; n < b->undo_first + b->nb_logs; n++)
+            records[n & (size - 1)] = *eb_undo_record(b, n);
+        qe_free(&b->undo_records);
+        b->undo_records = records;
+        b->undo_mask = size - 1;
+    }
+    return eb_undo_record(b, b->undo_first + b->nb_logs++);
+}
+
+/* Discard the oldest commands from the undo journal until it fits in
+ * the undo-outer-limit budget. Records are dropped from the ring in
+ * constant time, their data is removed from the log buffer in large
+ * batches. The current command and the records being undone are kept.
+ */
+static void eb_trim_undo(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    UndoRecord *rec;
+    int n, keep, group, last_group;
+    qe_off_t dead;
+
+    if (qs->undo_outer_limit <= 0 || b->nb_logs == 0)
+        return;
+
+    last_group = eb_undo_record(b, b->undo_first + b->nb_logs - 1)->group;
+    keep = b->log_current ? b->log_current - 1 : INT_MAX;
+    while (b->undo_size > qs->undo_outer_limit) {
+        rec = eb_undo_record(b, b->undo_first);
+        group = rec->group;
+        if (group == last_group || b->undo_first >= keep)
+            break;
+        while (b->nb_logs > 0 && b->undo_first < keep && rec->group == group) {
+            b->undo_size -= rec->cost;
+            b->undo_first++;
+            b->nb_logs--;
+            rec = eb_undo_record(b, b->undo_first);
+        }
+    }
+    dead = eb_undo_record(b, b->undo_first)->data_offset;
+    if (dead >= LARGE_PAGE_SIZE && dead >= b->log_buffer->total_size / 2) {
+        eb_delete(b->log_buffer, 0, dead);
+        for (n = b->undo_first; n < b->undo_first + b->nb_logs; n++)
+            eb_undo_record(b, n)->data_offset -= dead;
+    }
+}
+
+/* Return the bytes of undo memory needed to log a modification */
+static qe_off_t eb_log_cost(EditBuffer *b, enum LogOperation op,
+                            qe_off_t offset, qe_off_t size)
+{
+    qe_off_t cost = sizeof(UndoRecord);
+
+    if (op != LOGOP_INSERT)
+        cost += eb_copy_cost(b, offset, size);
+    return cost;
+}
+
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size)
+                      qe_off_t offset, qe_off_t size)
 {
-    int was_modified, len, size_trailer;
-    LogBuffer lb;
+    QEmacsState *qs = &qe_state;
+    int was_modified;
+    qe_off_t cost;
+    UndoRecord *rec;
     EditBufferCallbackList *l;
 
     /* callbacks and logging disabled for composite undo phase */
@@ -1159,85 +2135,131 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
          * should not be a problem since this log buffer is never
          * referenced by name.
          */
+        /* records may survive a killed log buffer */
+        eb_free_log_buffer(b);
         snprintf(buf, sizeof(buf), "*L<%.*s>", MAX_BUFFERNAME_SIZE - 5, b->name);
         b->log_buffer = eb_new(buf, BF_SYSTEM | BF_IS_LOG | BF_RAW);
         if (!b->log_buffer)
             return;
-        b->log_new_index = 0;
-        b->log_current = 0;
         b->last_log = 0;
         b->last_log_char = 0;
-        b->nb_logs = 0;
-    }
-    /* XXX: better test to limit size */
-    if (b->nb_logs >= (NB_LOGS_MAX-1)) {
-        /* no free space, delete least recent entry */
-        /* XXX: should check undo record integrity */
-        eb_read(b->log_buffer, 0, &lb, sizeof(lb));
-        len = lb.size;
-        if (lb.op == LOGOP_INSERT)
-            len = 0;
-        len += sizeof(LogBuffer) + sizeof(int);
-        eb_delete(b->log_buffer, 0, len);
-        b->log_new_index -= len;
-        if (b->log_current > 1)
-            b->log_current -= len;
-        b->nb_logs--;
+    }
+    /* a new modification ends the undo sequence */
+    if (qs->this_cmd_func != (CmdFunc)do_undo
+    &&  qs->this_cmd_func != (CmdFunc)do_redo) {
+        b->log_current = 0;
     }
 
     /* If inserting, try and coalesce log record with previous */
-    if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT
-    &&  (size_t)b->log_new_index >= sizeof(lb) + sizeof(int)
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
-                sizeof(int)) == sizeof(int)
-    &&  size_trailer == 0
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb,
-                sizeof(lb)) == sizeof(lb)
-    &&  lb.op == LOGOP_INSERT
-    &&  lb.offset + lb.size == offset) {
-        lb.size += size;
-        eb_write(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb, sizeof(lb));
-        return;
+    if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT && b->nb_logs > 0) {
+        rec = eb_undo_record(b, b->undo_first + b->nb_logs - 1);
+        if (rec->op == LOGOP_INSERT && rec->offset + rec->size == offset) {
+            rec->size += size;
+            return;
+        }
     }
 
     b->last_log = op;
 
-    /* XXX: should check undo record integrity */
+    cost = eb_log_cost(b, op, offset, size);
+    if (qs->undo_outer_limit > 0 && cost > qs->undo_outer_limit) {
+        /* this modification alone exceeds the budget: discard the
+           undo information rather than keeping an incomplete history */
+        eb_free_log_buffer(b);
+        return;
+    }
+    rec = eb_new_undo_record(b);
+    if (!rec)
+        return;
+    rec->op = op;
+    rec->was_modified = was_modified;
+    rec->group = qs->cmd_serial;
+    rec->offset = offset;
+    rec->size = size;
+    rec->data_offset = b->log_buffer->total_size;
+    rec->cost = cost;
+    b->undo_size += cost;
+
+    /* data: read-only pages are shared with the buffer */
+    if (op != LOGOP_INSERT)
+        eb_insert_buffer(b->log_buffer, rec->data_offset, b, offset, size);
+
+    eb_trim_undo(b);
+}
 
-    /* header */
-    lb.pad1 = '\n';   /* make log buffer display readable */
-    lb.pad2 = ':';
-    lb.op = op;
-    lb.offset = offset;
-    lb.size = size;
-    lb.was_modified = was_modified;
-    eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
-    b->log_new_index += sizeof(lb);
+/* Revert the modification of undo record number 'n', recording the
+ * inverse modification if '*logp' is true. Return the new position of
+ * point.  '*logp' is cleared if the inverse modification exceeds the
+ * undo-outer-limit budget: the caller must then discard the journal.
+ */
+static qe_off_t eb_revert_record(EditBuffer *b, int n, int *logp)
+{
+    QEmacsState *qs = &qe_state;
+    UndoRecord rec = *eb_undo_record(b, n);
+    int save_log = b->save_log;
+
+    if (*logp && rec.op == LOGOP_WRITE && qs->undo_outer_limit > 0
+    &&  eb_log_cost(b, LOGOP_WRITE, rec.offset, rec.size) > qs->undo_outer_limit) {
+        /* eb_addlog() would discard the journal, and the saved data
+           with it, before the data is restored */
+        *logp = 0;
+    }
+    if (!*logp)
+        b->save_log &= ~1;
 
-    /* data */
-    switch (op) {
-    case LOGOP_DELETE:
+    switch (rec.op) {
     case LOGOP_WRITE:
-        eb_insert_buffer(b->log_buffer, b->log_new_index, b, offset, size);
-        b->log_new_index += size;
-        size_trailer = size;
+        /* log the contents about to be overwritten, then restore the
+           data as a single write */
+        eb_addlog(b, LOGOP_WRITE, rec.offset, rec.size);
+        /* logging may have moved the data in the log buffer */
+        rec.data_offset = eb_undo_record(b, n)->data_offset;
+        b->save_log |= 2;
+        eb_delete(b, rec.offset, rec.size);
+        eb_insert_buffer(b, rec.offset, b->log_buffer, rec.data_offset,
+                         rec.size);
+        b->save_log &= ~2;
+        rec.offset += rec.size;
         break;
-    default:
-        size_trailer = 0;
+    case LOGOP_DELETE:
+        /* we must also disable the log there because the log buffer
+           would be modified BEFORE we insert it by the implicit
+           eb_addlog */
+        b->save_log |= 2;
+        eb_insert_buffer(b, rec.offset, b->log_buffer, rec.data_offset,
+                         rec.size);
+        b->save_log &= ~2;
+        eb_addlog(b, LOGOP_INSERT, rec.offset, rec.size);
+        rec.offset += rec.size;
         break;
+    case LOGOP_INSERT:
+        eb_delete(b, rec.offset, rec.size);
+        break;
+    default:
+        abort();
     }
-    /* trailer */
-    eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(int));
-    b->log_new_index += sizeof(int);
+    b->save_log = save_log;
+    b->modified = rec.was_modified;
+    return rec.offset;
+}
+
+/* Return true if an undo or redo continues the current undo sequence:
+ * the previous command was an undo or a redo, or the command is being
+ * repeated by a prefix argument.
+ */
+static int eb_undo_continues(EditState *s)
+{
+    QEmacsState *qs = s->qe_state;
 
-    b->nb_logs++;
+    return qs->last_cmd_func == (CmdFunc)do_undo
+        || qs->last_cmd_func == (CmdFunc)do_redo
+        || s->b->undo_serial == qs->cmd_serial;
 }
 
 void do_undo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
-    LogBuffer lb;
+    int n, last, group, log;
 
     if (!b->log_buffer) {
         put_status(s, "No undo information");
@@ -1247,74 +2269,53 @@ void do_undo(EditState *s)
     /* deactivate region hilite */
     s->region_style = 0;
 
-    /* Should actually keep undo state current until new logs are added */
-    if (s->qe_state->last_cmd_func != (CmdFunc)do_undo
-    &&  s->qe_state->last_cmd_func != (CmdFunc)do_redo) {
+    if (!eb_undo_continues(s))
         b->log_current = 0;
-    }
 
     if (b->log_current == 0) {
-        log_index = b->log_new_index;
+        last = b->undo_first + b->nb_logs;
     } else {
-        log_index = b->log_current - 1;
+        last = b->log_current - 1;
     }
-    if (log_index == 0) {
+    if (last <= b->undo_first) {
         put_status(s, "No further undo information");
         return;
     } else {
         put_status(s, "Undo!");
     }
-    /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
-
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
+    /* go backward to the first record of the command */
+    group = eb_undo_record(b, last - 1)->group;
+    for (n = last - 1; n > b->undo_first; n--) {
+        if (eb_undo_record(b, n - 1)->group != group)
+            break;
+    }
+    /* log_current is 1 + record number to have zero as default value */
+    b->log_current = n + 1;
 
     b->last_log = 0;  /* prevent log compression */
 
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        eb_delete(b, lb.offset, lb.size);
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
-    }
+    /* each undo step records its inverse modifications as a separate
+       group, even when repeated within a command */
+    s->qe_state->cmd_serial++;
 
-    b->modified = lb.was_modified;
+    /* play the log entries in reverse order */
+    log = 1;
+    while (last-- > n && b->log_buffer) {
+        s->offset = eb_revert_record(b, last, &log);
+    }
+    if (!log) {
+        /* the command was undone but its inverse is too large */
+        eb_free_log_buffer(b);
+        put_status(s, "Undo information discarded");
+    }
+    b->undo_serial = s->qe_state->cmd_serial;
 }
 
 void do_redo(EditState *s)
 {
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
-    LogBuffer lb;
+    int n, last, group, log = 0;
+    qe_off_t data_offset;
 
     if (!b->log_buffer) {
         put_status(s, "No undo information");
@@ -1325,80 +2326,42 @@ void do_redo(EditState *s)
     s->region_style = 0;
 
     /* Should actually keep undo state current until new logs are added */
-    if (s->qe_state->last_cmd_func != (CmdFunc)do_undo
-    &&  s->qe_state->last_cmd_func != (CmdFunc)do_redo) {
+    if (!eb_undo_continues(s))
         b->log_current = 0;
-    }
 
-    if (!b->log_current || !b->log_new_index) {
+    if (!b->log_current || !b->nb_logs) {
         put_status(s, "Nothing to redo");
         return;
     }
     put_status(s, "Redo!");
 
-    /* go forward in undo stack */
-    log_index = b->log_current - 1;
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-    if (lb.op != LOGOP_INSERT)
-        log_index += lb.size;
-    log_index += sizeof(int);
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
-
-    /* go backward from the end and remove undo record */
-    log_index = b->log_new_index;
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        b->save_log &= ~1;
-        eb_delete(b, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
+    /* go forward in undo stack, past the command undone last */
+    last = b->undo_first + b->nb_logs;
+    n = b->log_current - 1;
+    group = eb_undo_record(b, n)->group;
+    while (n < last && eb_undo_record(b, n)->group == group)
+        n++;
+    /* log_current is 1 + record number to have zero as default value */
+    b->log_current = n + 1;
+
+    /* go backward from the end and remove the undo records of the
+       last command, the one that undid the command now redone */
+    group = eb_undo_record(b, last - 1)->group;
+    while (last > b->undo_first && eb_undo_record(b, last - 1)->group == group) {
+        last--;
+        s->offset = eb_revert_record(b, last, &log);
+        b->undo_size -= eb_undo_record(b, last)->cost;
     }
+    data_offset = eb_undo_record(b, last)->data_offset;
+    eb_delete(b->log_buffer, data_offset,
+              b->log_buffer->total_size - data_offset);
+    b->nb_logs = last - b->undo_first;
 
-    b->modified = lb.was_modified;
-
-    log_index -= sizeof(LogBuffer);
-    eb_delete(b->log_buffer, log_index, b->log_new_index - log_index);
-    b->log_new_index = log_index;
-
-    if (b->log_current >= log_index + 1) {
+    if (b->log_current >= last + 1) {
         /* redone everything */
         b->log_current = 0;
     }
+    b->undo_serial = s->qe_state->cmd_serial;
 }
 
 /************************************************************/
@@ -1435,10 +2398,11 @@ void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type)
         Page *p = &b->page_table[n];
         p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
     }
+    b->page_tree_flags = 0;
 }
 
 /* XXX: change API to go faster */
-char32_t eb_nextc(EditBuffer *b, int offset, int *next_ptr)
+char32_t eb_nextc(EditBuffer *b, qe_off_t offset, qe_off_t *next_ptr)
 {
     u8 buf[MAX_CHAR_BYTES];
     char32_t ch;
@@ -1489,36 +2453,36 @@ char32_t eb_nextc(EditBuffer *b, int offset, int *next_ptr)
     return ch;
 }
 
-QETermStyle eb_get_style(EditBuffer *b, int offset)
+QETermStyle eb_get_style(EditBuffer *b, qe_off_t offset)
 {
-    if (b->b_styles) {
-        if (b->style_shift == 3) {
-            uint64_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 3, &style, 8);
-            return style;
-        } else
-        if (b->style_shift == 2) {
-            uint32_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 2, &style, 4);
-            return style;
-        } else
-        if (b->style_shift == 1) {
-            uint16_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 1, &style, 2);
-            return style;
-        } else {
-            uint8_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 0, &style, 1);
-            return style;
-        }
+    QEStyleRuns *sr = b->b_styles;
+
+    if (sr && offset >= 0 && offset < sr->size)
+        return sr->runs[style_find_run(sr, offset)].style;
+    return 0;
+}
+
+/* Get the style at offset and the end of the run of bytes sharing it
+ * in *endp, so styles of a whole line can be fetched run by run.
+ */
+QETermStyle eb_get_style_run(EditBuffer *b, qe_off_t offset, qe_off_t *endp)
+{
+    QEStyleRuns *sr = b->b_styles;
+    int i;
+
+    if (sr && offset >= 0 && offset < sr->size) {
+        i = style_find_run(sr, offset);
+        *endp = (i + 1 < sr->nb_runs) ? sr->runs[i + 1].offset : sr->size;
+        return sr->runs[i].style;
     }
+    *endp = QE_OFF_MAX;
     return 0;
 }
 
 /* compute offset after moving 'n' chars from 'offset'.
  * 'n' can be negative
  */
-int eb_skip_chars(EditBuffer *b, int offset, int n)
+qe_off_t eb_skip_chars(EditBuffer *b, qe_off_t offset, int n)
 {
     for (; n < 0 && offset > 0; n++) {
         offset = eb_prev(b, offset);
@@ -1530,20 +2494,20 @@ int eb_skip_chars(EditBuffer *b, int offset, int n)
 }
 
 /* delete one character at offset 'offset', return number of bytes removed */
-int eb_delete_char32(EditBuffer *b, int offset) {
+int eb_delete_char32(EditBuffer *b, qe_off_t offset) {
     return eb_delete_range(b, offset, eb_next(b, offset));
 }
 
 /* return the offset past any pending combining glyphs */
-int eb_skip_accents(EditBuffer *b, int offset) {
-    int offset1;
+qe_off_t eb_skip_accents(EditBuffer *b, qe_off_t offset) {
+    qe_off_t offset1;
     while (qe_isaccent(eb_nextc(b, offset, &offset1)))
         offset = offset1;
     return offset;
 }
 
 /* return the main character for the next glyph, update offset to next_ptr */
-char32_t eb_next_glyph(EditBuffer *b, int offset, int *next_ptr) {
+char32_t eb_next_glyph(EditBuffer *b, qe_off_t offset, qe_off_t *next_ptr) {
     char32_t c = eb_nextc(b, offset, &offset);
     if (c >= ' ') {
         offset += eb_skip_accents(b, offset);
@@ -1553,7 +2517,7 @@ char32_t eb_next_glyph(EditBuffer *b, int offset, int *next_ptr) {
 }
 
 /* return the main character for the previous glyph, update offset to next_ptr */
-char32_t eb_prev_glyph(EditBuffer *b, int offset, int *next_ptr) {
+char32_t eb_prev_glyph(EditBuffer *b, qe_off_t offset, qe_off_t *next_ptr) {
     for (;;) {
         char32_t c = eb_prevc(b, offset, &offset);
         if (!qe_isaccent(c)) {
@@ -1567,8 +2531,8 @@ char32_t eb_prev_glyph(EditBuffer *b, int offset, int *next_ptr) {
  * 'n' can be negative,
  * combining accents are skipped as part of the previous character.
  */
-int eb_skip_glyphs(EditBuffer *b, int offset, int n) {
-    int offset1;
+qe_off_t eb_skip_glyphs(EditBuffer *b, qe_off_t offset, int n) {
+    qe_off_t offset1;
 
     if (n < 0) {
         while (offset > 0) {
@@ -1591,7 +2555,7 @@ int eb_skip_glyphs(EditBuffer *b, int offset, int n) {
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_chars(EditBuffer *b, int offset, int n)
+qe_off_t eb_delete_chars(EditBuffer *b, qe_off_t offset, int n)
 {
     return eb_delete_range(b, offset, eb_skip_chars(b, offset, n));
 }
@@ -1599,14 +2563,14 @@ int eb_delete_chars(EditBuffer *b, int offset, int n)
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_glyphs(EditBuffer *b, int offset, int n)
+qe_off_t eb_delete_glyphs(EditBuffer *b, qe_off_t offset, int n)
 {
     return eb_delete_range(b, offset, eb_skip_glyphs(b, offset, n));
 }
 
 /* XXX: only stateless charsets are supported */
 /* XXX: suppress that? */
-char32_t eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
+char32_t eb_prevc(EditBuffer *b, qe_off_t offset, qe_off_t *prev_ptr)
 {
     char32_t ch;
     int char_size;
@@ -1621,7 +2585,7 @@ char32_t eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
             offset -= 1;
             ch = eb_read_one_byte(b, offset);
             if (utf8_is_trailing_byte(ch)) {
-                int offset1 = offset;
+                qe_off_t offset1 = offset;
                 q = buf + sizeof(buf);
                 *--q = '\0';
                 *--q = ch;
@@ -1673,129 +2637,118 @@ char32_t eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
     return ch;
 }
 
-int eb_goto_pos(EditBuffer *b, int line1, int col1)
+qe_off_t eb_goto_pos(EditBuffer *b, int line1, int col1)
 {
-    Page *p, *p_end;
-    int line2, col2, line, col, offset, offset1;
-
-    line = 0;
-    col = 0;
-    offset = 0;
-
-    p = b->page_table;
-    p_end = b->page_table + b->nb_pages;
-    while (p < p_end) {
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
-        }
-        line2 = line + p->nb_lines;
-        if (p->nb_lines)
-            col2 = 0;
-        col2 = col + p->col;
-        if (line2 > line1 || (line2 == line1 && col2 >= col1)) {
-            /* compute offset */
-            if (line < line1) {
-                /* seek to the correct line */
-                offset += b->charset->goto_line_func(&b->charset_state,
-                    p->data, p->size, line1 - line);
-                line = line1;
-                col = 0;
-            }
-            while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
-                col++;
-                offset = offset1;
-            }
-            return offset;
+    Page *p;
+    PageNode acc;
+    QEMapPos pos;
+    int n;
+    qe_off_t line, col, offset, offset1;
+
+    n = page_tree_find(b, PAGE_FIND_POS, PG_VALID_POS, line1, col1, &acc);
+    if (n >= b->nb_pages)
+        return b->total_size;
+
+    p = &b->page_table[n];
+    line = acc.nb_lines;
+    col = acc.col;
+    offset = acc.size;
+    if (line < line1) {
+        /* seek to the correct line from the closest known position */
+        map_pos_find(b, p, PG_VALID_POS, PAGE_FIND_POS, line1 - line, &pos);
+        n = pos.offset + b->charset->goto_line_func(&b->charset_state,
+            p->data + pos.offset, p->size - pos.offset,
+            line1 - line - pos.nb_lines);
+        if ((p->flags & PG_READ_ONLY) && p->map
+        &&  n - pos.offset > MAP_POS_STEP) {
+            pos.offset = n;
+            pos.nb_lines = line1 - line;
+            pos.col = 0;
+            map_pos_add(p->map, &pos);
         }
-        line = line2;
-        col = col2;
-        offset += p->size;
-        p++;
+        offset += n;
+        line = line1;
+        col = 0;
     }
-    return b->total_size;
+    while (col < col1 && eb_nextc(b, offset, &offset1) != '\n') {
+        col++;
+        offset = offset1;
+    }
+    return offset;
 }
 
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset)
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, qe_off_t offset)
 {
-    Page *p, *p_end;
-    int line, col, line1, col1;
+    Page *p;
+    PageNode acc;
+    QEMapPos pos;
+    int n;
+    qe_off_t line, col;
 
     QASSERT(offset >= 0);
 
-    line = 0;
-    col = 0;
-    p = b->page_table;
-    p_end = p + b->nb_pages;
-    for (;;) {
-        if (p >= p_end)
-            goto the_end;
-        if (offset < p->size)
-            break;
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
-        }
-        line += p->nb_lines;
-        if (p->nb_lines)
+    n = page_tree_find(b, PAGE_FIND_OFFSET, PG_VALID_POS, offset, 0, &acc);
+    line = acc.nb_lines;
+    col = acc.col;
+    if (n < b->nb_pages) {
+        p = &b->page_table[n];
+        eb_page_scan(b, p, PG_VALID_POS, offset - acc.size, &pos);
+        line += pos.nb_lines;
+        if (pos.nb_lines)
             col = 0;
-        col += p->col;
-        offset -= p->size;
-        p++;
+        col += pos.col;
     }
-    b->charset_state.get_pos_func(&b->charset_state, p->data, offset,
-                                  &line1, &col1);
-    line += line1;
-    if (line1)
-        col = 0;
-    col += col1;
-
- the_end:
-    *line_ptr = line;
-    *col_ptr = col;
-    return line;
+    /* line and column numbers are int: saturate them in huge buffers */
+    *line_ptr = min_offset(line, INT_MAX);
+    *col_ptr = min_offset(col, INT_MAX);
+    return *line_ptr;
 }
 
 /************************************************************/
 /* char offset computation */
 
 /* convert a char number into a byte offset according to buffer charset */
-int eb_goto_char(EditBuffer *b, int pos)
+qe_off_t eb_goto_char(EditBuffer *b, qe_off_t pos)
 {
-    int offset;
-    Page *p, *p_end;
+    int n;
+    qe_off_t offset;
+    PageNode acc;
+    QEMapPos mpos;
+    Page *p;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
         offset = min_offset(pos * b->charset->char_size, b->total_size);
     } else {
-        offset = 0;
-        p = b->page_table;
-        p_end = b->page_table + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (pos < p->nb_chars) {
-                offset += b->charset->goto_char_func(&b->charset_state, p->data, p->size, pos);
-                break;
-            } else {
-                pos -= p->nb_chars;
-                offset += p->size;
-                p++;
+        n = page_tree_find(b, PAGE_FIND_CHAR, PG_VALID_CHAR, pos, 0, &acc);
+        offset = acc.size;
+        if (n < b->nb_pages) {
+            p = &b->page_table[n];
+            /* seek from the closest known position */
+            map_pos_find(b, p, PG_VALID_CHAR, PAGE_FIND_CHAR,
+                         pos - acc.nb_chars, &mpos);
+            n = mpos.offset + b->charset->goto_char_func(&b->charset_state,
+                p->data + mpos.offset, p->size - mpos.offset,
+                pos - acc.nb_chars - mpos.nb_chars);
+            if ((p->flags & PG_READ_ONLY) && p->map
+            &&  n - mpos.offset > MAP_POS_STEP) {
+                mpos.offset = n;
+                mpos.nb_chars = pos - acc.nb_chars;
+                map_pos_add(p->map, &mpos);
             }
+            offset += n;
         }
     }
     return offset;
 }
 
 /* convert a byte offset into a char number according to buffer charset */
-int eb_get_char_offset(EditBuffer *b, int offset)
+qe_off_t eb_get_char_offset(EditBuffer *b, qe_off_t offset)
 {
-    int pos;
-    Page *p, *p_end;
+    int n;
+    qe_off_t pos;
+    PageNode acc;
+    QEMapPos mpos;
+    Page *p;
 
     if (offset < 0)
         offset = 0;
@@ -1818,22 +2771,12 @@ int eb_get_char_offset(EditBuffer *b, int offset)
         } else {
             /* CG: XXX: offset rounding to character boundary is undefined */
         }
-        pos = 0;
-        p = b->page_table;
-        p_end = p + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (offset < p->size) {
-                pos += b->charset->get_chars_func(&b->charset_state, p->data, offset);
-                break;
-            } else {
-                pos += p->nb_chars;
-                offset -= p->size;
-                p++;
-            }
+        n = page_tree_find(b, PAGE_FIND_OFFSET, PG_VALID_CHAR, offset, 0, &acc);
+        pos = acc.nb_chars;
+        if (n < b->nb_pages) {
+            p = &b->page_table[n];
+            eb_page_scan(b, p, PG_VALID_CHAR, offset - acc.size, &mpos);
+            pos += mpos.nb_chars;
         }
     }
     return pos;
@@ -1842,10 +2785,10 @@ int eb_get_char_offset(EditBuffer *b, int offset)
 /* delete a range of bytes from the buffer, bounds in any order, return
  * number of bytes removed.
  */
-int eb_delete_range(EditBuffer *b, int p1, int p2)
+qe_off_t eb_delete_range(EditBuffer *b, qe_off_t p1, qe_off_t p2)
 {
     if (p1 > p2) {
-        int tmp = p1;
+        qe_off_t tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1855,7 +2798,7 @@ int eb_delete_range(EditBuffer *b, int p1, int p2)
 /* replace 'size' bytes at offset 'offset' with 'size1' bytes from 'buf'
  * return the number of bytes written
  */
-int eb_replace(EditBuffer *b, int offset, int size,
+int eb_replace(EditBuffer *b, qe_off_t offset, qe_off_t size,
                const void *buf, int size1)
 {
     /* CG: behaviour is not exactly identical: mark, point and other
@@ -1867,7 +2810,7 @@ int eb_replace(EditBuffer *b, int offset, int size,
         return eb_write(b, offset, buf, size1);
     } else {
         eb_delete(b, offset, size);
-        return eb_insert(b, offset, buf, size1);
+        return max_int(eb_insert(b, offset, buf, size1), 0);
     }
 }
 
@@ -1876,119 +2819,160 @@ int eb_replace(EditBuffer *b, int offset, int size,
 
 #define IOBUF_SIZE 32768
 
-#if 0
+#define ASYNC_LOAD_SIZE     (8 * 1024 * 1024)  /* files loaded in background */
+#define LOAD_FIRST_SIZE     (256 * 1024)  /* bytes loaded before display */
+#define LOAD_CHUNK_SIZE     (1024 * 1024)  /* bytes loaded per event */
+#define LOAD_DISPLAY_DELAY  100  /* milliseconds between redisplays */
 
+/* Asynchronous loading: the beginning of the file is loaded at once to
+ * display the first screen, the rest is appended chunk by chunk from
+ * the read handler of the event loop.  The buffer stays read-only and
+ * in 'loading' state until complete.
+ */
 typedef struct BufferIOState {
-    URLContext *handle;
-    void (*progress_cb)(void *opaque, int size);
-    void (*completion_cb)(void *opaque, int err);
-    void *opaque;
-    int offset;
-    int saved_flags;
-    int saved_log;
-    int nolog;
-    unsigned char buffer[IOBUF_SIZE];
+    int fd;
+    qe_off_t offset;   /* insertion offset in the buffer */
+    qe_off_t loaded;   /* number of bytes loaded */
+    qe_off_t size;     /* file size when the load started */
+    int saved_flags;   /* BF_READONLY state to restore */
+    int modified;      /* modified state to restore */
+    int display_time;  /* time of the next redisplay request */
+    unsigned char buffer[LOAD_CHUNK_SIZE];
 } BufferIOState;
 
-static void load_connected_cb(void *opaque, int err);
-static void load_read_cb(void *opaque, int size);
-static void eb_io_stop(EditBuffer *b, int err);
-
-/* load a buffer asynchronously and launch the callback. The buffer
-   stays in 'loading' state while begin loaded. It is also marked
-   readonly. */
-int load_buffer(EditBuffer *b, const char *filename,
-                int offset, int nolog,
-                void (*progress_cb)(void *opaque, int size),
-                void (*completion_cb)(void *opaque, int err), void *opaque)
+/* Stop loading buffer 'b'.  'err' is the error number if the load
+ * failed: the buffer contents are then incomplete and the buffer stays
+ * read-only so a save cannot truncate the file.
+ */
+static void eb_load_stop(EditBuffer *b, int err)
 {
-    URLContext *h;
-    BufferIOState *s;
+    BufferIOState *s = b->io_state;
 
-    /* cannot load a buffer if already I/Os or readonly */
-    if (b->flags & (BF_LOADING | BF_SAVING | BF_READONLY))
-        return -1;
-    s = qe_mallocz(BufferIOState);
     if (!s)
-        return -1;
-    b->io_state = s;
-    h = url_new();
-    if (!h) {
-        qe_free(&b->io_state);
-        return -1;
-    }
-    s->handle = h;
-    s->saved_flags = b->flags;
-    s->nolog = nolog;
-    if (s->nolog) {
-        s->saved_log = b->save_log;
-        b->save_log = 0;
+        return;
+    set_read_handler(s->fd, NULL, NULL);
+    close(s->fd);
+    b->flags &= ~BF_LOADING;
+    if (err) {
+        put_error(NULL, "Error loading '%s': %s", b->filename, strerror(err));
+    } else {
+        b->flags &= ~BF_READONLY;
+        b->flags |= s->saved_flags;
+        /* the file may not be writable */
+        if (b->filename[0] && access(b->filename, W_OK))
+            b->flags |= BF_READONLY;
     }
-    b->flags |= BF_LOADING | BF_READONLY;
-    s->handle = h;
-    s->progress_cb = progress_cb;
-    s->completion_cb = completion_cb;
-    s->opaque = opaque;
-    s->offset = offset;
-    printf("connect_async: '%s'\n", filename);
-    url_connect_async(s->handle, filename, URL_RDONLY,
-                      load_connected_cb, b);
-    return 0;
+    b->modified = s->modified;
+    qe_free(&b->io_state);
+    url_redisplay();
 }
 
-static void load_connected_cb(void *opaque, int err)
+static void eb_load_read_cb(void *opaque)
 {
     EditBuffer *b = opaque;
     BufferIOState *s = b->io_state;
-    printf("connect_cb: err=%d\n", err);
-    if (err) {
-        eb_io_stop(b, err);
+    int len, save_log, now;
+
+    len = read(s->fd, s->buffer, LOAD_CHUNK_SIZE);
+    if (len < 0 && errno == EINTR)
+        return;
+    if (len <= 0) {
+        /* end of file or read error */
+        eb_load_stop(b, len < 0 ? errno : 0);
+        return;
+    }
+    if (s->loaded + len > qe_state.max_load_size) {
+        /* the file has grown beyond the load limit */
+        eb_load_stop(b, EFBIG);
+        return;
+    }
+    save_log = b->save_log;
+    b->save_log = 0;
+    b->flags &= ~BF_READONLY;
+    len = eb_insert(b, s->offset, s->buffer, len);
+    b->flags |= BF_READONLY;
+    b->save_log = save_log;
+    if (len < 0) {
+        eb_load_stop(b, ENOMEM);
         return;
     }
-    url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
+    s->offset += len;
+    b->modified = s->modified;
+    s->loaded += len;
+
+    now = get_clock_ms();
+    if (now - s->display_time >= 0) {
+        s->display_time = now + LOAD_DISPLAY_DELAY;
+        url_redisplay();
+    }
 }
 
-static void load_read_cb(void *opaque, int size)
+/* Load the beginning of file f at offset and the rest asynchronously,
+ * return the number of bytes loaded or -1 upon read error.
+ */
+static int eb_load_async(EditBuffer *b, FILE *f, qe_off_t offset, qe_off_t size)
 {
-    EditBuffer *b = opaque;
-    BufferIOState *s = b->io_state;
+    BufferIOState *s;
+    int len, fd;
 
-    printf("read_cb: size=%d\n", size);
-    if (size < 0) {
-        eb_io_stop(b, -EIO);
-    } else if (size == 0) {
-        /* end of file */
-        eb_io_stop(b, 0);
-    } else {
-        s->offset += eb_insert(b, s->offset, s->buffer, size);
-        /* launch next read request */
-        url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
+    s = qe_mallocz(BufferIOState);
+    if (!s)
+        return eb_raw_buffer_load1(b, f, offset);
+    len = fread(s->buffer, 1, LOAD_FIRST_SIZE, f);
+    if (len < 0 || ferror(f)) {
+        qe_free(&s);
+        return -1;
+    }
+    if (eb_insert(b, offset, s->buffer, len) < 0) {
+        qe_free(&s);
+        return -1;
+    }
+    offset += len;
+    if (len < LOAD_FIRST_SIZE) {
+        /* file was shorter than expected */
+        qe_free(&s);
+        return len;
     }
+    /* use a separate descriptor: f is closed by the caller */
+    fd = open(b->filename, O_RDONLY);
+    if (fd < 0 || lseek(fd, len, SEEK_SET) != len) {
+        if (fd >= 0)
+            close(fd);
+        qe_free(&s);
+        len = eb_raw_buffer_load1(b, f, offset);
+        return len < 0 ? -1 : LOAD_FIRST_SIZE + len;
+    }
+    s->fd = fd;
+    s->offset = offset;
+    s->loaded = len;
+    s->size = size;
+    s->saved_flags = b->flags & BF_READONLY;
+    s->modified = 0;
+    s->display_time = get_clock_ms() + LOAD_DISPLAY_DELAY;
+    b->io_state = s;
+    b->flags |= BF_LOADING | BF_READONLY;
+    set_read_handler(fd, eb_load_read_cb, b);
+    return len;
 }
 
-static void eb_io_stop(EditBuffer *b, int err)
+/* Return the percentage of a background load completed */
+int eb_get_load_progress(EditBuffer *b)
 {
     BufferIOState *s = b->io_state;
 
-    b->flags = s->saved_flags;
-    if (s->nolog) {
-        b->modified = 0;
-        b->save_log = s->saved_log;
-    }
-    url_close(s->handle);
-    s->completion_cb(s->opaque, err);
-    qe_free(&b->io_state);
+    if (!s)
+        return 100;
+    return compute_percent(s->loaded, s->size);
 }
-#endif
 
 /* CG: returns number of bytes read, or -1 upon read error */
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
+int eb_raw_buffer_load1(EditBuffer *b, FILE *f, qe_off_t offset)
 {
     unsigned char buf[IOBUF_SIZE];
-    int len, size, inserted;
+    int len, size;
 
     //put_status(NULL, "loading %s", filename);
-    size = inserted = 0;
+    size = 0;
     for (;;) {
         len = fread(buf, 1, IOBUF_SIZE, f);
         if (len <= 0) {
@@ -1996,7 +2980,8 @@ int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
                 return -1;
             break;
         }
-        inserted += eb_insert(b, offset, buf, len);
+        if (eb_insert(b, offset, buf, len) < 0)
+            return -1;
         offset += len;
         size += len;
     }
@@ -2005,19 +2990,21 @@ int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
 }
 
 #ifdef CONFIG_MMAP
+/* release the buffer reference to its file mapping: the file stays
+ * mapped as long as pages from this or other buffers point into it.
+ */
 void eb_munmap_buffer(EditBuffer *b)
 {
-    if (b->map_address) {
-        munmap(b->map_address, b->map_length);
-        b->map_address = NULL;
-        b->map_length = 0;
-    }
+    qe_map_unref(&b->mapping);
 }
 
 int eb_mmap_buffer(EditBuffer *b, const char *filename)
 {
-    int fd, len, file_size, n, size;
+    int fd, len, n;
+    qe_off_t file_size, size;
+    off_t st_size;
     u8 *file_ptr, *ptr;
+    QEMapping *m;
     Page *p;
 
     eb_munmap_buffer(b);
@@ -2025,34 +3012,54 @@ int eb_mmap_buffer(EditBuffer *b, const char *filename)
     fd = open(filename, O_RDONLY);
     if (fd < 0)
         return -1;
-    file_size = lseek(fd, 0, SEEK_END);
+    /* the whole file must fit in the address space: pages are only
+     * read from disk when accessed.
+     */
+    st_size = lseek(fd, 0, SEEK_END);
+    if (st_size < 0 || (uint64_t)st_size > SIZE_MAX
+    ||  st_size / MAX_PAGE_SIZE >= INT_MAX) {
+        close(fd);
+        errno = (st_size < 0) ? errno : EFBIG;
+        return -1;
+    }
+    file_size = st_size;
     //put_status(NULL, "mapping %s", filename);
     file_ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
     if ((void*)file_ptr == MAP_FAILED) {
         close(fd);
         return -1;
     }
-    b->map_address = file_ptr;
-    b->map_length = file_size;
-
-    n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
+    /* describe the file with read-only extents: they are split into
+     * editable pages by eb_split_pages() where they are modified.
+     */
+    n = (file_size + MAX_EXTENT_SIZE - 1) / MAX_EXTENT_SIZE;
+    m = qe_mallocz(QEMapping);
     p = qe_malloc_array(Page, n);
-    if (!p) {
+    if (!m || !p) {
+        qe_free(&m);
+        qe_free(&p);
+        munmap(file_ptr, file_size);
         close(fd);
         return -1;
     }
+    m->address = file_ptr;
+    m->length = file_size;
+    /* one reference for the buffer and one for each page */
+    m->ref_count = 1 + n;
+    b->mapping = m;
+
     b->page_table = p;
     b->total_size = file_size;
     b->nb_pages = n;
+    eb_invalidate_pages(b, 0, INT_MAX);
     size = file_size;
     ptr = file_ptr;
     while (size > 0) {
-        len = size;
-        if (len > MAX_PAGE_SIZE)
-            len = MAX_PAGE_SIZE;
+        len = min_offset(size, MAX_EXTENT_SIZE);
         p->data = ptr;
         p->size = len;
         p->flags = PG_READ_ONLY;
+        p->map = m;
         ptr += len;
         size -= len;
         p++;
@@ -2069,11 +3076,18 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     QEmacsState *qs = &qe_state;
     struct stat st;
 
-    /* TODO: Should produce error messages */
-
     if (stat(b->filename, &st))
         return -1;
 
+    if (st.st_size > MAX_BUFFER_SIZE) {
+        /* file offsets would overflow the buffer offsets */
+        errno = EFBIG;
+        return -1;
+    }
+
+    /* stop loading a previous version of the file */
+    eb_load_stop(b, 0);
+
 #ifdef CONFIG_MMAP
     if (st.st_size >= qs->mmap_threshold) {
         if (!eb_mmap_buffer(b, b->filename))
@@ -2081,27 +3095,105 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     }
 #endif
     if (st.st_size <= qs->max_load_size) {
+        /* large files that could not be mapped are loaded in the
+           background once the screen is initialized */
+        if (st.st_size >= ASYNC_LOAD_SIZE && qs->screen && b->filename[0])
+            return eb_load_async(b, f, 0, st.st_size);
         return eb_raw_buffer_load1(b, f, 0);
     }
+    errno = EFBIG;
     return -1;
 }
 
-/* Write bytes between <start> and <end> to file filename,
- * return bytes written or -1 if error
+#define SAVE_IOV_COUNT  256  /* pages written per writev() call */
+
+/* Write bytes between <start> and <end> to file descriptor fd directly
+ * from the page data, return bytes written or -1 if error
  */
-static int raw_buffer_save(EditBuffer *b, int start, int end,
-                           const char *filename)
+static qe_off_t eb_write_pages(EditBuffer *b, int fd, qe_off_t start, qe_off_t end)
 {
-    int fd, len, size, written;
-    unsigned char buf[IOBUF_SIZE];
+    Page *p;
+    int page_offset, len;
+    qe_off_t size, written;
+#ifndef CONFIG_WIN32
+    struct iovec iov[SAVE_IOV_COUNT];
+    ssize_t ret;
+    int i, n;
+#endif
 
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0)
-        return -1;
+    written = 0;
+    size = end - start;
+    if (size <= 0)
+        return 0;
+    p = find_page(b, start, &page_offset);
+#ifndef CONFIG_WIN32
+    while (size > 0) {
+        /* gather a batch of pages */
+        for (n = 0; n < SAVE_IOV_COUNT && size > 0; n++, p++) {
+            len = min_offset(p->size - page_offset, size);
+            iov[n].iov_base = p->data + page_offset;
+            iov[n].iov_len = len;
+            size -= len;
+            page_offset = 0;
+        }
+        for (i = 0; i < n;) {
+            ret = writev(fd, iov + i, n - i);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            written += ret;
+            /* skip the written vectors after a partial write */
+            while (i < n && (size_t)ret >= iov[i].iov_len) {
+                ret -= iov[i].iov_len;
+                i++;
+            }
+            if (i < n) {
+                iov[i].iov_base = (u8 *)iov[i].iov_base + ret;
+                iov[i].iov_len -= ret;
+            }
+        }
+    }
+#else
+    while (size > 0) {
+        len = min_offset(p->size - page_offset, size);
+        len = write(fd, p->data + page_offset, len);
+        if (len < 0)
+            return -1;
+        written += len;
+        size -= len;
+        page_offset += len;
+        if (page_offset >= p->size) {
+            p++;
+            page_offset = 0;
+        }
+    }
+#endif
+    return written;
+}
+
+/* Write bytes between <start> and <end> to file filename,
+ * return bytes written or -1 if error.
+ * The data is written to a temporary file in the same directory, synced
+ * and renamed over the target: the target is never left truncated, and
+ * pages mapped from the old file remain valid.
+ */
+static qe_off_t raw_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                const char *filename)
+{
+    int fd, err;
+    qe_off_t written;
+#ifndef CONFIG_WIN32
+    char path[MAX_FILENAME_SIZE];
+    char tmpname[MAX_FILENAME_SIZE];
+    struct stat st;
+    mode_t mode;
+#endif
 
     //put_status(NULL, "writing %s", filename);
     if (end < start) {
-        int tmp = start;
+        qe_off_t tmp = start;
         start = end;
         end = tmp;
     }
@@ -2109,23 +3201,75 @@ static int raw_buffer_save(EditBuffer *b, int start, int end,
         start = 0;
     if (end > b->total_size)
         end = b->total_size;
-    written = 0;
-    size = end - start;
-    while (size > 0) {
-        len = size;
-        if (len > IOBUF_SIZE)
-            len = IOBUF_SIZE;
-        eb_read(b, start, buf, len);
-        len = write(fd, buf, len);
-        if (len < 0) {
-            close(fd);
-            return -1;
-        }
-        written += len;
-        start += len;
-        size -= len;
+
+#ifndef CONFIG_WIN32
+    /* replace the target of a symbolic link, not the link itself */
+    if (lstat(filename, &st) == 0 && S_ISLNK(st.st_mode)
+    &&  realpath(filename, path)) {
+        filename = path;
+    }
+    fd = -1;
+    if (stat(filename, &st) == 0) {
+        mode = st.st_mode & 07777;
+        /* special files are written in place */
+        if (!S_ISREG(st.st_mode))
+            goto in_place;
+    } else {
+        mode = umask(0);
+        umask(mode);
+        mode = 0644 & ~mode;
+        st.st_uid = (uid_t)-1;
+        st.st_gid = (gid_t)-1;
+    }
+    if (snprintf(tmpname, sizeof(tmpname), "%s.tmpXXXXXX", filename)
+        < ssizeof(tmpname)) {
+        fd = mkstemp(tmpname);
+    }
+    if (fd < 0) {
+        /* directory is not writable: write the file in place */
+        goto in_place;
+    }
+    fchmod(fd, mode);
+    if (st.st_uid != (uid_t)-1 && fchown(fd, st.st_uid, st.st_gid)) {
+        /* keep the file with the current owner */
+    }
+    written = eb_write_pages(b, fd, start, end);
+    if (written < 0 || fsync(fd)) {
+        err = errno;
+        close(fd);
+        goto fail;
+    }
+    if (close(fd) || rename(tmpname, filename)) {
+        err = errno;
+        goto fail;
+    }
+    /* make the rename durable */
+    get_dirname(path, sizeof(path), filename);
+    fd = open(*path ? path : ".", O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    //put_status(NULL, "");
+    return written;
+
+ fail:
+    unlink(tmpname);
+    errno = err;
+    return -1;
+
+ in_place:
+#endif
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    written = eb_write_pages(b, fd, start, end);
+    err = errno;
+    if (close(fd) && written >= 0) {
+        err = errno;
+        written = -1;
     }
-    close(fd);
+    errno = err;
     //put_status(NULL, "");
     return written;
 }
@@ -2170,28 +3314,28 @@ int eb_encode_char32(EditBuffer *b, char *buf, char32_t c) {
 
 /* Insert unicode character according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_char32(EditBuffer *b, int offset, char32_t c) {
+int eb_insert_char32(EditBuffer *b, qe_off_t offset, char32_t c) {
     char buf[MAX_CHAR_BYTES];
     int len;
 
     len = eb_encode_char32(b, buf, c);
-    return eb_insert(b, offset, buf, len);
+    return max_int(eb_insert(b, offset, buf, len), 0);
 }
 
 /* Replace the character at `offset` with `c`,
  * return number of bytes to move past `c`.
  */
-int eb_replace_char32(EditBuffer *b, int offset, char32_t c) {
+int eb_replace_char32(EditBuffer *b, qe_off_t offset, char32_t c) {
     char buf[MAX_CHAR_BYTES];
     int len;
-    int offset1;
+    qe_off_t offset1;
 
     len = eb_encode_char32(b, buf, c);
     eb_nextc(b, offset, &offset1);
     return eb_replace(b, offset, offset1 - offset, buf, len);
 }
 
-int eb_insert_char32_n(EditBuffer *b, int offset, char32_t c, int n) {
+int eb_insert_char32_n(EditBuffer *b, qe_off_t offset, char32_t c, int n) {
     char buf[1024];
     int size, pos;
 
@@ -2199,7 +3343,9 @@ int eb_insert_char32_n(EditBuffer *b, int offset, char32_t c, int n) {
     while (n --> 0) {
         pos += eb_encode_char32(b, buf + pos, c);
         if (pos > ssizeof(buf) - MAX_CHAR_BYTES || n == 0) {
-            size += eb_insert(b, offset + size, buf, pos);
+            if (eb_insert(b, offset + size, buf, pos) < 0)
+                break;
+            size += pos;
             pos = 0;
         }
     }
@@ -2208,10 +3354,10 @@ int eb_insert_char32_n(EditBuffer *b, int offset, char32_t c, int n) {
 
 /* Insert buffer with utf8 chars according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *str, int len)
+int eb_insert_utf8_buf(EditBuffer *b, qe_off_t offset, const char *str, int len)
 {
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
-        return eb_insert(b, offset, str, len);
+        return max_int(eb_insert(b, offset, str, len), 0);
     } else {
         char buf[1024];
         int size, pos;
@@ -2224,7 +3370,9 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *str, int len)
             int clen = eb_encode_char32(b, buf + pos, c);
             pos += clen;
             if (pos > countof(buf) - MAX_CHAR_BYTES || p >= strend) {
-                size += eb_insert(b, offset + size, buf, pos);
+                if (eb_insert(b, offset + size, buf, pos) < 0)
+                    break;
+                size += pos;
                 pos = 0;
             }
         }
@@ -2234,7 +3382,7 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *str, int len)
 
 /* Insert chars from char32 array according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_char32_buf(EditBuffer *b, int offset, const char32_t *p, int len)
+int eb_insert_char32_buf(EditBuffer *b, qe_off_t offset, const char32_t *p, int len)
 {
     char buf[1024];
     int i, size, pos;
@@ -2245,19 +3393,21 @@ int eb_insert_char32_buf(EditBuffer *b, int offset, const char32_t *p, int len)
         int clen = eb_encode_char32(b, buf + pos, c);
         pos += clen;
         if (pos > countof(buf) - MAX_CHAR_BYTES || i >= len) {
-            size += eb_insert(b, offset + size, buf, pos);
+            if (eb_insert(b, offset + size, buf, pos) < 0)
+                break;
+            size += pos;
             pos = 0;
         }
     }
     return size;
 }
 
-int eb_insert_str(EditBuffer *b, int offset, const char *str)
+int eb_insert_str(EditBuffer *b, qe_off_t offset, const char *str)
 {
     return eb_insert_utf8_buf(b, offset, str, strlen(str));
 }
 
-int eb_match_char32(EditBuffer *b, int offset, char32_t c, int *offsetp)
+int eb_match_char32(EditBuffer *b, qe_off_t offset, char32_t c, qe_off_t *offsetp)
 {
     if (eb_nextc(b, offset, &offset) != c)
         return 0;
@@ -2266,7 +3416,7 @@ int eb_match_char32(EditBuffer *b, int offset, char32_t c, int *offsetp)
     return 1;
 }
 
-int eb_match_str_utf8(EditBuffer *b, int offset, const char *str, int *offsetp) {
+int eb_match_str_utf8(EditBuffer *b, qe_off_t offset, const char *str, qe_off_t *offsetp) {
     const char *p = str;
 
     while (*p) {
@@ -2279,7 +3429,7 @@ int eb_match_str_utf8(EditBuffer *b, int offset, const char *str, int *offsetp)
     return 1;
 }
 
-int eb_match_istr_utf8(EditBuffer *b, int offset, const char *str, int *offsetp) {
+int eb_match_istr_utf8(EditBuffer *b, qe_off_t offset, const char *str, qe_off_t *offsetp) {
     const char *p = str;
 
     while (*p) {
@@ -2352,7 +3502,7 @@ int eb_printf(EditBuffer *b, const char *fmt, ...) {
 
 #if 0
 /* pad current line with spaces so that it reaches column n */
-void eb_line_pad(EditBuffer *b, int offset, int n) {
+void eb_line_pad(EditBuffer *b, qe_off_t offset, int n) {
     /* Compute visual column visual column */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
     int col = text_screen_width(b, eb_goto_bol(b, offset), offset, tw);
@@ -2362,10 +3512,10 @@ void eb_line_pad(EditBuffer *b, int offset, int n) {
 #endif
 
 /* Read the contents of a buffer region encoded in a utf8 string */
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, qe_off_t start, qe_off_t stop,
                            char *buf, int buf_size, int encode_zero)
 {
-    int size, offset;
+    qe_off_t size, offset;
     buf_t outbuf, *out;
 
     stop = clamp_offset(stop, 0, b->total_size);
@@ -2394,7 +3544,7 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
 }
 
 /* Compute the size of the contents of a buffer region encoded in utf8 */
-int eb_get_region_content_size(EditBuffer *b, int start, int stop)
+qe_off_t eb_get_region_content_size(EditBuffer *b, qe_off_t start, qe_off_t stop)
 {
     stop = clamp_offset(stop, 0, b->total_size);
     start = clamp_offset(start, 0, stop);
@@ -2403,7 +3553,7 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return stop - start;
     } else {
-        int offset, size;
+        qe_off_t offset, size;
         char buf[MAX_CHAR_BYTES];
 
         for (size = 0, offset = start; offset < stop;) {
@@ -2414,54 +3564,218 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
     }
 }
 
+#define CONVERT_CHUNK_SIZE  65536
+
+static inline int charset_is_ascii_compatible(QECharset *charset)
+{
+    return charset == &charset_utf8 || charset == &charset_8859_1
+        || charset == &charset_raw;
+}
+
+/* Copy the styles of a range of 'src' to the same range of 'dest',
+ * run by run.
+ */
+static void eb_copy_styles(EditBuffer *dest, qe_off_t dest_offset,
+                           EditBuffer *src, qe_off_t src_offset, qe_off_t size)
+{
+    qe_off_t offset, end, offset_max = src_offset + size;
+    QETermStyle style;
+
+    for (offset = src_offset; offset < offset_max; offset = end) {
+        style = eb_get_style_run(src, offset, &end);
+        if (end > offset_max)
+            end = offset_max;
+        eb_set_style(dest, style, LOGOP_WRITE,
+                     dest_offset + offset - src_offset, end - offset);
+    }
+}
+
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Charset converson between source and destination buffer is
  * performed.
  * Return the number of bytes inserted.
  */
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size)
+qe_off_t eb_insert_buffer_convert(EditBuffer *dest, qe_off_t dest_offset,
+                                  EditBuffer *src, qe_off_t src_offset,
+                                  qe_off_t size)
 {
     int styles_flags = min_int((dest->flags & BF_STYLES), (src->flags & BF_STYLES));
+    QECharset *charset;
+    CharsetDecodeState *ds;
+    const unsigned short *table;
+    u8 *ibuf, *obuf, *q, *qend;
+    const u8 *p, *pend;
+    qe_off_t offset, offset_max, style_end;
+    int len, avail, stop, dest_ascii, ascii_runs;
+    QETermStyle style, cur_style;
+    char32_t ch;
 
     if (dest->charset == src->charset
-    &&  dest->eol_type == src->eol_type
-    &&  !styles_flags) {
-        return eb_insert_buffer(dest, dest_offset, src, src_offset, size);
-    } else {
-        EditBuffer *b;
-        int offset, offset_max, offset1 = dest_offset;
-
-        b = dest;
-        if (!styles_flags
-        &&  ((b->flags & BF_SAVELOG) || dest_offset != b->total_size)) {
-            b = eb_new("*tmp*", BF_SYSTEM);
-            eb_set_charset(b, dest->charset, dest->eol_type);
-            offset1 = 0;
-        }
-
-        /* well, not very fast, but simple */
-        /* XXX: should optimize save_log system for insert sequences */
-        // XXX: should optimize styles transfer
-        offset_max = min_offset(src->total_size, src_offset + size);
-        size = 0;
-        for (offset = src_offset; offset < offset_max;) {
-            char buf[MAX_CHAR_BYTES];
-            QETermStyle style = eb_get_style(src, offset);
-            char32_t c = eb_nextc(src, offset, &offset);
-            int len = eb_encode_char32(b, buf, c);
-            b->cur_style = style;
-            size += eb_insert(b, offset1 + size, buf, len);
-        }
-
-        if (b != dest) {
-            size = eb_insert_buffer(dest, dest_offset, b, 0, b->total_size);
-            eb_free(&b);
-        }
+    &&  dest->eol_type == src->eol_type) {
+        size = eb_insert_buffer(dest, dest_offset, src, src_offset, size);
+        if (styles_flags)
+            eb_copy_styles(dest, dest_offset, src, src_offset, size);
         return size;
     }
+
+    /* Stream the source in chunks: decode with the charset table,
+     * encode into an output chunk and insert whole chunks.  Chunks are
+     * cut at style run boundaries to transfer the styles.
+     */
+    ibuf = qe_malloc_bytes(CONVERT_CHUNK_SIZE + MAX_CHAR_BYTES
+                           + CONVERT_CHUNK_SIZE + 2 * MAX_CHAR_BYTES);
+    if (!ibuf)
+        return 0;
+    obuf = ibuf + CONVERT_CHUNK_SIZE + MAX_CHAR_BYTES;
+    qend = obuf + CONVERT_CHUNK_SIZE;
+    q = obuf;
+
+    charset = dest->charset;
+    ds = &src->charset_state;
+    table = ds->table;
+    dest_ascii = charset_is_ascii_compatible(charset);
+    /* copy ASCII runs word by word between ASCII compatible charsets */
+    ascii_runs = dest_ascii && charset_is_ascii_compatible(src->charset)
+        && src->eol_type == EOL_UNIX && dest->eol_type == EOL_UNIX;
+
+    /* without style transfer, insert with the current style */
+    style = cur_style = dest->cur_style;
+    style_end = styles_flags ? 0 : QE_OFF_MAX;
+    offset_max = min_offset(src->total_size, src_offset + size);
+    size = 0;
+
+    for (offset = src_offset; offset < offset_max;) {
+        if (offset >= style_end) {
+            if (q > obuf) {
+                dest->cur_style = style;
+                if (eb_insert(dest, dest_offset + size, obuf, q - obuf) < 0)
+                    goto done;
+                size += q - obuf;
+                q = obuf;
+            }
+            style = eb_get_style_run(src, offset, &style_end);
+        }
+        /* read a chunk, keeping a margin for characters spanning the
+           end of the chunk, unless it is the last one */
+        len = min_offset(offset_max - offset, CONVERT_CHUNK_SIZE);
+        if (style_end - offset < len - MAX_CHAR_BYTES)
+            len = style_end - offset + MAX_CHAR_BYTES;
+        /* characters at the end of the range are decoded from the
+           following bytes, as eb_nextc() does */
+        avail = eb_read(src, offset, ibuf, len + MAX_CHAR_BYTES);
+        if (avail <= 0)
+            break;
+        if (len > avail)
+            len = avail;
+        memset(ibuf + avail, 0, len + MAX_CHAR_BYTES - avail);
+        stop = len;
+        if (offset + len < offset_max)
+            stop -= MAX_CHAR_BYTES;
+        if (stop > style_end - offset)
+            stop = style_end - offset;
+
+        p = ibuf;
+        pend = ibuf + stop;
+        while (p < pend) {
+            if (q >= qend) {
+                dest->cur_style = style;
+                if (eb_insert(dest, dest_offset + size, obuf, q - obuf) < 0)
+                    goto done;
+                size += q - obuf;
+                q = obuf;
+            }
+            if (ascii_runs && *p < 0x80) {
+                /* fast path for ASCII runs, 8 bytes at a time */
+                const u8 *p1 = p;
+                int n = min_int(pend - p, qend - q);
+                while (n >= 8) {
+                    uint64_t w;
+                    memcpy(&w, p1, 8);
+                    if (w & 0x8080808080808080ULL)
+                        break;
+                    p1 += 8;
+                    n -= 8;
+                }
+                while (n > 0 && *p1 < 0x80) {
+                    p1++;
+                    n--;
+                }
+                memcpy(q, p, p1 - p);
+                q += p1 - p;
+                p = p1;
+                continue;
+            }
+            /* decode a character as eb_nextc() does */
+            ch = table[*p];
+            if (ch == ESCAPE_CHAR) {
+                ds->p = p;
+                ch = ds->decode_func(ds);
+                p = ds->p;
+            } else {
+                p++;
+            }
+            if (ch == '\r') {
+                if (src->eol_type == EOL_DOS) {
+                    ds->p = p;
+                    if (p < ibuf + avail && ds->decode_func(ds) == '\n') {
+                        p = ds->p;
+                        ch = '\n';
+                    }
+                } else
+                if (src->eol_type == EOL_MAC) {
+                    ch = '\n';
+                }
+            } else
+            if (ch == '\n') {
+                if (src->eol_type == EOL_MAC) {
+                    ch = '\r';
+                }
+            }
+            /* encode it as eb_encode_char32() does */
+            if (ch == '\n') {
+                if (dest->eol_type == EOL_MAC) {
+                    ch = '\r';
+                } else
+                if (dest->eol_type == EOL_DOS) {
+                    q = charset->encode_func(charset, q, '\r');
+                }
+            }
+            if (ch < 0x80 && dest_ascii) {
+                *q++ = ch;
+            } else
+            if (charset == &charset_utf8) {
+                q += utf8_encode((char *)q, ch);
+            } else
+            if (charset == &charset_ucs2le && ch < 0x10000) {
+                q[0] = ch;
+                q[1] = ch >> 8;
+                q += 2;
+            } else
+            if (charset == &charset_ucs2be && ch < 0x10000) {
+                q[0] = ch >> 8;
+                q[1] = ch;
+                q += 2;
+            } else {
+                u8 *q1 = charset->encode_func(charset, q, ch);
+                if (q1) {
+                    q = q1;
+                } else {
+                    *q++ = '?';
+                }
+            }
+        }
+        offset += min_int(p - ibuf, len);
+    }
+    if (q > obuf) {
+        dest->cur_style = style;
+        if (eb_insert(dest, dest_offset + size, obuf, q - obuf) > 0)
+            size += q - obuf;
+    }
+ done:
+    dest->cur_style = cur_style;
+    qe_free(&ibuf);
+    return size;
 }
 
 /* Get the line starting at offset `offset` as an array of code points.
@@ -2471,7 +3785,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_get_line(EditBuffer *b, char32_t *buf, int size,
-                int offset, int *offset_ptr)
+                qe_off_t offset, qe_off_t *offset_ptr)
 {
     int len = 0;
     char32_t c;
@@ -2504,13 +3818,13 @@ int eb_get_line(EditBuffer *b, char32_t *buf, int size,
  * Truncation can be detected by checking if buf[len] is '\n'.
  */
 int eb_fgets(EditBuffer *b, char *buf, int buf_size,
-             int offset, int *offset_ptr)
+             qe_off_t offset, qe_off_t *offset_ptr)
 {
     buf_t outbuf, *out;
 
     out = buf_init(&outbuf, buf, buf_size);
     for (;;) {
-        int next;
+        qe_off_t next;
         char32_t c = eb_nextc(b, offset, &next);
         if (!buf_putc_utf8(out, c)) {
             /* truncation: offset points to the first unread character */
@@ -2528,9 +3842,10 @@ int eb_fgets(EditBuffer *b, char *buf, int buf_size,
     return out->len;
 }
 
-int eb_prev_line(EditBuffer *b, int offset)
+qe_off_t eb_prev_line(EditBuffer *b, qe_off_t offset)
 {
-    int offset1, seen_nl;
+    qe_off_t offset1;
+    int seen_nl;
 
     for (seen_nl = 0;;) {
         if (eb_prevc(b, offset, &offset1) == '\n') {
@@ -2543,9 +3858,9 @@ int eb_prev_line(EditBuffer *b, int offset)
 }
 
 /* return offset of the beginning of the line containing offset */
-int eb_goto_bol(EditBuffer *b, int offset)
+qe_off_t eb_goto_bol(EditBuffer *b, qe_off_t offset)
 {
-    int offset1;
+    qe_off_t offset1;
 
     for (;;) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2558,9 +3873,10 @@ int eb_goto_bol(EditBuffer *b, int offset)
 /* move to the beginning of the line containing offset */
 /* return offset of the beginning of the line containing offset */
 /* store count of characters skipped at *countp */
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
+qe_off_t eb_goto_bol2(EditBuffer *b, qe_off_t offset, int *countp)
 {
-    int count, offset1;
+    qe_off_t offset1;
+    int count;
 
     for (count = 0;; count++) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2575,7 +3891,7 @@ int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
  * return 0 if not blank.
  * return 1 if blank and store start of next line in <*offset1>.
  */
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1) {
+int eb_is_blank_line(EditBuffer *b, qe_off_t offset, qe_off_t *offset1) {
     char32_t c;
 
     while ((c = eb_nextc(b, offset, &offset)) != '\n') {
@@ -2588,7 +3904,7 @@ int eb_is_blank_line(EditBuffer *b, int offset, int *offset1) {
 }
 
 /* check if <offset> is within indentation. */
-int eb_is_in_indentation(EditBuffer *b, int offset) {
+int eb_is_in_indentation(EditBuffer *b, qe_off_t offset) {
     char32_t c;
 
     while ((c = eb_prevc(b, offset, &offset)) != '\n') {
@@ -2599,16 +3915,16 @@ int eb_is_in_indentation(EditBuffer *b, int offset) {
 }
 
 /* return offset of the end of the line containing offset */
-int eb_goto_eol(EditBuffer *b, int offset1) {
+qe_off_t eb_goto_eol(EditBuffer *b, qe_off_t offset1) {
     for (;;) {
-        int offset = offset1;
+        qe_off_t offset = offset1;
         char32_t c = eb_nextc(b, offset, &offset1);
         if (c == '\n')
             return offset;
     }
 }
 
-int eb_next_line(EditBuffer *b, int offset) {
+qe_off_t eb_next_line(EditBuffer *b, qe_off_t offset) {
     for (;;) {
         char32_t c = eb_nextc(b, offset, &offset);
         if (c == '\n')
@@ -2619,102 +3935,205 @@ int eb_next_line(EditBuffer *b, int offset) {
 /* buffer property handling */
 
 static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
-                              enum LogOperation op, int offset, int size)
+                              enum LogOperation op, qe_off_t offset, qe_off_t size);
+
+/* Find the last property at each level whose offset is below 'offset'.
+ * Their offsets are stored to 'pos'. The head of the list stands
+ * before all properties at offset 0.
+ */
+static void eb_find_property_links(EditBuffer *b, qe_off_t offset,
+                                   QEProperty **update, qe_off_t *pos)
+{
+    QEProperty *x = b->property_list;
+    int i;
+    qe_off_t x_offset = 0;
+
+    for (i = x->level; i-- > 0;) {
+        while (x->link[i].next && x_offset + x->link[i].span < offset) {
+            x_offset += x->link[i].span;
+            x = x->link[i].next;
+        }
+        update[i] = x;
+        pos[i] = x_offset;
+    }
+}
+
+/* Remove the properties anchored in [offset, offset2) and shift the
+ * following ones by 'delta'.
+ */
+static void eb_remove_properties(EditBuffer *b, qe_off_t offset,
+                                 qe_off_t offset2, qe_off_t delta)
+{
+    QEProperty *update[QE_PROP_MAX_LEVEL];
+    qe_off_t pos[QE_PROP_MAX_LEVEL];
+    QEProperty *head = b->property_list;
+    QEProperty *x;
+    int i;
+
+    eb_find_property_links(b, offset, update, pos);
+    while ((x = update[0]->link[0].next) != NULL
+       &&  pos[0] + update[0]->link[0].span < offset2) {
+        /* x is the first property at or after offset on all its levels */
+        for (i = 0; i < x->level; i++) {
+            update[i]->link[i].next = x->link[i].next;
+            update[i]->link[i].span += x->link[i].span;
+        }
+        if (x->link[0].next)
+            x->link[0].next->prev = update[0];
+        if (x->type & QE_PROP_FREE)
+            qe_free(&x->data);
+        qe_free(&x);
+    }
+    if (delta) {
+        for (i = 0; i < head->level; i++) {
+            if (update[i]->link[i].next)
+                update[i]->link[i].span += delta;
+        }
+    }
+}
+
+static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
+                              enum LogOperation op, qe_off_t offset, qe_off_t size)
 {
-    QEProperty **pp;
-    QEProperty *p;
+    QEProperty *update[QE_PROP_MAX_LEVEL];
+    qe_off_t pos[QE_PROP_MAX_LEVEL];
+    QEProperty *head = b->property_list;
+    int i;
 
     /* update properties */
     if (op == LOGOP_INSERT) {
-        for (p = b->property_list; p; p = p->next) {
-            if (p->offset >= offset)
-                p->offset += size;
+        /* properties at or after offset move by size */
+        eb_find_property_links(b, offset, update, pos);
+        for (i = 0; i < head->level; i++) {
+            if (update[i]->link[i].next)
+                update[i]->link[i].span += size;
         }
     } else
     if (op == LOGOP_DELETE) {
-        for (pp = &b->property_list; (p = *pp) != NULL;) {
-            if (p->offset >= offset) {
-                if (p->offset < offset + size) {
-                    /* property is anchored inside block: remove it */
-                    *pp = (*pp)->next;
-                    if (p->type & QE_PROP_FREE) {
-                        qe_free(&p->data);
-                    }
-                    qe_free(&p);
-                    continue;
-                }
-                p->offset -= size;
-            }
-            pp = &(*pp)->next;
-        }
+        /* properties anchored inside block are removed */
+        eb_remove_properties(b, offset, offset + size, -size);
     }
 }
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data) {
-    QEProperty *p;
-    QEProperty **pp;
+void eb_add_property(EditBuffer *b, qe_off_t offset, int type, void *data) {
+    static unsigned int seed = 2463534242U;
+    QEProperty *update[QE_PROP_MAX_LEVEL];
+    qe_off_t pos[QE_PROP_MAX_LEVEL];
+    QEProperty *head, *p, *x;
+    int i, level;
+    qe_off_t x_offset;
 
     if (!b->property_list) {
+        head = qe_malloc_bytes(sizeof(QEProperty) +
+                               QE_PROP_MAX_LEVEL * sizeof(QEPropertyLink));
+        if (!head)
+            return;
+        memset(head, 0, sizeof(QEProperty) +
+               QE_PROP_MAX_LEVEL * sizeof(QEPropertyLink));
+        head->level = 1;
+        b->property_list = head;
         eb_add_callback(b, eb_plist_callback, NULL, 0);
     }
-
-    for (pp = &b->property_list; (p = *pp) != NULL; pp = &(*pp)->next) {
-        if (p->offset >= offset) {
-            if (p->offset == offset) {
-                if (p->type == type && type == QE_PROP_TAG) {
-                    /* prevent tag duplicates */
-                    if (strequal(p->data, data)) {
-                        if (type & QE_PROP_FREE)
-                            qe_free(&data);
-                        return;
-                    }
-                }
-                continue;
+    head = b->property_list;
+
+    if (type == QE_PROP_TAG) {
+        /* prevent tag duplicates */
+        eb_find_property_links(b, offset, update, pos);
+        x = update[0]->link[0].next;
+        x_offset = pos[0] + update[0]->link[0].span;
+        for (; x && x_offset == offset; x = x->link[0].next) {
+            if (x->type == type && strequal(x->data, data)) {
+                if (type & QE_PROP_FREE)
+                    qe_free(&data);
+                return;
             }
-            break;
+            x_offset += x->link[0].span;
         }
     }
 
-    p = qe_mallocz(QEProperty);
-    p->offset = offset;
+    /* random level with a probability of 1/4 for each level */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    for (level = 1; level < QE_PROP_MAX_LEVEL
+         &&  ((seed >> (2 * level)) & 3) == 0; level++)
+        continue;
+
+    p = qe_malloc_bytes(sizeof(QEProperty) + level * sizeof(QEPropertyLink));
+    if (!p)
+        return;
     p->type = type;
     p->data = data;
-    p->next = *pp;
-    *pp = p;
+    p->level = level;
+
+    /* insert after the properties at the same offset */
+    eb_find_property_links(b, offset + 1, update, pos);
+    for (i = head->level; i < level; i++) {
+        update[i] = head;
+        pos[i] = 0;
+        head->link[i].next = NULL;
+    }
+    if (head->level < level)
+        head->level = level;
+    for (i = 0; i < level; i++) {
+        x = update[i];
+        p->link[i].next = x->link[i].next;
+        p->link[i].span = x->link[i].next ?
+            pos[i] + x->link[i].span - offset : 0;
+        x->link[i].next = p;
+        x->link[i].span = offset - pos[i];
+    }
+    p->prev = update[0];
+    if (p->link[0].next)
+        p->link[0].next->prev = p;
 }
 
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type) {
-    QEProperty *found = NULL;
-    QEProperty *p;
-    for (p = b->property_list; p && p->offset < offset2; p = p->next) {
-        if (p->offset >= offset && p->type == type) {
-            /* return the last property between offset and offset2 */
-            found = p;
-        }
+/* Iterate on buffer properties in offset order: return the property
+ * following 'p', or the first one if 'p' is NULL, and update the
+ * offset in '*offsetp'.
+ */
+QEProperty *eb_next_property(EditBuffer *b, QEProperty *p, qe_off_t *offsetp) {
+    if (!p) {
+        p = b->property_list;
+        if (!p)
+            return NULL;
+        *offsetp = 0;
     }
-    return found;
+    *offsetp += p->link[0].span;
+    return p->link[0].next;
 }
 
-void eb_delete_properties(EditBuffer *b, int offset, int offset2) {
-    QEProperty *p;
-    QEProperty **pp;
+/* Return the last property of type 'type' between offset and offset2 */
+QEProperty *eb_find_property(EditBuffer *b, qe_off_t offset, qe_off_t offset2, int type) {
+    QEProperty *update[QE_PROP_MAX_LEVEL];
+    qe_off_t pos[QE_PROP_MAX_LEVEL];
+    QEProperty *x;
+    qe_off_t x_offset;
 
     if (!b->property_list)
-        return;
+        return NULL;
 
-    for (pp = &b->property_list; (p = *pp) != NULL && p->offset < offset2;) {
-        if (p->offset >= offset && p->offset < offset2) {
-            *pp = (*pp)->next;
-            if (p->type & QE_PROP_FREE) {
-                qe_free(&p->data);
-            }
-            qe_free(&p);
-        } else {
-            pp = &(*pp)->next;
-        }
+    eb_find_property_links(b, offset2, update, pos);
+    /* walk back from the last property before offset2 */
+    x_offset = pos[0];
+    for (x = update[0]; x != b->property_list; x = x->prev) {
+        if (x_offset < offset)
+            break;
+        if (x->type == type)
+            return x;
+        x_offset -= x->prev->link[0].span;
     }
-    if (!b->property_list) {
+    return NULL;
+}
+
+void eb_delete_properties(EditBuffer *b, qe_off_t offset, qe_off_t offset2) {
+    if (!b->property_list)
+        return;
+
+    eb_remove_properties(b, offset, offset2, 0);
+    if (!b->property_list->link[0].next) {
         eb_free_callback(b, eb_plist_callback, NULL);
+        qe_free(&b->property_list);
     }
 }
 
@@ -2735,21 +4154,29 @@ void eb_register_data_type(EditBufferDataType *bdt)
 /* Write buffer contents between <start> and <end> to file <filename>,
  * return bytes written or -1 if error
  */
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
+qe_off_t eb_write_buffer(EditBuffer *b, qe_off_t start, qe_off_t end,
+                         const char *filename)
 {
     if (!b->data_type->buffer_save)
         return -1;
 
+    if (b->flags & BF_LOADING) {
+        /* the buffer contents are incomplete */
+        errno = EBUSY;
+        return -1;
+    }
+
     return b->data_type->buffer_save(b, start, end, filename);
 }
 
 /* Save buffer contents to buffer associated file, handle backups,
  * return bytes written or -1 if error
  */
-int eb_save_buffer(EditBuffer *b)
+qe_off_t eb_save_buffer(EditBuffer *b)
 {
     QEmacsState *qs = &qe_state;
-    int ret, st_mode;
+    qe_off_t ret;
+    int st_mode;
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
     struct stat st;
@@ -2757,6 +4184,11 @@ int eb_save_buffer(EditBuffer *b)
     if (!b->data_type->buffer_save)
         return -1;
 
+    if (b->flags & BF_LOADING) {
+        errno = EBUSY;
+        return -1;
+    }
+
     filename = b->filename;
     /* get old file permission */
     st_mode = 0644;
@@ -2767,8 +4199,17 @@ int eb_save_buffer(EditBuffer *b)
     &&  strlen(filename) < MAX_FILENAME_SIZE - 1) {
         /* backup old file if present */
         if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
+            int linked = 0;
+#ifndef CONFIG_WIN32
+            /* keep the old file in place until the new one replaces it */
+            if (lstat(filename, &st) == 0 && !S_ISLNK(st.st_mode)) {
+                unlink(buf1);
+                linked = !link(filename, buf1);
+            }
+#endif
             // should check error code
-            rename(filename, buf1);
+            if (!linked)
+                rename(filename, buf1);
         }
     }
 
@@ -222,8 +222,8 @@ static inline int clamp_int(int a, int b, int c) {
         return a;
 }
 
-static inline int compute_percent(int a, int b) {
-    return b <= 0 ? 0 : (int)((long long)a * 100 / b);
+static inline int compute_percent(int64_t a, int64_t b) {
+    return b <= 0 ? 0 : (int)(a * 100 / b);
 }
 
 static inline int align(int a, int n) {
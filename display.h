@@ -137,6 +137,9 @@ struct QEditScreen {
     /* clip region handling */
     int clip_x1, clip_y1;
     int clip_x2, clip_y2;
+    /* output statistics, maintained by the display driver */
+    int frame_count;
+    int64_t frame_bytes;
     void *priv_data;
 };
 
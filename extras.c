@@ -27,12 +27,12 @@
 #include "qe.h"
 #include "variables.h"
 
-static int qe_skip_comments(EditState *s, int offset, int *offsetp)
+static int qe_skip_comments(EditState *s, qe_off_t offset, qe_off_t *offsetp)
 {
     char32_t buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, len, pos;
-    int offset0, offset1;
+    qe_off_t offset0, offset1;
 
     if (!s->colorize_func && !s->b->b_styles)
         return 0;
@@ -55,9 +55,9 @@ static int qe_skip_comments(EditState *s, int offset, int *offsetp)
     return 1;
 }
 
-static int eb_skip_spaces(EditBuffer *b, int offset, int *offsetp)
+static int eb_skip_spaces(EditBuffer *b, qe_off_t offset, qe_off_t *offsetp)
 {
-    int offset0 = offset, offset1;
+    qe_off_t offset0 = offset, offset1;
 
     while (offset < b->total_size
         && qe_isspace(eb_nextc(b, offset, &offset1))) {
@@ -71,10 +71,10 @@ static int eb_skip_spaces(EditBuffer *b, int offset, int *offsetp)
 }
 
 static void compare_resync(EditState *s1, EditState *s2,
-                           int save1, int save2,
-                           int *offset1_ptr, int *offset2_ptr)
+                           qe_off_t save1, qe_off_t save2,
+                           qe_off_t *offset1_ptr, qe_off_t *offset2_ptr)
 {
-    int pos1, off1, pos2, off2;
+    qe_off_t pos1, off1, pos2, off2;
     char32_t ch1, ch2;
 
     off1 = save1;
@@ -126,7 +126,7 @@ void do_compare_windows(EditState *s, int argval)
     QEmacsState *qs = s->qe_state;
     EditState *s1;
     EditState *s2;
-    int offset1, offset2, size1, size2;
+    qe_off_t offset1, offset2, size1, size2;
     char32_t ch1, ch2;
     int tries, resync = 0;
     char buf1[MAX_CHAR_BYTES + 2], buf2[MAX_CHAR_BYTES + 2];
@@ -225,10 +225,11 @@ void do_compare_windows(EditState *s, int argval)
             break;
         }
         if (resync) {
-            int save1 = s1->offset, save2 = s2->offset;
+            qe_off_t save1 = s1->offset, save2 = s2->offset;
             compare_resync(s1, s2, save1, save2, &s1->offset, &s2->offset);
-            put_status(s, "Skipped %d and %d bytes",
-                       s1->offset - save1, s2->offset - save2);
+            put_status(s, "Skipped %lld and %lld bytes",
+                       (long long)(s1->offset - save1),
+                       (long long)(s2->offset - save2));
         } else {
             put_status(s, "%s%s%sDifference: '%s' [0x%02X] <-> '%s' [0x%02X]",
                        comment1, comment2, comment3,
@@ -293,7 +294,7 @@ void do_compare_files(EditState *s, const char *filename, int bflags)
 
 void do_delete_horizontal_space(EditState *s)
 {
-    int from, to, offset;
+    qe_off_t from, to, offset;
 
     /* boundary check unnecessary because eb_prevc returns '\n'
      * at bof and eof and qe_isblank return true only on SPC and TAB.
@@ -314,13 +315,13 @@ static void do_delete_blank_lines(EditState *s) {
      * On isolated blank line, delete that one.
      * On nonblank line, delete any immediately following blank lines.
      */
-    int p0, p1, p2, p3;
+    qe_off_t p0, p1, p2, p3;
     EditBuffer *b = s->b;
 
     p0 = p1 = eb_goto_bol(b, s->offset);
     if (eb_is_blank_line(b, p1, &p2)) {
         while (p0 > 0) {
-            int offset0 = eb_prev_line(b, p0);
+            qe_off_t offset0 = eb_prev_line(b, p0);
             if (!eb_is_blank_line(b, offset0, NULL))
                 break;
             p0 = offset0;
@@ -359,10 +360,10 @@ static void do_tabify(EditState *s, int p1, int p2)
      */
     EditBuffer *b = s->b;
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max_offset(0, min_offset(p1, p2));
-    int stop = min_offset(b->total_size, max_offset(p1, p2));
+    qe_off_t start = max_offset(0, min_offset(p1, p2));
+    qe_off_t stop = min_offset(b->total_size, max_offset(p1, p2));
     int col;
-    int offset, offset1, offset2, delta;
+    qe_off_t offset, offset1, offset2, delta;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -432,10 +433,10 @@ static void do_untabify(EditState *s, int p1, int p2)
      */
     EditBuffer *b = s->b;
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max_offset(0, min_offset(p1, p2));
-    int stop = min_offset(b->total_size, max_offset(p1, p2));
+    qe_off_t start = max_offset(0, min_offset(p1, p2));
+    qe_off_t stop = min_offset(b->total_size, max_offset(p1, p2));
     int col, col0;
-    int offset, offset1, offset2, delta;
+    qe_off_t offset, offset1, offset2, delta;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -551,9 +552,9 @@ static void forward_block(EditState *s, int dir)
     int line_num, col_num, style, style0, level;
     int pos;      /* position of the current character on line */
     int len;      /* number of colorized positions */
-    int offset;   /* offset of the current character */
-    int offset0;  /* offset of the beginning of line */
-    int offset1;  /* offset of the beginning of the next line */
+    qe_off_t offset;   /* offset of the current character */
+    qe_off_t offset0;  /* offset of the beginning of line */
+    qe_off_t offset1;  /* offset of the beginning of the next line */
     char32_t c;
 
     offset = s->offset;
@@ -619,7 +620,7 @@ static void forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int off;
+                    qe_off_t off;
                     char32_t c1;
                     while ((c1 = eb_prevc(s->b, offset, &off)) != '\n') {
                         offset = off;
@@ -697,7 +698,7 @@ static void forward_block(EditState *s, int dir)
             case '\'':
                 if (pos >= len) {
                     /* simplistic string skip with escape char */
-                    int off;
+                    qe_off_t off;
                     char32_t c1;
                     while ((c1 = eb_nextc(s->b, offset, &off)) != '\n') {
                         offset = off;
@@ -763,7 +764,7 @@ static void do_forward_block(EditState *s, int n)
 
 static void do_kill_block(EditState *s, int n)
 {
-    int start = s->offset;
+    qe_off_t start = s->offset;
 
     if (n != 0) {
         do_forward_block(s, n);
@@ -774,8 +775,8 @@ static void do_kill_block(EditState *s, int n)
 void do_transpose(EditState *s, int cmd)
 {
     QEmacsState *qs = s->qe_state;
-    int offset0, offset1, offset2, offset3, end_offset;
-    int size0, size1, size2;
+    qe_off_t offset0, offset1, offset2, offset3, end_offset;
+    qe_off_t size0, size1, size2;
     EditBuffer *b = s->b;
 
     if (check_read_only(s))
@@ -949,14 +950,15 @@ static void do_describe_function(EditState *s, const char *cmd_name) {
 #define SF_BASENAME   0x40
 #define SF_PARAGRAPH  0x80
 #define SF_SILENT     0x100
-static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags);
+static int eb_sort_span(EditBuffer *b, qe_off_t *pp1, qe_off_t *pp2, qe_off_t cur_offset, int flags);
 
 static void print_bindings(EditBuffer *b, ModeDef *mode)
 {
     struct QEmacsState *qs = &qe_state;
     char buf[256];
     const CmdDef *d;
-    int gfound, start, stop, i, j;
+    int gfound, i, j;
+    qe_off_t start, stop;
 
     start = 0;
     gfound = 0;
@@ -1003,7 +1005,8 @@ void do_apropos(EditState *s, const char *str)
     EditBuffer *b;
     const CmdDef *d;
     VarDef *vp;
-    int found_command, found_variable, start, stop, i, j;
+    int found_command, found_variable, i, j;
+    qe_off_t start, stop;
 
     b = new_help_buffer();
     if (!b)
@@ -1072,7 +1075,8 @@ static void do_about_qemacs(EditState *s)
     EditBuffer *b;
     ModeDef *m;
     const CmdDef *d;
-    int start, stop, i, j;
+    int i, j;
+    qe_off_t start, stop;
 
     b = eb_scratch("*About QEmacs*", BF_UTF8);
     eb_printf(b, "\n  %s\n\n%s\n", str_version, str_credits);
@@ -1207,7 +1211,7 @@ static int qe_term_get_style(const char *str, QETermStyle *style)
 
 static void do_set_region_color(EditState *s, const char *str)
 {
-    int offset, size;
+    qe_off_t offset, size;
     QETermStyle style;
 
     /* deactivate region hilite */
@@ -1228,12 +1232,14 @@ static void do_set_region_color(EditState *s, const char *str)
         eb_create_style_buffer(s->b, QE_TERM_STYLE_BITS <= 16 ? BF_STYLE2 :
                                QE_TERM_STYLE_BITS <= 32 ? BF_STYLE4 : BF_STYLE8);
         eb_set_style(s->b, style, LOGOP_WRITE, offset, size);
+        /* styles are changed without a buffer modification */
+        edit_invalidate(s, 1);
     }
 }
 
 static void do_set_region_style(EditState *s, const char *str)
 {
-    int offset, size;
+    qe_off_t offset, size;
     QETermStyle style;
     QEStyleDef *st;
 
@@ -1257,12 +1263,14 @@ static void do_set_region_style(EditState *s, const char *str)
         eb_create_style_buffer(s->b, QE_TERM_STYLE_BITS <= 16 ? BF_STYLE2 :
                                QE_TERM_STYLE_BITS <= 32 ? BF_STYLE4 : BF_STYLE8);
         eb_set_style(s->b, style, LOGOP_WRITE, offset, size);
+        edit_invalidate(s, 1);
     }
 }
 
 static void do_drop_styles(EditState *s)
 {
     eb_free_style_buffer(s->b);
+    edit_invalidate(s, 1);
     s->b->flags &= ~BF_STYLES;
 }
 
@@ -1287,10 +1295,10 @@ static void do_describe_buffer(EditState *s, int argval)
     eb_printf(b1, "        name: %s\n", b->name);
     eb_printf(b1, "    filename: %s\n", b->filename);
     eb_printf(b1, "    modified: %d\n", b->modified);
-    eb_printf(b1, "  total_size: %d\n", b->total_size);
-    eb_printf(b1, "        mark: %d\n", b->mark);
-    eb_printf(b1, "   s->offset: %d\n", s->offset);
-    eb_printf(b1, "   b->offset: %d\n", b->offset);
+    eb_printf(b1, "  total_size: %lld\n", (long long)b->total_size);
+    eb_printf(b1, "        mark: %lld\n", (long long)b->mark);
+    eb_printf(b1, "   s->offset: %lld\n", (long long)s->offset);
+    eb_printf(b1, "   b->offset: %lld\n", (long long)b->offset);
 
     eb_printf(b1, "   tab_width: %d\n", b->tab_width);
     eb_printf(b1, " fill_column: %d\n", b->fill_column);
@@ -1351,25 +1359,33 @@ static void do_describe_buffer(EditState *s, int argval)
         eb_printf(b1, "  saved_mode: %s\n", b->saved_mode->name);
 
     eb_printf(b1, "   data_type: %s\n", b->data_type->name);
-    eb_printf(b1, "       pages: %d\n", b->nb_pages);
+    eb_printf(b1, "       pages: %d  (page_size=%d)\n", b->nb_pages,
+              b->page_size);
 
-    if (b->map_address) {
-        eb_printf(b1, " map_address: %p  (length=%d, handle=%d)\n",
-                  b->map_address, b->map_length, b->map_handle);
+    if (b->mapping) {
+        eb_printf(b1, " map_address: %p  (length=%lld, refs=%d, handle=%d)\n",
+                  b->mapping->address, (long long)b->mapping->length,
+                  b->mapping->ref_count, b->map_handle);
     }
 
-    eb_printf(b1, "    save_log: %d  (new_index=%d, current=%d, nb_logs=%d)\n",
-              b->save_log, b->log_new_index, b->log_current, b->nb_logs);
+    eb_printf(b1, "    save_log: %d  (nb_logs=%d, first=%d, current=%d, size=%lld)\n",
+              b->save_log, b->nb_logs, b->undo_first, b->log_current,
+              (long long)b->undo_size);
     eb_printf(b1, "      styles: %d  (cur_style=%lld, bytes=%d, shift=%d)\n",
               !!b->b_styles, (long long)b->cur_style,
               b->style_bytes, b->style_shift);
+    if (b->b_styles) {
+        eb_printf(b1, "  style_runs: %d  (%d bytes allocated)\n",
+                  b->b_styles->nb_runs,
+                  b->b_styles->max_runs * (int)sizeof(QEStyleRun));
+    }
 
     if (b->total_size > 0) {
         u8 iobuf[4096];
         int count[256];
-        int total_size = b->total_size;
-        int offset, c, i, col, max_count, count_width;
-        int word_char, word_count, nb_chars, line, column;
+        qe_off_t total_size = b->total_size, offset, nb_chars;
+        int c, i, col, max_count, count_width;
+        int word_char, word_count, line, column;
 
         eb_get_pos(b, &line, &column, total_size);
         nb_chars = eb_get_char_offset(b, total_size);
@@ -1395,11 +1411,11 @@ static void do_describe_buffer(EditState *s, int argval)
         }
         max_count = 0;
         for (i = 0; i < 256; i++) {
-            max_count = max_offset(max_count, count[i]);
+            max_count = max_int(max_count, count[i]);
         }
         count_width = snprintf(NULL, 0, "%d", max_count);
 
-        eb_printf(b1, "       chars: %d\n", nb_chars);
+        eb_printf(b1, "       chars: %lld\n", (long long)nb_chars);
         eb_printf(b1, "       words: %d\n", word_count);
         eb_printf(b1, "       lines: %d\n", line + (column > 0));
 
@@ -1439,7 +1455,7 @@ static void do_describe_buffer(EditState *s, int argval)
                       i, p->size, p->flags, p->nb_lines, p->col, p->nb_chars,
                       (void *)p->data);
             pc = p->data;
-            n = min_offset(p->size, 16);
+            n = min_int(p->size, 16);
             while (n-- > 0) {
                 char cbuf[8];
                 byte_quote(cbuf, sizeof cbuf, *pc++);
@@ -1478,9 +1494,9 @@ static void do_describe_window(EditState *s, int argval)
               (s->flags & WF_MINIBUF) ? " MINIBUF" : "",
               (s->flags & WF_HIDDEN) ? " HIDDEN" : "",
               (s->flags & WF_FILELIST) ? " FILELIST" : "");
-    eb_printf(b1, "%*s: %d\n", w, "offset", s->offset);
-    eb_printf(b1, "%*s: %d\n", w, "offset_top", s->offset_top);
-    eb_printf(b1, "%*s: %d\n", w, "offset_bottom", s->offset_bottom);
+    eb_printf(b1, "%*s: %lld\n", w, "offset", (long long)s->offset);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_top", (long long)s->offset_top);
+    eb_printf(b1, "%*s: %lld\n", w, "offset_bottom", (long long)s->offset_bottom);
     eb_printf(b1, "%*s: %d\n", w, "y_disp", s->y_disp);
     eb_printf(b1, "%*s: %d, %d\n", w, "x_disp[]", s->x_disp[0], s->x_disp[1]);
     eb_printf(b1, "%*s: %d\n", w, "dump_width", s->dump_width);
@@ -1508,13 +1524,20 @@ static void do_describe_window(EditState *s, int argval)
     eb_printf(b1, "%*s: %s\n", w, "mode", s->mode->name);
     eb_printf(b1, "%*s: %d\n", w, "colorize_nb_lines", s->colorize_nb_lines);
     eb_printf(b1, "%*s: %d\n", w, "colorize_nb_valid_lines", s->colorize_nb_valid_lines);
-    eb_printf(b1, "%*s: %d\n", w, "colorize_max_valid_offset", s->colorize_max_valid_offset);
+    eb_printf(b1, "%*s: %lld\n", w, "colorize_max_valid_offset", (long long)s->colorize_max_valid_offset);
+    eb_printf(b1, "%*s: %d\n", w, "colorize_guess_max", s->colorize_guess_max);
     eb_printf(b1, "%*s: %d\n", w, "busy", s->busy);
     eb_printf(b1, "%*s: %d\n", w, "display_invalid", s->display_invalid);
     eb_printf(b1, "%*s: %d\n", w, "borders_invalid", s->borders_invalid);
+    eb_printf(b1, "%*s: %d\n", w, "display_dirty", s->display_dirty);
     eb_printf(b1, "%*s: %d\n", w, "show_selection", s->show_selection);
     eb_printf(b1, "%*s: %d\n", w, "region_style", s->region_style);
     eb_printf(b1, "%*s: %d\n", w, "curline_style", s->curline_style);
+    if (s->layout_cache) {
+        eb_printf(b1, "%*s: %d entries, %d hits, %d misses\n", w,
+                  "layout_cache", s->layout_cache->nb_entries,
+                  s->layout_cache->hits, s->layout_cache->misses);
+    }
     eb_putc(b1, '\n');
 
     show_popup(s, b1, "Window Description");
@@ -1522,6 +1545,7 @@ static void do_describe_window(EditState *s, int argval)
 
 static void do_describe_screen(EditState *e, int argval)
 {
+    QEmacsState *qs = e->qe_state;
     QEditScreen *s = e->screen;
     EditBuffer *b1;
     int w;
@@ -1544,6 +1568,18 @@ static void do_describe_screen(EditState *e, int argval)
     eb_printf(b1, "%*s: %d\n", w, "bitmap_format", s->bitmap_format);
     eb_printf(b1, "%*s: %d\n\n", w, "video_format", s->video_format);
 
+    eb_printf(b1, "%*s: %d  (%d reads coalesced, %d/s, interval %d ms)\n",
+              w, "process frames", qs->process_frames,
+              qs->process_dropped_frames, qs->process_frame_rate,
+              qs->process_frame_interval);
+    eb_printf(b1, "%*s: %d  (%d windows displayed, %d skipped, %d deferred, "
+              "%.3f ms/window, budget %d ms)\n\n",
+              w, "display frames", qs->display_frames,
+              qs->display_windows, qs->display_skipped_windows,
+              qs->display_deferred_windows,
+              qs->display_window_time / 1000.0 / max_int(1, qs->display_windows),
+              qs->display_frame_budget);
+
     eb_printf(b1, "%*s: %d\n", w, "QE_TERM_STYLE_BITS", QE_TERM_STYLE_BITS);
     eb_printf(b1, "%*s: %x << %d\n", w, "QE_TERM_FG_COLORS", QE_TERM_FG_COLORS, QE_TERM_FG_SHIFT);
     eb_printf(b1, "%*s: %x << %d\n\n", w, "QE_TERM_BG_COLORS", QE_TERM_BG_COLORS, QE_TERM_BG_SHIFT);
@@ -1565,12 +1601,12 @@ struct chunk_ctx {
 };
 
 struct chunk {
-    int start, end, offset;
+    qe_off_t start, end, offset;
     unsigned short c[2];
 };
 
-static int eb_skip_to_basename(EditBuffer *b, int pos) {
-    int base = pos;
+static qe_off_t eb_skip_to_basename(EditBuffer *b, qe_off_t pos) {
+    qe_off_t base = pos;
     char32_t c;
     while ((c = eb_nextc(b, pos, &pos)) != '\n') {
         if (c == '/' || c == '\\')
@@ -1583,7 +1619,7 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     struct chunk_ctx *cp = vp0;
     const struct chunk *p1 = vp1;
     const struct chunk *p2 = vp2;
-    int pos1, pos2;
+    qe_off_t pos1, pos2;
 
     if ((++cp->ncmp & 8191) == 8191) {
         QEmacsState *qs = &qe_state;
@@ -1661,16 +1697,17 @@ static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
     return (p1->start > p2->start) - (p1->start < p2->start);
 }
 
-static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags) {
+static int eb_sort_span(EditBuffer *b, qe_off_t *pp1, qe_off_t *pp2, qe_off_t cur_offset, int flags) {
     struct chunk_ctx ctx;
     EditBuffer *b1;
-    int p1 = *pp1, p2 = *pp2;
-    int i, j, offset, line1, line2, col1, col2, line, col, lines;
+    qe_off_t p1 = *pp1, p2 = *pp2;
+    int i, j, line1, line2, col1, col2, line, col, lines;
+    qe_off_t offset;
     char32_t c;
     struct chunk *chunk_array;
 
     if (p1 > p2) {
-        int tmp = p1;
+        qe_off_t tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1704,7 +1741,7 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
     }
     offset = p1;
     for (i = 0; i < lines && offset < p2; i++) {
-        int pos, pos1;
+        qe_off_t pos, pos1;
         pos = offset;
         if (flags & SF_COLUMN) {
             for (col = ctx.col; col-- > 0;) {
@@ -1751,7 +1788,7 @@ static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int f
         chunk_array[i].end = offset = eb_goto_eol(b, pos);
         offset = eb_next(b, offset);
         if (flags & SF_PARAGRAPH) {
-            int offset1;
+            qe_off_t offset1;
             /* paragraph sorting: skip continuation lines */
             // XXX: Should ignore initial indent
             while (offset < p2 && qe_isspace(eb_nextc(b, offset, &offset1))) {
@@ -1795,7 +1832,7 @@ done:
     return 0;
 }
 
-static void do_sort_span(EditState *s, int p1, int p2, int argval, int flags) {
+static void do_sort_span(EditState *s, qe_off_t p1, qe_off_t p2, int argval, int flags) {
     s->region_style = 0;
     if (eb_sort_span(s->b, &p1, &p2, s->offset, flags | argval) < 0) {
         put_status(s, "Out of memory");
@@ -1818,7 +1855,8 @@ static void do_sort_buffer(EditState *s, int argval, int flags) {
 static void tag_buffer(EditState *s) {
     char32_t buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
-    int offset, line_num, col_num;
+    int line_num, col_num;
+    qe_off_t offset;
 
     if (s->colorize_func || s->b->b_styles) {
         /* force complete buffer colorization */
@@ -1831,11 +1869,12 @@ static void tag_buffer(EditState *s) {
 static void tag_complete(CompleteState *cp, CompleteFunc enumerate) {
     /* XXX: only support current buffer */
     QEProperty *p;
+    qe_off_t offset;
 
     if (cp->target) {
         tag_buffer(cp->target);
 
-        for (p = cp->target->b->property_list; p; p = p->next) {
+        for (p = NULL; (p = eb_next_property(cp->target->b, p, &offset)) != NULL;) {
             if (p->type == QE_PROP_TAG) {
                 enumerate(cp, p->data, CT_GLOB);
             }
@@ -1847,13 +1886,14 @@ static int tag_print_entry(CompleteState *cp, EditState *s, const char *name) {
     if (cp->target) {
         EditBuffer *b = cp->target->b;
         QEProperty *p;
+        qe_off_t p_offset;
         if (!s->colorize_func && cp->target->colorize_func) {
             set_colorize_func(s, cp->target->colorize_func, cp->target->colorize_mode);
         }
-        for (p = b->property_list; p; p = p->next) {
+        for (p = NULL; (p = eb_next_property(b, p, &p_offset)) != NULL;) {
             if (p->type == QE_PROP_TAG && strequal(p->data, name)) {
-                int offset = eb_goto_bol(b, p->offset);
-                int offset1 = eb_goto_eol(b, p->offset);
+                qe_off_t offset = eb_goto_bol(b, p_offset);
+                qe_off_t offset1 = eb_goto_eol(b, p_offset);
                 return eb_insert_buffer_convert(s->b, s->b->total_size,
                                                 b, offset, offset1 - offset);
             }
@@ -1862,7 +1902,7 @@ static int tag_print_entry(CompleteState *cp, EditState *s, const char *name) {
     return eb_puts(s->b, name);
 }
 
-static int tag_get_entry(EditState *s, char *dest, int size, int offset)
+static int tag_get_entry(EditState *s, char *dest, int size, qe_off_t offset)
 {
     int len = eb_fgets(s->b, dest, size, offset, &offset);
     int p2 = strcspn(dest, "=[{(,;");
@@ -1879,12 +1919,13 @@ static int tag_get_entry(EditState *s, char *dest, int size, int offset)
 
 static void do_find_tag(EditState *s, const char *str) {
     QEProperty *p;
+    qe_off_t offset;
 
     tag_buffer(s);
 
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = NULL; (p = eb_next_property(s->b, p, &offset)) != NULL;) {
         if (p->type == QE_PROP_TAG && strequal(p->data, str)) {
-            s->offset = p->offset;
+            s->offset = offset;
             return;
         }
     }
@@ -1914,6 +1955,7 @@ static void do_list_tags(EditState *s, int argval) {
     char buf[256];
     EditBuffer *b;
     QEProperty *p;
+    qe_off_t p_offset;
     EditState *e1;
 
     b = new_help_buffer();
@@ -1923,11 +1965,11 @@ static void do_list_tags(EditState *s, int argval) {
     tag_buffer(s);
 
     snprintf(buf, sizeof buf, "Tags in file %.*s", 242, s->b->filename);
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = NULL; (p = eb_next_property(s->b, p, &p_offset)) != NULL;) {
         if (p->type == QE_PROP_TAG) {
-            //eb_printf(b, "%12d  %s\n", p->offset, (char*)p->data);
-            int offset = eb_goto_bol(s->b, p->offset);
-            int offset1 = eb_goto_eol(s->b, p->offset);
+            //eb_printf(b, "%12d  %s\n", p_offset, (char*)p->data);
+            qe_off_t offset = eb_goto_bol(s->b, p_offset);
+            qe_off_t offset1 = eb_goto_eol(s->b, p_offset);
             eb_insert_buffer_convert(b, b->offset, s->b, offset, offset1 - offset);
             eb_putc(b, '\n');
         }
@@ -2052,7 +2094,7 @@ static int charname_print_entry(CompleteState *cp, EditState *s, const char *nam
     }
 }
 
-static int charname_get_entry(EditState *s, char *dest, int size, int offset) {
+static int charname_get_entry(EditState *s, char *dest, int size, qe_off_t offset) {
     char entry[256];
     char *p;
     int len;
@@ -2077,7 +2119,7 @@ static CompletionDef charname_completion = {
 
 /*---------------- paragraph handling ----------------*/
 
-int eb_next_paragraph(EditBuffer *b, int offset) {
+qe_off_t eb_next_paragraph(EditBuffer *b, qe_off_t offset) {
     /* find end of paragraph around or after point:
        skip blank lines, if any, then skip non blank lines
        and return start of blank line before text.
@@ -2114,8 +2156,8 @@ void do_mark_paragraph(EditState *s, int n) {
        Interactively if the current region is highlighted, it marks
        the next ARG paragraphs after the ones already marked.
      */
-    int start = s->offset;
-    int end = s->region_style ? s->b->mark : s->offset;
+    qe_off_t start = s->offset;
+    qe_off_t end = s->region_style ? s->b->mark : s->offset;
     if (n < 0) {
         end = eb_prev_paragraph(s->b, end);
         if (!s->region_style)
@@ -2135,7 +2177,7 @@ void do_mark_paragraph(EditState *s, int n) {
     do_mark_region(s, end, start);
 }
 
-int eb_prev_paragraph(EditBuffer *b, int offset) {
+qe_off_t eb_prev_paragraph(EditBuffer *b, qe_off_t offset) {
     /* find start of paragraph around or before point:
        skip blank lines, if any, then skip non blank lines
        and return start of blank line after end of text.
@@ -2172,7 +2214,7 @@ void do_kill_paragraph(EditState *s, int n) {
        negative arg -N means kill backward to Nth start of paragraph.
      */
     if (n != 0) {
-        int start = s->offset;
+        qe_off_t start = s->offset;
         do_forward_paragraph(s, n);
         do_kill(s, start, s->offset, n, 0);
     }
@@ -2180,8 +2222,9 @@ void do_kill_paragraph(EditState *s, int n) {
 
 /* replace the contents between p1 and p2 with a specified number
    of newlines and spaces */
-static int eb_respace(EditBuffer *b, int p1, int p2, int newlines, int spaces) {
-    int adjust = 0, nb, offset1;
+static qe_off_t eb_respace(EditBuffer *b, qe_off_t p1, qe_off_t p2,
+                           int newlines, int spaces) {
+    qe_off_t adjust = 0, nb, offset1;
     char32_t c;
     while (newlines > 0 && p1 < p2) {
         c = eb_nextc(b, p1, &offset1);
@@ -2221,7 +2264,7 @@ static int eb_respace(EditBuffer *b, int p1, int p2, int newlines, int spaces) {
     return adjust;
 }
 
-static int get_indent_size(EditState *s, int p1, int p2) {
+static int get_indent_size(EditState *s, qe_off_t p1, qe_off_t p2) {
     int indent_size = 0;
     while (p1 < p2) {
         char32_t c = eb_nextc(s->b, p1, &p1);
@@ -2240,7 +2283,7 @@ static int get_indent_size(EditState *s, int p1, int p2) {
 void do_fill_paragraph(EditState *s)
 {
     /* buffer offsets, byte counts */
-    int par_start, par_end, offset, offset1, chunk_start, word_start;
+    qe_off_t par_start, par_end, offset, offset1, chunk_start, word_start;
     /* number of characters / screen positions */
     int col, indent0_size, indent_size, word_size;
 
@@ -2290,13 +2333,13 @@ void do_fill_paragraph(EditState *s)
             }
             if (col + 1 + word_size > s->b->fill_column) {
                 /* insert newline and indentation */
-                int nb = eb_respace(s->b, chunk_start, word_start, 1, indent_size);
+                qe_off_t nb = eb_respace(s->b, chunk_start, word_start, 1, indent_size);
                 offset += nb;
                 par_end += nb;
                 col = indent_size + word_size;
             } else {
                 /* single space the word */
-                int nb = eb_respace(s->b, chunk_start, word_start, 0, 1);
+                qe_off_t nb = eb_respace(s->b, chunk_start, word_start, 0, 1);
                 offset += nb;
                 par_end += nb;
                 col += 1 + word_size;
@@ -2305,6 +2348,747 @@ void do_fill_paragraph(EditState *s)
     }
 }
 
+/*---------------- benchmarks ----------------*/
+
+/* simple pseudo random generator for reproducible benchmarks */
+static unsigned int bench_rand(unsigned int *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 1;
+}
+
+/* Create a UTF-8 system buffer of approximately `size` bytes filled
+ * with 80 column lines of text, using pages of `page_size` bytes.
+ */
+static EditBuffer *bench_new_buffer(const char *name, qe_off_t size,
+                                    int page_size) {
+    char buf[65536];
+    EditBuffer *b;
+    int i;
+
+    b = eb_new(name, BF_SYSTEM | BF_UTF8);
+    if (!b)
+        return NULL;
+    eb_set_page_size(b, page_size);
+    for (i = 0; i < ssizeof(buf); i++) {
+        buf[i] = (i % 81 == 80) ? '\n' : 'a' + i % 26;
+    }
+    while (b->total_size < size) {
+        if (eb_insert(b, b->total_size, buf,
+                      min_offset(ssizeof(buf), size - b->total_size)) <= 0)
+            break;
+    }
+    return b;
+}
+
+/* Report the average latency of `count` operations since `start_time` */
+static void bench_report(EditBuffer *b1, const char *what,
+                         int start_time, int count) {
+    int elapsed = get_clock_usec() - start_time;
+    eb_printf(b1, "  %-28s %10.3f us/op\n", what,
+              count ? (double)elapsed / count : 0.0);
+}
+
+static void do_benchmark_buffer_lookups(EditState *s, int argval)
+{
+    static int const sizes[] = { 1, 100, 1024 };
+    unsigned int seed = 1;
+    EditBuffer *b, *b1;
+    int i, j, n, nsizes, size, start_time, nb_lines, line, col;
+    qe_off_t nb_chars;
+    int sum = 0;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    nsizes = (argval == NO_ARG) ? countof(sizes) : 1;
+    for (j = 0; j < nsizes; j++) {
+        size = (argval == NO_ARG) ? sizes[j] : argval;
+        size = clamp_int(size, 1, 2047) << 20;
+        start_time = get_clock_usec();
+        b = bench_new_buffer("*bench*", size, MAX_PAGE_SIZE);
+        if (!b) {
+            put_error(s, "Cannot allocate benchmark buffer");
+            break;
+        }
+        eb_printf(b1, "\nBuffer of %d MB, %d pages: created in %d ms\n",
+                  (int)(b->total_size >> 20), b->nb_pages,
+                  (get_clock_usec() - start_time) / 1000);
+
+        /* first lookups build the line and char indexes */
+        start_time = get_clock_usec();
+        eb_get_pos(b, &nb_lines, &col, b->total_size);
+        nb_chars = eb_get_char_offset(b, b->total_size);
+        eb_printf(b1, "  %-28s %10d ms\n", "initial indexing",
+                  (get_clock_usec() - start_time) / 1000);
+
+        n = 100000;
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            sum += eb_read_one_byte(b, bench_rand(&seed) % b->total_size);
+        }
+        bench_report(b1, "eb_read_one_byte (random)", start_time, n);
+
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            sum += eb_get_pos(b, &line, &col, bench_rand(&seed) % b->total_size);
+        }
+        bench_report(b1, "eb_get_pos", start_time, n);
+
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            sum += eb_goto_pos(b, bench_rand(&seed) % (nb_lines + 1), 40);
+        }
+        bench_report(b1, "eb_goto_pos", start_time, n);
+
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            sum += eb_get_char_offset(b, bench_rand(&seed) % b->total_size);
+        }
+        bench_report(b1, "eb_get_char_offset", start_time, n);
+
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            sum += eb_goto_char(b, bench_rand(&seed) % (nb_chars + 1));
+        }
+        bench_report(b1, "eb_goto_char", start_time, n);
+
+        /* edits only reindex the pages they touch */
+        n = 10000;
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            qe_off_t offset = bench_rand(&seed) % b->total_size;
+            eb_insert(b, offset, "x", 1);
+            sum += eb_get_pos(b, &line, &col, offset);
+        }
+        bench_report(b1, "eb_insert + eb_get_pos", start_time, n);
+
+        eb_free(&b);
+    }
+    /* prevent the compiler from optimizing the loops away */
+    eb_printf(b1, "\n(checksum: %d)\n", sum & 0xffff);
+
+    show_popup(s, b1, "Buffer lookup benchmark");
+}
+
+static void do_benchmark_page_sizes(EditState *s, int argval)
+{
+    static int const page_sizes[] = {
+        4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20,
+    };
+    unsigned int seed = 1;
+    EditBuffer *b, *b1;
+    int i, j, n, size, start_time, elapsed, c;
+    qe_off_t offset;
+    int sum = 0;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    size = clamp_int((argval == NO_ARG) ? 64 : argval, 1, 2047) << 20;
+    eb_printf(b1, "Buffer of %d MB\n\n", size >> 20);
+    eb_printf(b1, "%9s %8s %10s %10s %10s %10s\n",
+              "page_size", "pages", "nextc", "read", "insert", "append");
+    eb_printf(b1, "%9s %8s %10s %10s %10s %10s\n",
+              "", "", "MB/s", "MB/s", "us/op", "us/op");
+
+    for (j = 0; j < countof(page_sizes); j++) {
+        b = bench_new_buffer("*bench*", size, page_sizes[j]);
+        if (!b) {
+            put_error(s, "Cannot allocate benchmark buffer");
+            break;
+        }
+        eb_printf(b1, "%9d %8d", b->page_size, b->nb_pages);
+
+        /* sequential scan, character by character */
+        start_time = get_clock_usec();
+        for (offset = 0; offset < b->total_size;) {
+            c = eb_nextc(b, offset, &offset);
+            sum += c;
+        }
+        elapsed = max_int(1, get_clock_usec() - start_time);
+        eb_printf(b1, " %10.1f", (double)b->total_size / elapsed);
+
+        /* sequential scan, in blocks */
+        start_time = get_clock_usec();
+        for (offset = 0; offset < b->total_size;) {
+            char buf[4096];
+            offset += eb_read(b, offset, buf, sizeof(buf));
+            sum += buf[0];
+        }
+        elapsed = max_int(1, get_clock_usec() - start_time);
+        eb_printf(b1, " %10.1f", (double)b->total_size / elapsed);
+
+        /* insertions at random places split the large pages */
+        n = 10000;
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            eb_insert(b, bench_rand(&seed) % b->total_size, "x", 1);
+        }
+        elapsed = get_clock_usec() - start_time;
+        eb_printf(b1, " %10.3f", (double)elapsed / n);
+
+        /* appending lines as shell and log buffers do */
+        start_time = get_clock_usec();
+        for (i = 0; i < n; i++) {
+            eb_insert(b, b->total_size,
+                      "appended line of text, as process output\n", 41);
+        }
+        elapsed = get_clock_usec() - start_time;
+        eb_printf(b1, " %10.3f\n", (double)elapsed / n);
+
+        eb_free(&b);
+    }
+    /* prevent the compiler from optimizing the loops away */
+    eb_printf(b1, "\n(checksum: %d)\n", sum & 0xffff);
+
+    show_popup(s, b1, "Page size benchmark");
+}
+
+/* Search a pattern character by character, the way eb_search does for
+ * buffers that cannot be matched as raw bytes.
+ */
+static qe_off_t bench_search_chars(EditBuffer *b, const char *pat, int len) {
+    qe_off_t offset, offset1, offset2;
+    int pos;
+    char32_t c;
+
+    for (offset = 0; offset < b->total_size; offset = offset1) {
+        c = eb_nextc(b, offset, &offset1);
+        for (pos = 0, offset2 = offset1;;) {
+            if (qe_wtoupper(c) != qe_wtoupper((u8)pat[pos]))
+                break;
+            if (++pos >= len)
+                return offset;
+            if (offset2 >= b->total_size)
+                break;
+            c = eb_nextc(b, offset2, &offset2);
+        }
+    }
+    return -1;
+}
+
+/* Report the throughput of a search that scanned `size` bytes */
+static void bench_report_search(EditBuffer *b1, const char *what,
+                                int start_time, qe_off_t size, qe_off_t found) {
+    int elapsed = max_int(1, get_clock_usec() - start_time);
+    eb_printf(b1, "  %-28s %10.1f MB/s  (found at %lld)\n", what,
+              (double)size / elapsed, (long long)found);
+}
+
+static void do_benchmark_search(EditState *s, int argval)
+{
+    static char const needle[] = "the quick brown fox";
+    static char const sparse[] = "Zebra";
+    int len = strlen(needle);
+    EditBuffer *b, *b1;
+    u8 fold[256], pat[64];
+    int i, start_time;
+    qe_off_t size, found;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    size = clamp_int((argval == NO_ARG) ? 64 : argval, 1, 2047) << 20;
+    b = bench_new_buffer("*bench*", size, MAX_PAGE_SIZE);
+    if (!b) {
+        put_error(s, "Cannot allocate benchmark buffer");
+        return;
+    }
+    /* the needle is found at the end of the buffer */
+    eb_insert(b, b->total_size, needle, len);
+    size = b->total_size;
+    eb_printf(b1, "Buffer of %lld MB, %d pages\n\n",
+              (long long)(size >> 20), b->nb_pages);
+
+    for (i = 0; i < 256; i++)
+        fold[i] = qe_toupper(i);
+
+    start_time = get_clock_usec();
+    found = bench_search_chars(b, needle, len);
+    bench_report_search(b1, "character by character", start_time, size, found);
+
+    start_time = get_clock_usec();
+    found = eb_search_bytes(b, 1, 0, size, (const u8 *)needle, len, NULL);
+    bench_report_search(b1, "bytes, forward", start_time, size, found);
+
+    for (i = 0; i < len; i++)
+        pat[i] = fold[(u8)needle[i]];
+    start_time = get_clock_usec();
+    found = eb_search_bytes(b, 1, 0, size, pat, len, fold);
+    bench_report_search(b1, "bytes, ignore case", start_time, size, found);
+
+    /* the first byte of this pattern never occurs in the text */
+    start_time = get_clock_usec();
+    found = eb_search_bytes(b, 1, 0, size, (const u8 *)sparse,
+                            strlen(sparse), NULL);
+    bench_report_search(b1, "bytes, rare first byte", start_time, size, found);
+
+    start_time = get_clock_usec();
+    found = eb_search_bytes(b, -1, 0, size - len, (const u8 *)needle,
+                            len, NULL);
+    bench_report_search(b1, "bytes, backward", start_time, size, found);
+
+    eb_free(&b);
+    show_popup(s, b1, "Search benchmark");
+}
+
+/* Save a buffer the way raw_buffer_save() used to: copy each chunk to a
+ * stack buffer and write it to the truncated target.
+ */
+static qe_off_t bench_save_copy(EditBuffer *b, const char *filename, int sync) {
+    unsigned char buf[32768];
+    qe_off_t offset, written = 0;
+    int fd, len;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    for (offset = 0; offset < b->total_size; offset += len) {
+        len = eb_read(b, offset, buf, ssizeof(buf));
+        if (write(fd, buf, len) != len) {
+            written = -1;
+            break;
+        }
+        written += len;
+    }
+    if (sync)
+        fsync(fd);
+    close(fd);
+    return written;
+}
+
+/* Report the throughput of a save that wrote `size` bytes */
+static void bench_report_save(EditBuffer *b1, const char *what,
+                              int start_time, qe_off_t size) {
+    int elapsed = max_int(1, get_clock_usec() - start_time);
+    if (size < 0) {
+        eb_printf(b1, "  %-36s failed: %s\n", what, strerror(errno));
+    } else {
+        eb_printf(b1, "  %-36s %10.1f MB/s\n", what, (double)size / elapsed);
+    }
+}
+
+static void do_benchmark_save(EditState *s, int argval)
+{
+    char filename[MAX_FILENAME_SIZE];
+    const char *tmpdir;
+    EditBuffer *b, *b1;
+    int size, start_time;
+    qe_off_t written;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    size = clamp_int((argval == NO_ARG) ? 256 : argval, 1, 2047) << 20;
+    b = bench_new_buffer("*bench*", size, MAX_PAGE_SIZE);
+    if (!b) {
+        put_error(s, "Cannot allocate benchmark buffer");
+        return;
+    }
+    tmpdir = getenv("TMPDIR");
+    snprintf(filename, sizeof(filename), "%s/qe-bench-save.txt",
+             tmpdir ? tmpdir : "/tmp");
+    eb_printf(b1, "Buffer of %d MB, %d pages, saved to %s\n\n",
+              (int)(b->total_size >> 20), b->nb_pages, filename);
+
+    start_time = get_clock_usec();
+    written = bench_save_copy(b, filename, 0);
+    bench_report_save(b1, "copy and write, no sync", start_time, written);
+
+    start_time = get_clock_usec();
+    written = bench_save_copy(b, filename, 1);
+    bench_report_save(b1, "copy and write, fsync", start_time, written);
+
+    start_time = get_clock_usec();
+    written = eb_write_buffer(b, 0, b->total_size, filename);
+    bench_report_save(b1, "writev pages, fsync and rename", start_time,
+                      written);
+    eb_free(&b);
+
+#ifdef CONFIG_MMAP
+    /* save a buffer over the file it is mapped from */
+    b = eb_new("*bench*", BF_SYSTEM);
+    if (b && !eb_mmap_buffer(b, filename)) {
+        start_time = get_clock_usec();
+        written = eb_write_buffer(b, 0, b->total_size, filename);
+        bench_report_save(b1, "writev mapped pages over their file",
+                          start_time, written);
+    }
+    eb_free(&b);
+#endif
+    unlink(filename);
+    show_popup(s, b1, "Save benchmark");
+}
+
+static void do_benchmark_properties(EditState *s, int argval)
+{
+    unsigned int seed = 1;
+    EditBuffer *b, *b1;
+    int i, n, count, start_time, found = 0;
+    qe_off_t offset;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    /* tag every line of a buffer, as colorizers do for definitions */
+    count = clamp_int((argval == NO_ARG) ? 400 : argval, 1, 10000) * 1000;
+    b = bench_new_buffer("*bench*", count * 81, MAX_PAGE_SIZE);
+    if (!b) {
+        put_error(s, "Cannot allocate benchmark buffer");
+        return;
+    }
+    eb_printf(b1, "Buffer of %d MB, %d properties\n\n",
+              (int)(b->total_size >> 20), count);
+
+    start_time = get_clock_usec();
+    for (i = 0; i < count; i++) {
+        eb_add_property(b, i * 81, QE_PROP_TAG, qe_strdup("tag"));
+    }
+    bench_report(b1, "eb_add_property (append)", start_time, count);
+
+    n = 10000;
+    start_time = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        offset = bench_rand(&seed) % b->total_size;
+        eb_add_property(b, offset, QE_PROP_TAG, qe_strdup("random"));
+    }
+    bench_report(b1, "eb_add_property (random)", start_time, n);
+
+    start_time = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        offset = bench_rand(&seed) % b->total_size;
+        found += !!eb_find_property(b, 0, offset + 1, QE_PROP_TAG);
+    }
+    bench_report(b1, "eb_find_property", start_time, n);
+
+    /* every edit updates the property offsets */
+    start_time = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        eb_insert(b, bench_rand(&seed) % b->total_size, "x", 1);
+    }
+    bench_report(b1, "eb_insert", start_time, n);
+
+    start_time = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        eb_delete(b, bench_rand(&seed) % b->total_size, 1);
+    }
+    bench_report(b1, "eb_delete", start_time, n);
+
+    /* invalidation drops the properties past the edited line */
+    n = 100;
+    start_time = get_clock_usec();
+    for (i = 0; i < n; i++) {
+        eb_delete_properties(b, b->total_size - (i + 1) * 8100,
+                             b->total_size - i * 8100);
+    }
+    bench_report(b1, "eb_delete_properties (100)", start_time, n);
+
+    start_time = get_clock_usec();
+    eb_delete_properties(b, 0, QE_OFF_MAX);
+    bench_report(b1, "eb_delete_properties (all)", start_time, 1);
+
+    eb_printf(b1, "\n(checksum: %d)\n", found);
+    eb_free(&b);
+    show_popup(s, b1, "Property benchmark");
+}
+
+static void bench_idle(qe__unused__ EditState *s, qe__unused__ int n)
+{
+}
+
+/* Redisplay the screen after each of `count` moves in window `s` and
+ * report the terminal output and the lines laid out per frame.
+ */
+static void bench_display(EditBuffer *b1, const char *what, EditState *s,
+                          void (*move)(EditState *s, int n), int n, int count)
+{
+    QEmacsState *qs = s->qe_state;
+    QEditScreen *screen = qs->screen;
+    int64_t bytes = screen->frame_bytes;
+    int frames = screen->frame_count;
+    int i, start_time, elapsed, misses;
+
+    s->offset = s->offset_top = 0;
+    s->y_disp = 0;
+    edit_display(qs);
+    dpy_flush(screen);
+    bytes = screen->frame_bytes;
+    frames = screen->frame_count;
+    misses = s->layout_cache ? s->layout_cache->misses : 0;
+
+    start_time = get_clock_usec();
+    for (i = 0; i < count; i++) {
+        if (move) {
+            move(s, n);
+        } else {
+            qs->complete_refresh = 1;
+            do_refresh(s);
+        }
+        edit_display(qs);
+        dpy_flush(screen);
+    }
+    elapsed = get_clock_usec() - start_time;
+    frames = max_int(1, screen->frame_count - frames);
+    if (s->layout_cache)
+        misses = s->layout_cache->misses - misses;
+    eb_printf(b1, "  %-16s %10.1f bytes/frame %10.1f us/frame %8.1f layouts/frame\n",
+              what, (double)(screen->frame_bytes - bytes) / frames,
+              (double)elapsed / count, (double)misses / count);
+}
+
+static void do_benchmark_display(EditState *s, int argval)
+{
+    EditBuffer *b1;
+    int count, y_disp, pass;
+    qe_off_t offset, offset_top;
+    int disable = disable_layout_cache;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    count = clamp_int((argval == NO_ARG) ? 200 : argval, 1, 100000);
+    offset = s->offset;
+    offset_top = s->offset_top;
+    y_disp = s->y_disp;
+
+    eb_printf(b1, "Buffer %s, %d frames, screen %dx%d\n\n",
+              s->b->name, count, s->screen->width, s->screen->height);
+    for (pass = 0; pass < 2; pass++) {
+        /* compare with the lines laid out again on each pass */
+        disable_layout_cache = pass;
+        eb_printf(b1, "%s:\n", pass ? "Without layout cache" : "Layout cache");
+        bench_display(b1, "cursor motion", s, do_left_right, 1, count);
+        bench_display(b1, "line scroll", s, do_scroll_up_down, 1, count);
+        bench_display(b1, "page scroll", s, do_scroll_up_down, 2, count);
+        bench_display(b1, "unchanged", s, bench_idle, 0, count);
+        bench_display(b1, "full repaint", s, NULL, 0, count);
+        eb_putc(b1, '\n');
+    }
+    disable_layout_cache = disable;
+
+    s->offset = offset;
+    s->offset_top = offset_top;
+    s->y_disp = y_disp;
+    show_popup(s, b1, "Display benchmark");
+}
+
+static void bench_jump(EditState *s, int n)
+{
+    s->offset = min_offset(s->offset + n, s->b->total_size);
+}
+
+/* Fill `b` with `nb_lines` lines of text or, if `nb_lines` is 0, with
+ * a single line of `size` bytes of JSON records.
+ */
+static void bench_fill_text(EditBuffer *b, int size, int nb_lines)
+{
+    char buf[65536];
+    int len, i;
+
+    for (i = len = 0; nb_lines ? i < nb_lines : b->total_size + len < size; i++) {
+        if (nb_lines) {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "%7d: %.*s\tvalue = %d;\n", i + 1, 8 + i % 40,
+                            "the quick brown fox jumps over the lazy dog",
+                            i * 7);
+        } else {
+            len += snprintf(buf + len, sizeof(buf) - len,
+                            "{\"id\":%d,\"name\":\"item%d\",\"tags\":[\"a\",\"b\"]},",
+                            i, i % 1000);
+        }
+        if (len > ssizeof(buf) - 256) {
+            eb_insert(b, b->total_size, buf, len);
+            len = 0;
+        }
+    }
+    if (!nb_lines)
+        buf[len++] = '\n';
+    eb_insert(b, b->total_size, buf, len);
+}
+
+static void do_benchmark_scroll(EditState *s, int argval)
+{
+    EditBuffer *b, *b0, *b1, *last_buffer;
+    int count;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+    b = eb_new("*bench*", BF_SYSTEM | BF_UTF8);
+    if (!b) {
+        put_error(s, "Cannot allocate benchmark buffer");
+        return;
+    }
+    count = clamp_int((argval == NO_ARG) ? 100 : argval, 1, 100000);
+    b0 = s->b;
+    last_buffer = s->last_buffer;
+
+    eb_printf(b1, "%d frames, screen %dx%d%s\n\n",
+              count, s->screen->width, s->screen->height,
+              disable_crc ? ", line shadow disabled" : "");
+
+    bench_fill_text(b, 0, 1000000);
+    switch_to_buffer(s, b);
+    s->wrap = WRAP_TRUNCATE;
+    eb_printf(b1, "1M lines, %lld bytes:\n", (long long)b->total_size);
+    bench_display(b1, "page scroll", s, do_scroll_up_down, 2, count);
+    bench_display(b1, "jump", s, bench_jump, b->total_size / count, count);
+
+    eb_delete(b, 0, b->total_size);
+    bench_fill_text(b, 50 << 20, 0);
+    s->wrap = WRAP_LINE;
+    eb_printf(b1, "\nSingle line, %lld bytes, wrapped:\n",
+              (long long)b->total_size);
+    bench_display(b1, "page scroll", s, do_scroll_up_down, 2, count);
+    bench_display(b1, "jump", s, bench_jump, b->total_size / count, count);
+    s->wrap = WRAP_TRUNCATE;
+    eb_printf(b1, "\nSingle line, %lld bytes, truncated:\n",
+              (long long)b->total_size);
+    bench_display(b1, "hscroll", s, bench_jump, s->cols, count);
+    bench_display(b1, "jump", s, bench_jump, b->total_size / count, count);
+
+    switch_to_buffer(s, b0);
+    s->last_buffer = last_buffer;
+    eb_free(&b);
+    show_popup(s, b1, "Scroll benchmark");
+}
+
+#define BENCH_PROBE_FILES  1000
+#define BENCH_PROBE_SIZE   4096
+
+typedef struct BenchProbeFile {
+    char *filename;
+    int st_mode;
+    qe_off_t size;
+    QECharset *charset;
+    EOLType eol_type;
+    int len;
+    u8 buf[BENCH_PROBE_SIZE + 1];
+} BenchProbeFile;
+
+/* select the mode of a file as qe_load_file() does, reading its first
+   block and detecting its charset again if 'do_read', return the mode
+   or NULL if the file cannot be read */
+static ModeDef *bench_probe_file(EditState *s, EditBuffer *b,
+                                 BenchProbeFile *fp, int do_read)
+{
+    ModeDef *mode;
+    struct stat st;
+    FILE *f;
+    int score;
+
+    if (do_read) {
+        if (stat(fp->filename, &st) < 0 || !(f = fopen(fp->filename, "r")))
+            return NULL;
+        fp->st_mode = st.st_mode;
+        fp->size = st.st_size;
+        fp->len = fread(fp->buf, 1, BENCH_PROBE_SIZE, f);
+        fclose(f);
+        if (fp->len < 0)
+            return NULL;
+        fp->buf[fp->len] = '\0';
+        fp->charset = detect_charset(fp->buf, fp->len, &fp->eol_type);
+    }
+    if (!fp->charset
+    ||  !probe_mode(s, b, &mode, 1, &score, 2, fp->filename, 0,
+                    fp->st_mode, fp->size, fp->buf, fp->len,
+                    fp->charset, fp->eol_type)) {
+        return NULL;
+    }
+    return mode;
+}
+
+static void do_benchmark_mode_probe(EditState *s, int argval)
+{
+    char dir[MAX_FILENAME_SIZE];
+    char filename[MAX_FILENAME_SIZE];
+    FindFileState *ffst;
+    BenchProbeFile *files;
+    ModeDef **modes;
+    EditBuffer *b, *b1;
+    int i, n, nb_files, count, pass, start_time, elapsed, mismatches;
+    int disable = disable_mode_index;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    count = clamp_int((argval == NO_ARG) ? 10 : argval, 1, 10000);
+    get_default_path(s->b, s->offset, dir, sizeof(dir));
+    files = qe_mallocz_array(BenchProbeFile, BENCH_PROBE_FILES);
+    modes = qe_mallocz_array(ModeDef *, BENCH_PROBE_FILES);
+    b = eb_new("*bench*", BF_SYSTEM);
+    if (!files || !modes || !b) {
+        put_error(s, "Cannot allocate benchmark data");
+        goto done;
+    }
+    nb_files = 0;
+    ffst = find_file_open(dir, "*", FF_NODIR);
+    while (ffst && nb_files < BENCH_PROBE_FILES
+       &&  !find_file_next(ffst, filename, sizeof(filename))) {
+        files[nb_files].filename = qe_strdup(filename);
+        if (files[nb_files].filename)
+            nb_files++;
+    }
+    find_file_close(&ffst);
+    if (!nb_files) {
+        put_error(s, "No files in %s", dir);
+        goto done;
+    }
+
+    eb_printf(b1, "%d files in %s, %d passes\n\n", nb_files, dir, count);
+    /* warm up the file cache and build the mode index */
+    for (i = 0; i < nb_files; i++) {
+        bench_probe_file(s, b, &files[i], 1);
+    }
+    mismatches = 0;
+    for (pass = 0; pass < 2; pass++) {
+        /* compare with all the mode probes called for each file */
+        disable_mode_index = pass;
+        eb_printf(b1, "%s:\n", pass ? "Without mode index" : "Mode index");
+        start_time = get_clock_usec();
+        for (n = 0; n < count; n++) {
+            for (i = 0; i < nb_files; i++) {
+                bench_probe_file(s, b, &files[i], 1);
+            }
+        }
+        elapsed = max_int(1, get_clock_usec() - start_time);
+        eb_printf(b1, "  %-16s %10.0f files/s\n", "open and probe",
+                  (double)nb_files * count * 1000000 / elapsed);
+        start_time = get_clock_usec();
+        for (n = 0; n < count; n++) {
+            for (i = 0; i < nb_files; i++) {
+                ModeDef *mode = bench_probe_file(s, b, &files[i], 0);
+                if (pass == 0)
+                    modes[i] = mode;
+                else
+                    mismatches += (mode != modes[i]);
+            }
+        }
+        elapsed = max_int(1, get_clock_usec() - start_time);
+        eb_printf(b1, "  %-16s %10.0f files/s\n", "probe only",
+                  (double)nb_files * count * 1000000 / elapsed);
+    }
+    disable_mode_index = disable;
+    eb_printf(b1, "\n%d files with a different mode\n", mismatches / count);
+
+ done:
+    if (files) {
+        for (i = 0; i < BENCH_PROBE_FILES; i++)
+            qe_free(&files[i].filename);
+    }
+    qe_free(&files);
+    qe_free(&modes);
+    eb_free(&b);
+    show_popup(s, b1, "Mode probe benchmark");
+}
+
 /*---------------- command and binding definitions ----------------*/
 
 static const CmdDef extra_commands[] = {
@@ -2416,6 +3200,35 @@ static const CmdDef extra_commands[] = {
     CMD2( "describe-window", "C-u C-h w, C-u C-h C-w",
           "Show information about the current window",
           do_describe_window, ESi, "p")
+    CMD2( "benchmark-buffer-lookups", "",
+          "Measure offset, line and char lookup latency (size in MB as argument)",
+          do_benchmark_buffer_lookups, ESi, "P")
+    CMD2( "benchmark-page-sizes", "",
+          "Measure scan throughput and insert latency for several page sizes "
+          "(size in MB as argument)",
+          do_benchmark_page_sizes, ESi, "P")
+    CMD2( "benchmark-search", "",
+          "Measure literal search throughput (size in MB as argument)",
+          do_benchmark_search, ESi, "P")
+    CMD2( "benchmark-save", "",
+          "Measure buffer save throughput (size in MB as argument)",
+          do_benchmark_save, ESi, "P")
+    CMD2( "benchmark-properties", "",
+          "Measure property insertion, lookup and update latency "
+          "(thousands of properties as argument)",
+          do_benchmark_properties, ESi, "P")
+    CMD2( "benchmark-display", "",
+          "Measure terminal output per frame while moving and scrolling "
+          "the current window (number of frames as argument)",
+          do_benchmark_display, ESi, "P")
+    CMD2( "benchmark-scroll", "",
+          "Measure frame time while scrolling through a file of 1M lines and "
+          "a 50 MB single line file (number of frames as argument)",
+          do_benchmark_scroll, ESi, "P")
+    CMD2( "benchmark-mode-probe", "",
+          "Measure the number of files opened and probed per second in the "
+          "directory of the current buffer (number of passes as argument)",
+          do_benchmark_mode_probe, ESi, "P")
 
     /* XXX: should take region as argument, implicit from keyboard */
     CMD2( "set-region-color", "C-c c",
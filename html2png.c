@@ -95,7 +95,7 @@ void put_error(qe__unused__ EditState *s, const char *fmt, ...)
 
 /* dummy functions */
 char32_t eb_nextc(qe__unused__ EditBuffer *b,
-                  qe__unused__ int offset, qe__unused__ int *next_ptr)
+                  qe__unused__ qe_off_t offset, qe__unused__ qe_off_t *next_ptr)
 {
     return 0;
 }
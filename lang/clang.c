@@ -689,9 +689,10 @@ enum {
 };
 
 /* Normalize indentation at <offset>, return offset past indentation */
-static int normalize_indent(EditState *s, int offset, int indent)
+static qe_off_t normalize_indent(EditState *s, qe_off_t offset, int indent)
 {
-    int ntabs, nspaces, update, offset0, offset1;
+    int ntabs, nspaces, update;
+    qe_off_t offset0, offset1;
 
     if (indent < 0)
         indent = 0;
@@ -776,9 +777,10 @@ static int c_line_has_label(EditState *s, const char32_t *buf, int len,
    - if the previous line starts with a label, increment the previous indent by one level - c_label_offset
    - by default, indent the line like the previous code line,
 */
-void c_indent_line(EditState *s, int offset0)
+void c_indent_line(EditState *s, qe_off_t offset0)
 {
-    int offset, offset1, offsetl, pos, line_num, col_num;
+    int pos, line_num, col_num;
+    qe_off_t offset, offset1, offsetl;
     int i, eoi_found, len, pos1, lpos, style, line_num1, state;
     int off, found_comma, has_else;
     char32_t c;
@@ -1123,7 +1125,7 @@ static void do_c_indent(EditState *s)
 
 static void do_c_electric_key(EditState *s, int key)
 {
-    int offset = s->offset;
+    qe_off_t offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     do_char(s, key, 1);
@@ -1136,7 +1138,7 @@ static void do_c_electric_key(EditState *s, int key)
 
 static void do_c_newline(EditState *s)
 {
-    int offset = s->offset;
+    qe_off_t offset = s->offset;
     int was_preview = s->b->flags & BF_PREVIEW;
 
     /* XXX: should also remove trailing spaces on current line */
@@ -1148,7 +1150,7 @@ static void do_c_newline(EditState *s)
     if (s->mode->auto_indent && s->mode->indent_func) {
         /* delete blanks at end of line (necessary for non blank lines) */
         /* XXX: should factorize with do_delete_horizontal_space() */
-        int from = offset, to = offset;
+        qe_off_t from = offset, to = offset;
         while (qe_isblank(eb_prevc(s->b, from, &offset)))
             from = offset;
         eb_delete_range(s->b, from, to);
@@ -1165,7 +1167,7 @@ static void c_forward_conditional(EditState *s, int dir)
     char32_t buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset0, offset1;
+    qe_off_t offset, offset0, offset1;
 
     offset = offset0 = eb_goto_bol(s->b, s->offset);
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -1233,7 +1235,7 @@ static void do_c_list_conditionals(EditState *s)
     char32_t buf[COLORED_MAX_LINE_SIZE], *p;
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
     int line_num, col_num, sharp, level;
-    int offset, offset1;
+    qe_off_t offset, offset1;
     EditBuffer *b;
 
     b = eb_scratch("Preprocessor conditionals", BF_UTF8);
@@ -88,6 +88,6 @@ enum {
 };
 
 int get_c_identifier(char *buf, int buf_size, const char32_t *p, int flavor);
-void c_indent_line(EditState *s, int offset0);
+void c_indent_line(EditState *s, qe_off_t offset0);
 
 #endif /* CLANG_H */
@@ -1956,8 +1956,8 @@ typedef struct {
     uint8_t *state_stack;
     size_t state_stack_size;
     size_t state_stack_len;
-    unsigned int (*nextc)(const uint8_t *bc_buf, int offset, int *offsetp);
-    unsigned int (*prevc)(const uint8_t *bc_buf, int offset, int *offsetp);
+    unsigned int (*nextc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp);
+    unsigned int (*prevc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp);
 } REExecContext;
 
 static int push_state(REExecContext *s,
@@ -2013,10 +2013,11 @@ static int push_state(REExecContext *s,
    clen. */
 int lre_exec(enum REExecFlavor flavor,
              uint8_t **capture,
-             const uint8_t *bc_buf, const uint8_t *cbuf, int cindex, int clen,
+             const uint8_t *bc_buf, const uint8_t *cbuf,
+             intptr_t cindex, intptr_t clen,
              int cbuf_type, void *opaque, uint32_t bof_char, uint32_t eof_char,
-             unsigned int (*nextc)(const uint8_t *bc_buf, int offset, int *offsetp),
-             unsigned int (*prevc)(const uint8_t *bc_buf, int offset, int *offsetp))
+             unsigned int (*nextc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp),
+             unsigned int (*prevc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp))
 {
     REExecContext s_s, *s = &s_s;
     int re_flags, i, alloca_size, ret;
@@ -2088,6 +2089,42 @@ int lre_get_flags(const uint8_t *bc_buf)
     return bc_buf[RE_HEADER_FLAGS];
 }
 
+/* Store in buf the characters every match must start with and return
+   their number, at most size. The characters are canonicalized if the
+   regexp ignores case. */
+int lre_get_prefix(const uint8_t *bc_buf, uint32_t *buf, int size)
+{
+    const uint8_t *pc = bc_buf + RE_HEADER_LEN;
+    const uint8_t *pc_end = pc + get_u32(bc_buf + 3);
+    int len = 0;
+
+    /* skip the implicit .*? of non sticky regexps */
+    if (pc < pc_end && *pc == REOP_split_goto_first)
+        pc += 5 + 1 + 5;
+    while (len < size && pc < pc_end) {
+        switch (*pc) {
+        case REOP_char:
+            buf[len++] = get_u16(pc + 1);
+            break;
+        case REOP_char32:
+            buf[len++] = get_u32(pc + 1);
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_line_start:
+        case REOP_word_boundary:
+        case REOP_not_word_boundary:
+            /* zero width */
+            break;
+        default:
+            return len;
+        }
+        pc += reopcode_info[*pc].size;
+    }
+    return len;
+}
+
 /* Return NULL if no group names. Otherwise, return a pointer to
    'capture_count - 1' zero terminated UTF-8 strings. */
 const char *lre_get_groupnames(const uint8_t *bc_buf)
@@ -49,13 +49,15 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
                      void *opaque);
 int lre_get_capture_count(const uint8_t *bc_buf);
 int lre_get_flags(const uint8_t *bc_buf);
+int lre_get_prefix(const uint8_t *bc_buf, uint32_t *buf, int size);
 const char *lre_get_groupnames(const uint8_t *bc_buf);
 int lre_exec(enum REExecFlavor flavor,
              uint8_t **capture,
-             const uint8_t *bc_buf, const uint8_t *cbuf, int cindex, int clen,
+             const uint8_t *bc_buf, const uint8_t *cbuf,
+             intptr_t cindex, intptr_t clen,
              int cbuf_type, void *opaque, uint32_t bof_char, uint32_t eof_char,
-             unsigned int (*nextc)(const uint8_t *bc_buf, int offset, int *offsetp),
-             unsigned int (*prevc)(const uint8_t *bc_buf, int offset, int *offsetp));
+             unsigned int (*nextc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp),
+             unsigned int (*prevc)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp));
 
 int lre_parse_escape(const uint8_t **pp, int allow_utf16);
 LRE_BOOL lre_is_space(int c);
@@ -115,11 +115,11 @@
 #define IF_USE_CBUF_TYPE(e) e
 #else
 struct EditBuffer;
-unsigned int eb_nextc(struct EditBuffer *b, int offset, int *next_ptr);
-unsigned int eb_prevc(struct EditBuffer *b, int offset, int *next_ptr);
+unsigned int eb_nextc(struct EditBuffer *b, int64_t offset, int64_t *next_ptr);
+unsigned int eb_prevc(struct EditBuffer *b, int64_t offset, int64_t *next_ptr);
 #define GET_CHAR(c, cptr, cbuf_end)                     \
     do {                                                \
-        int offset = cptr - s->cbuf;                    \
+        int64_t offset = cptr - s->cbuf;                \
         struct EditBuffer *b = unconst(void *)s->cbuf;  \
         c = eb_nextc(b, offset, &offset);               \
         cptr = s->cbuf + offset;                        \
@@ -127,21 +127,21 @@ unsigned int eb_prevc(struct EditBuffer *b, int offset, int *next_ptr);
 
 #define PEEK_CHAR(c, cptr, cbuf_end)                    \
     do {                                                \
-        int offset = cptr - s->cbuf;                    \
+        int64_t offset = cptr - s->cbuf;                \
         struct EditBuffer *b = unconst(void *)s->cbuf;  \
         c = eb_nextc(b, offset, &offset);               \
     } while (0)
 
 #define PEEK_PREV_CHAR(c, cptr, cbuf_start)             \
     do {                                                \
-        int offset = cptr - s->cbuf;                    \
+        int64_t offset = cptr - s->cbuf;                \
         struct EditBuffer *b = unconst(void *)s->cbuf;  \
         c = eb_prevc(b, offset, &offset);               \
     } while (0)
 
 #define GET_PREV_CHAR(c, cptr, cbuf_start)              \
     do {                                                \
-        int offset = cptr - s->cbuf;                    \
+        int64_t offset = cptr - s->cbuf;                \
         struct EditBuffer *b = unconst(void *)s->cbuf;  \
         c = eb_prevc(b, offset, &offset);               \
         cptr = s->cbuf + offset;                        \
@@ -149,7 +149,7 @@ unsigned int eb_prevc(struct EditBuffer *b, int offset, int *next_ptr);
 
 #define PREV_CHAR(cptr, cbuf_start)                     \
     do {                                                \
-        int offset = cptr - s->cbuf;                    \
+        int64_t offset = cptr - s->cbuf;                \
         struct EditBuffer *b = unconst(void *)s->cbuf;  \
         eb_prevc(b, offset, &offset);                   \
         cptr = s->cbuf + offset;                        \
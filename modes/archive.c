@@ -163,8 +163,8 @@ static int archive_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int archive_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static qe_off_t archive_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                    const char *filename)
 {
     /* XXX: prevent saving parsed contents to archive file */
     return -1;
@@ -310,8 +310,8 @@ static int compress_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int compress_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static qe_off_t compress_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                     const char *filename)
 {
     /* XXX: should recompress contents to compressed file */
     return -1;
@@ -397,8 +397,8 @@ static int wget_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int wget_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static qe_off_t wget_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                 const char *filename)
 {
     /* XXX: should put contents back to web server */
     return -1;
@@ -489,8 +489,8 @@ static int man_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int man_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static qe_off_t man_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                const char *filename)
 {
     /* XXX: should put contents back to web server */
     return -1;
@@ -108,7 +108,7 @@ struct DiredItem {
     dev_t   rdev;   /* device type, for special file inode */
     time_t  mtime;
     off_t   size;
-    int     offset;
+    qe_off_t offset;
     char    hidden;
     char    mark;
     char    name[1];
@@ -1237,7 +1237,7 @@ static void dired_display_hook(EditState *s)
     }
 }
 
-static char *dired_get_default_path(EditBuffer *b, int offset,
+static char *dired_get_default_path(EditBuffer *b, qe_off_t offset,
                                     char *buf, int buf_size)
 {
     if (is_directory(b->filename)) {
@@ -1509,8 +1509,8 @@ static int dired_buffer_load(EditBuffer *b, FILE *f)
     return -1;
 }
 
-static int dired_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static qe_off_t dired_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                  const char *filename)
 {
     /* XXX: prevent saving parsed contents to dired file */
     return -1;
@@ -1599,7 +1599,8 @@ static void filelist_display_hook(EditState *s)
     char filename[MAX_FILENAME_SIZE];
     QEmacsState *qs = s->qe_state;
     EditState *e;
-    int i, len, offset, target_line;
+    int i, len, target_line;
+    qe_off_t offset;
 
     offset = eb_goto_bol(s->b, s->offset);
     len = eb_fgets(s->b, buf, sizeof(buf), offset, &offset);
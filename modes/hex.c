@@ -45,26 +45,24 @@ static int to_disp(int c)
     return c;
 }
 
-static int hex_backward_offset(EditState *s, int offset)
+static qe_off_t hex_backward_offset(EditState *s, qe_off_t offset)
 {
-    return align(offset, s->dump_width);
+    return align_offset(offset, s->dump_width);
 }
 
-static int hex_display_line(EditState *s, DisplayState *ds, int offset)
+static qe_off_t hex_display_line(EditState *s, DisplayState *ds, qe_off_t offset)
 {
     int j, len, ateof;
-    int offset1, offset2;
+    qe_off_t offset1, offset2;
     unsigned char b;
 
     display_bol(ds);
 
     ds->style = HEX_STYLE_OFFSET;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", (long long)offset);
 
     ateof = 0;
-    len = s->b->total_size - offset;
-    if (len > s->dump_width)
-        len = s->dump_width;
+    len = (int)min_offset(s->b->total_size - offset, s->dump_width);
 
     if (s->mode == &hex_mode) {
 
@@ -230,12 +228,12 @@ static int hex_mode_probe(ModeDef *mode, ModeProbeData *p)
 
 static void hex_move_bol(EditState *s)
 {
-    s->offset = align(s->offset, s->dump_width);
+    s->offset = align_offset(s->offset, s->dump_width);
 }
 
 static void hex_move_eol(EditState *s)
 {
-    s->offset = min_offset(align(s->offset, s->dump_width) + s->dump_width - 1,
+    s->offset = min_offset(align_offset(s->offset, s->dump_width) + s->dump_width - 1,
                            s->b->total_size);
 }
 
@@ -252,8 +250,8 @@ static void hex_move_up_down(EditState *s, int dir)
 void hex_write_char(EditState *s, int key)
 {
     char32_t cur_ch, ch;
-    int hsize, shift, cur_len, len, h;
-    int offset = s->offset;
+    int hsize, shift, len, h;
+    qe_off_t cur_len, offset = s->offset;
     char buf[10];
 
     if (s->hex_mode) {
@@ -319,7 +317,8 @@ void hex_write_char(EditState *s, int key)
 static void hex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "--0x%x--0x%x", s->offset, s->b->total_size);
+    buf_printf(out, "--0x%llx--0x%llx",
+               (long long)s->offset, (long long)s->b->total_size);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
@@ -206,7 +206,9 @@ static void html_display(EditState *s)
         hs->css_ctx->default_bgcolor = qe_styles[QE_STYLE_CSS_DEFAULT].bg_color;
 
         timer_start();
-        hs->top_box = xml_parse_buffer(s->b, s->b->name, 0, s->b->total_size,
+        /* the CSS layout engine uses int offsets */
+        hs->top_box = xml_parse_buffer(s->b, s->b->name, 0,
+                                       min_offset(s->b->total_size, INT_MAX),
                                        hs->css_ctx->style_sheet,
                                        hs->parse_flags,
                                        html_test_abort, NULL);
@@ -702,7 +704,7 @@ static void html_move_bol_eol(EditState *s, int dir)
 
 static void html_move_bol(EditState *s)
 {
-    int offset;
+    qe_off_t offset;
     offset = s->offset;
     html_move_bol_eol(s, 1);
     /* XXX: hack to allow to go back on left side */
@@ -787,8 +789,8 @@ static void html_mouse_goto(EditState *s, int x, int y)
 static void html_callback(qe__unused__ EditBuffer *b,
                           void *opaque, qe__unused__ int arg,
                           qe__unused__ enum LogOperation op,
-                          qe__unused__ int offset,
-                          qe__unused__ int size)
+                          qe__unused__ qe_off_t offset,
+                          qe__unused__ qe_off_t size)
 {
     HTMLState *hs = opaque;
 
@@ -869,7 +871,7 @@ static int html_mode_probe(ModeDef *mode, ModeProbeData *p1)
 
     score = 0;
 
-    if (!use_html)
+    if (!use_html || p1->total_size > INT_MAX)
         return 0;
 
     while (qe_isspace(*p))
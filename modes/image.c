@@ -84,7 +84,7 @@ int qe_bitmap_format_to_pix_fmt(int format)
 }
 
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                           enum LogOperation op, int offset, int size);
+                           enum LogOperation op, qe_off_t offset, qe_off_t size);
 
 void draw_alpha_grid(EditState *s, int x1, int y1, int w, int h)
 {
@@ -363,8 +363,8 @@ static int set_new_image(EditBuffer *b, ImageBuffer *ib)
     return 0;
 }
 
-static int image_buffer_save(EditBuffer *b, int start, int end,
-                             const char *filename)
+static qe_off_t image_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                  const char *filename)
 {
     ByteIOContext pb1, *pb = &pb1;
     ImageBufferState *ibs = qe_get_buffer_mode_data(b, &image_mode, NULL);
@@ -633,7 +633,7 @@ static void image_mode_close(EditState *s)
 
 /* when the image is modified, reparse it */
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                           enum LogOperation op, int offset, int size)
+                           enum LogOperation op, qe_off_t offset, qe_off_t size)
 {
     //    EditState *s = opaque;
 
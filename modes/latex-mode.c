@@ -175,7 +175,7 @@ static int latex_mode_probe(ModeDef *mode, ModeProbeData *mp)
 static void do_tex_insert_quote(EditState *s)
 {
     EditBuffer *b = s->b;
-    int offset = s->offset;
+    qe_off_t offset = s->offset;
     char32_t c1 = eb_prevc(b, offset, &offset);
     char32_t c2 = eb_prevc(b, offset, &offset);
 
@@ -453,16 +453,17 @@ static void mkd_colorize_line(QEColorizeContext *cp,
     cp->colorize_state = colstate;
 }
 
-static int mkd_is_header_line(EditState *s, int offset)
+static int mkd_is_header_line(EditState *s, qe_off_t offset)
 {
     /* Check if line starts with '#' */
     /* XXX: should ignore blocks using colorstate */
     return eb_nextc(s->b, eb_goto_bol(s->b, offset), &offset) == '#';
 }
 
-static int mkd_find_heading(EditState *s, int offset, int *level, int silent)
+static qe_off_t mkd_find_heading(EditState *s, qe_off_t offset, int *level, int silent)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     offset = eb_goto_bol(s->b, offset);
@@ -487,9 +488,10 @@ static int mkd_find_heading(EditState *s, int offset, int *level, int silent)
     return -1;
 }
 
-static int mkd_next_heading(EditState *s, int offset, int target, int *level)
+static qe_off_t mkd_next_heading(EditState *s, qe_off_t offset, int target, int *level)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     for (;;) {
@@ -512,9 +514,10 @@ static int mkd_next_heading(EditState *s, int offset, int target, int *level)
     return offset;
 }
 
-static int mkd_prev_heading(EditState *s, int offset, int target, int *level)
+static qe_off_t mkd_prev_heading(EditState *s, qe_off_t offset, int target, int *level)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     for (;;) {
@@ -549,7 +552,8 @@ static void do_outline_previous_vsible_heading(EditState *s)
 
 static void do_outline_up_heading(EditState *s)
 {
-    int offset, level;
+    int level;
+    qe_off_t offset;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -565,7 +569,8 @@ static void do_outline_up_heading(EditState *s)
 
 static void do_mkd_backward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -581,7 +586,8 @@ static void do_mkd_backward_same_level(EditState *s)
 
 static void do_mkd_forward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -597,7 +603,8 @@ static void do_mkd_forward_same_level(EditState *s)
 
 static void do_mkd_goto(EditState *s, const char *dest)
 {
-    int offset, level, level1, nb;
+    int level, level1, nb;
+    qe_off_t offset;
     const char *p = dest;
 
     /* XXX: Should pop up a window with numbered outline index
@@ -625,7 +632,8 @@ static void do_mkd_goto(EditState *s, const char *dest)
 static void do_mkd_mark_element(EditState *s, int subtree)
 {
     QEmacsState *qs = s->qe_state;
-    int offset, offset1, level;
+    int level;
+    qe_off_t offset, offset1;
 
     offset = mkd_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -645,7 +653,8 @@ static void do_mkd_mark_element(EditState *s, int subtree)
 
 static void do_mkd_insert_heading(EditState *s, int flags)
 {
-    int offset, offset0, offset1, level = 1;
+    int level = 1;
+    qe_off_t offset, offset0, offset1;
 
     if (check_read_only(s))
         return;
@@ -684,7 +693,8 @@ static void do_mkd_insert_heading(EditState *s, int flags)
 
 static void do_mkd_promote(EditState *s, int dir)
 {
-    int offset, level;
+    int level;
+    qe_off_t offset;
 
     if (check_read_only(s))
         return;
@@ -706,7 +716,8 @@ static void do_mkd_promote(EditState *s, int dir)
 
 static void do_mkd_promote_subtree(EditState *s, int dir)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     if (check_read_only(s))
         return;
@@ -735,7 +746,8 @@ static void do_mkd_promote_subtree(EditState *s, int dir)
 
 static void do_mkd_move_subtree(EditState *s, int dir)
 {
-    int offset, offset1, offset2, level, level1, level2, size;
+    int level, level1, level2;
+    qe_off_t offset, offset1, offset2, size;
     EditBuffer *b1;
 
     if (check_read_only(s))
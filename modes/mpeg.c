@@ -37,10 +37,11 @@
 #define SYSTEM_HEADER_START_CODE    0x000001bb
 #define ISO_11172_END_CODE          0x000001b9
 
-static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
+static qe_off_t mpeg_display_line(EditState *s, DisplayState *ds, qe_off_t offset)
 {
     unsigned int startcode;
-    int ret, badchars, offset_start;
+    int ret, badchars;
+    qe_off_t offset_start;
     unsigned char buf[4];
 
     /* search start code */
@@ -48,7 +49,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
     badchars = 0;
 
     display_bol(ds);
-    display_printf(ds, -1, -1, "%08x:", offset);
+    display_printf(ds, -1, -1, "%08llx:", (long long)offset);
     for (;;) {
         ret = eb_read(s->b, offset, buf, 4);
         if (ret == 0) {
@@ -63,7 +64,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
                 if (badchars) {
                     display_eol(ds, -1, -1);
                     display_bol(ds);
-                    display_printf(ds, -1, -1, "%08x:", offset);
+                    display_printf(ds, -1, -1, "%08llx:", (long long)offset);
                 }
                 break;
             }
@@ -121,7 +122,7 @@ static int mpeg_display_line(EditState *s, DisplayState *ds, int offset)
 }
 
 /* go to previous synchronization point */
-static int mpeg_backward_offset(EditState *s, int offset)
+static qe_off_t mpeg_backward_offset(EditState *s, qe_off_t offset)
 {
     unsigned char buf[4];
     unsigned int startcode;
@@ -290,16 +290,17 @@ static void org_colorize_line(QEColorizeContext *cp,
     cp->colorize_state = colstate;
 }
 
-static int org_is_header_line(EditState *s, int offset)
+static int org_is_header_line(EditState *s, qe_off_t offset)
 {
     /* Check if line starts with '*' */
     /* XXX: should ignore blocks using colorstate */
     return eb_nextc(s->b, eb_goto_bol(s->b, offset), &offset) == '*';
 }
 
-static int org_find_heading(EditState *s, int offset, int *level, int silent)
+static qe_off_t org_find_heading(EditState *s, qe_off_t offset, int *level, int silent)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     offset = eb_goto_bol(s->b, offset);
@@ -324,9 +325,10 @@ static int org_find_heading(EditState *s, int offset, int *level, int silent)
     return -1;
 }
 
-static int org_next_heading(EditState *s, int offset, int target, int *level)
+static qe_off_t org_next_heading(EditState *s, qe_off_t offset, int target, int *level)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     for (;;) {
@@ -349,9 +351,10 @@ static int org_next_heading(EditState *s, int offset, int target, int *level)
     return offset;
 }
 
-static int org_prev_heading(EditState *s, int offset, int target, int *level)
+static qe_off_t org_prev_heading(EditState *s, qe_off_t offset, int target, int *level)
 {
-    int offset1, nb;
+    int nb;
+    qe_off_t offset1;
     char32_t c;
 
     for (;;) {
@@ -386,7 +389,8 @@ static void do_outline_previous_vsible_heading(EditState *s)
 
 static void do_outline_up_heading(EditState *s)
 {
-    int offset, level;
+    int level;
+    qe_off_t offset;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -402,7 +406,8 @@ static void do_outline_up_heading(EditState *s)
 
 static void do_org_backward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -418,7 +423,8 @@ static void do_org_backward_same_level(EditState *s)
 
 static void do_org_forward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -434,7 +440,8 @@ static void do_org_forward_same_level(EditState *s)
 
 static void do_org_goto(EditState *s, const char *dest)
 {
-    int offset, level, level1, nb;
+    int level, level1, nb;
+    qe_off_t offset;
     const char *p = dest;
 
     /* XXX: Should pop up a window with numbered outline index
@@ -462,7 +469,8 @@ static void do_org_goto(EditState *s, const char *dest)
 static void do_org_mark_element(EditState *s, int subtree)
 {
     QEmacsState *qs = s->qe_state;
-    int offset, offset1, level;
+    int level;
+    qe_off_t offset, offset1;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -482,7 +490,8 @@ static void do_org_mark_element(EditState *s, int subtree)
 
 static void do_org_todo(EditState *s)
 {
-    int offset, offset1, bullets, kw;
+    int bullets, kw;
+    qe_off_t offset, offset1;
 
     if (check_read_only(s))
         return;
@@ -512,7 +521,8 @@ static void do_org_todo(EditState *s)
 
 static void do_org_insert_heading(EditState *s, int flags)
 {
-    int offset, offset0, offset1, level = 1;
+    int level = 1;
+    qe_off_t offset, offset0, offset1;
 
     if (check_read_only(s))
         return;
@@ -555,7 +565,8 @@ static void do_org_insert_heading(EditState *s, int flags)
 
 static void do_org_promote(EditState *s, int dir)
 {
-    int offset, level;
+    int level;
+    qe_off_t offset;
 
     if (check_read_only(s))
         return;
@@ -577,7 +588,8 @@ static void do_org_promote(EditState *s, int dir)
 
 static void do_org_promote_subtree(EditState *s, int dir)
 {
-    int offset, level, level1;
+    int level, level1;
+    qe_off_t offset;
 
     if (check_read_only(s))
         return;
@@ -606,7 +618,8 @@ static void do_org_promote_subtree(EditState *s, int dir)
 
 static void do_org_move_subtree(EditState *s, int dir)
 {
-    int offset, offset1, offset2, level, level1, level2, size;
+    int level, level1, level2;
+    qe_off_t offset, offset1, offset2, size;
     EditBuffer *b1;
 
     if (check_read_only(s))
@@ -60,14 +60,14 @@ typedef struct ShellState {
     /* buffer state */
     int cols, rows;
     int use_alternate_screen;
-    int screen_top, alternate_screen_top;
+    qe_off_t screen_top, alternate_screen_top;
     int scroll_top, scroll_bottom;  /* scroll region (top included, bottom excluded) */
     int pty_fd;
     int pid; /* -1 if not launched */
     unsigned int attr, fgcolor, bgcolor, reverse;
-    int cur_offset; /* current offset at position x, y */
+    qe_off_t cur_offset; /* current offset at position x, y */
     int cur_offset_hack; /* the target position is in the middle of a wide glyph */
-    int cur_prompt; /* offset of end of prompt on current line */
+    qe_off_t cur_prompt; /* offset of end of prompt on current line */
     int save_x, save_y;
     int nb_params;
     int params[MAX_CSI_PARAMS + 1];
@@ -99,7 +99,7 @@ typedef struct ShellState {
 
 /* CG: these variables should be encapsulated in a global structure */
 static char error_buffer[MAX_BUFFERNAME_SIZE];
-static int error_offset = -1;
+static qe_off_t error_offset = -1;
 static int error_line_num = -1;
 static int error_col_num = -1;
 static char error_filename[MAX_FILENAME_SIZE];
@@ -108,10 +108,10 @@ static char error_filename[MAX_FILENAME_SIZE];
 #define SR_REFRESH      2
 #define SR_SILENT       4
 static void do_shell_refresh(EditState *e, int flags);
-static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size);
+static char *shell_get_curpath(EditBuffer *b, qe_off_t offset,
+                               char *buf, int buf_size, int max_lines);
 
-static void set_error_offset(EditBuffer *b, int offset)
+static void set_error_offset(EditBuffer *b, qe_off_t offset)
 {
     pstrcpy(error_buffer, sizeof(error_buffer), b ? b->name : "");
     error_offset = offset - 1;
@@ -668,9 +668,49 @@ static inline void qe_term_set_style(ShellState *s) {
     s->b->cur_style = QE_TERM_COMPOSITE | s->attr | composite_color;
 }
 
+/* Return the length of the initial run of printable ASCII bytes
+ * (0x20..0x7E) in p[0..len-1], scanning 8 bytes at a time.
+ */
+static int qe_term_printable_run(const u8 *p, int len)
+{
+    const u8 *p1 = p;
+
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p1, 8);
+        /* stop on bytes >= 0x80, < 0x20 or equal to 0x7F */
+        if ((w | ((w - 0x2020202020202020ULL) & ~w) |
+             (((w ^ 0x7F7F7F7F7F7F7F7FULL) - 0x0101010101010101ULL) &
+              ~(w ^ 0x7F7F7F7F7F7F7F7FULL))) & 0x8080808080808080ULL)
+            break;
+        p1 += 8;
+        len -= 8;
+    }
+    while (len > 0 && *p1 >= 0x20 && *p1 < 0x7F) {
+        p1++;
+        len--;
+    }
+    return p1 - p;
+}
+
+/* Return the number of printable ASCII bytes at `offset`, at most `n`.
+ * These are single column glyphs in the UTF-8 and vt100 charsets,
+ * position computations can skip them without decoding.
+ */
+static int qe_term_ascii_run(ShellState *s, qe_off_t offset, int n)
+{
+    u8 buf[256];
+
+    if (s->b->charset != &charset_utf8 && s->b->charset != &charset_vt100)
+        return 0;
+    n = eb_read(s->b, offset, buf, min_int(n, countof(buf)));
+    return qe_term_printable_run(buf, n);
+}
+
 /* return offset of the n-th terminal line from a given offset */
-static int qe_term_skip_lines(ShellState *s, int offset, int n) {
-    int x, y, w, offset1, offset2;
+static qe_off_t qe_term_skip_lines(ShellState *s, qe_off_t offset, int n) {
+    int x, y, w;
+    qe_off_t offset1, offset2;
     x = y = 0;
     while (y < n && offset < s->b->total_size) {
         char32_t c = eb_nextc(s->b, offset, &offset1);
@@ -711,10 +751,10 @@ static int qe_term_skip_lines(ShellState *s, int offset, int n) {
 }
 
 typedef struct ShellPos {
-    int screen_start; /* offset of the start of row 0 */
-    int line_start; /* offset of the start of current row */
-    int offset;     /* offset of the glyph */
-    int line_end;   /* offset of the newline or the first character that wraps */
+    qe_off_t screen_start; /* offset of the start of row 0 */
+    qe_off_t line_start; /* offset of the start of current row */
+    qe_off_t offset;     /* offset of the glyph */
+    qe_off_t line_end;   /* offset of the newline or the first character that wraps */
     int row;        /* row of the target offset */
     int col;        /* column of the target (0 based, newline may have col == s->cols) */
     int end_col;    /* column of the end of line_end */
@@ -729,8 +769,8 @@ typedef struct ShellPos {
 } ShellPos;
 
 #define SP_NO_UPDATE  1
-static int qe_term_get_pos2(ShellState *s, int destoffset, ShellPos *spp, int flags) {
-    int offset, offset0, offset1, start_offset, line_offset;
+static qe_off_t qe_term_get_pos2(ShellState *s, qe_off_t destoffset, ShellPos *spp, int flags) {
+    qe_off_t offset, offset0, offset1, start_offset, line_offset;
     int x, y, w, gpflags;
     char32_t c;
 
@@ -744,6 +784,14 @@ static int qe_term_get_pos2(ShellState *s, int destoffset, ShellPos *spp, int fl
         destoffset = clamp_offset(destoffset, 0, s->b->total_size);
         offset = offset0 = line_offset = start_offset;
         for (x = y = 0; offset < destoffset;) {
+            if (x < s->cols - 1
+            &&  (w = qe_term_ascii_run(s, offset, (int)min_offset(destoffset - offset,
+                                                                    s->cols - 1 - x))) > 0) {
+                offset0 = offset + w - 1;
+                offset += w;
+                x += w;
+                continue;
+            }
             offset0 = offset;
             c = eb_nextc(s->b, offset, &offset);
             if (c == '\n') {
@@ -849,9 +897,9 @@ static int qe_term_get_pos2(ShellState *s, int destoffset, ShellPos *spp, int fl
     return start_offset;
 }
 
-static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
-    int offset, offset1;
-    int x, y, w, start_offset;
+static qe_off_t qe_term_get_pos(ShellState *s, qe_off_t destoffset, int *px, int *py) {
+    qe_off_t offset, offset1, start_offset;
+    int x, y, w;
     char32_t c;
 
     if (s->use_alternate_screen) {
@@ -863,6 +911,13 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
         destoffset = clamp_offset(destoffset, 0, s->b->total_size);
         offset = start_offset;
         for (x = y = 0; offset < destoffset;) {
+            if (x < s->cols - 1
+            &&  (w = qe_term_ascii_run(s, offset, (int)min_offset(destoffset - offset,
+                                                                    s->cols - 1 - x))) > 0) {
+                offset += w;
+                x += w;
+                continue;
+            }
             c = eb_nextc(s->b, offset, &offset);
             if (c == '\n') {
                 y++;
@@ -933,8 +988,9 @@ static int qe_term_get_pos(ShellState *s, int destoffset, int *px, int *py) {
 #define TG_RELATIVE      0x03
 #define TG_NOCLIP        0x04
 #define TG_NOEXTEND      0x08
-static int qe_term_goto_pos(ShellState *s, int offset, int destx, int desty, int flags) {
-    int x, y, w, x1, y1, start_offset, offset1, offset2;
+static qe_off_t qe_term_goto_pos(ShellState *s, qe_off_t offset, int destx, int desty, int flags) {
+    int x, y, w, x1, y1;
+    qe_off_t start_offset, offset1, offset2;
     char32_t c;
 
     s->cur_offset_hack = 0;
@@ -986,6 +1042,13 @@ static int qe_term_goto_pos(ShellState *s, int offset, int destx, int desty, int
             }
             break;
         } else {
+            if (x < s->cols - 1 && (y < desty || x < destx)
+            &&  (w = qe_term_ascii_run(s, offset, y < desty ? s->cols - 1 - x :
+                                       min_int(destx, s->cols - 1) - x)) > 0) {
+                offset += w;
+                x += w;
+                continue;
+            }
             c = eb_nextc(s->b, offset, &offset1);
             if (c == '\n') {
                 if (y < desty) {
@@ -1078,10 +1141,10 @@ static void qe_term_goto_tab(ShellState *s, int n) {
  * of width w.
  * Must replace overwritten wide glyphs with spaces
  */
-static int qe_term_overwrite(ShellState *s, int offset, int w,
-                             const char *buf, int len)
+static qe_off_t qe_term_overwrite(ShellState *s, qe_off_t offset, int w,
+                                  const char *buf, int len)
 {
-    int offset1, offset2;
+    qe_off_t offset1, offset2;
     int w1, x, y, x1;
     char32_t c1, c2;
 
@@ -1166,9 +1229,10 @@ static int qe_term_overwrite(ShellState *s, int offset, int w,
     return offset + len;
 }
 
-static int qe_term_delete_lines(ShellState *s, int offset, int n)
+static qe_off_t qe_term_delete_lines(ShellState *s, qe_off_t offset, int n)
 {
-    int i, offset1, offset2;
+    int i;
+    qe_off_t offset1, offset2;
 
     // XXX: should scan buffer contents to handle line wrapping
     // XXX: should insert a newline if offset is inside a wrapping line
@@ -1184,7 +1248,7 @@ static int qe_term_delete_lines(ShellState *s, int offset, int n)
     return offset;
 }
 
-static int qe_term_insert_lines(ShellState *s, int offset, int n)
+static qe_off_t qe_term_insert_lines(ShellState *s, qe_off_t offset, int n)
 {
     if (n > 0) {
         // XXX: tricky if offset is in the middle of a wrapping line
@@ -1534,7 +1598,8 @@ static unsigned char const sco_color[16] = {
 
 static void qe_term_emulate(ShellState *s, int c)
 {
-    int i, param1, param2, len, offset, offset1, offset2;
+    int i, param1, param2, len;
+    qe_off_t offset, offset1, offset2;
     ShellPos pos;
     char buf1[10];
 
@@ -1712,7 +1777,8 @@ static void qe_term_emulate(ShellState *s, int c)
                 /* accents are always inserted */
                 // XXX: what if s->cur_offset_hack is not 0?
                 // XXX: should insert a space if previous character is '\n'
-                s->cur_offset += eb_insert(s->b, offset, s->term_buf, s->utf8_len);
+                if (eb_insert(s->b, offset, s->term_buf, s->utf8_len) > 0)
+                    s->cur_offset += s->utf8_len;
             } else {
                 s->cur_offset = qe_term_overwrite(s, offset, w, cs8(s->term_buf), s->utf8_len);
             }
@@ -1795,7 +1861,8 @@ static void qe_term_emulate(ShellState *s, int c)
         case 'M':   // Reverse Index (RI  is 0x8d). [ri]
                     // move cursor up, scroll if at top line
             {
-                int start, offset3, col, row;
+                int col, row;
+                qe_off_t start, offset3;
                 start = qe_term_get_pos(s, offset, &col, &row);
                 if (--row < 0) {
                     /* if (start == 0) */ {
@@ -1973,7 +2040,8 @@ static void qe_term_emulate(ShellState *s, int c)
         case '@':  /* ICH: Insert Ps (Blank) Character(s) (default = 1) */
             {
                 char32_t c2;
-                int x, y, x1, y1, offset3;
+                int x, y, x1, y1;
+                qe_off_t offset3;
 
                 // XXX: should simplify this mess
                 offset1 = offset;
@@ -2036,7 +2104,8 @@ static void qe_term_emulate(ShellState *s, int c)
             /* XXX: should just force top of window to in infinite scroll mode */
             {   /*     0: Below (default), 1: Above, 2: All, 3: Saved Lines (xterm) */
                 /* XXX: should handle eol style */
-                int offset0, bos, eos, col, row;
+                int bos, eos, col, row;
+                qe_off_t offset0;
 
                 bos = eos = 0;
                 // default param is 0
@@ -2078,7 +2147,8 @@ static void qe_term_emulate(ShellState *s, int c)
         case ESC2('?','K'):  /* DECSEL: Selective Erase in Line. */
             {   /*     0: to Right (default), 1: to Left, 2: All */
                 /* XXX: should handle eol style */
-                int col, row, col2, row2, n1, n2, offset3;
+                int col, row, col2, row2, n1, n2;
+                qe_off_t offset3;
 
                 // XXX: should use qe_term_get_pos2()
                 qe_term_get_pos(s, offset, &col, &row);
@@ -2485,8 +2555,127 @@ static void qe_term_emulate(ShellState *s, int c)
     qe_term_update_cursor(s);
 }
 
+/* Output a run of `len` printable ASCII bytes at the cursor with a
+ * single buffer operation. Return the number of bytes handled, 0 if
+ * the run must go through qe_term_emulate() one byte at a time.
+ */
+static int qe_term_emulate_run(ShellState *s, const u8 *p, int len)
+{
+    u8 cur[256 + 1];
+    int n, k;
+    qe_off_t offset;
+
+    if (s->state != QE_TERM_STATE_NORM || s->shifted || s->cur_offset_hack)
+        return 0;
+
+    offset = s->cur_offset = clamp_offset(s->cur_offset, 0, s->b->total_size);
+    qe_term_set_style(s);
+    if (offset >= s->b->total_size) {
+        /* append: no wrapping or glyph adjustment at end of buffer */
+        k = eb_insert(s->b, offset, p, len);
+    } else {
+        /* overwrite existing printable ASCII contents, stop before
+         * newlines, tabs and multi-byte glyphs which need adjustments.
+         * A non ASCII byte may also be an accent on the previous glyph.
+         */
+        n = eb_read(s->b, offset, cur, min_int(len, countof(cur) - 1) + 1);
+        for (k = 0; k < n && k < len && cur[k] >= 0x20 && cur[k] < 0x7F; k++)
+            continue;
+        if (k < n && cur[k] >= 0x80)
+            k--;
+        if (k <= 0)
+            return 0;
+        eb_write(s->b, offset, p, k);
+    }
+    /* update the state as qe_term_emulate() would for the last byte */
+    s->cur_offset = offset + k;
+    s->lastc = p[k - 1];
+    s->term_buf[0] = p[k - 1];
+    s->term_pos = s->term_len = 1;
+    return k;
+}
+
+/* Feed a block of process output to the terminal emulator: runs of
+ * printable bytes are handled in bulk, control and escape sequences
+ * go through the state machine.
+ */
+static void qe_term_emulate_buf(ShellState *s, const u8 *buf, int len)
+{
+    int i, n, k;
+
+    for (i = 0; i < len;) {
+        if (s->state == QE_TERM_STATE_NORM) {
+            n = qe_term_printable_run(buf + i, len - i);
+            if (n > 1) {
+                k = qe_term_emulate_run(s, buf + i, n);
+                if (k > 0) {
+                    i += k;
+                    continue;
+                }
+                /* printable bytes do not change the NORM state */
+                while (n --> 0)
+                    qe_term_emulate(s, buf[i++]);
+                continue;
+            }
+        }
+        qe_term_emulate(s, buf[i++]);
+    }
+}
+
 /* buffer related functions */
 
+/* Process output is read for at most this many ms per event loop
+ * iteration, so keyboard input keeps being handled.
+ */
+#define SHELL_DRAIN_SLICE  10
+
+static void shell_display(QEmacsState *qs)
+{
+    int now = get_clock_ms();
+
+    qs->process_frames++;
+    qs->process_rate_frames++;
+    if (now - qs->process_rate_start >= 1000) {
+        qs->process_frame_rate = (now - qs->process_rate_start >= 2000) ? 0 :
+            qs->process_rate_frames * 1000 / (now - qs->process_rate_start);
+        qs->process_rate_start = now;
+        qs->process_rate_frames = 0;
+    }
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
+static void shell_display_cb(void *opaque)
+{
+    QEmacsState *qs = opaque;
+
+    qs->process_display_timer = NULL;
+    shell_display(qs);
+}
+
+/* Redisplay after process output, at most once per
+ * process_frame_interval: output received in between is coalesced
+ * into a single frame, displayed when the interval expires.
+ */
+static void shell_schedule_display(QEmacsState *qs)
+{
+    int delay;
+
+    if (qs->process_display_timer) {
+        qs->process_dropped_frames++;
+        return;
+    }
+    delay = qs->process_display_time + qs->process_frame_interval -
+        get_clock_ms();
+    if (delay <= 0 || delay > qs->process_frame_interval) {
+        qs->process_display_time = get_clock_ms();
+        shell_display(qs);
+    } else {
+        qs->process_display_time += qs->process_frame_interval;
+        qs->process_display_timer = qe_add_timer(delay, qs, shell_display_cb);
+    }
+}
+
 /* called when characters are available from the process */
 static void shell_read_cb(void *opaque)
 {
@@ -2494,7 +2683,7 @@ static void shell_read_cb(void *opaque)
     QEmacsState *qs;
     EditBuffer *b;
     unsigned char buf[16 * 1024];
-    int len, i, save_readonly;
+    int len, save_readonly, start_time, nb_reads;
 
     if (!s || s->base.mode != &shell_mode)
         return;
@@ -2505,19 +2694,46 @@ static void shell_read_cb(void *opaque)
 
     b = s->b;
     qs = s->qe_state;
-    if (qs->trace_buffer)
-        eb_trace_bytes(buf, len, EB_TRACE_SHELL);
 
     /* Suspend BF_READONLY flag to allow shell output to readonly buffer */
     save_readonly = b->flags & BF_READONLY;
     b->flags &= ~BF_READONLY;
     b->last_log = 0;
 
-    if (s->shell_flags & SF_COLOR) {
-        /* optional terminal emulation (shell, ssh, make, latex, man modes) */
-        for (i = 0; i < len; i++) {
-            qe_term_emulate(s, buf[i]);
+    start_time = get_clock_ms();
+    for (nb_reads = 1;; nb_reads++) {
+        if (qs->trace_buffer)
+            eb_trace_bytes(buf, len, EB_TRACE_SHELL);
+
+        if (s->shell_flags & SF_COLOR) {
+            /* optional terminal emulation (shell, ssh, make, latex, man modes) */
+            qe_term_emulate_buf(s, buf, len);
+        } else {
+            qe_off_t pos = b->total_size;
+            int threshold = 3 << 20;    /* 3MB for large pictures */
+            eb_write(b, b->total_size, buf, len);
+            if (pos < threshold && pos + len >= threshold) {
+                EditState *e;
+                for (e = qs->first_window; e != NULL; e = e->next_window) {
+                    if (e->b == b) {
+                        if (s->shell_flags & SF_AUTO_CODING)
+                            do_set_auto_coding(e, 0);
+                        if (s->shell_flags & SF_AUTO_MODE)
+                            qe_set_next_mode(e, 0, 0);
+                    }
+                }
+            }
         }
+        /* drain the pty (non blocking) for at most a time slice */
+        if (get_clock_ms() - start_time >= SHELL_DRAIN_SLICE)
+            break;
+        len = read(s->pty_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+    }
+    qs->process_dropped_frames += nb_reads - 1;
+
+    if (s->shell_flags & SF_COLOR) {
         if (s->last_char == '\000' || s->last_char == '\001'
         ||  s->last_char == '\003'
         ||  s->last_char == '\r' || s->last_char == '\n') {
@@ -2535,22 +2751,9 @@ static void shell_read_cb(void *opaque)
                 b->mark = s->cur_prompt;
             }
         }
-        shell_get_curpath(b, s->cur_offset, s->curpath, sizeof(s->curpath));
-    } else {
-        int pos = b->total_size;
-        int threshold = 3 << 20;    /* 3MB for large pictures */
-        eb_write(b, b->total_size, buf, len);
-        if (pos < threshold && pos + len >= threshold) {
-            EditState *e;
-            for (e = qs->first_window; e != NULL; e = e->next_window) {
-                if (e->b == b) {
-                    if (s->shell_flags & SF_AUTO_CODING)
-                        do_set_auto_coding(e, 0);
-                    if (s->shell_flags & SF_AUTO_MODE)
-                        qe_set_next_mode(e, 0, 0);
-                }
-            }
-        }
+        /* a new prompt is on the last rows, avoid rescanning older output */
+        shell_get_curpath(b, s->cur_offset, s->curpath, sizeof(s->curpath),
+                          s->curpath[0] ? s->rows : 0);
     }
     if (save_readonly) {
         b->modified = 0;
@@ -2558,8 +2761,7 @@ static void shell_read_cb(void *opaque)
     }
 
     /* now we do some refresh (should just invalidate?) */
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    shell_schedule_display(qs);
 }
 
 static void shell_mode_free(EditBuffer *b, void *state)
@@ -2681,25 +2883,14 @@ static void shell_pid_cb(void *opaque, int status)
     dpy_flush(qs->screen);
 }
 
-EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
-                             const char *bufname, const char *caption,
-                             const char *path,
-                             const char *cmd, int shell_flags)
+/* Attach a fresh terminal emulator state to buffer b */
+static ShellState *shell_new_state(EditBuffer *b, const char *caption,
+                                   int shell_flags)
 {
     QEmacsState *qs = &qe_state;
     ShellState *s;
-    EditBuffer *b;
     const char *lang;
-    int cols, rows;
 
-    b = b0;
-    if (!b) {
-        b = eb_new(bufname, BF_SAVELOG | BF_SHELL);
-        if (!b)
-            return NULL;
-    }
-
-    eb_set_buffer_name(b, bufname); /* ensure that the name is unique */
     if (shell_flags & SF_COLOR) {
         eb_create_style_buffer(b, QE_TERM_STYLE_BITS <= 16 ? BF_STYLE2 :
                                QE_TERM_STYLE_BITS <= 32 ? BF_STYLE4 : BF_STYLE8);
@@ -2715,11 +2906,8 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
     s = qe_get_buffer_mode_data(b, &shell_mode, NULL);
     if (!s) {
         s = (ShellState*)qe_create_buffer_mode_data(b, &shell_mode);
-        if (!s) {
-            if (!b0)
-                eb_free(&b);
+        if (!s)
             return NULL;
-        }
         /* Track cursor with edge effect */
         eb_add_callback(b, eb_offset_callback, &s->cur_offset, 1);
         eb_add_callback(b, eb_offset_callback, &s->cur_prompt, 0);
@@ -2734,6 +2922,32 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
     s->shell_flags = shell_flags;
     s->cur_prompt = s->cur_offset = b->total_size;
     qe_term_init(s);
+    return s;
+}
+
+EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
+                             const char *bufname, const char *caption,
+                             const char *path,
+                             const char *cmd, int shell_flags)
+{
+    ShellState *s;
+    EditBuffer *b;
+    int cols, rows;
+
+    b = b0;
+    if (!b) {
+        b = eb_new(bufname, BF_SAVELOG | BF_SHELL);
+        if (!b)
+            return NULL;
+    }
+
+    eb_set_buffer_name(b, bufname); /* ensure that the name is unique */
+    s = shell_new_state(b, caption, shell_flags);
+    if (!s) {
+        if (!b0)
+            eb_free(&b);
+        return NULL;
+    }
 
     /* launch shell */
     /* default values for cols, rows should come from the screen size */
@@ -3183,16 +3397,16 @@ static void shell_write_char(EditState *e, int c)
     }
 }
 
-static void shell_delete_bytes(EditState *e, int offset, int size)
+static void shell_delete_bytes(EditState *e, qe_off_t offset, qe_off_t size)
 {
     ShellState *s = shell_get_state(e, 1);
-    int start = offset;
-    int end = offset + size;
+    qe_off_t start = offset;
+    qe_off_t end = offset + size;
 
     // XXX: should deal with regions spanning current input line and
     // previous buffer contents
     if (s && !s->grab_keys && end > s->cur_prompt) {
-        int start_char, cur_char, end_char, size1;
+        qe_off_t start_char, cur_char, end_char, size1;
         if (start < s->cur_prompt) {
             /* delete part before the interactive input */
             size1 = eb_delete_range(e->b, start, s->cur_prompt);
@@ -3242,7 +3456,7 @@ static void do_shell_newline(EditState *e)
         ShellState *s = shell_get_state(e, 1);
 
         if (s) {
-            shell_get_curpath(e->b, e->offset, s->curpath, sizeof(s->curpath));
+            shell_get_curpath(e->b, e->offset, s->curpath, sizeof(s->curpath), 0);
         }
         shell_write_char(e, '\r');
         /* give the process a chance to handle the input */
@@ -3298,7 +3512,7 @@ static void do_shell_kill_word(EditState *e, int dir)
 
     if (s && e->interactive) {
         /* copy word to the kill ring */
-        int start = e->offset;
+        qe_off_t start = e->offset;
 
         // XXX: word pattern is different for shell line editor?
         text_move_word_left_right(e, dir);
@@ -3317,7 +3531,7 @@ static void do_shell_kill_line(EditState *e, int argval)
 {
     ShellState *s = shell_get_state(e, 1);
     int dir = (argval == NO_ARG || argval > 0) ? 1 : -1;
-    int offset, p1 = e->offset, p2 = p1;
+    qe_off_t offset, p1 = e->offset, p2 = p1;
 
     if (s && e->interactive) {
         /* ignore count argument in interactive mode */
@@ -3383,7 +3597,7 @@ static void do_shell_yank(EditState *e)
          * large. Hard coded limit can be removed if shell input is
          * made asynchronous via an auxiliary buffer.
          */
-        int offset;
+        qe_off_t offset;
         QEmacsState *qs = e->qe_state;
         EditBuffer *b = qs->yank_buffers[qs->yank_current];
 
@@ -3503,12 +3717,16 @@ static void do_shell_toggle_input(EditState *e)
 
 /* get current directory from prompt on current line */
 /* XXX: should extend behavior to handle more subtile cases */
-static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size)
+/* Find the current directory from the prompt on the line at `offset`
+ * or a previous line, looking back at most `max_lines` lines if not 0.
+ */
+static char *shell_get_curpath(EditBuffer *b, qe_off_t offset,
+                               char *buf, int buf_size, int max_lines)
 {
     char line[1024];
     char curpath[MAX_FILENAME_SIZE];
-    int start, stop0, stop, i, len, offset1;
+    int start, stop0, stop, i, len;
+    qe_off_t offset1;
 
     offset = eb_goto_bol(b, offset);
 again:
@@ -3542,25 +3760,24 @@ again:
             return pstrcpy(buf, buf_size, curpath);
         }
     }
-    /* XXX: limit backlook? */
-    if (offset > 0) {
+    if (offset > 0 && --max_lines != 0) {
         offset = eb_prev_line(b, offset);
         goto again;
     }
     return NULL;
 }
 
-static char *shell_get_default_path(EditBuffer *b, int offset,
+static char *shell_get_default_path(EditBuffer *b, qe_off_t offset,
                                     char *buf, int buf_size)
 {
 #if 0
     ShellState *s = qe_get_buffer_mode_data(b, &shell_mode, NULL);
 
-    if (s && (s->curpath[0] || shell_get_curpath(b, offset, s->curpath, sizeof(s->curpath)))) {
+    if (s && (s->curpath[0] || shell_get_curpath(b, offset, s->curpath, sizeof(s->curpath), 0))) {
         return pstrcpy(buf, buf_size, s->curpath);
     }
 #endif
-    return shell_get_curpath(b, offset, buf, buf_size);
+    return shell_get_curpath(b, offset, buf, buf_size, 0);
 }
 
 static void do_shell_command(EditState *e, const char *cmd)
@@ -3630,7 +3847,7 @@ static void do_next_error(EditState *s, int arg, int dir)
     QEmacsState *qs = s->qe_state;
     EditState *e;
     EditBuffer *b;
-    int offset, found_offset;
+    qe_off_t offset, found_offset;
     char filename[MAX_FILENAME_SIZE];
     char fullpath[MAX_FILENAME_SIZE];
     buf_t fnamebuf, *fname;
@@ -3707,7 +3924,7 @@ static void do_next_error(EditState *s, int arg, int dir)
             line_num = line_num * 10 + c - '0';
         }
         if (c == ':' || c == ',' || c == '.') {
-            int offset0 = offset;
+            qe_off_t offset0 = offset;
             char32_t c0 = c;
             for (;;) {
                 c = eb_nextc(b, offset, &offset);
@@ -3778,16 +3995,43 @@ static int match_string(char32_t *buf, int n, const char *str) {
     return (str[i] == '\0') ? i : 0;
 }
 
+/* rank of mode 'm' in the mode list starting from 1, 0 if none */
+static int shell_mode_rank(ModeDef *m)
+{
+    ModeDef *m1;
+    int rank = 1;
+
+    for (m1 = qe_state.first_mode; m1 && m; m1 = m1->next, rank++) {
+        if (m1 == m)
+            return rank;
+    }
+    return 0;
+}
+
+static ModeDef *shell_mode_from_rank(int rank)
+{
+    ModeDef *m;
+
+    for (m = qe_state.first_mode; m && rank > 1; m = m->next)
+        rank--;
+    return rank == 1 ? m : NULL;
+}
+
 void shell_colorize_line(QEColorizeContext *cp,
                          char32_t *str, int n, ModeDef *syn)
 {
     /* detect match lines for known languages and colorize accordingly */
-    static char filename[MAX_FILENAME_SIZE];
-    ModeDef *m;
-    int i = 0, len;
+    char filename[MAX_FILENAME_SIZE];
+    ModeDef *m = NULL;
+    int i = 0, len, diagnostic = 0;
 
     if (cp->colorize_state) {
-        cp->colorize_state -= 1;
+        /* the line after a diagnostic is colorized with the mode of
+         * its file, kept in the state as 1 + the rank of the mode so
+         * the colorization does not depend on the previous line.
+         */
+        m = shell_mode_from_rank(cp->colorize_state - 1);
+        cp->colorize_state = 0;
     } else {
         len = 0;
         if (!qe_isspace(str[0])) {
@@ -3805,7 +4049,7 @@ void shell_colorize_line(QEColorizeContext *cp,
                     ||  match_string(str + i, n - i, " note:")
                     ||  match_string(str + i, n - i, " warning:")) {
                         /* clang diagnostic, will colorize the next line */
-                        cp->colorize_state = 1;
+                        diagnostic = 1;
                         i = n;
                     }
                     break;
@@ -3821,30 +4065,137 @@ void shell_colorize_line(QEColorizeContext *cp,
             }
         }
         filename[len] = '\0';
-    }
-    if (cp->colorize_state == 0 && *filename) {
         /* XXX: should verify if filename exists, but this is difficult
          * if the current directory of the shell process changes and
          * is not possible for remote shells.
          */
-        /* XXX: filename based mode should be stored as a number into cp->colorize_state */
-        if (i < n && (m = qe_find_mode_filename(filename, MODEF_SYNTAX)) != NULL) {
-            cp->colorize_state = 0;
-            m->colorize_func(cp, str + i, n - i, m);
-            cp->combine_stop = i;
-            if (!(m->flags & MODEF_NO_TRAILING_BLANKS)) {
-                /* Mark trailing blanks as errors if cursor is not on same line */
-                int j;
-                for (j = n; j > i && qe_isblank(str[j - 1] & CHAR_MASK); j--) {
-                    str[j - 1] &= CHAR_MASK;
-                    SET_COLOR1(str, j - 1, QE_STYLE_BLANK_HILITE);
-                }
+        if (*filename && (diagnostic || i < n))
+            m = qe_find_mode_filename(filename, MODEF_SYNTAX);
+        if (diagnostic) {
+            cp->colorize_state = 1 + shell_mode_rank(m);
+            return;
+        }
+    }
+    if (i < n && m != NULL) {
+        m->colorize_func(cp, str + i, n - i, m);
+        cp->combine_stop = i;
+        if (!(m->flags & MODEF_NO_TRAILING_BLANKS)) {
+            /* Mark trailing blanks as errors if cursor is not on same line */
+            int j;
+            for (j = n; j > i && qe_isblank(str[j - 1] & CHAR_MASK); j--) {
+                str[j - 1] &= CHAR_MASK;
+                SET_COLOR1(str, j - 1, QE_STYLE_BLANK_HILITE);
             }
         }
         cp->colorize_state = 0;
     }
 }
 
+/* Build a synthetic colored build log of about `size` bytes */
+static int bench_terminal_log(char *buf, int size)
+{
+    int pos, n, i;
+
+    for (pos = i = 0; pos < size - 256; pos += n, i++) {
+        switch (i % 4) {
+        case 0:
+            n = snprintf(buf + pos, 256,
+                         "  CC      modes/module%d.o\r\n", i);
+            break;
+        case 1:
+            n = snprintf(buf + pos, 256,
+                         "\033[1mmodes/module%d.c:%d:%d: "
+                         "\033[35mwarning: \033[0m\033[1munused variable "
+                         "'value%d' [-Wunused-variable]\033[0m\r\n",
+                         i, i % 5000, i % 80, i);
+            break;
+        case 2:
+            n = snprintf(buf + pos, 256,
+                         " %5d |     int value%d = compute(state, %d);\r\n",
+                         i % 5000, i, i);
+            break;
+        default:
+            n = snprintf(buf + pos, 256,
+                         "       |         \033[32m^~~~~~~~~\033[0m\r\n");
+            break;
+        }
+    }
+    return pos;
+}
+
+static void do_benchmark_terminal(EditState *e, int argval)
+{
+    EditBuffer *b1, *b[2] = { NULL, NULL };
+    ShellState *s;
+    char *log;
+    int log_size, size, pass, total, pos, n, start_time, elapsed, same, len;
+    qe_off_t offset;
+
+    b1 = new_help_buffer();
+    if (!b1)
+        return;
+
+    size = clamp_int((argval == NO_ARG) ? 16 : argval, 1, 1024) << 20;
+    log_size = 1 << 20;
+    log = qe_malloc_array(char, log_size);
+    if (!log) {
+        put_error(e, "Cannot allocate benchmark data");
+        return;
+    }
+    log_size = bench_terminal_log(log, log_size);
+    eb_printf(b1, "Terminal emulation of %d MB of colored build log\n\n",
+              size >> 20);
+
+    for (pass = 0; pass < 2; pass++) {
+        b[pass] = eb_new("*bench-terminal*", BF_SYSTEM | BF_SHELL);
+        if (!b[pass])
+            break;
+        s = shell_new_state(b[pass], NULL, SF_COLOR);
+        if (!s)
+            break;
+        eb_set_charset(b[pass], &charset_utf8, b[pass]->eol_type);
+        s->cols = QE_TERM_XSIZE;
+        s->rows = QE_TERM_YSIZE;
+        start_time = get_clock_usec();
+        for (total = 0; total < size; total += log_size) {
+            /* feed the log in chunks of the size shell_read_cb() reads */
+            for (pos = 0; pos < log_size; pos += n) {
+                n = min_int(log_size - pos, 16 * 1024);
+                if (pass == 0) {
+                    int i;
+                    for (i = 0; i < n; i++)
+                        qe_term_emulate(s, (u8)log[pos + i]);
+                } else {
+                    qe_term_emulate_buf(s, (const u8 *)log + pos, n);
+                }
+            }
+        }
+        elapsed = max_int(get_clock_usec() - start_time, 1);
+        eb_printf(b1, "  %-28s %10.1f MB/s %14.0f bytes/s\n",
+                  pass == 0 ? "byte at a time" : "printable runs",
+                  (double)total / elapsed, (double)total * 1e6 / elapsed);
+    }
+    /* both passes must produce the same contents and styles */
+    if (b[0] && b[1]) {
+        same = (b[0]->total_size == b[1]->total_size);
+        for (offset = 0; same && offset < b[0]->total_size; offset += len) {
+            u8 buf0[4096], buf1[4096];
+            len = eb_read(b[0], offset, buf0, sizeof(buf0));
+            same = (len > 0 && eb_read(b[1], offset, buf1, len) == len
+                    && !memcmp(buf0, buf1, len));
+        }
+        for (offset = 0; same && offset < b[0]->total_size; offset++) {
+            same = (eb_get_style(b[0], offset) == eb_get_style(b[1], offset));
+        }
+        eb_printf(b1, "\n  buffer size %lld bytes, outputs %s\n",
+                  (long long)b[0]->total_size, same ? "identical" : "DIFFER");
+    }
+    eb_free(&b[0]);
+    eb_free(&b[1]);
+    qe_free(&log);
+    show_popup(e, b1, "Terminal emulation benchmark");
+}
+
 /* shell mode specific commands */
 static const CmdDef shell_commands[] = {
     CMD0( "shell-toggle-input", "C-o",
@@ -3922,6 +4273,10 @@ static const CmdDef shell_global_commands[] = {
     CMD2( "shell", "C-x RET RET, C-x LF LF, M-C-g s",
           "Start a shell buffer or move to the last shell buffer used",
           do_shell, ESi, "p")
+    CMD2( "benchmark-terminal", "",
+          "Measure terminal emulation throughput on a synthetic build log "
+          "(number of megabytes as argument)",
+          do_benchmark_terminal, ESi, "P")
     CMD2( "shell-command", "M-!",
           "Run a shell command and display a new buffer with its collected output",
           do_shell_command, ESs,
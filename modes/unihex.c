@@ -33,7 +33,8 @@ enum {
 static int unihex_mode_init(EditState *s, EditBuffer *b, int flags)
 {
     if (s) {
-        int offset, max_offset, w;
+        qe_off_t offset, max_offset;
+        int w;
         char32_t c, maxc;
 
         /* unihex mode is incompatible with EOL_DOS eol type */
@@ -67,29 +68,29 @@ static int unihex_to_disp(char32_t c) {
     return c;
 }
 
-static int unihex_backward_offset(EditState *s, int offset)
+static qe_off_t unihex_backward_offset(EditState *s, qe_off_t offset)
 {
-    int pos;
+    qe_off_t pos;
 
     /* CG: beware: offset may fall inside a character */
     pos = eb_get_char_offset(s->b, offset);
-    pos = align(pos, s->dump_width);
+    pos = align_offset(pos, s->dump_width);
     return eb_goto_char(s->b, pos);
 }
 
-static int unihex_display_line(EditState *s, DisplayState *ds, int offset)
+static qe_off_t unihex_display_line(EditState *s, DisplayState *ds, qe_off_t offset)
 {
     int j, len, ateof, dump_width, w;
-    int offset1, offset2;
+    qe_off_t offset1, offset2;
     char32_t c, maxc, b;
     /* CG: array size is incorrect, should be smaller */
     char32_t buf[LINE_MAX_SIZE];
-    char32_t pos[LINE_MAX_SIZE];
+    qe_off_t pos[LINE_MAX_SIZE];
 
     display_bol(ds);
 
     ds->style = UNIHEX_STYLE_OFFSET;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", (long long)offset);
     //int charpos = eb_get_char_offset(s->b, offset);
     //display_printf(ds, -1, -1, "%08x ", charpos);
     //display_printf(ds, -1, -1, "%08x %08x ", charpos, offset);
@@ -181,21 +182,21 @@ static int unihex_display_line(EditState *s, DisplayState *ds, int offset)
 
 static void unihex_move_bol(EditState *s)
 {
-    int pos;
+    qe_off_t pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
-    pos = align(pos, s->dump_width);
+    pos = align_offset(pos, s->dump_width);
     s->offset = eb_goto_char(s->b, pos);
 }
 
 static void unihex_move_eol(EditState *s)
 {
-    int pos;
+    qe_off_t pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
     /* CG: should include the last character! */
-    pos = align(pos, s->dump_width) + s->dump_width - 1;
+    pos = align_offset(pos, s->dump_width) + s->dump_width - 1;
 
     s->offset = eb_goto_char(s->b, pos);
 }
@@ -211,7 +212,7 @@ static void unihex_move_left_right(EditState *s, int dir)
 
 static void unihex_move_up_down(EditState *s, int dir)
 {
-    int pos;
+    qe_off_t pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
@@ -223,9 +224,9 @@ static void unihex_move_up_down(EditState *s, int dir)
 static void unihex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "--0x%x--0x%x--%s",
-               eb_get_char_offset(s->b, s->offset),
-               s->offset, s->b->charset->name);
+    buf_printf(out, "--0x%llx--0x%llx--%s",
+               (long long)eb_get_char_offset(s->b, s->offset),
+               (long long)s->offset, s->b->charset->name);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
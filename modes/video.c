@@ -90,8 +90,8 @@ static int video_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int video_buffer_save(EditBuffer *b, int start, int end,
-                             const char *filename)
+static qe_off_t video_buffer_save(EditBuffer *b, qe_off_t start, qe_off_t end,
+                                  const char *filename)
 {
     /* cannot save anything */
     return -1;
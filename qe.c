@@ -49,6 +49,10 @@ static int generic_mode_init(EditState *s);
 static void generic_mode_close(EditState *s);
 static void generic_text_display(EditState *s);
 static void display1(DisplayState *ds);
+static QELayoutCache *layout_cache_get(EditState *e, DisplayState *ds);
+static void layout_cache_free(EditState *s);
+static qe_off_t display_line_cached(EditState *s, DisplayState *ds,
+                                    qe_off_t offset);
 #ifndef CONFIG_TINY
 static void save_selection(void);
 static void do_linum_mode(EditState *s, int argval);
@@ -63,6 +67,9 @@ static int no_init_file;
 static int single_window;
 int force_tty;
 int disable_crc;
+int disable_layout_cache;
+int disable_window_skip;
+int disable_mode_index;
 #ifdef CONFIG_SESSION
 int use_session_file;
 #endif
@@ -85,6 +92,187 @@ static int generic_mode_probe(ModeDef *mode, ModeProbeData *p)
     return 1;
 }
 
+/* Hash index of the extensions and shell handlers of the modes probed
+ * by generic_mode_probe: probe_mode() only calls the generic probes of
+ * the modes found for the filename extensions and the #! line, the
+ * other probes sniff the contents and are always called.  The index is
+ * built on the first probe after modes are registered.
+ */
+#define MODE_INDEX_BITS      10
+#define MODE_INDEX_SHELL     1  /* entry is a shell handler */
+#define MODE_INDEX_MAX_MODES 32 /* max candidate modes for a file */
+
+typedef struct ModeIndexEntry {
+    const char *key;    /* word of the mode list, not null terminated */
+    int len;
+    int flags;
+    int next;           /* next entry in the bucket, -1 if none */
+    ModeDef *mode;
+} ModeIndexEntry;
+
+typedef struct ModeIndex {
+    int nb_entries;
+    int alloc_entries;
+    OWNED ModeIndexEntry *entries;
+    int buckets[1 << MODE_INDEX_BITS];
+} ModeIndex;
+
+/* extensions are matched ignoring case, shell handlers exactly */
+static unsigned int mode_index_hash(const char *key, int len, int flags)
+{
+    unsigned int h = flags;
+
+    while (len-- > 0) {
+        u8 c = *key++;
+        h = h * 31 + ((flags & MODE_INDEX_SHELL) ? c : qe_tolower(c));
+    }
+    return (h ^ (h >> MODE_INDEX_BITS)) & ((1 << MODE_INDEX_BITS) - 1);
+}
+
+static int mode_index_add_list(ModeIndex *mi, ModeDef *m,
+                               const char *list, int flags)
+{
+    ModeIndexEntry *ep;
+    const char *p, *q;
+    unsigned int h;
+    int c, n;
+
+    if (!list)
+        return 0;
+
+    /* same word splitting as match_extension() and memfind():
+       initial and final | do not match an empty word, but || does */
+    for (p = q = list;; p++) {
+        c = *p;
+        if (c == '|' || c == '\0') {
+            if (p > q || (q != list && c != '\0')) {
+                if (mi->nb_entries >= mi->alloc_entries) {
+                    n = mi->alloc_entries + (mi->alloc_entries >> 1) + 256;
+                    if (!qe_realloc(&mi->entries, n * sizeof(*mi->entries)))
+                        return -1;
+                    mi->alloc_entries = n;
+                }
+                h = mode_index_hash(q, p - q, flags);
+                ep = &mi->entries[mi->nb_entries];
+                ep->key = q;
+                ep->len = p - q;
+                ep->flags = flags;
+                ep->mode = m;
+                ep->next = mi->buckets[h];
+                mi->buckets[h] = mi->nb_entries++;
+            }
+            if (c == '|')
+                q = p + 1;
+            else
+                break;
+        }
+    }
+    return 0;
+}
+
+static void mode_index_free(QEmacsState *qs)
+{
+    if (qs->mode_index) {
+        qe_free(&qs->mode_index->entries);
+        qe_free(&qs->mode_index);
+    }
+}
+
+static ModeIndex *mode_index_get(QEmacsState *qs)
+{
+    ModeIndex *mi;
+    ModeDef *m;
+
+    if (disable_mode_index)
+        return NULL;
+    if (!qs->mode_index) {
+        mi = qe_mallocz(ModeIndex);
+        if (!mi)
+            return NULL;
+        memset(mi->buckets, 0xff, sizeof(mi->buckets));
+        qs->mode_index = mi;
+        for (m = qs->first_mode; m != NULL; m = m->next) {
+            if (m->mode_probe == generic_mode_probe
+            &&  (mode_index_add_list(mi, m, m->extensions, 0)
+            ||   mode_index_add_list(mi, m, m->shell_handlers,
+                                     MODE_INDEX_SHELL))) {
+                mode_index_free(qs);
+                break;
+            }
+        }
+    }
+    return qs->mode_index;
+}
+
+/* add the modes of the entries matching 'key' to 'modes', return the
+   new number of modes or -1 if there are too many */
+static int mode_index_find(ModeIndex *mi, const char *key, int len, int flags,
+                           ModeDef **modes, int nb_modes)
+{
+    ModeIndexEntry *ep;
+    int i, e;
+
+    for (e = mi->buckets[mode_index_hash(key, len, flags)]; e >= 0; e = ep->next) {
+        ep = &mi->entries[e];
+        if (ep->flags != flags || ep->len != len
+        ||  ((flags & MODE_INDEX_SHELL) ? memcmp(ep->key, key, len) :
+             qe_memicmp(ep->key, key, len)))
+            continue;
+        for (i = 0; i < nb_modes && modes[i] != ep->mode; i++)
+            continue;
+        if (i == nb_modes) {
+            if (nb_modes >= MODE_INDEX_MAX_MODES)
+                return -1;
+            modes[nb_modes++] = ep->mode;
+        }
+    }
+    return nb_modes;
+}
+
+/* Collect the modes whose generic probe may match the file: those with
+ * an extension of the filename, or with the name of a word of the #!
+ * line as a shell handler, a superset of the matches of
+ * match_extension() and match_shell_handler().  Return the number of
+ * modes, or -1 if all generic probes must be called.
+ */
+static int mode_index_candidates(QEmacsState *qs, ModeProbeData *p,
+                                 ModeDef **modes)
+{
+    ModeIndex *mi = mode_index_get(qs);
+    const char *base, *q, *end, *start, *word;
+    int nb = 0;
+
+    if (!mi)
+        return -1;
+
+    base = get_basename(p->filename);
+    while (*base == '.')
+        base++;
+    for (q = base; nb >= 0 && (q = strchr(q, '.')) != NULL;) {
+        q++;
+        nb = mode_index_find(mi, q, strlen(q), 0, modes, nb);
+    }
+    if (nb >= 0 && p->line_len >= 2 && p->buf[0] == '#' && p->buf[1] == '!') {
+        /* the interpreter, or the command run by env */
+        q = cs8(p->buf) + 2;
+        end = cs8(p->buf) + p->line_len;
+        nb = mode_index_find(mi, q, 0, MODE_INDEX_SHELL, modes, nb);
+        while (nb >= 0 && q < end) {
+            while (q < end && qe_isspace(*q))
+                q++;
+            for (start = word = q; q < end && !qe_isspace(*q); q++) {
+                if (*q == '/')
+                    word = q + 1;
+            }
+            if (start < word && nb >= 0)
+                nb = mode_index_find(mi, start, q - start, MODE_INDEX_SHELL, modes, nb);
+            if (word < q && nb >= 0)
+                nb = mode_index_find(mi, word, q - word, MODE_INDEX_SHELL, modes, nb);
+        }
+    }
+    return nb;
+}
+
 ModeDef *qe_find_mode(const char *name, int flags)
 {
     QEmacsState *qs = &qe_state;
@@ -135,6 +323,9 @@ void qe_register_mode(ModeDef *m, int flags)
 
     m->flags |= flags;
 
+    /* the mode index is built again for the next probe */
+    mode_index_free(qs);
+
     if (m->flags & MODEF_SYNTAX) {
         /* default to text handling */
         /* should follow the fallback chain */
@@ -295,7 +486,7 @@ int command_print_entry(CompleteState *cp, EditState *s, const char *name) {
     }
 }
 
-int command_get_entry(EditState *s, char *dest, int size, int offset)
+int command_get_entry(EditState *s, char *dest, int size, qe_off_t offset)
 {
     int len;
     eb_fgets(s->b, dest, size, offset, &offset);
@@ -763,8 +954,8 @@ void text_move_eol(EditState *s)
     s->offset = eb_goto_eol(s->b, s->offset);
 }
 
-static int eb_word_right(EditBuffer *b, int w, int offset) {
-    int offset1;
+static qe_off_t eb_word_right(EditBuffer *b, int w, qe_off_t offset) {
+    qe_off_t offset1;
 
     while (offset < b->total_size) {
         char32_t c = eb_nextc(b, offset, &offset1);
@@ -775,8 +966,8 @@ static int eb_word_right(EditBuffer *b, int w, int offset) {
     return offset;
 }
 
-static int eb_word_left(EditBuffer *b, int w, int offset) {
-    int offset1;
+static qe_off_t eb_word_left(EditBuffer *b, int w, qe_off_t offset) {
+    qe_off_t offset1;
 
     while (offset > 0) {
         char32_t c = eb_prevc(b, offset, &offset1);
@@ -787,11 +978,11 @@ static int eb_word_left(EditBuffer *b, int w, int offset) {
     return offset;
 }
 
-int word_right(EditState *s, int w) {
+qe_off_t word_right(EditState *s, int w) {
     return s->offset = eb_word_right(s->b, w, s->offset);
 }
 
-int word_left(EditState *s, int w) {
+qe_off_t word_left(EditState *s, int w) {
     return s->offset = eb_word_left(s->b, w, s->offset);
 }
 
@@ -807,11 +998,11 @@ void text_move_word_left_right(EditState *s, int dir)
 }
 
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr)
+                qe_off_t offset, qe_off_t *offset_ptr)
 {
     EditBuffer *b = s->b;
     buf_t outbuf, *out;
-    int offset1;
+    qe_off_t offset1;
     char32_t c;
 
     out = buf_init(&outbuf, buf, buf_size);
@@ -839,7 +1030,7 @@ int qe_get_word(EditState *s, char *buf, int buf_size,
     return out->len;
 }
 
-void do_mark_region(EditState *s, int mark, int offset)
+void do_mark_region(EditState *s, qe_off_t mark, qe_off_t offset)
 {
     /* CG: Should have local and global mark rings */
     s->b->mark = clamp_offset(mark, 0, s->b->total_size);
@@ -853,7 +1044,8 @@ void do_mark_region(EditState *s, int mark, int offset)
 
 /* Upper / lower / capital case functions. Update offset, return isword */
 /* arg: -1=lower-case, +1=upper-case, +2=capital-case */
-static int eb_changecase(EditBuffer *b, int offset, int *offsetp, int arg)
+static int eb_changecase(EditBuffer *b, qe_off_t offset, qe_off_t *offsetp,
+                         int arg)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
@@ -881,7 +1073,7 @@ static int eb_changecase(EditBuffer *b, int offset, int *offsetp, int arg)
 
 void do_changecase_word(EditState *s, int arg)
 {
-    int offset, offset1;
+    qe_off_t offset, offset1;
 
     offset = word_right(s, 1);
     while (offset < s->b->total_size) {
@@ -896,7 +1088,7 @@ void do_changecase_word(EditState *s, int arg)
 
 void do_changecase_region(EditState *s, int arg)
 {
-    int offset;
+    qe_off_t offset;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -920,7 +1112,7 @@ void do_changecase_region(EditState *s, int arg)
 
 void do_delete_char(EditState *s, int argval)
 {
-    int endpos;
+    qe_off_t endpos;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -947,7 +1139,7 @@ void do_delete_char(EditState *s, int argval)
 
 void do_backspace(EditState *s, int argval)
 {
-    int endpos;
+    qe_off_t endpos;
 
 #ifndef CONFIG_TINY
     if (s->b->flags & BF_PREVIEW) {
@@ -975,7 +1167,7 @@ void do_backspace(EditState *s, int argval)
            Characters at the end of a line are removed, not replaced
            with spaces.
          */
-        int offset1;
+        qe_off_t offset1;
         int spaces = 0;
         int newlines = 0;
         int count = (argval == NO_ARG) ? 1 : argval;
@@ -1050,7 +1242,7 @@ typedef struct {
     int linec;
     int yc;
     int xc;
-    int offsetc;
+    qe_off_t offsetc;
     DirType basec; /* direction of the line */
     DirType dirc; /* direction of the char under the cursor */
     int cursor_width;
@@ -1058,7 +1250,7 @@ typedef struct {
 } CursorContext;
 
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                qe_off_t offset1, qe_off_t offset2, int line_num,
                 int x, int y, int w, int h, qe__unused__ int hex_mode)
 {
     CursorContext *m = ds->cursor_opaque;
@@ -1105,12 +1297,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    qe_off_t offsetd;
 } MoveContext;
 
 /* called each time the cursor could be displayed */
 static int down_cursor_func(DisplayState *ds,
-                            int offset1, qe__unused__ int offset2, int line_num,
+                            qe_off_t offset1, qe__unused__ qe_off_t offset2,
+                            int line_num,
                             int x, qe__unused__ int y,
                             int w, qe__unused__ int h,
                             qe__unused__ int hex_mode)
@@ -1190,7 +1383,7 @@ void text_move_up_down(EditState *s, int dir)
     if (dir < 0) {
         /* difficult case: we need to go backward on displayed text */
         while (cm.linec <= 0) {
-            int offset_top = s->offset_top;
+            qe_off_t offset_top = s->offset_top;
 
             if (offset_top <= 0)
                 return;
@@ -1223,14 +1416,14 @@ void text_move_up_down(EditState *s, int dir)
 
 typedef struct {
     int y_found;
-    int offset_found;
+    qe_off_t offset_found;
     int dir;
-    int offsetc;
+    qe_off_t offsetc;
 } ScrollContext;
 
 /* called each time the cursor could be displayed */
 static int scroll_cursor_func(DisplayState *ds,
-                              int offset1, int offset2,
+                              qe_off_t offset1, qe_off_t offset2,
                               qe__unused__ int line_num,
                               qe__unused__ int x, int y,
                               qe__unused__ int w, int h,
@@ -1329,7 +1522,7 @@ void perform_scroll_up_down(EditState *s, int h)
                    exit loop */
                 s->y_disp = 0;
             } else {
-                int offset = eb_prev(s->b, s->offset_top);
+                qe_off_t offset = eb_prev(s->b, s->offset_top);
                 s->offset_top = s->mode->backward_offset(s, offset);
                 ds->y = 0;
                 s->mode->display_line(s, ds, s->offset_top);
@@ -1387,7 +1580,7 @@ void do_center_cursor(EditState *s, int force)
          * speeds up get_cursor_pos() on large files, except for the
          * pathological case of huge lines.
          */
-        int offset = eb_prev(s->b, s->offset);
+        qe_off_t offset = eb_prev(s->b, s->offset);
         s->offset_top = s->mode->backward_offset(s, offset);
     } else {
         if (!force)
@@ -1407,13 +1600,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    qe_off_t offsetd;
     int dir;
     int after_found;
 } LeftRightMoveContext;
 
 static int left_right_cursor_func(DisplayState *ds,
-                                  int offset1, qe__unused__ int offset2,
+                                  qe_off_t offset1, qe__unused__ qe_off_t offset2,
                                   int line_num,
                                   int x, qe__unused__ int y,
                                   int w, qe__unused__ int h,
@@ -1476,8 +1669,8 @@ void text_move_left_right_visual(EditState *s, int dir)
         if (m->offsetd >= 0) {
             /* position found : update and exit */
             /* adjust for accents */
-            int offset = m->offsetd;
-            int offset1, offset2;
+            qe_off_t offset = m->offsetd;
+            qe_off_t offset1, offset2;
             while (qe_isaccent(eb_nextc(s->b, offset, &offset1))
             &&     eb_prevc(s->b, offset, &offset2) != '\n') {
                 offset = offset1;
@@ -1493,7 +1686,7 @@ void text_move_left_right_visual(EditState *s, int dir)
             } else {
                 /* no suitable position found: go to previous line */
                 if (yc <= 0) {
-                    int offset = s->offset_top;
+                    qe_off_t offset = s->offset_top;
 
                     if (offset <= 0)
                         break;
@@ -1521,7 +1714,7 @@ typedef struct {
     int xd;
     int dy_min;
     int dx_min;
-    int offset_found;
+    qe_off_t offset_found;
     int hex_mode;
 } MouseGotoContext;
 
@@ -1539,7 +1732,7 @@ static int seg_dist(int x, int x1, int x2)
 /* XXX: would need two passes in the general case (first search line,
    then colunm */
 static int mouse_goto_func(DisplayState *ds,
-                           int offset1, qe__unused__ int offset2,
+                           qe_off_t offset1, qe__unused__ qe_off_t offset2,
                            qe__unused__ int line_num,
                            int x, int y, int w, int h, int hex_mode)
 {
@@ -1607,7 +1800,7 @@ int do_delete_selection(EditState *s)
     if (s->region_style && s->b->mark != s->offset) {
         /* Delete hilighted region */
         // XXX: make it optional?
-        res = eb_delete_range(s->b, s->b->mark, s->offset);
+        res = eb_delete_range(s->b, s->b->mark, s->offset) != 0;
     }
     /* deactivate region hilite */
     s->region_style = 0;
@@ -1669,7 +1862,8 @@ void do_char(EditState *s, int key, int argval) {
 
 #ifdef CONFIG_UNICODE_JOIN
 void do_combine_accent(EditState *s, int accent_arg) {
-    int offset0, len;
+    int len;
+    qe_off_t offset0;
     char32_t g[2];
     char buf[MAX_CHAR_BYTES];
     char32_t c, accent = accent_arg;
@@ -1704,8 +1898,9 @@ void do_combine_accent(EditState *s, int accent_arg) {
    assuming a TAB width of tw and a fixed fitch font with single or
    double width glyphs and zero width accents.
  */
-int text_screen_width(EditBuffer *b, int start, int stop, int tw) {
-    int col = 0, offset = start;
+int text_screen_width(EditBuffer *b, qe_off_t start, qe_off_t stop, int tw) {
+    int col = 0;
+    qe_off_t offset = start;
 
     while (offset < stop) {
         char32_t c = eb_nextc(b, offset, &offset);
@@ -1723,7 +1918,8 @@ int text_screen_width(EditBuffer *b, int start, int stop, int tw) {
 
 void text_write_char(EditState *s, int key)
 {
-    int len, endpos, ret, insert;
+    int len, ret, insert;
+    qe_off_t endpos;
     char buf[MAX_CHAR_BYTES];
     char32_t cur_ch, c2;
 
@@ -1741,7 +1937,8 @@ void text_write_char(EditState *s, int key)
 
     if (insert) {
         const InputMethod *m;
-        int match_buf[20], match_len, offset, i;
+        int match_buf[20], match_len, i;
+        qe_off_t offset;
 
         /* use compose system only if insert mode */
         if (s->compose_len == 0)
@@ -1754,7 +1951,9 @@ void text_write_char(EditState *s, int key)
         s->b->last_log_char = key;
 
         /* insert char */
-        s->offset += eb_insert(s->b, s->offset, buf, len);
+        if (eb_insert(s->b, s->offset, buf, len) < 0)
+            return;
+        s->offset += len;
 
         s->compose_buf[s->compose_len++] = key;
         m = s->input_method;
@@ -1796,7 +1995,8 @@ void text_write_char(EditState *s, int key)
             }
         }
     } else {
-        int w, w1, offset2;
+        int w, w1;
+        qe_off_t offset2;
 
         w = qe_wcwidth(key);
         if (cur_ch == '\t') {
@@ -1804,7 +2004,8 @@ void text_write_char(EditState *s, int key)
             int col = text_screen_width(s->b, eb_goto_bol(s->b, s->offset), s->offset, tw);
             w1 = tw - col % tw;
             if (w < w1) {
-                s->offset += eb_insert(s->b, s->offset, buf, len);
+                if (eb_insert(s->b, s->offset, buf, len) > 0)
+                    s->offset += len;
                 return;
             }
         } else {
@@ -1924,8 +2125,8 @@ void do_tab(EditState *s, int argval)
     } else if (s->indent_tabs_mode) {
         do_char(s, '\t', argval);
     } else {
-        int offset = s->offset;
-        int offset0 = eb_goto_bol(s->b, offset);
+        qe_off_t offset = s->offset;
+        qe_off_t offset0 = eb_goto_bol(s->b, offset);
         int col = 0;
         int tw = s->b->tab_width > 0 ? s->b->tab_width : DEFAULT_TAB_WIDTH;
         int indent = s->indent_size > 0 ? s->indent_size : tw;
@@ -2077,10 +2278,10 @@ void do_append_next_kill(qe__unused__ EditState *s)
     /* do nothing! */
 }
 
-void do_kill(EditState *s, int p1, int p2, int dir, int keep)
+void do_kill(EditState *s, qe_off_t p1, qe_off_t p2, int dir, int keep)
 {
     QEmacsState *qs = s->qe_state;
-    int len, tmp;
+    qe_off_t len, tmp;
     EditBuffer *b;
 
     /* deactivate region hilite */
@@ -2128,7 +2329,8 @@ void do_copy_region(EditState *s) {
 
 void do_kill_line(EditState *s, int argval)
 {
-    int p1, p2, offset1, dir = 1;
+    int dir = 1;
+    qe_off_t p1, p2, offset1;
 
     // XXX: should handle kill_whole_line variable
     // XXX: can there be a variable and a function with the same name?
@@ -2183,7 +2385,8 @@ void do_kill_whole_line(EditState *s, int n)
 {
     // XXX: should not modify s->offset
     // XXX: should fix behavior for binary and hex modes
-    int p1 = 0, p2 = 0, dir = n;
+    qe_off_t p1 = 0, p2 = 0;
+    int dir = n;
     if (n < 0) {
         do_eol(s);
         p1 = s->offset;
@@ -2208,7 +2411,7 @@ void do_kill_whole_line(EditState *s, int n)
 
 void do_kill_word(EditState *s, int n)
 {
-    int start = s->offset;
+    qe_off_t start = s->offset;
 
     if (n != 0) {
         do_word_left_right(s, n);
@@ -2223,7 +2426,7 @@ void do_yank(EditState *s) {
          the n-th element of the kill-ring
        qemacs: with a C-u prefix, yank n copies of the last killed block
      */
-    int size;
+    qe_off_t size;
     QEmacsState *qs = s->qe_state;
     EditBuffer *b;
 
@@ -2270,7 +2473,7 @@ void do_yank_pop(EditState *s)
 
 void do_exchange_point_and_mark(EditState *s)
 {
-    int tmp;
+    qe_off_t tmp;
 
     tmp = s->b->mark;
     s->b->mark = s->offset;
@@ -2306,6 +2509,7 @@ static int reload_buffer(EditState *s, EditBuffer *b)
      */
     saved = b->save_log;
     b->save_log = 0;
+    errno = 0;
     if (b->data_type->buffer_load)
         ret = b->data_type->buffer_load(b, f);
     else
@@ -2319,6 +2523,10 @@ static int reload_buffer(EditState *s, EditBuffer *b)
 
     if (ret < 0) {
       fail:
+        if (!f1 && errno) {
+            put_status(s, "Could not load '%s': %s", b->filename,
+                       strerror(errno));
+        } else
         if (!f1) {
             put_status(s, "Could not load '%s'", b->filename);
         } else {
@@ -2660,10 +2868,9 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, len, i;
+    int i;
     EditBufferCallbackList *cb;
-    int pos[32];
-    char buf[MAX_CHAR_BYTES];
+    qe_off_t pos[32];
 
     eol_type = s->b->eol_type;
     charset = read_charset(s, charset_str, &eol_type);
@@ -2679,38 +2886,30 @@ void do_convert_buffer_file_coding_system(EditState *s,
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            int *offsetp = (int *)cb->opaque;
+            qe_off_t *offsetp = cb->opaque;
             pos[i] = eb_get_char_offset(b, *offsetp);
             i++;
         }
     }
 
-    // XXX: should use eb_insert_buffer_convert()
-    /* slow, but simple iterative method */
-    for (offset = 0; offset < b->total_size;) {
-        QETermStyle style = eb_get_style(b, offset);
-        char32_t c = eb_nextc(b, offset, &offset);
-        b1->cur_style = style;
-        len = eb_encode_char32(b1, buf, c);
-        eb_insert(b1, b1->total_size, buf, len);
-    }
+    eb_insert_buffer_convert(b1, 0, b, 0, b->total_size);
 
     /* replace current buffer with conversion */
-    /* quick hack to transfer styles from tmp buffer to b */
-    eb_free(&b->b_styles);
     eb_delete(b, 0, b->total_size);
     eb_set_charset(b, charset, eol_type);
-    // XXX: this does not transfer styles
-    //      should use eb_insert_buffer_convert()
     eb_insert_buffer(b, 0, b1, 0, b1->total_size);
-    b->b_styles = b1->b_styles;
-    b1->b_styles = NULL;
+    /* transfer styles from tmp buffer to b */
+    {
+        QEStyleRuns *sr = b->b_styles;
+        b->b_styles = b1->b_styles;
+        b1->b_styles = sr;
+    }
 
     /* restore positions */
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            int *offsetp = (int *)cb->opaque;
+            qe_off_t *offsetp = cb->opaque;
             *offsetp = eb_goto_char(b, pos[i]);
             i++;
         }
@@ -2718,8 +2917,8 @@ void do_convert_buffer_file_coding_system(EditState *s,
 
     eb_free(&b1);
 
-    put_status(s, "Buffer charset is now %s, %d bytes",
-               s->b->charset->name, b->total_size);
+    put_status(s, "Buffer charset is now %s, %lld bytes",
+               s->b->charset->name, (long long)b->total_size);
 }
 
 void do_toggle_bidir(EditState *s)
@@ -2794,7 +2993,8 @@ void do_word_wrap(EditState *s)
 void do_goto(EditState *s, const char *str, int unit)
 {
     const char *p;
-    int pos, line, col, rel;
+    qe_off_t pos;
+    int line, col, rel;
 
     /* Update s->offset from str specification:
      * optional +- for relative moves
@@ -2867,10 +3067,10 @@ void do_goto(EditState *s, const char *str, int unit)
         goto getcol;
 
     case 'l':
-        line = pos - 1;
+        line = (int)(pos - 1);
         if (rel || pos <= 0) {
             eb_get_pos(s->b, &line, &col, s->offset);
-            line += pos;
+            line += (int)pos;
         }
     getcol:
         col = 0;
@@ -2880,7 +3080,7 @@ void do_goto(EditState *s, const char *str, int unit)
         if (*p)
             goto error;
         // XXX: col should be a display column, not a character number
-        s->offset = eb_goto_pos(s->b, max_offset(0, line), col);
+        s->offset = eb_goto_pos(s->b, max_int(0, line), col);
         return;
     }
 error:
@@ -2911,7 +3111,7 @@ void do_what_cursor_position(EditState *s)
     char32_t accents[6];
     buf_t outbuf, *out;
     int line_num, col_num;
-    int offset1, off;
+    qe_off_t offset1, off;
     int w, v;
     int i, n;
     char32_t c, cc;
@@ -2984,9 +3184,10 @@ void do_what_cursor_position(EditState *s)
         }
     }
     eb_get_pos(s->b, &line_num, &col_num, s->offset);
-    put_status(s, "%s  point=%d mark=%d size=%d region=%d col=%d",
-               out->buf, s->offset, s->b->mark, s->b->total_size,
-               abs(s->offset - s->b->mark), col_num);
+    put_status(s, "%s  point=%lld mark=%lld size=%lld region=%lld col=%d",
+               out->buf, (long long)s->offset, (long long)s->b->mark,
+               (long long)s->b->total_size,
+               (long long)llabs(s->offset - s->b->mark), col_num);
 }
 
 void do_set_tab_width(EditState *s, int tab_width)
@@ -3058,6 +3259,8 @@ void basic_mode_line(EditState *s, buf_t *out, int c1)
     buf_printf(out, "%c%c:%c%c  %-20s  (%s)",
                c1, state, s->b->flags & BF_READONLY ? '%' : mod,
                mod, s->b->name, mode_name);
+    if (s->b->flags & BF_LOADING)
+        buf_printf(out, "  Loading %d%%", eb_get_load_progress(s->b));
 }
 
 void text_mode_line(EditState *s, buf_t *out)
@@ -3353,6 +3556,7 @@ void do_set_style(EditState *e, const char *stylestr,
                   const char *propstr, const char *value)
 {
     QEStyleDef *stp;
+    EditState *e1;
     int v, prop_index;
 
     stp = find_style(stylestr);
@@ -3422,7 +3626,11 @@ void do_set_style(EditState *e, const char *stylestr,
         }
         break;
     }
-    //s->qe_state->complete_refresh = 1;
+    /* the style may be used in any window: inactive windows are not
+       redisplayed unless invalidated */
+    for (e1 = e->qe_state->first_window; e1 != NULL; e1 = e1->next_window) {
+        edit_invalidate(e1, 0);
+    }
 }
 
 void do_define_color(EditState *e, const char *name, const char *value)
@@ -3523,7 +3731,7 @@ void display_close(DisplayState *ds)
 
 void display_init(DisplayState *ds, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *ds,
-                                     int offset1, int offset2, int line_num,
+                                     qe_off_t offset1, qe_off_t offset2, int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque)
 {
@@ -3575,6 +3783,7 @@ void display_init(DisplayState *ds, EditState *e, enum DisplayType do_disp,
     }
     display_bol(ds);
     release_font(e->screen, font);
+    ds->layout = layout_cache_get(e, ds);
 }
 
 static void reverse_fragments(TextFragment *str, int len)
@@ -3634,13 +3843,102 @@ static uint64_t compute_crc(const void *p, int size, uint64_t sum)
     return sum;
 }
 
+/* Laid out lines are cached per window as the sequence of flush_line()
+ * calls made by text_display_line(), with the buffer offsets relative
+ * to the start of the line.  The cached layouts are replayed by the
+ * cursor and print passes and by the following frames, until the line
+ * is modified, as tracked by a buffer callback, or the window settings
+ * change.
+ */
+#define LAYOUT_CACHE_MIN   32      /* initial number of cached lines */
+#define LAYOUT_CACHE_MAX   512
+#define LAYOUT_MAX_SIZE    (64 * 1024)  /* overlong lines are not kept */
+
+/* arguments of a flush_line() call and the display state it uses,
+   followed by the fragments and the line chars */
+typedef struct QELayoutRow {
+    int nb_fragments;
+    int nb_glyphs;
+    int offset1, offset2;
+    int last;
+    int x_start, x_line, left_gutter;
+    int base, embedding_level_max;
+} QELayoutRow;
+
+/* stop recording the layout, the line will be laid out each time */
+static void layout_record_stop(DisplayState *ds)
+{
+    QELineLayout *ll = ds->layout_rec;
+
+    qe_free(&ll->data);
+    ll->alloc_size = 0;
+    ll->size = -1;
+    ds->layout_rec = NULL;
+}
+
+static void layout_record_row(DisplayState *ds, TextFragment *fragments,
+                              int nb_fragments,
+                              qe_off_t offset1, qe_off_t offset2, int last)
+{
+    QELineLayout *ll = ds->layout_rec;
+    QELayoutRow row;
+    int i, n, size, off[2];
+    u8 *p;
+
+    n = ds->line_index;
+    size = sizeof(row) + nb_fragments * sizeof(*fragments) +
+        n * (sizeof(*ds->line_chars) + sizeof(*ds->line_offsets) +
+             sizeof(*ds->line_char_widths) + sizeof(*ds->line_hex_mode));
+    if (ll->size + size > ll->alloc_size) {
+        int alloc_size = max_int(ll->size + size, ll->alloc_size * 2);
+        if (ll->size + size > LAYOUT_MAX_SIZE
+        ||  !qe_realloc(&ll->data, alloc_size)) {
+            layout_record_stop(ds);
+            return;
+        }
+        ll->alloc_size = alloc_size;
+    }
+    row.nb_fragments = nb_fragments;
+    row.nb_glyphs = n;
+    /* the offsets are stored relative to the start of the line */
+    row.offset1 = offset1 < 0 ? -1 : (int)(offset1 - ll->offset);
+    row.offset2 = offset2 < 0 ? -1 : (int)(offset2 - ll->offset);
+    row.last = last;
+    row.x_start = ds->x_start;
+    row.x_line = ds->x_line;
+    row.left_gutter = ds->left_gutter;
+    row.base = ds->base;
+    row.embedding_level_max = ds->embedding_level_max;
+
+    p = ll->data + ll->size;
+    memcpy(p, &row, sizeof(row));
+    p += sizeof(row);
+    memcpy(p, fragments, nb_fragments * sizeof(*fragments));
+    p += nb_fragments * sizeof(*fragments);
+    memcpy(p, ds->line_chars, n * sizeof(*ds->line_chars));
+    p += n * sizeof(*ds->line_chars);
+    for (i = 0; i < n; i++) {
+        off[0] = ds->line_offsets[i][0] < 0 ? -1 :
+            (int)(ds->line_offsets[i][0] - ll->offset);
+        off[1] = ds->line_offsets[i][1] < 0 ? -1 :
+            (int)(ds->line_offsets[i][1] - ll->offset);
+        memcpy(p, off, sizeof(off));
+        p += sizeof(off);
+    }
+    memcpy(p, ds->line_char_widths, n * sizeof(*ds->line_char_widths));
+    p += n * sizeof(*ds->line_char_widths);
+    memcpy(p, ds->line_hex_mode, n * sizeof(*ds->line_hex_mode));
+    p += n * sizeof(*ds->line_hex_mode);
+    ll->size = p - ll->data;
+}
+
 /* flush the line fragments to the screen.
    `offset1..offset2` is the range of offsets for cursor management
    `last` is 0 for a line wrap, 1 for end of line, -1 for continuation
 */
 static void flush_line(DisplayState *ds,
                        TextFragment *fragments, int nb_fragments,
-                       int offset1, int offset2, int last)
+                       qe_off_t offset1, qe_off_t offset2, int last)
 {
     EditState *e = ds->edit_state;
     QEditScreen *screen = e->screen;
@@ -3648,6 +3946,10 @@ static void flush_line(DisplayState *ds,
     TextFragment *frag;
     QEFont *font;
 
+    if (ds->layout_rec) {
+        layout_record_row(ds, fragments, nb_fragments, offset1, offset2, last);
+    }
+
     /* compute baseline and lineheight (incorrect for very long lines) */
     baseline = 0;
     max_descent = 0;
@@ -3684,33 +3986,45 @@ static void flush_line(DisplayState *ds,
     /* draw everything if line is visible in window */
     if (ds->do_disp == DISP_PRINT
     &&  ds->y + line_height >= 0
-    &&  ds->y < e->ytop + e->height) {
+    &&  ds->y < e->height) {
         QEStyleDef styledef, default_style;
         int no_display = 0;
 
+        x1 = ds->width + ds->eol_width;
+        if (last == -1) {
+            /* segment of an overlong line: skip it if it is outside
+               the window, as when scrolled horizontally */
+            for (i = 0, x = ds->x_line; i < nb_fragments; i++)
+                x += fragments[i].width;
+            if (ds->x_line >= x1 || x <= 0)
+                no_display = 1;
+        }
+
         /* test if display needed */
-        if (ds->line_num >= 0 && ds->line_num < 2048) {
-            /* paranoid: prevent cache growing too large */
+        if (!no_display && !disable_crc) {
             /* Use checksum based line cache to improve speed in graphics mode.
-             * XXX: overlong lines will fail the cache test
+             * The shadow has an entry per row displayed in the window,
+             * and per segment for the rows of overlong lines.
              */
-            if (ds->line_num >= e->shadow_nb_lines) {
+            int n = ds->shadow_index++;
+
+            if (n >= e->shadow_nb_lines) {
                 /* reallocate shadow */
-                int n = ds->line_num + LINE_SHADOW_INCR;
-                if (qe_realloc(&e->line_shadow, n * sizeof(QELineShadow))) {
+                int n1 = n + LINE_SHADOW_INCR;
+                if (qe_realloc(&e->line_shadow, n1 * sizeof(QELineShadow))) {
                     /* put an impossible value so that we redraw */
                     memset(&e->line_shadow[e->shadow_nb_lines], 0xff,
-                           (n - e->shadow_nb_lines) * sizeof(QELineShadow));
-                    e->shadow_nb_lines = n;
+                           (n1 - e->shadow_nb_lines) * sizeof(QELineShadow));
+                    e->shadow_nb_lines = n1;
                 }
             }
-            if (ds->line_num < e->shadow_nb_lines && !disable_crc) {
+            if (n < e->shadow_nb_lines) {
                 QELineShadow *ls;
                 uint64_t crc;
 
                 crc = compute_crc(fragments, sizeof(*fragments) * nb_fragments, 0);
                 crc = compute_crc(ds->line_chars, sizeof(*ds->line_chars) * ds->line_index, crc);
-                ls = &e->line_shadow[ds->line_num];
+                ls = &e->line_shadow[n];
                 if (ls->y != ds->y || ls->x != ds->x_line
                 ||  ls->height != line_height || ls->crc != crc) {
                     /* update values for the line cache */
@@ -3738,7 +4052,6 @@ static void flush_line(DisplayState *ds,
                                ds->left_gutter, line_height, styledef.bg_color);
             }
             x = ds->x_line;
-            x1 = ds->width + ds->eol_width;
             for (i = 0; i < nb_fragments && x < x1; i++) {
                 frag = &fragments[i];
                 get_style(e, &styledef, frag->style);
@@ -3816,8 +4129,8 @@ static void flush_line(DisplayState *ds,
             frag = &fragments[i];
 
             for (j = frag->line_index, k = 0; k < frag->len; k++, j++) {
-                int _offset1 = ds->line_offsets[j][0];
-                int _offset2 = ds->line_offsets[j][1];
+                qe_off_t _offset1 = ds->line_offsets[j][0];
+                qe_off_t _offset2 = ds->line_offsets[j][1];
                 int hex_mode = ds->line_hex_mode[j];
                 int w = ds->line_char_widths[j];
                 x += w;
@@ -3944,7 +4257,7 @@ static void flush_fragment(DisplayState *ds)
         j++;
     }
     for (i = 0; i < ds->fragment_index; i++) {
-        int offset1, offset2;
+        qe_off_t offset1, offset2;
         j = ds->line_index + char_to_glyph_pos[i];
         offset1 = ds->fragment_offsets[i][0];
         offset2 = ds->fragment_offsets[i][1];
@@ -4090,7 +4403,7 @@ static void flush_fragment(DisplayState *ds)
     ds->fragment_index = 0;
 }
 
-int display_char_bidir(DisplayState *ds, int offset1, int offset2,
+int display_char_bidir(DisplayState *ds, qe_off_t offset1, qe_off_t offset2,
                        int embedding_level, char32_t ch)
 {
     int space, istab, isaccent;
@@ -4102,8 +4415,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     /* special code to colorize block */
     e = ds->edit_state;
     if (e->show_selection || e->region_style) {
-        int mark = e->b->mark;
-        int offset = e->offset;
+        qe_off_t mark = e->b->mark;
+        qe_off_t offset = e->offset;
 
         if ((offset1 >= offset && offset1 < mark) ||
             (offset1 >= mark && offset1 < offset)) {
@@ -4133,7 +4446,8 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
             /* flush the current fragment if needed */
             if (isaccent && ds->fragment_chars[ds->fragment_index - 1] == ' ') {
                 /* separate last space to make it part of the next word */
-                int off1, off2, cur_hex;
+                int cur_hex;
+                qe_off_t off1, off2;
                 --ds->fragment_index;
                 off1 = ds->fragment_offsets[ds->fragment_index][0];
                 off2 = ds->fragment_offsets[ds->fragment_index][1];
@@ -4176,7 +4490,7 @@ int display_char_bidir(DisplayState *ds, int offset1, int offset2,
     return 0;
 }
 
-void display_printhex(DisplayState *ds, int offset1, int offset2,
+void display_printhex(DisplayState *ds, qe_off_t offset1, qe_off_t offset2,
                       char32_t h, int n)
 {
     int i, v;
@@ -4199,7 +4513,7 @@ void display_printhex(DisplayState *ds, int offset1, int offset2,
     ds->cur_hex_mode = 0;
 }
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, qe_off_t offset1, qe_off_t offset2,
                     const char *fmt, ...)
 {
     char buf[256], *p;
@@ -4221,7 +4535,7 @@ void display_printf(DisplayState *ds, int offset1, int offset2,
 }
 
 /* end of line */
-void display_eol(DisplayState *ds, int offset1, int offset2)
+void display_eol(DisplayState *ds, qe_off_t offset1, qe_off_t offset2)
 {
     flush_fragment(ds);
 
@@ -4233,15 +4547,12 @@ void display_eol(DisplayState *ds, int offset1, int offset2)
 static void display1(DisplayState *ds)
 {
     EditState *e = ds->edit_state;
-    int offset;
+    qe_off_t offset;
 
     ds->eod = 0;
     offset = e->offset_top;
     for (;;) {
-        /* XXX: need early bailout from display_line if WRAP_TRUNCATE
-           and far beyond the right border after cursor found.
-        */
-        offset = e->mode->display_line(e, ds, offset);
+        offset = display_line_cached(e, ds, offset);
         e->offset_bottom = offset;
 
         /* EOF reached ? */
@@ -4269,7 +4580,7 @@ static void display1(DisplayState *ds)
 }
 
 /******************************************************/
-int text_backward_offset(EditState *s, int offset)
+qe_off_t text_backward_offset(EditState *s, qe_off_t offset)
 {
     int line, col;
 
@@ -4281,11 +4592,12 @@ int text_backward_offset(EditState *s, int offset)
 #ifdef CONFIG_UNICODE_JOIN
 /* max_size should be >= 2 */
 static int bidir_compute_attributes(BidirTypeLink *list_tab, int max_size,
-                                    EditBuffer *b, int offset)
+                                    EditBuffer *b, qe_off_t offset)
 {
     BidirTypeLink *p;
     BidirCharType type, ltype;
-    int left, offset1;
+    int left;
+    qe_off_t start, offset1;
     char32_t c;
 
     p = list_tab;
@@ -4298,6 +4610,8 @@ static int bidir_compute_attributes(BidirTypeLink *list_tab, int max_size,
 
     ltype = BIDIR_TYPE_SOT;
 
+    /* link positions are relative to the start of the line */
+    start = offset;
     for (;;) {
         offset1 = offset;
         c = eb_nextc(b, offset, &offset);
@@ -4307,7 +4621,7 @@ static int bidir_compute_attributes(BidirTypeLink *list_tab, int max_size,
         /* if not enough room, increment last link */
         if (type != ltype && left > 0) {
             p->type = type;
-            p->pos = offset1;
+            p->pos = offset1 - start;
             p->len = 1;
             p++;
             left--;
@@ -4320,7 +4634,7 @@ static int bidir_compute_attributes(BidirTypeLink *list_tab, int max_size,
     /* Add the ending link */
     p->type = BIDIR_TYPE_EOT;
     p->len = 0;
-    p->pos = offset1;
+    p->pos = offset1 - start;
     p++;
 
     return p - list_tab;
@@ -4334,16 +4648,22 @@ static int bidir_compute_attributes(BidirTypeLink *list_tab, int max_size,
 
 static int get_staticly_colorized_line(EditState *s, char32_t *buf, int buf_size,
                                        QETermStyle *sbuf,
-                                       int offset, int *offset_ptr, int line_num)
+                                       qe_off_t offset, qe_off_t *offset_ptr,
+                                       int line_num)
 {
     EditBuffer *b = s->b;
     char32_t *buf_ptr, *buf_end;
+    QETermStyle style = 0;
+    qe_off_t style_end = 0;
 
     buf_ptr = buf;
     buf_end = buf + buf_size - 1;
     for (;;) {
-        QETermStyle style = eb_get_style(b, offset);
-        char32_t c = eb_nextc(b, offset, &offset);
+        char32_t c;
+        /* fetch styles run by run */
+        if (offset >= style_end)
+            style = eb_get_style_run(b, offset, &style_end);
+        c = eb_nextc(b, offset, &offset);
         if (c == '\n') {
             /* XXX: set style for end of line? */
             break;
@@ -4361,31 +4681,38 @@ static int get_staticly_colorized_line(EditState *s, char32_t *buf, int buf_size
 
 #ifndef CONFIG_TINY
 
-/* Gets the colorized line beginning at 'offset'. Its length
-   excluding '\n' is returned */
+/* Colorization states are propagated from the beginning of the buffer,
+ * one state per line.  The lines needed for display are colorized
+ * synchronously up to COLORIZE_SYNC_LINES lines past the valid states.
+ * Beyond that, the display guesses the state of the visible lines by
+ * colorizing COLORIZE_GUESS_LINES lines from the initial state, while
+ * colorize_idle() computes the exact states in time slices from a
+ * timer, yielding to user input, and redisplays when done.
+ */
 
 #define COLORIZED_LINE_PREALLOC_SIZE 64
+#define COLORIZE_SYNC_LINES    4096  /* lines colorized before display */
+#define COLORIZE_GUESS_LINES   256   /* lines colorized to guess a state */
+#define COLORIZE_CHECKPOINT    256   /* lines between checks for input */
+#define COLORIZE_IDLE_DELAY    50    /* ms before idle colorization */
+#define COLORIZE_IDLE_SLICE    20    /* ms of idle colorization per timer */
 
-static int syntax_get_colorized_line(EditState *s,
-                                     char32_t *buf, int buf_size,
-                                     QETermStyle *sbuf,
-                                     int offset, int *offsetp, int line_num)
+static QETimer *colorize_timer;
+
+static void colorize_idle(void *opaque);
+
+static void colorize_schedule(void)
 {
-    QEColorizeContext cctx;
-    EditBuffer *b = s->b;
-    int i, len, line, n, col, bom;
+    if (!colorize_timer)
+        colorize_timer = qe_add_timer(COLORIZE_IDLE_DELAY, &qe_state,
+                                      colorize_idle);
+}
 
-    /* invalidate cache if needed */
-    if (s->colorize_max_valid_offset != INT_MAX) {
-        eb_get_pos(b, &line, &col, s->colorize_max_valid_offset);
-        line++;
-        if (line < s->colorize_nb_valid_lines)
-            s->colorize_nb_valid_lines = line;
-        eb_delete_properties(b, s->colorize_max_valid_offset, INT_MAX);
-        s->colorize_max_valid_offset = INT_MAX;
-    }
+/* make room for the states of lines up to 'line_num' */
+static int colorize_alloc_states(EditState *s, int line_num)
+{
+    int n;
 
-    /* realloc state array if needed */
     if ((line_num + 2) > s->colorize_nb_lines) {
         /* Reallocate colorization state buffer with pseudo-Fibonacci
          * geometric progression (ratio of 1.625)
@@ -4395,47 +4722,221 @@ static int syntax_get_colorized_line(EditState *s,
             n += (n >> 1) + (n >> 3);
         if (!qe_realloc(&s->colorize_states,
                         n * sizeof(*s->colorize_states))) {
-            return 0;
+            return -1;
         }
         s->colorize_nb_lines = n;
     }
+    return 0;
+}
+
+/* discard the states invalidated by buffer modifications.  The states
+ * of the lines after the modified area are kept to stop propagation
+ * when the recomputed states converge with them.
+ */
+static void colorize_invalidate(EditState *s)
+{
+    EditBuffer *b = s->b;
+    int line, col, nb_lines, tail_line, delta, lo, hi;
+
+    if (s->colorize_max_valid_offset != QE_OFF_MAX) {
+        eb_get_pos(b, &line, &col, s->colorize_max_valid_offset);
+        line++;
+
+        /* the lines after the unmodified tail of the buffer are shifted
+         * by 'delta' lines: their states are kept if they were known */
+        eb_get_pos(b, &nb_lines, &col, b->total_size);
+        eb_get_pos(b, &tail_line, &col,
+                   b->total_size - s->colorize_tail_size);
+        delta = nb_lines - s->colorize_old_nb_lines;
+        if (s->colorize_keep_start < s->colorize_keep_end) {
+            lo = max_int(s->colorize_keep_start, s->colorize_nb_valid_lines);
+            hi = s->colorize_keep_end;
+        } else {
+            lo = 0;
+            hi = s->colorize_nb_valid_lines;
+        }
+        lo = max_int(lo, tail_line + 1 - delta);
+        s->colorize_keep_start = s->colorize_keep_end = 0;
+        if (lo < hi && !colorize_alloc_states(s, hi + delta)) {
+            memmove(s->colorize_states + lo + delta, s->colorize_states + lo,
+                    (hi - lo) * sizeof(*s->colorize_states));
+            s->colorize_keep_start = lo + delta;
+            s->colorize_keep_end = hi + delta;
+        }
+
+        if (line < s->colorize_nb_valid_lines)
+            s->colorize_nb_valid_lines = line;
+        eb_delete_properties(b, s->colorize_max_valid_offset,
+                             b->total_size - s->colorize_tail_size);
+        s->colorize_max_valid_offset = QE_OFF_MAX;
+        /* guessed states may depend on the modified lines */
+        s->colorize_guess_line = 0;
+    }
+}
+
+/* update cctx->colorize_state with the contents of line 'line' at
+ * 'offset', return the offset of the next line.
+ */
+static qe_off_t colorize_state_line(EditState *s, QEColorizeContext *cctx,
+                                    char32_t *buf, int buf_size,
+                                    qe_off_t offset, int line)
+{
+    EditBuffer *b = s->b;
+    int len, bom;
+
+    cctx->offset = offset;
+    len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
+    if (buf[len] != '\n') {
+        /* line was truncated */
+        /* XXX: should use reallocatable buffer */
+        offset = eb_goto_pos(b, line + 1, 0);
+    }
+    buf[len] = '\0';
+
+    /* skip byte order mark if present */
+    bom = (buf[0] == 0xFEFF);
+    if (bom) {
+        cctx->offset = eb_next(b, cctx->offset);
+    }
+    s->colorize_func(cctx, buf + bom, len - bom, s->colorize_mode);
+    return offset;
+}
+
+/* store the state before line 'line', the first invalid line.  Return
+ * true if it matches the state kept from before the modification: the
+ * following kept states are then valid too.
+ */
+static int colorize_store_state(EditState *s, int line, int state)
+{
+    unsigned short st = state;
+
+    if (line >= s->colorize_keep_start && line < s->colorize_keep_end
+    &&  s->colorize_states[line] == st) {
+        s->colorize_nb_valid_lines = s->colorize_keep_end;
+        s->colorize_keep_start = s->colorize_keep_end = 0;
+        return 1;
+    }
+    s->colorize_states[line] = st;
+    s->colorize_nb_valid_lines = line + 1;
+    return 0;
+}
+
+/* propagate the colorization states up to line 'line_num'.  If
+ * 'deadline' is not 0, stop at a checkpoint if the time given by
+ * get_clock_ms() reaches it or if user input is pending.  Return the
+ * offset of line 'line_num', or -1 if stopped or out of memory.
+ */
+static qe_off_t colorize_propagate(EditState *s, char32_t *buf, int buf_size,
+                                   int line_num, int deadline)
+{
+    QEColorizeContext cctx;
+    qe_off_t offset;
+    int line;
+
+    if (colorize_alloc_states(s, line_num))
+        return -1;
+
+    if (s->colorize_nb_valid_lines == 0) {
+        s->colorize_states[0] = 0; /* initial state : zero */
+        s->colorize_nb_valid_lines = 1;
+    }
+    if (line_num < s->colorize_nb_valid_lines)
+        return eb_goto_pos(s->b, line_num, 0);
+    offset = eb_goto_pos(s->b, s->colorize_nb_valid_lines - 1, 0);
+
+    memset(&cctx, 0, sizeof(cctx));
+    cctx.s = s;
+    cctx.b = s->b;
+    cctx.colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
+    cctx.state_only = 1;
+
+    for (line = s->colorize_nb_valid_lines; line <= line_num; line++) {
+        offset = colorize_state_line(s, &cctx, buf, buf_size, offset, line - 1);
+        if (colorize_store_state(s, line, cctx.colorize_state)) {
+            if (line == line_num)
+                return offset;
+            return colorize_propagate(s, buf, buf_size, line_num, deadline);
+        }
+        if (deadline && line % COLORIZE_CHECKPOINT == 0 && line < line_num
+        &&  (get_clock_ms() - deadline >= 0 || is_user_input_pending())) {
+            /* the states are valid up to this checkpoint */
+            return -1;
+        }
+    }
+    return offset;
+}
+
+/* guess the colorization state of line 'line_num' by colorizing the
+ * preceding lines from the initial state, or from the last guess.
+ * Return the offset of line 'line_num'.
+ */
+static qe_off_t colorize_guess_state(EditState *s, QEColorizeContext *cctx,
+                                     char32_t *buf, int buf_size,
+                                     int line_num)
+{
+    qe_off_t offset;
+    int line;
+
+    line = max_int(line_num - COLORIZE_GUESS_LINES,
+                   s->colorize_nb_valid_lines - 1);
+    cctx->colorize_state = 0;
+    if (line == s->colorize_nb_valid_lines - 1)
+        cctx->colorize_state = s->colorize_states[line];
+    if (s->colorize_guess_line > line && s->colorize_guess_line <= line_num) {
+        line = s->colorize_guess_line;
+        cctx->colorize_state = s->colorize_guess_state;
+    }
+    cctx->state_only = 1;
+    offset = eb_goto_pos(s->b, line, 0);
+    for (; line < line_num; line++) {
+        offset = colorize_state_line(s, cctx, buf, buf_size, offset, line);
+    }
+    return offset;
+}
+
+/* Gets the colorized line beginning at 'offset'. Its length
+   excluding '\n' is returned.  If 'guess' is true, the state of
+   lines far from the valid states is guessed. */
+
+static int syntax_get_colorized_line(EditState *s,
+                                     char32_t *buf, int buf_size,
+                                     QETermStyle *sbuf,
+                                     qe_off_t offset, qe_off_t *offsetp,
+                                     int line_num, int guess)
+{
+    QEColorizeContext cctx;
+    EditBuffer *b = s->b;
+    int i, len, bom, guessed;
+
+    /* invalidate cache if needed */
+    colorize_invalidate(s);
+
+    /* realloc state array if needed */
+    if (colorize_alloc_states(s, line_num))
+        return 0;
 
     memset(&cctx, 0, sizeof(cctx));
     cctx.s = s;
     cctx.b = b;
 
     /* propagate state if needed */
+    guessed = 0;
     if (line_num >= s->colorize_nb_valid_lines) {
-        if (s->colorize_nb_valid_lines == 0) {
-            s->colorize_states[0] = 0; /* initial state : zero */
-            s->colorize_nb_valid_lines = 1;
-        }
-        offset = eb_goto_pos(b, s->colorize_nb_valid_lines - 1, 0);
-        cctx.colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
-        cctx.state_only = 1;
-
-        for (line = s->colorize_nb_valid_lines; line <= line_num; line++) {
-            cctx.offset = offset;
-            len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
-            if (buf[len] != '\n') {
-                /* line was truncated */
-                /* XXX: should use reallocatable buffer */
-                offset = eb_goto_pos(b, line, 0);
-            }
-            buf[len] = '\0';
-
-            /* skip byte order mark if present */
-            bom = (buf[0] == 0xFEFF);
-            if (bom) {
-                cctx.offset = eb_next(b, cctx.offset);
-            }
-            s->colorize_func(&cctx, buf + bom, len - bom, s->colorize_mode);
-            s->colorize_states[line] = cctx.colorize_state;
+        if (guess && line_num >= s->colorize_nb_valid_lines + COLORIZE_SYNC_LINES) {
+            /* let colorize_idle() compute the exact states */
+            offset = colorize_guess_state(s, &cctx, buf, buf_size, line_num);
+            guessed = 1;
+            colorize_schedule();
+        } else {
+            offset = colorize_propagate(s, buf, buf_size, line_num, 0);
+            if (offset < 0)
+                return 0;
         }
     }
+    if (!guessed)
+        cctx.colorize_state = s->colorize_states[line_num];
 
     /* compute line color */
-    cctx.colorize_state = s->colorize_states[line_num];
     cctx.state_only = 0;
     cctx.offset = offset;
     len = eb_get_line(b, buf, buf_size - 1, offset, offsetp);
@@ -4447,7 +4948,7 @@ static int syntax_get_colorized_line(EditState *s,
     buf[len] = '\0';
     if (s->offset >= offset && s->offset < *offsetp + (s->offset == s->b->total_size)) {
         /* compute cursor position */
-        int offset1 = offset;
+        qe_off_t offset1 = offset;
         for (cctx.cur_pos = 0; offset1 < s->offset; cctx.cur_pos++)
             offset1 = eb_next(b, offset1);
     }
@@ -4464,12 +4965,17 @@ static int syntax_get_colorized_line(EditState *s,
     /* buf[len] has char '\0' but may hold style, force buf ending */
     buf[len + 1] = 0;
 
-    /* XXX: if state is same as previous, minimize invalid region? */
-    s->colorize_states[line_num + 1] = cctx.colorize_state;
-
-    /* Extend valid area */
-    if (s->colorize_nb_valid_lines < line_num + 2)
-        s->colorize_nb_valid_lines = line_num + 2;
+    if (guessed) {
+        /* remember the guess for the next line and redisplay the
+         * guessed lines when the exact states are known */
+        s->colorize_guess_line = line_num + 1;
+        s->colorize_guess_state = cctx.colorize_state;
+        s->colorize_guess_max = max_int(s->colorize_guess_max, line_num + 1);
+    } else
+    if (s->colorize_nb_valid_lines < line_num + 2) {
+        /* Extend valid area */
+        colorize_store_state(s, line_num + 1, cctx.colorize_state);
+    }
 
     /* Extract styles from colored codepoint array */
     for (i = 0; i <= len + 1; i++) {
@@ -4480,9 +4986,12 @@ static int syntax_get_colorized_line(EditState *s,
     /* Combine with buffer styles on restricted range */
     if (s->b->b_styles) {
         int start = bom + cctx.combine_start, stop = bom + cctx.combine_stop;
+        QETermStyle style = 0;
+        qe_off_t style_end = 0;
         offset = cctx.offset;
         for (i = bom; i < stop; i++) {
-            QETermStyle style = eb_get_style(b, offset);
+            if (offset >= style_end)
+                style = eb_get_style_run(b, offset, &style_end);
             if (style && i >= start) {
                 sbuf[i] = style;
             }
@@ -4499,16 +5008,68 @@ static int syntax_get_colorized_line(EditState *s,
 }
 
 /* invalidate the colorize data */
-static void colorize_callback(qe__unused__ EditBuffer *b,
+static void colorize_callback(EditBuffer *b,
                               void *opaque, qe__unused__ int arg,
-                              qe__unused__ enum LogOperation op,
-                              int offset,
-                              qe__unused__ int size)
+                              enum LogOperation op,
+                              qe_off_t offset, qe_off_t size)
 {
     EditState *e = opaque;
+    int col;
+    qe_off_t tail_size;
 
+    /* called before the modification */
+    if (e->colorize_max_valid_offset == QE_OFF_MAX) {
+        /* first modification since the states were invalidated */
+        eb_get_pos(b, &e->colorize_old_nb_lines, &col, b->total_size);
+        e->colorize_tail_size = b->total_size;
+    }
     if (offset < e->colorize_max_valid_offset)
         e->colorize_max_valid_offset = offset;
+    /* the bytes after the modified range are not modified */
+    tail_size = b->total_size - offset;
+    if (op != LOGOP_INSERT)
+        tail_size -= size;
+    if (tail_size < e->colorize_tail_size)
+        e->colorize_tail_size = tail_size;
+    colorize_schedule();
+}
+
+/* timer callback: propagate the colorization states of all windows
+ * to the end of their buffers, in slices interrupted by user input.
+ */
+static void colorize_idle(void *opaque)
+{
+    QEmacsState *qs = opaque;
+    char32_t buf[COLORED_MAX_LINE_SIZE];
+    EditState *s;
+    int deadline, nb_lines, col, more;
+
+    /* the timer is freed upon return */
+    colorize_timer = NULL;
+    deadline = get_clock_ms() + COLORIZE_IDLE_SLICE;
+    more = 0;
+    for (s = qs->first_window; s != NULL; s = s->next_window) {
+        if (!s->colorize_func)
+            continue;
+        colorize_invalidate(s);
+        eb_get_pos(s->b, &nb_lines, &col, s->b->total_size);
+        if (s->colorize_nb_valid_lines <= nb_lines
+        &&  colorize_propagate(s, buf, countof(buf), nb_lines, deadline) < 0) {
+            more = 1;
+        }
+        if (s->colorize_guess_max
+        &&  s->colorize_nb_valid_lines >= s->colorize_guess_max) {
+            /* the guessed lines can now be colorized exactly: the
+               window must be redisplayed even if inactive */
+            s->colorize_guess_max = 0;
+            s->display_dirty = 1;
+            url_redisplay();
+        }
+        if (more)
+            break;
+    }
+    if (more)
+        colorize_timer = qe_add_timer(0, qs, colorize_idle);
 }
 
 #endif /* CONFIG_TINY */
@@ -4523,22 +5084,28 @@ void set_colorize_func(EditState *s, ColorizeFunc colorize_func, ModeDef *colori
     qe_free(&s->colorize_states);
     s->colorize_nb_lines = 0;
     s->colorize_nb_valid_lines = 0;
-    s->colorize_max_valid_offset = INT_MAX;
+    s->colorize_max_valid_offset = QE_OFF_MAX;
+    s->colorize_guess_line = 0;
+    s->colorize_guess_max = 0;
+    s->colorize_keep_start = s->colorize_keep_end = 0;
     s->colorize_func = colorize_func;
     s->colorize_mode = colorize_mode;
-    if (colorize_func)
+    if (colorize_func) {
         eb_add_callback(s->b, colorize_callback, s, 0);
+        colorize_schedule();
+    }
 #endif
 }
 
-int get_colorized_line(EditState *s, char32_t *buf, int buf_size,
-                       QETermStyle *sbuf,
-                       int offset, int *offsetp, int line_num)
+static int get_colorized_line1(EditState *s, char32_t *buf, int buf_size,
+                               QETermStyle *sbuf,
+                               qe_off_t offset, qe_off_t *offsetp,
+                               int line_num, qe__unused__ int guess)
 {
 #ifndef CONFIG_TINY
     if (s->colorize_func) {
         return syntax_get_colorized_line(s, buf, buf_size, sbuf,
-                                         offset, offsetp, line_num);
+                                         offset, offsetp, line_num, guess);
     } else
 #endif
     if (s->b->b_styles) {
@@ -4560,52 +5127,773 @@ int get_colorized_line(EditState *s, char32_t *buf, int buf_size,
     }
 }
 
-#define RLE_EMBEDDINGS_SIZE    128
-
-/* Display one line in the window */
-int text_display_line(EditState *s, DisplayState *ds, int offset)
+int get_colorized_line(EditState *s, char32_t *buf, int buf_size,
+                       QETermStyle *sbuf,
+                       qe_off_t offset, qe_off_t *offsetp, int line_num)
 {
-    char32_t c;
-    int offset0, offset1, line_num, col_num;
-    BidirTypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
-    int embedding_level, embedding_max_level;
-    BidirCharType base;
-    char32_t buf[COLORED_MAX_LINE_SIZE];
-    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
-    int char_index, colored_nb_chars;
+    return get_colorized_line1(s, buf, buf_size, sbuf,
+                               offset, offsetp, line_num, 0);
+}
 
-    line_num = 0;
-    /* XXX: should test a flag, to avoid this call in hex/binary */
-    if (ds->line_numbers || s->colorize_func) {
-        eb_get_pos(s->b, &line_num, &col_num, offset);
-    }
+/* test if char 'c' is displayed as a hex escape sequence */
+static int text_char_is_hex(EditState *s, char32_t c)
+{
+    return (c >= 128
+        &&  (s->qe_state->show_unicode == 1 ||
+             c == 0xfeff ||   /* Display BOM as \uFEFF to make it explicit */
+             c > MAX_UNICODE_DISPLAY ||
+             (c < 160 && s->b->charset == &charset_raw)));
+}
 
-    offset1 = offset;
+static const char *text_char_hex_format(char32_t c)
+{
+    if (c > 0xffff)
+        return "\\U%08x";
+    if (c > 0xff)
+        return "\\u%04x";
+    return "\\x%02x";
+}
 
-#ifdef CONFIG_UNICODE_JOIN
-    /* compute the embedding levels and rle encode them */
-    if (s->bidir
-    &&  bidir_compute_attributes(embeds, RLE_EMBEDDINGS_SIZE,
-                                 s->b, offset) > 2)
-    {
-        base = BIDIR_TYPE_WL;
-        bidir_analyze_string(embeds, &base, &embedding_max_level);
-        /* assure that base has only two possible values */
-        if (base != BIDIR_TYPE_RTL)
-            base = BIDIR_TYPE_LTR;
+/* display char 'c' read from 'offset0' to 'offset' */
+static void text_display_char(EditState *s, DisplayState *ds,
+                              qe_off_t offset0, qe_off_t offset,
+                              int embedding_level, char32_t c)
+{
+    /* XXX: use embedding level for all cases ? */
+    /* CG: should query screen or window about display methods */
+    if ((c < ' ' && (c != '\t' || (s->flags & WF_MINIBUF))) || c == 127) {
+        /* EOL_MAC encoding swaps \r and \n to simplify end of line
+           handling in many places. We must handle '\r' explicitly for
+           it to be displayed as ^J
+         */
+        if (c == '\r' && s->b->eol_type == EOL_MAC)
+            c = '\n';
+        display_printf(ds, offset0, offset, "^%c", ('@' + c) & 127);
     } else
-#endif
-    {
-        /* all line is at embedding level 0 */
-        embedding_max_level = 0;
-        embeds[1].level = 0;
-        embeds[2].pos = 0x7fffffff;
-        base = BIDIR_TYPE_LTR;
+    if (text_char_is_hex(s, c)) {
+        /* display unsupported unicode code points as hex */
+        display_printf(ds, offset0, offset, text_char_hex_format(c), c);
+    } else {
+        display_char_bidir(ds, offset0, offset, embedding_level, c);
     }
+}
 
-    display_bol_bidir(ds, base, embedding_max_level);
+/* Very long lines displayed in truncate mode are only laid out from
+ * the step before the first visible column and around the cursor.
+ * The steps of LONG_LINE_STEP chars are measured once up to the
+ * displayed columns, with the colorization state before each step, so
+ * that a step can be colorized by itself.  The colorizers see the
+ * steps as separate lines: constructs spanning a step boundary may be
+ * colored differently.  The bidirectional algorithm is not applied.
+ * In line wrap mode, the rows are broken by the measure itself and
+ * the steps start on a row: all the rows of the line are measured
+ * once, to know its height, and only the steps holding the visible
+ * rows and the rows around the cursor are laid out.
+ */
+#define LONG_LINE_MIN_SIZE  COLORED_MAX_LINE_SIZE  /* in bytes */
+#define LONG_LINE_STEP      1024    /* chars per step */
+#define LONG_LINE_MIN_STEPS 64      /* initial size of the step array */
+
+/* update the long line steps before a buffer modification: the steps
+   after the modified offset are dropped */
+static void long_line_callback(qe__unused__ EditBuffer *b, void *opaque,
+                               qe__unused__ int arg, enum LogOperation op,
+                               qe_off_t offset, qe_off_t size)
+{
+    QELongLineCache *lc = opaque;
+    QELongLine *ll;
+    int i, n;
 
-    /* line numbers */
+    for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+        ll = &lc->lines[i];
+        if (ll->offset < 0)
+            continue;
+        if (op == LOGOP_INSERT && offset < ll->offset) {
+            ll->offset += size;
+            ll->end += size;
+        } else
+        if (op == LOGOP_DELETE && offset + size <= ll->offset) {
+            ll->offset -= size;
+            ll->end -= size;
+        } else
+        if (offset < ll->offset) {
+            ll->offset = -1;
+        } else
+        if (offset <= ll->end) {
+            /* the steps up to the modified offset are unchanged */
+            for (n = ll->nb_steps;
+                 n > 1 && ll->offset + ll->steps[n - 1].offset > offset;
+                 n--)
+                continue;
+            ll->nb_steps = n;
+        }
+    }
+}
+
+static void long_line_flush(QELongLineCache *lc)
+{
+    int i;
+
+    for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+        lc->lines[i].offset = -1;
+    }
+}
+
+static void long_line_free(EditState *s)
+{
+    QELongLineCache *lc = s->long_lines;
+    int i;
+
+    if (lc) {
+        eb_free_callback(s->b, long_line_callback, lc);
+        for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+            qe_free(&lc->lines[i].steps);
+        }
+        qe_free(&s->long_lines);
+    }
+}
+
+/* find or allocate the steps of the long line from 'offset' to 'end',
+   return NULL if out of memory */
+static QELongLine *long_line_get(EditState *s, DisplayState *ds,
+                                 qe_off_t offset, qe_off_t end)
+{
+    QELongLineCache *lc = s->long_lines;
+    QELongLine *ll;
+    int i, wrap_width;
+
+    if (!lc) {
+        lc = qe_mallocz(QELongLineCache);
+        if (!lc)
+            return NULL;
+        long_line_flush(lc);
+        eb_add_callback(s->b, long_line_callback, lc, 0);
+        s->long_lines = lc;
+    }
+    /* the widths depend on these settings, the rows on the width */
+    wrap_width = (ds->wrap == WRAP_TRUNCATE) ? 0 : ds->width - ds->x_disp;
+    if (lc->charset != s->b->charset || lc->eol_type != s->b->eol_type
+    ||  lc->tab_width != ds->tab_width
+    ||  lc->show_unicode != s->qe_state->show_unicode
+    ||  lc->wrap_width != wrap_width) {
+        long_line_flush(lc);
+        lc->charset = s->b->charset;
+        lc->eol_type = s->b->eol_type;
+        lc->tab_width = ds->tab_width;
+        lc->show_unicode = s->qe_state->show_unicode;
+        lc->wrap_width = wrap_width;
+    }
+    lc->stamp++;
+
+    for (i = 0; i < LONG_LINE_CACHE_SIZE; i++) {
+        if (lc->lines[i].offset == offset)
+            break;
+    }
+    if (i < LONG_LINE_CACHE_SIZE) {
+        ll = &lc->lines[i];
+    } else {
+        /* replace the least recently used line */
+        ll = &lc->lines[0];
+        for (i = 1; i < LONG_LINE_CACHE_SIZE && ll->offset >= 0; i++) {
+            if (lc->lines[i].offset < 0
+            ||  lc->lines[i].stamp - ll->stamp < 0)
+                ll = &lc->lines[i];
+        }
+        if (!ll->steps) {
+            if (!qe_realloc(&ll->steps,
+                            LONG_LINE_MIN_STEPS * sizeof(*ll->steps)))
+                return NULL;
+            ll->alloc_steps = LONG_LINE_MIN_STEPS;
+        }
+        ll->offset = offset;
+        ll->nb_steps = 1;
+        ll->steps[0].offset = 0;
+        ll->steps[0].x = -1;    /* set by long_line_start() */
+        ll->steps[0].row = 0;
+        ll->steps[0].state = 0;
+    }
+    ll->stamp = lc->stamp;
+    ll->end = end;
+    while (ll->nb_steps > 1
+    &&     offset + ll->steps[ll->nb_steps - 1].offset > end) {
+        ll->nb_steps--;
+    }
+    return ll;
+}
+
+/* get the colorization state before line 'line_num' */
+static int long_line_state(EditState *s, char32_t *buf, int line_num)
+{
+    int state = 0;
+
+#ifndef CONFIG_TINY
+    if (s->colorize_func) {
+        colorize_invalidate(s);
+        if (line_num >= s->colorize_nb_valid_lines
+        &&  line_num < s->colorize_nb_valid_lines + COLORIZE_SYNC_LINES) {
+            colorize_propagate(s, buf, COLORED_MAX_LINE_SIZE, line_num, 0);
+        }
+        if (line_num < s->colorize_nb_valid_lines) {
+            state = s->colorize_states[line_num];
+        } else {
+            /* redisplay when colorize_idle() reaches the line */
+            s->colorize_guess_max = max_int(s->colorize_guess_max,
+                                            line_num + 1);
+            colorize_schedule();
+        }
+    }
+#endif
+    return state;
+}
+
+/* width of char 'c' displayed by text_display_char() at position 'x' */
+static int long_line_char_width(EditState *s, DisplayState *ds,
+                                QEFont *font, char32_t c, int x)
+{
+    QECharMetrics metrics;
+    char32_t cbuf[12];
+    char hbuf[12];
+    int i, n, w;
+
+    if (c == '\t')
+        return ds->tab_width - x % ds->tab_width;
+
+    n = 0;
+    if (c < ' ' || c == 127) {
+        if (c == '\r' && s->b->eol_type == EOL_MAC)
+            c = '\n';
+        cbuf[n++] = '^';
+        cbuf[n++] = ('@' + c) & 127;
+    } else
+    if (text_char_is_hex(s, c)) {
+        snprintf(hbuf, sizeof(hbuf), text_char_hex_format(c), c);
+        for (i = 0; hbuf[i]; i++)
+            cbuf[n++] = hbuf[i];
+    } else {
+        cbuf[n++] = c;
+    }
+    w = 0;
+    for (i = 0; i < n; i++) {
+        text_metrics(s->screen, font, &metrics, &cbuf[i], 1);
+        w += metrics.width;
+    }
+    return w;
+}
+
+/* measure the steps of 'll' until the last one is at or beyond 'x_max'
+   and beyond 'offset_max', or at the end of the line */
+static void long_line_measure(EditState *s, DisplayState *ds,
+                              QELongLine *ll, char32_t *buf,
+                              int x_max, qe_off_t offset_max)
+{
+    QEditScreen *screen = s->screen;
+    QELongLineStep *st;
+    QEStyleDef style;
+    QEFont *font;
+    int n, len, max_len, x, w, x_wrap, row;
+    qe_off_t offset, next;
+    char32_t c;
+
+    max_len = LONG_LINE_STEP;
+    x_wrap = INT_MAX;
+    if (ds->wrap != WRAP_TRUNCATE) {
+        /* steps start on a row, unless the rows are very long */
+        max_len = 2 * LONG_LINE_STEP;
+        x_wrap = ds->width - ds->x_disp;
+    }
+    get_style(s, &style, QE_STYLE_DEFAULT);
+    font = select_font(screen, style.font_style, style.font_size);
+    for (;;) {
+        st = &ll->steps[ll->nb_steps - 1];
+        offset = ll->offset + st->offset;
+        if (offset >= ll->end
+        ||  (ll->nb_steps > 1 && st->x >= x_max && offset > offset_max))
+            break;
+        if (ll->nb_steps >= ll->alloc_steps) {
+            n = ll->alloc_steps * 2;
+            if (!qe_realloc(&ll->steps, n * sizeof(*ll->steps)))
+                break;
+            ll->alloc_steps = n;
+            st = &ll->steps[ll->nb_steps - 1];
+        }
+        x = st->x;
+        row = st->row;
+        for (len = 0; len < max_len && offset < ll->end; len++) {
+            c = eb_nextc(s->b, offset, &next);
+            /* XXX: the styles may use other fonts */
+            w = long_line_char_width(s, ds, font, c, x);
+            if (x + w > x_wrap && x > ds->line_numbers) {
+                /* the char starts a new row, as in flush_fragment(),
+                   and keeps its width: a tab cannot start a step */
+                row++;
+                x = ds->line_numbers;
+                if (len >= LONG_LINE_STEP && c != '\t')
+                    break;
+            }
+            buf[len] = c;
+            x += w;
+            offset = next;
+        }
+        buf[len] = '\0';
+        st[1].offset = offset - ll->offset;
+        st[1].x = x;
+        st[1].row = row;
+        st[1].state = st->state;
+#ifndef CONFIG_TINY
+        if (s->colorize_func) {
+            QEColorizeContext cctx;
+
+            memset(&cctx, 0, sizeof(cctx));
+            cctx.s = s;
+            cctx.b = s->b;
+            cctx.offset = ll->offset + st->offset;
+            cctx.colorize_state = st->state;
+            cctx.state_only = 1;
+            cctx.cur_pos = -1;
+            s->colorize_func(&cctx, buf, len, s->colorize_mode);
+            st[1].state = cctx.colorize_state;
+        }
+#endif
+        ll->nb_steps++;
+    }
+    release_font(screen, font);
+}
+
+/* get the chars of step 'k' of 'll' and their styles, return the
+   number of chars */
+static int long_line_colorize(EditState *s, QELongLine *ll, int k,
+                              char32_t *buf, QETermStyle *sbuf)
+{
+    EditBuffer *b = s->b;
+    int i, len, start, stop;
+    qe_off_t offset, offset1, stop_offset;
+
+    offset = offset1 = ll->offset + ll->steps[k].offset;
+    stop_offset = ll->offset + ll->steps[k + 1].offset;
+    for (len = 0; offset1 < stop_offset; len++) {
+        buf[len] = eb_nextc(b, offset1, &offset1);
+    }
+    buf[len] = buf[len + 1] = '\0';
+    memset(sbuf, 0, (len + 1) * sizeof(*sbuf));
+    start = 0;
+    stop = len;
+
+#ifndef CONFIG_TINY
+    if (s->colorize_func) {
+        QEColorizeContext cctx;
+
+        memset(&cctx, 0, sizeof(cctx));
+        cctx.s = s;
+        cctx.b = b;
+        cctx.offset = offset;
+        cctx.colorize_state = ll->steps[k].state;
+        cctx.combine_stop = len;
+        cctx.cur_pos = -1;
+        if (s->offset >= offset && s->offset <= stop_offset) {
+            for (cctx.cur_pos = 0, offset1 = offset; offset1 < s->offset;
+                 cctx.cur_pos++)
+                offset1 = eb_next(b, offset1);
+        }
+        s->colorize_func(&cctx, buf, len, s->colorize_mode);
+        for (i = 0; i <= len; i++) {
+            sbuf[i] = buf[i] >> STYLE_SHIFT;
+            buf[i] &= CHAR_MASK;
+        }
+        start = cctx.combine_start;
+        stop = cctx.combine_stop;
+        if (stop_offset >= ll->end
+        &&  !(s->colorize_mode->flags & MODEF_NO_TRAILING_BLANKS)) {
+            /* Mark trailing blanks as errors if cursor is not at end of line */
+            for (i = len; i > 0 && qe_isblank(buf[i - 1]) && i != cctx.cur_pos; i--) {
+                sbuf[i - 1] = QE_STYLE_BLANK_HILITE;
+            }
+        }
+    }
+#endif
+    /* Combine with buffer styles on restricted range */
+    if (b->b_styles) {
+        QETermStyle style = 0;
+        qe_off_t style_end = 0;
+
+        for (i = 0, offset1 = offset; i < stop; i++) {
+            if (offset1 >= style_end)
+                style = eb_get_style_run(b, offset1, &style_end);
+            if (style && i >= start) {
+                sbuf[i] = style;
+            }
+            offset1 = eb_next(b, offset1);
+        }
+    }
+    if (s->isearch_state) {
+        isearch_colorize_matches(s, buf, len, sbuf, offset);
+    }
+    /* colorize the region or the current line as text_display_line() */
+    if (s->region_style && !s->curline_style) {
+        qe_off_t start_offset, end_offset;
+
+        if (b->mark < s->offset) {
+            start_offset = max_offset(offset, b->mark);
+            end_offset = min_offset(stop_offset, s->offset);
+        } else {
+            start_offset = max_offset(offset, s->offset);
+            end_offset = min_offset(stop_offset, b->mark);
+        }
+        for (i = 0, offset1 = offset; i < len && offset1 < end_offset; i++) {
+            if (offset1 >= start_offset)
+                sbuf[i] = s->region_style;
+            offset1 = eb_next(b, offset1);
+        }
+    } else
+    if (s->curline_style && s->offset >= ll->offset && s->offset <= ll->end) {
+        for (i = 0; i < len; i++)
+            sbuf[i] = s->curline_style;
+    }
+    return len;
+}
+
+/* flush the pending fragments and move the layout to position 'x' */
+static void display_move_to(DisplayState *ds, int x)
+{
+    flush_fragment(ds);
+    if (ds->nb_fragments) {
+        flush_line(ds, ds->fragments, ds->nb_fragments, -1, -1, -1);
+        ds->nb_fragments = 0;
+        ds->line_index = 0;
+        ds->word_index = 0;
+    }
+    ds->x = ds->x_line = x;
+}
+
+/* find the last step of 'll' before step 'n' at or before position 'x'
+   if 'offset' is negative, or at or before 'offset' otherwise */
+static int long_line_find_step(QELongLine *ll, int n, int x, qe_off_t offset)
+{
+    int lo = 0, hi = n, k;
+
+    while (hi - lo > 1) {
+        k = (lo + hi) / 2;
+        if (offset < 0 ? ll->steps[k].x <= x :
+            ll->offset + ll->steps[k].offset <= offset)
+            lo = k;
+        else
+            hi = k;
+    }
+    return lo;
+}
+
+/* find the last step of 'll' before step 'n' starting at or before
+   row 'row' */
+static int long_line_find_row(QELongLine *ll, int n, int row)
+{
+    int lo = 0, hi = n, k;
+
+    while (hi - lo > 1) {
+        k = (lo + hi) / 2;
+        if (ll->steps[k].row <= row)
+            lo = k;
+        else
+            hi = k;
+    }
+    return lo;
+}
+
+/* check the first step of 'll' and return the cursor offset if 'ds'
+   looks for it in the line, -1 otherwise */
+static qe_off_t long_line_start(EditState *s, DisplayState *ds,
+                                QELongLine *ll, char32_t *buf, int line_num)
+{
+    int x0, state;
+
+    /* the first step depends on the line number column and the
+       colorization of the previous lines */
+    flush_fragment(ds);
+    x0 = ds->x - ds->x_disp;
+    state = long_line_state(s, buf, line_num);
+    if (ll->steps[0].x != x0 || ll->steps[0].state != state) {
+        ll->nb_steps = 1;
+        ll->steps[0].x = x0;
+        ll->steps[0].state = state;
+    }
+    if (ds->cursor_func && s->offset >= ll->offset && s->offset <= ll->end)
+        return s->offset;
+    return -1;
+}
+
+/* Display the long line 'll' starting at the current position of 'ds'
+   and followed by the line at 'next'.  Only the steps that contain the
+   visible columns and the cursor, if 'ds' looks for it, are laid out. */
+static qe_off_t text_display_long_line(EditState *s, DisplayState *ds,
+                                       QELongLine *ll, int line_num,
+                                       qe_off_t next)
+{
+    char32_t buf[COLORED_MAX_LINE_SIZE];
+    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    int spans[2][2], nb_spans, i, j, k, n, len, x0, x1;
+    qe_off_t offset, offset0, offsetc;
+    char32_t c;
+
+    offsetc = long_line_start(s, ds, ll, buf, line_num);
+
+    /* visible columns and cursor */
+    x0 = -ds->x_disp;
+    x1 = x0 + ds->width + ds->eol_width;
+    long_line_measure(s, ds, ll, buf, x1, offsetc);
+    n = ll->nb_steps - 1;
+    if (n <= 0) {
+        /* out of memory */
+        display_eol(ds, -1, -1);
+        return ll->end >= s->b->total_size ? -1 : next;
+    }
+
+    spans[0][0] = long_line_find_step(ll, n, x0, -1);
+    for (k = spans[0][0] + 1; k < n && ll->steps[k].x < x1; k++)
+        continue;
+    spans[0][1] = k;
+    nb_spans = 1;
+    if (offsetc >= 0) {
+        k = long_line_find_step(ll, n, 0, offsetc);
+        if (k + 1 < spans[0][0]) {
+            spans[1][0] = spans[0][0];
+            spans[1][1] = spans[0][1];
+            spans[0][0] = k;
+            spans[0][1] = k + 1;
+            nb_spans = 2;
+        } else
+        if (k > spans[0][1]) {
+            spans[1][0] = k;
+            spans[1][1] = k + 1;
+            nb_spans = 2;
+        } else {
+            spans[0][0] = min_int(spans[0][0], k);
+            spans[0][1] = max_int(spans[0][1], k + 1);
+        }
+    }
+
+    offset = ll->offset;
+    for (i = 0; i < nb_spans; i++) {
+        k = spans[i][0];
+        if (offset != ll->offset + ll->steps[k].offset)
+            display_move_to(ds, ds->x_disp + ll->steps[k].x);
+        for (; k < spans[i][1]; k++) {
+            len = long_line_colorize(s, ll, k, buf, sbuf);
+            offset = ll->offset + ll->steps[k].offset;
+            for (j = 0; j < len; j++) {
+                offset0 = offset;
+                c = eb_nextc(s->b, offset, &offset);
+                ds->style = sbuf[j];
+                text_display_char(s, ds, offset0, offset, 0, c);
+            }
+        }
+    }
+    if (offset < ll->end) {
+        /* the end of line is not displayed */
+        display_eol(ds, -1, -1);
+    } else
+    if (offset >= s->b->total_size) {
+        display_eol(ds, offset, offset + 1);
+        return -1;
+    } else {
+        display_eol(ds, offset, next);
+    }
+    return ll->end >= s->b->total_size ? -1 : next;
+}
+
+/* flush the pending fragments as a row continued on the next row */
+static void display_wrap_row(DisplayState *ds)
+{
+    flush_fragment(ds);
+    flush_line(ds, ds->fragments, ds->nb_fragments, -1, -1, 0);
+    ds->nb_fragments = 0;
+    ds->line_index = 0;
+    ds->word_index = 0;
+    /* skip line number column if present */
+    ds->left_gutter = ds->line_numbers;
+    ds->x = ds->x_line += ds->left_gutter;
+}
+
+/* Display the long line 'll' in line wrap mode, starting at the
+   current position of 'ds' and followed by the line at 'next'.  Only
+   the steps that contain the visible rows and the rows around the
+   cursor, if 'ds' looks for it, are laid out: the other rows are
+   skipped with their measured height. */
+static qe_off_t text_display_long_rows(EditState *s, DisplayState *ds,
+                                       QELongLine *ll, int line_num,
+                                       qe_off_t next)
+{
+    char32_t buf[COLORED_MAX_LINE_SIZE];
+    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    int spans[2][2], nb_spans, i, j, k, n, len;
+    int y0, line_num0, lh, nb_rows, row0, row1;
+    qe_off_t offset, offset0, offsetc;
+    char32_t c;
+
+    offsetc = long_line_start(s, ds, ll, buf, line_num);
+
+    /* the height of the line is needed: measure all its rows */
+    long_line_measure(s, ds, ll, buf, INT_MAX, -1);
+    n = ll->nb_steps - 1;
+    if (n <= 0 || ll->offset + ll->steps[n].offset < ll->end) {
+        /* out of memory */
+        display_eol(ds, -1, -1);
+        return ll->end >= s->b->total_size ? -1 : next;
+    }
+
+    /* XXX: the rows are assumed to have the default height */
+    y0 = ds->y;
+    line_num0 = ds->line_num;
+    lh = ds->default_line_height;
+    nb_rows = ll->steps[n].row + 1;
+    row0 = clamp_int(-y0 / lh, 0, nb_rows);
+    row1 = clamp_int((ds->height - y0 + lh - 1) / lh, 0, nb_rows);
+    nb_spans = 0;
+    if (row0 < row1) {
+        spans[0][0] = long_line_find_row(ll, n, row0);
+        for (k = spans[0][0] + 1; k < n && ll->steps[k].row < row1; k++)
+            continue;
+        spans[0][1] = k;
+        nb_spans = 1;
+    }
+    if (offsetc >= 0) {
+        /* the cursor row and the rows above and below it */
+        k = long_line_find_step(ll, n, 0, offsetc);
+        spans[nb_spans][0] = max_int(k - 1, 0);
+        spans[nb_spans][1] = min_int(k + 2, n);
+        if (nb_spans && spans[1][1] < spans[0][0]) {
+            k = spans[0][0];
+            spans[0][0] = spans[1][0];
+            spans[1][0] = k;
+            k = spans[0][1];
+            spans[0][1] = spans[1][1];
+            spans[1][1] = k;
+        }
+        nb_spans++;
+        if (nb_spans == 2 && spans[1][0] <= spans[0][1]) {
+            spans[0][0] = min_int(spans[0][0], spans[1][0]);
+            spans[0][1] = max_int(spans[0][1], spans[1][1]);
+            nb_spans = 1;
+        }
+    }
+
+    /* flush_fragment() breaks the rows where long_line_measure() did */
+    offset = ll->offset;
+    k = 0;
+    for (i = 0; i < nb_spans; i++) {
+        if (k != spans[i][0]) {
+            /* skip the rows before the span */
+            k = spans[i][0];
+            flush_fragment(ds);
+            ds->nb_fragments = 0;
+            ds->line_index = 0;
+            ds->word_index = 0;
+            ds->y = y0 + ll->steps[k].row * lh;
+            ds->line_num = line_num0 + ll->steps[k].row;
+            ds->left_gutter = ll->steps[k].row ? ds->line_numbers : 0;
+            ds->x = ds->x_line = ds->x_disp + ll->steps[k].x;
+        }
+        for (; k < spans[i][1]; k++) {
+            len = long_line_colorize(s, ll, k, buf, sbuf);
+            offset = ll->offset + ll->steps[k].offset;
+            for (j = 0; j < len; j++) {
+                offset0 = offset;
+                c = eb_nextc(s->b, offset, &offset);
+                ds->style = sbuf[j];
+                text_display_char(s, ds, offset0, offset, 0, c);
+            }
+        }
+        if (k < n) {
+            /* the next step starts a row */
+            display_wrap_row(ds);
+        }
+    }
+
+    if (k < n) {
+        /* skip the rows after the last span */
+        ds->nb_fragments = 0;
+        ds->line_index = 0;
+        ds->word_index = 0;
+        ds->fragment_index = 0;
+        ds->y = y0 + nb_rows * lh;
+        ds->line_num = line_num0 + nb_rows;
+        ds->x = ds->x_line = ds->x_start;
+        ds->left_gutter = 0;
+    } else
+    if (offset >= s->b->total_size) {
+        display_eol(ds, offset, offset + 1);
+        return -1;
+    } else {
+        display_eol(ds, offset, next);
+    }
+    return ll->end >= s->b->total_size ? -1 : next;
+}
+
+#define RLE_EMBEDDINGS_SIZE    128
+
+/* Display one line in the window */
+qe_off_t text_display_line(EditState *s, DisplayState *ds, qe_off_t offset)
+{
+    char32_t c;
+    qe_off_t offset0, offset1, next;
+    int line_num, col_num;
+    BidirTypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
+    int embedding_level, embedding_max_level;
+    BidirCharType base;
+    char32_t buf[COLORED_MAX_LINE_SIZE];
+    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    int char_index, colored_nb_chars;
+    QELongLine *ll;
+    int long_lines;
+
+    /* the rows of long lines are broken by long_line_measure() in line
+       wrap mode, not at word boundaries */
+    long_lines = (ds->wrap == WRAP_TRUNCATE || ds->wrap == WRAP_LINE ||
+                  ds->wrap == WRAP_TERM) &&
+        !(s->flags & WF_MINIBUF) && s->mode != &list_mode;
+
+    line_num = 0;
+    /* XXX: should test a flag, to avoid this call in hex/binary */
+    if (ds->line_numbers || s->colorize_func || long_lines) {
+        eb_get_pos(s->b, &line_num, &col_num, offset);
+    }
+
+    /* find the end of long lines from the page index */
+    ll = NULL;
+    next = -1;
+    if (long_lines) {
+        next = eb_goto_pos(s->b, line_num + 1, 0);
+        if (next - offset >= LONG_LINE_MIN_SIZE) {
+            qe_off_t end;
+            if (eb_prevc(s->b, next, &end) != '\n')
+                end = next;
+            ll = long_line_get(s, ds, offset, end);
+        }
+    }
+
+    offset1 = offset;
+
+#ifdef CONFIG_UNICODE_JOIN
+    /* compute the embedding levels and rle encode them */
+    if (s->bidir && !ll
+    &&  bidir_compute_attributes(embeds, RLE_EMBEDDINGS_SIZE,
+                                 s->b, offset) > 2)
+    {
+        base = BIDIR_TYPE_WL;
+        bidir_analyze_string(embeds, &base, &embedding_max_level);
+        /* assure that base has only two possible values */
+        if (base != BIDIR_TYPE_RTL)
+            base = BIDIR_TYPE_LTR;
+    } else
+#endif
+    {
+        /* all line is at embedding level 0 */
+        embedding_max_level = 0;
+        embeds[1].level = 0;
+        embeds[2].pos = 0x7fffffff;
+        base = BIDIR_TYPE_LTR;
+    }
+
+    display_bol_bidir(ds, base, embedding_max_level);
+
+    /* line numbers */
     if (ds->line_numbers) {
         // XXX: line_numbers should be the number of characters to use
         ds->style = QE_STYLE_GUTTER;
@@ -4622,6 +5910,17 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
         }
     }
 
+    if (ll) {
+        if (ds->layout_rec) {
+            /* the layout depends on the cursor and the visible columns */
+            layout_record_stop(ds);
+        }
+        if (ds->wrap == WRAP_TRUNCATE)
+            return text_display_long_line(s, ds, ll, line_num, next);
+        else
+            return text_display_long_rows(s, ds, ll, line_num, next);
+    }
+
     /* colorize */
     colored_nb_chars = 0;
     offset0 = offset;
@@ -4629,8 +5928,10 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     ||  s->curline_style || s->region_style
     ||  s->isearch_state) {
         /* XXX: deal with truncation */
-        colored_nb_chars = get_colorized_line(s, buf, countof(buf), sbuf,
-                                              offset, &offset0, line_num);
+        /* the display may guess the colors of lines far from the
+         * colorized area until idle colorization reaches them */
+        colored_nb_chars = get_colorized_line1(s, buf, countof(buf), sbuf,
+                                               offset, &offset0, line_num, 1);
         if (s->mode == &list_mode) {
             QEmacsState *qs = s->qe_state;
             int i;
@@ -4660,8 +5961,8 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     if (s->curline_style || s->region_style) {
         /* CG: Should combine styles instead of replacing */
         if (s->region_style && !s->curline_style) {
-            int line, start_offset, end_offset;
-            int i, start_char, end_char;
+            qe_off_t start_offset, end_offset;
+            int line, i, start_char, end_char;
 
             if (s->b->mark < s->offset) {
                 start_offset = max_offset(offset, s->b->mark);
@@ -4714,37 +6015,10 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
                 break;
             }
             /* compute embedding from RLE embedding list */
-            if (offset0 >= bd[1].pos)
+            if (offset0 - offset1 >= bd[1].pos)
                 bd++;
             embedding_level = bd[0].level;
-            /* XXX: use embedding level for all cases ? */
-            /* CG: should query screen or window about display methods */
-            if ((c < ' ' && (c != '\t' || (s->flags & WF_MINIBUF))) || c == 127) {
-                /* EOL_MAC encoding swaps \r and \n to simplify end of line
-                   handling in many places. We must handle '\r' explicitly for
-                   it to be displayed as ^J
-                 */
-                if (c == '\r' && s->b->eol_type == EOL_MAC)
-                    c = '\n';
-                display_printf(ds, offset0, offset, "^%c", ('@' + c) & 127);
-            } else
-            if (c >= 128
-            &&  (s->qe_state->show_unicode == 1 ||
-                 c == 0xfeff ||   /* Display BOM as \uFEFF to make it explicit */
-                 c > MAX_UNICODE_DISPLAY ||
-                 (c < 160 && s->b->charset == &charset_raw))) {
-                /* display unsupported unicode code points as hex */
-                if (c > 0xffff) {
-                    display_printf(ds, offset0, offset, "\\U%08x", c);
-                } else
-                if (c > 0xff) {
-                    display_printf(ds, offset0, offset, "\\u%04x", c);
-                } else {
-                    display_printf(ds, offset0, offset, "\\x%02x", c);
-                }
-            } else {
-                display_char_bidir(ds, offset0, offset, embedding_level, c);
-            }
+            text_display_char(s, ds, offset0, offset, embedding_level, c);
             char_index++;
             //if (ds->y >= s->height && ds->eod)  //@@@ causes bug
             //    break;
@@ -4753,12 +6027,302 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
     return offset;
 }
 
+/* update the cached layouts before a buffer modification: the lines
+   after the modified range are moved, the lines it touches dropped */
+static void layout_callback(qe__unused__ EditBuffer *b, void *opaque,
+                            qe__unused__ int arg, enum LogOperation op,
+                            qe_off_t offset, qe_off_t size)
+{
+    QELayoutCache *lc = opaque;
+    QELineLayout *ll;
+    qe_off_t end;
+    int i;
+
+    for (i = 0; i < lc->nb_entries; i++) {
+        ll = &lc->entries[i];
+        if (ll->offset < 0)
+            continue;
+        /* the last line also changes if text is appended */
+        end = ll->end + (ll->next < 0);
+        switch (op) {
+        case LOGOP_INSERT:
+            if (offset <= ll->offset) {
+                ll->offset += size;
+                ll->end += size;
+            } else
+            if (offset < end) {
+                ll->offset = -1;
+            }
+            break;
+        case LOGOP_DELETE:
+            if (offset + size <= ll->offset) {
+                ll->offset -= size;
+                ll->end -= size;
+            } else
+            if (offset < end) {
+                ll->offset = -1;
+            }
+            break;
+        default:
+            if (offset < end && offset + size > ll->offset)
+                ll->offset = -1;
+            break;
+        }
+    }
+}
+
+static void layout_cache_flush(QELayoutCache *lc)
+{
+    int i;
+
+    for (i = 0; i < lc->nb_entries; i++) {
+        lc->entries[i].offset = -1;
+    }
+}
+
+static void layout_cache_free(EditState *s)
+{
+    QELayoutCache *lc = s->layout_cache;
+    int i;
+
+    if (lc) {
+        eb_free_callback(s->b, layout_callback, lc);
+        for (i = 0; i < lc->nb_entries; i++) {
+            qe_free(&lc->entries[i].data);
+        }
+        qe_free(&lc->entries);
+        qe_free(&s->layout_cache);
+    }
+}
+
+/* Return the layout cache of window 'e' for a display pass, flushed if
+   the settings used by the layouts have changed, or NULL if the lines
+   of 'e' are not cached. */
+static QELayoutCache *layout_cache_get(EditState *e, DisplayState *ds)
+{
+    QELayoutCache *lc;
+    QELayoutKey key;
+
+    /* XXX: other display_line functions depend on more state */
+    if (disable_layout_cache || !e->mode || !e->b
+    ||  e->mode->display_line != text_display_line
+    ||  (e->flags & WF_MINIBUF) || e->prompt || e->isearch_state)
+        return NULL;
+
+    memset(&key, 0, sizeof(key));
+    key.b = e->b;
+    key.mode = e->mode;
+    key.colorize_func = e->colorize_func;
+    key.charset = e->b->charset;
+    key.wrap = ds->wrap;
+    key.width = ds->width;
+    key.eol_width = ds->eol_width;
+    key.tab_width = ds->tab_width;
+    key.space_width = ds->space_width;
+    key.line_height = ds->default_line_height;
+    key.line_numbers = ds->line_numbers;
+    key.x_disp[0] = e->x_disp[0];
+    key.x_disp[1] = e->x_disp[1];
+    key.bidir = e->bidir;
+    key.eol_type = e->b->eol_type;
+    key.style_shift = e->b->b_styles ? e->b->style_shift + 1 : 0;
+    key.show_unicode = e->qe_state->show_unicode;
+    key.show_selection = e->show_selection;
+    key.region_style = e->region_style;
+    key.curline_style = e->curline_style;
+    if (e->show_selection || e->region_style || e->curline_style
+    ||  e->mode == &list_mode) {
+        /* the styles of the lines depend on the cursor and the mark */
+        key.offset = e->offset;
+        key.mark = e->b->mark;
+        key.highlight = (e->qe_state->active_window == e ||
+                         e->force_highlight);
+    }
+
+    lc = e->layout_cache;
+    if (!lc) {
+        lc = qe_mallocz(QELayoutCache);
+        if (!lc)
+            return NULL;
+        eb_add_callback(e->b, layout_callback, lc, 0);
+        e->layout_cache = lc;
+        lc->key = key;
+    } else
+    if (memcmp(&lc->key, &key, sizeof(key))) {
+        layout_cache_flush(lc);
+        lc->key = key;
+    }
+    lc->stamp++;
+    return lc;
+}
+
+static QELineLayout *layout_find(QELayoutCache *lc, qe_off_t offset)
+{
+    int i, n;
+
+    /* lines are usually looked up in the order they were stored */
+    for (i = lc->hint, n = lc->nb_entries; n-- > 0; i++) {
+        if (i >= lc->nb_entries)
+            i = 0;
+        if (lc->entries[i].offset == offset) {
+            lc->hint = i + 1;
+            return &lc->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* find an entry for a new layout, replacing the least recently used */
+static QELineLayout *layout_alloc(QELayoutCache *lc)
+{
+    QELineLayout *ll = NULL;
+    int i, n;
+
+    for (i = 0; i < lc->nb_entries; i++) {
+        if (lc->entries[i].offset < 0) {
+            ll = &lc->entries[i];
+            break;
+        }
+        if (!ll || lc->entries[i].stamp - ll->stamp < 0)
+            ll = &lc->entries[i];
+    }
+    if ((!ll || (ll->offset >= 0 && ll->stamp == lc->stamp))
+    &&  lc->nb_entries < LAYOUT_CACHE_MAX) {
+        /* all entries are used by the current pass */
+        n = max_int(LAYOUT_CACHE_MIN, lc->nb_entries * 2);
+        if (qe_realloc(&lc->entries, n * sizeof(*lc->entries))) {
+            memset(&lc->entries[lc->nb_entries], 0,
+                   (n - lc->nb_entries) * sizeof(*lc->entries));
+            for (i = lc->nb_entries; i < n; i++) {
+                lc->entries[i].offset = -1;
+            }
+            ll = &lc->entries[lc->nb_entries];
+            lc->nb_entries = n;
+        }
+    }
+    return ll;
+}
+
+/* get the colorization state before line 'line_num' if the layout
+   depends on it.  Return false if it is not known yet. */
+static int layout_state(EditState *s, int line_num, int *statep)
+{
+    *statep = 0;
+#ifndef CONFIG_TINY
+    if (s->colorize_func) {
+        colorize_invalidate(s);
+        if (line_num >= s->colorize_nb_valid_lines)
+            return 0;
+        *statep = s->colorize_states[line_num];
+    }
+#endif
+    return 1;
+}
+
+/* the colorizers use the cursor position on its line */
+static int layout_cursor(EditState *s, QELineLayout *ll)
+{
+    if (s->colorize_func && s->offset >= ll->offset && s->offset <= ll->end)
+        return (int)(s->offset - ll->offset);
+    return -1;
+}
+
+static qe_off_t layout_replay(DisplayState *ds, QELineLayout *ll)
+{
+    QELayoutRow row;
+    const u8 *p = ll->data;
+    const u8 *p_end = p + ll->size;
+    int i, n, off[2];
+
+    while (p < p_end) {
+        memcpy(&row, p, sizeof(row));
+        p += sizeof(row);
+        n = row.nb_glyphs;
+        memcpy(ds->fragments, p, row.nb_fragments * sizeof(*ds->fragments));
+        p += row.nb_fragments * sizeof(*ds->fragments);
+        memcpy(ds->line_chars, p, n * sizeof(*ds->line_chars));
+        p += n * sizeof(*ds->line_chars);
+        for (i = 0; i < n; i++) {
+            memcpy(off, p, sizeof(off));
+            p += sizeof(off);
+            ds->line_offsets[i][0] = off[0] < 0 ? -1 : off[0] + ll->offset;
+            ds->line_offsets[i][1] = off[1] < 0 ? -1 : off[1] + ll->offset;
+        }
+        memcpy(ds->line_char_widths, p, n * sizeof(*ds->line_char_widths));
+        p += n * sizeof(*ds->line_char_widths);
+        memcpy(ds->line_hex_mode, p, n * sizeof(*ds->line_hex_mode));
+        p += n * sizeof(*ds->line_hex_mode);
+
+        ds->line_index = n;
+        ds->nb_fragments = row.nb_fragments;
+        ds->x_start = row.x_start;
+        ds->x_line = row.x_line;
+        ds->left_gutter = row.left_gutter;
+        ds->base = row.base;
+        ds->embedding_level_max = row.embedding_level_max;
+        flush_line(ds, ds->fragments, row.nb_fragments,
+                   row.offset1 < 0 ? -1 : row.offset1 + ll->offset,
+                   row.offset2 < 0 ? -1 : row.offset2 + ll->offset,
+                   row.last);
+    }
+    ds->fragment_index = 0;
+    ds->line_index = 0;
+    ds->nb_fragments = 0;
+    return ll->next < 0 ? -1 : ll->offset + ll->next;
+}
+
+/* Display the line at 'offset' with the mode display_line() function,
+   or replay its cached layout if the line is unchanged. */
+static qe_off_t display_line_cached(EditState *s, DisplayState *ds,
+                                    qe_off_t offset)
+{
+    QELayoutCache *lc = ds->layout;
+    QELineLayout *ll;
+    qe_off_t next;
+    int line_num, col, state;
+
+    if (!lc || offset < 0)
+        return s->mode->display_line(s, ds, offset);
+
+    line_num = -1;
+    if (ds->line_numbers || s->colorize_func)
+        eb_get_pos(s->b, &line_num, &col, offset);
+
+    ll = layout_find(lc, offset);
+    if (ll && ll->line_num == line_num
+    &&  layout_state(s, line_num, &state) && ll->state == state
+    &&  ll->cursor == layout_cursor(s, ll)) {
+        lc->hits++;
+        ll->stamp = lc->stamp;
+        return layout_replay(ds, ll);
+    }
+    lc->misses++;
+    if (!ll && !(ll = layout_alloc(lc)))
+        return s->mode->display_line(s, ds, offset);
+
+    ll->offset = offset;
+    ll->stamp = lc->stamp;
+    ll->size = 0;
+    ds->layout_rec = ll;
+    next = s->mode->display_line(s, ds, offset);
+    ds->layout_rec = NULL;
+
+    ll->next = next < 0 ? -1 : next - offset;
+    ll->end = next < 0 ? s->b->total_size : next;
+    ll->line_num = line_num;
+    ll->cursor = layout_cursor(s, ll);
+    if (ll->size < 0 || !layout_state(s, line_num, &ll->state))
+        ll->offset = -1;
+    return next;
+}
+
 /* Generic display algorithm with automatic fit */
 static void generic_text_display(EditState *s)
 {
     CursorContext m1, *m = &m1;
     DisplayState ds1, *ds = &ds1;
-    int x1, xc, yc, offset, bottom = -1;
+    qe_off_t offset, bottom = -1;
+    int x1, xc, yc;
 
     if (s->offset == 0) {
         s->offset_top = s->y_disp = s->x_disp[0] = s->x_disp[1] = 0;
@@ -4777,6 +6341,11 @@ static void generic_text_display(EditState *s)
         qe_free(&s->line_shadow);
         s->shadow_nb_lines = 0;
         s->display_invalid = 0;
+        /* the layouts may depend on style or font changes */
+        if (s->layout_cache)
+            layout_cache_flush(s->layout_cache);
+        if (s->long_lines)
+            long_line_flush(s->long_lines);
     }
 
     /* find cursor position with the current x_disp & y_disp and
@@ -4794,7 +6363,7 @@ static void generic_text_display(EditState *s)
             s->offset_top = offset;
             s->y_disp = ds->y;
         }
-        offset = s->mode->display_line(s, ds, offset);
+        offset = display_line_cached(s, ds, offset);
         s->offset_bottom = offset;
         if (offset < 0 || ds->y >= s->height || m->xc != NO_CURSOR)
             break;
@@ -4808,7 +6377,7 @@ static void generic_text_display(EditState *s)
         display_init(ds, s, DISP_CURSOR_SCREEN, cursor_func, m);
         ds->y = 0;
         offset = s->mode->backward_offset(s, s->offset);
-        bottom = s->mode->display_line(s, ds, offset);
+        bottom = display_line_cached(s, ds, offset);
         if (m->xc == NO_CURSOR) {
             /* XXX: should not happen */
             put_error(NULL, "ERROR: cursor not found");
@@ -4820,7 +6389,7 @@ static void generic_text_display(EditState *s)
         while (ds->y < s->height && offset > 0) {
             offset = eb_prev(s->b, offset);
             offset = s->mode->backward_offset(s, offset);
-            bottom = s->mode->display_line(s, ds, offset);
+            bottom = display_line_cached(s, ds, offset);
         }
         s->offset_top = offset;
         s->offset_bottom = bottom;
@@ -4897,10 +6466,10 @@ static void generic_text_display(EditState *s)
         fill_rectangle(s->screen, s->xleft, s->ytop + ds->y,
                        s->width, s->height - ds->y,
                        default_style.bg_color);
-        if (ds->line_num >= 0 && ds->line_num < s->shadow_nb_lines) {
+        if (ds->shadow_index < s->shadow_nb_lines) {
             /* erase the line shadow for the rest of the window */
-            memset(&s->line_shadow[ds->line_num], 0xff,
-                   (s->shadow_nb_lines - ds->line_num) * sizeof(QELineShadow));
+            memset(&s->line_shadow[ds->shadow_index], 0xff,
+                   (s->shadow_nb_lines - ds->shadow_index) * sizeof(QELineShadow));
         }
     }
     display_close(ds);
@@ -4910,7 +6479,7 @@ static void generic_text_display(EditState *s)
 
     if (xc != NO_CURSOR && yc != NO_CURSOR
     &&  s->qe_state->active_window == s) {
-        int x, y, w, h;
+        int x, y, w, h, i;
         x = s->xleft + xc;
         y = s->ytop + yc;
         w = m->cursor_width;
@@ -4925,9 +6494,11 @@ static void generic_text_display(EditState *s)
                 w = -w;
             }
             xor_rectangle(s->screen, x, y, w, h, QERGB(0xFF, 0xFF, 0xFF));
-            if (m->linec >= 0 && m->linec < s->shadow_nb_lines) {
-                /* invalidate line so that the cursor will be erased next time */
-                memset(&s->line_shadow[m->linec], 0xff, sizeof(QELineShadow));
+            /* invalidate the cursor row so that the cursor will be
+               erased next time */
+            for (i = 0; i < s->shadow_nb_lines; i++) {
+                if (s->line_shadow[i].y == yc)
+                    memset(&s->line_shadow[i], 0xff, sizeof(QELineShadow));
             }
         }
     }
@@ -5240,10 +6811,11 @@ static void parse_arguments(ExecCmdState *es)
             break;
         case CMD_ARG_INT:
             switch (cas.code_letter) {
-            case 'd':   argp->n = s->offset;    break;
-            case 'e':   argp->n = s->b->total_size; break;
+            /* XXX: integer arguments cannot hold offsets beyond 2GB */
+            case 'd':   argp->n = min_offset(s->offset, INT_MAX); break;
+            case 'e':   argp->n = min_offset(s->b->total_size, INT_MAX); break;
             case 'k':   argp->n = es->key;      break;
-            case 'm':   argp->n = s->b->mark;   break;
+            case 'm':   argp->n = min_offset(s->b->mark, INT_MAX); break;
             case 'n':   argp->n = 0; get_arg = 1; break;
             case 'N':   argp->n = es->argval; get_arg = !es->has_arg; goto consume_arg;
             case 'p':   argp->n = es->argval;   goto consume_arg;
@@ -5309,6 +6881,8 @@ static void parse_arguments(ExecCmdState *es)
 
     qs->this_cmd_func = d->action.func;
     qs->cmd_start_time = get_clock_ms();
+    /* buffer modifications of a command are undone together */
+    qs->cmd_serial++;
 
     while (rep_count --> 0) {
         /* special case for hex mode */
@@ -5337,6 +6911,7 @@ static void parse_arguments(ExecCmdState *es)
         put_status(s, "|%s: %dms", d->name, elapsed_time);
 
     qs->last_cmd_func = qs->this_cmd_func;
+    qs->cmd_serial++;
  fail:
     free_cmd(&es);
 }
@@ -5423,6 +6998,72 @@ void do_execute_command(EditState *s, const char *cmd, int argval)
     }
 }
 
+/* mark the windows of a buffer for display if it is modified in or
+   before their displayed range */
+static void window_dirty_callback(qe__unused__ EditBuffer *b, void *opaque,
+                                  qe__unused__ int arg,
+                                  qe__unused__ enum LogOperation op,
+                                  qe_off_t offset, qe__unused__ qe_off_t size)
+{
+    EditState *s = opaque;
+
+    if (s->offset_bottom < 0 || offset <= s->offset_bottom)
+        s->display_dirty = 1;
+}
+
+static void window_get_key(EditState *s, QEWindowKey *key)
+{
+    QEmacsState *qs = s->qe_state;
+
+    memset(key, 0, sizeof(*key));
+    key->b = s->b;
+    key->mode = s->mode;
+    key->colorize_func = s->colorize_func;
+    key->charset = s->b->charset;
+    key->default_style = s->default_style;
+    key->offset = s->offset;
+    key->offset_top = s->offset_top;
+    key->y_disp = s->y_disp;
+    key->x_disp[0] = s->x_disp[0];
+    key->x_disp[1] = s->x_disp[1];
+    key->mark = s->b->mark;
+    key->xleft = s->xleft;
+    key->ytop = s->ytop;
+    key->width = s->width;
+    key->height = s->height;
+    key->flags = s->flags;
+    key->buffer_flags = s->b->flags;
+    key->wrap = s->wrap;
+    key->wrap_cols = s->wrap_cols;
+    key->bidir = s->bidir;
+    key->eol_type = s->b->eol_type;
+    key->tab_width = s->b->tab_width;
+    key->line_numbers = has_linum_mode(s);
+    key->hex_mode = s->hex_mode;
+    key->unihex_mode = s->unihex_mode;
+    key->hex_nibble = s->hex_nibble;
+    key->dump_width = s->dump_width;
+    key->overwrite = s->overwrite;
+    key->show_unicode = qs->show_unicode;
+    key->show_selection = s->show_selection;
+    key->region_style = s->region_style;
+    key->curline_style = s->curline_style;
+    key->highlight = (qs->active_window == s || s->force_highlight);
+}
+
+#define DISPLAY_FRAME_BUDGET  10  /* ms */
+#define DISPLAY_IDLE_DELAY    10  /* ms before displaying deferred windows */
+
+static void display_idle(void *opaque)
+{
+    QEmacsState *qs = opaque;
+
+    /* the timer is freed upon return */
+    qs->display_timer = NULL;
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
 void window_display(EditState *s)
 {
     QEmacsState *qs = s->qe_state;
@@ -5447,6 +7088,58 @@ void window_display(EditState *s)
     display_window_borders(s);
 }
 
+/* Display window 's' as part of the frame started at 'start_time',
+ * unless it is a text window other than the active one that can be
+ * skipped: its mode line only is updated if nothing else changed
+ * since its last display, and it is left for the next idle tick if
+ * the frame budget is spent and input is pending.
+ */
+static void edit_display_window(EditState *s, int start_time)
+{
+    QEmacsState *qs = s->qe_state;
+    QEWindowKey key;
+    int time;
+
+    /* XXX: other display functions depend on more state */
+    if (!disable_window_skip && !qs->complete_refresh
+    &&  s != qs->active_window && !s->isearch_state
+    &&  s->mode->display == generic_text_display
+    &&  !(s->flags & (WF_POPUP | WF_MINIBUF))) {
+#ifndef CONFIG_TINY
+        /* keep the colorization in step with the buffer as if the
+           window was displayed: invalidating it later would drop the
+           tags added in between by the other windows */
+        if (s->colorize_func)
+            colorize_invalidate(s);
+#endif
+        window_get_key(s, &key);
+        if (!s->display_dirty && !s->display_invalid && !s->borders_invalid
+        &&  !memcmp(&key, &s->display_key, sizeof(key))) {
+            display_mode_line(s);
+            qs->display_skipped_windows++;
+            return;
+        }
+        /* poll the input directly: is_user_input_pending() only
+           polls after some CPU time */
+        if (get_clock_ms() - start_time >= qs->display_frame_budget
+        &&  qs->screen->dpy.dpy_is_user_input_pending
+        &&  qs->screen->dpy.dpy_is_user_input_pending(qs->screen)) {
+            qs->display_deferred_windows++;
+            if (!qs->display_timer)
+                qs->display_timer = qe_add_timer(DISPLAY_IDLE_DELAY, qs,
+                                                 display_idle);
+            return;
+        }
+    }
+    time = get_clock_usec();
+    window_display(s);
+    qs->display_window_time += get_clock_usec() - time;
+    qs->display_windows++;
+    /* the display may have scrolled the window */
+    window_get_key(s, &s->display_key);
+    s->display_dirty = 0;
+}
+
 /* display all windows */
 /* XXX: should use correct clipping to avoid popups display hacks */
 void edit_display(QEmacsState *qs)
@@ -5456,6 +7149,7 @@ void edit_display(QEmacsState *qs)
     int start_time, elapsed_time;
 
     start_time = get_clock_ms();
+    qs->display_frames++;
 
     /* first call hooks for mode specific fixups */
     for (s = qs->first_window; s != NULL; s = s->next_window) {
@@ -5480,7 +7174,7 @@ void edit_display(QEmacsState *qs)
     for (s = qs->first_window; s != NULL; s = s->next_window) {
         if (!(s->flags & WF_POPUP) &&
             ((s->flags & WF_MINIBUF) || !has_popups || qs->complete_refresh)) {
-            window_display(s);
+            edit_display_window(s, start_time);
         }
     }
     /* refresh popups if any */
@@ -5489,7 +7183,7 @@ void edit_display(QEmacsState *qs)
             if (s->flags & WF_POPUP) {
                 //if (qs->complete_refresh)
                 //    /* refresh frame */;
-                window_display(s);
+                edit_display_window(s, start_time);
             }
         }
     }
@@ -5927,7 +7621,7 @@ static void qe_key_process(int key)
             out = buf_init(&outbuf, buf1, sizeof(buf1));
             buf_put_keys(out, c->keys, c->nb_keys);
             if (c->describe_key > 1) {
-                int save_offset = s->b->offset;
+                qe_off_t save_offset = s->b->offset;
                 s->b->offset = s->offset;
                 s->offset += eb_printf(s->b, "%s runs the command %s", buf1, d->name);
                 s->b->offset = save_offset;
@@ -6490,7 +8184,7 @@ static int default_completion_window_print_entry(CompleteState *cp, EditState *s
     return eb_puts(s->b, name);
 }
 
-static int default_completion_window_get_entry(EditState *s, char *dest, int size, int offset) {
+static int default_completion_window_get_entry(EditState *s, char *dest, int size, qe_off_t offset) {
     int len = eb_fgets(s->b, dest, size, offset, &offset);
     char *p = strchr(dest, '\t');
     if (p != NULL)
@@ -6535,8 +8229,8 @@ static CompletionDef *find_completion(const char *name)
     return NULL;
 }
 
-static void complete_start(CompleteState *cp, EditState *s, int start, int end,
-                           EditState *target)
+static void complete_start(CompleteState *cp, EditState *s,
+                           qe_off_t start, qe_off_t end, EditState *target)
 {
     memset(cp, 0, sizeof(*cp));
     cp->s = s;
@@ -6608,14 +8302,14 @@ typedef struct MinibufState {
     EditState *completion_popup_window;  /* XXX: should have a popup_window member */
     int completion_stage;
     int completion_flags;
-    int completion_start;
-    int completion_end;
+    qe_off_t completion_start;
+    qe_off_t completion_end;
     int completion_count;
     CompletionDef *completion;
 
     StringArray *history;
     int history_index;
-    int history_saved_offset;
+    qe_off_t history_saved_offset;
 } MinibufState;
 
 static ModeDef minibuffer_mode;
@@ -6648,7 +8342,8 @@ static int match_strings(const char *s1, const char *s2, int len) {
 
 void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     QEmacsState *qs = s->qe_state;
-    int count, i, match_len, start, end;
+    int count, i, match_len;
+    qe_off_t start, end;
     CompleteState cs;
     StringItem **outputs;
     EditState *e;
@@ -6698,7 +8393,7 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     end = s->offset;
     if (mb->completion_flags) {
         /* XXX: completion select? */
-        int offset = end;
+        qe_off_t offset = end;
         while ((start = offset) > 0) {
             char32_t c = eb_prevc(s->b, offset, &offset);
             if (!qe_isalnum_(c) && c != '-')
@@ -6797,8 +8492,8 @@ void do_minibuffer_complete(EditState *s, int type, int key, int argval) {
     complete_end(&cs);
 }
 
-static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
-                                   int *offsetp)
+static int eb_match_string_reverse(EditBuffer *b, qe_off_t offset,
+                                   const char *str, qe_off_t *offsetp)
 {
     int len = strlen(str);
 
@@ -6812,7 +8507,7 @@ static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
 
 static void do_minibuffer_electric_key(EditState *s, int key, int argval) {
     char32_t c;
-    int offset, stop;
+    qe_off_t offset, stop;
     MinibufState *mb = minibuffer_get_state(s, 0);
 
     /* erase beginning of line if typing / or ~ in certain places */
@@ -6878,7 +8573,8 @@ void do_minibuffer_scroll_up_down(EditState *s, int dir)
     }
 }
 
-static void minibuffer_set_str(EditState *s, int start, int end, const char *str)
+static void minibuffer_set_str(EditState *s, qe_off_t start, qe_off_t end,
+                               const char *str)
 {
     /* Replace the completion trigger zone */
     /* XXX: should insert UTF-8? */
@@ -7209,14 +8905,15 @@ int list_get_pos(EditState *s)
 }
 
 /* get current offset of the line in list */
-int list_get_offset(EditState *s)
+qe_off_t list_get_offset(EditState *s)
 {
     return eb_goto_bol(s->b, s->offset);
 }
 
 void list_toggle_selection(EditState *s, int dir)
 {
-    int offset, offset1, flags;
+    qe_off_t offset, offset1;
+    int flags;
     char32_t ch;
 
     if (dir < 0)
@@ -7449,6 +9146,10 @@ void do_switch_to_buffer(EditState *s, const char *bufname)
 
 void do_toggle_read_only(EditState *s)
 {
+    if (s->b->flags & BF_LOADING) {
+        put_status(s, "Buffer is being loaded");
+        return;
+    }
     s->b->flags ^= BF_READONLY;
 }
 
@@ -7573,7 +9274,7 @@ void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const cha
     canonicalize_absolute_buffer_path(s ? s->b : NULL, s ? s->offset : 0, buf, buf_size, path1);
 }
 
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int buf_size, const char *path1)
+void canonicalize_absolute_buffer_path(EditBuffer *b, qe_off_t offset, char *buf, int buf_size, const char *path1)
 {
     char cwd[MAX_FILENAME_SIZE];
     char path[MAX_FILENAME_SIZE];
@@ -7619,7 +9320,7 @@ void canonicalize_absolute_buffer_path(EditBuffer *b, int offset, char *buf, int
 }
 
 /* compute default path for find/save buffer */
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size)
+char *get_default_path(EditBuffer *b, qe_off_t offset, char *buf, int buf_size)
 {
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
@@ -7645,19 +9346,20 @@ char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size)
 }
 
 /* should have: rawbuf[len] == '\0' */
-static int probe_mode(EditState *s, EditBuffer *b,
-                      ModeDef **modes, int nb_modes,
-                      int *scores, int min_score,
-                      const char *filename, int st_errno, int st_mode,
-                      long total_size, const uint8_t *rawbuf, int len,
-                      QECharset *charset, EOLType eol_type)
+int probe_mode(EditState *s, EditBuffer *b,
+               ModeDef **modes, int nb_modes,
+               int *scores, int min_score,
+               const char *filename, int st_errno, int st_mode,
+               qe_off_t total_size, const uint8_t *rawbuf, int len,
+               QECharset *charset, EOLType eol_type)
 {
     u8 buf[4097];
     QEmacsState *qs = s->qe_state;
     char fname[MAX_FILENAME_SIZE];
     ModeDef *m;
     ModeProbeData probe_data;
-    int found_modes;
+    ModeDef *candidates[MODE_INDEX_MAX_MODES];
+    int found_modes, nb_candidates, i;
     const uint8_t *p;
 
     if (!modes || !scores || nb_modes < 1)
@@ -7725,11 +9427,21 @@ static int probe_mode(EditState *s, EditBuffer *b,
     p = memchr(probe_data.buf, '\n', probe_data.buf_size);
     probe_data.line_len = p ? p - probe_data.buf : probe_data.buf_size;
 
+    /* generic probes return 1 if the extensions and shell handlers do
+       not match */
+    nb_candidates = (min_score >= 1) ?
+        mode_index_candidates(qs, &probe_data, candidates) : -1;
+
     for (m = qs->first_mode; m != NULL; m = m->next) {
+        if (m->mode_probe == generic_mode_probe && nb_candidates >= 0) {
+            for (i = 0; i < nb_candidates && candidates[i] != m; i++)
+                continue;
+            if (i == nb_candidates)
+                continue;
+        }
         if (m->mode_probe) {
             int score = m->mode_probe(m, &probe_data);
             if (score > min_score) {
-                int i;
                 /* sort appropriate modes by insertion in modes array */
                 for (i = 0; i < found_modes; i++) {
                     if (scores[i] < score)
@@ -8094,7 +9806,7 @@ void do_load_file_from_path(EditState *s, const char *filename, int bflags)
 void do_insert_file(EditState *s, const char *filename)
 {
     FILE *f;
-    int size, lastsize = s->b->total_size;
+    qe_off_t size, lastsize = s->b->total_size;
 
     f = fopen(filename, "r");
     if (!f) {
@@ -8148,12 +9860,12 @@ void do_set_visited_file_name(EditState *s, const char *filename,
     eb_set_filename(s->b, path);
 }
 
-static void put_save_message(EditState *s, const char *filename, int nb)
+static void put_save_message(EditState *s, const char *filename, qe_off_t nb)
 {
     if (nb >= 0) {
-        put_status(s, "Wrote %d bytes to %s", nb, filename);
+        put_status(s, "Wrote %lld bytes to %s", (long long)nb, filename);
     } else {
-        put_status(s, "Could not write %s", filename);
+        put_status(s, "Could not write %s: %s", filename, strerror(errno));
     }
 }
 
@@ -8369,8 +10081,8 @@ void edit_invalidate(EditState *s, int all)
         EditState *e;
         for (e = s->qe_state->first_window; e != NULL; e = e->next_window) {
             if (e->b == s->b) {
-                s->modeline_shadow[0] = '\0';
-                s->display_invalid = 1;
+                e->modeline_shadow[0] = '\0';
+                e->display_invalid = 1;
             }
         }
     }
@@ -9318,6 +11030,8 @@ static int generic_mode_init(EditState *s)
     // XXX: should track insertions at s->offset?
     eb_add_callback(s->b, eb_offset_callback, &s->offset, 0);
     eb_add_callback(s->b, eb_offset_callback, &s->offset_top, 0);
+    eb_add_callback(s->b, window_dirty_callback, s, 0);
+    s->display_dirty = 1;
     set_colorize_func(s, NULL, NULL);
     return 0;
 }
@@ -9348,10 +11062,13 @@ static void generic_mode_close(EditState *s)
     set_colorize_func(s, NULL, NULL);
     eb_free_callback(s->b, eb_offset_callback, &s->offset);
     eb_free_callback(s->b, eb_offset_callback, &s->offset_top);
+    eb_free_callback(s->b, window_dirty_callback, s);
 
     /* Should free CRCs when switching display modes */
     qe_free(&s->line_shadow);
     s->shadow_nb_lines = 0;
+    layout_cache_free(s);
+    long_line_free(s);
 }
 
 ModeDef text_mode = {
@@ -9825,6 +11542,9 @@ static void qe_init(void *opaque)
     qs->default_tab_width = DEFAULT_TAB_WIDTH;
     qs->default_fill_column = DEFAULT_FILL_COLUMN;
     qs->mmap_threshold = MIN_MMAP_SIZE;
+    qs->undo_outer_limit = UNDO_OUTER_LIMIT;
+    qs->process_frame_interval = PROCESS_FRAME_INTERVAL;
+    qs->display_frame_budget = DISPLAY_FRAME_BUDGET;
     qs->max_load_size = MAX_LOAD_SIZE;
 
     /* setup resource path */
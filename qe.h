@@ -84,6 +84,7 @@ typedef struct KeyDef KeyDef;
 typedef struct InputMethod InputMethod;
 typedef struct ISearchState ISearchState;
 typedef struct QEProperty QEProperty;
+typedef struct QEStyleRuns QEStyleRuns;
 
 #ifndef INT_MAX
 #define INT_MAX  0x7fffffff
@@ -129,12 +130,13 @@ struct CompleteState {
     struct EditState *s;
     struct EditState *target;
     struct CompletionDef *completion;
-    int start, end, len, fuzzy;
+    qe_off_t start, end;
+    int len, fuzzy;
     char current[MAX_FILENAME_SIZE];
 };
 
 void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const char *path1);
-void canonicalize_absolute_buffer_path(EditBuffer *b, int offset,
+void canonicalize_absolute_buffer_path(EditBuffer *b, qe_off_t offset,
                                        char *buf, int buf_size,
                                        const char *path1);
 
@@ -246,12 +248,12 @@ KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m, int
 typedef int (*GetColorizedLineFunc)(EditState *s,
                                     char32_t *buf, int buf_size,
                                     QETermStyle *sbuf,
-                                    int offset, int *offsetp, int line_num);
+                                    qe_off_t offset, qe_off_t *offsetp, int line_num);
 
 struct QEColorizeContext {
     EditState *s;
     EditBuffer *b;
-    int offset;
+    qe_off_t offset;
     int colorize_state;
     int state_only;
     int combine_start, combine_stop; /* region for combine_static_colorized_line() */
@@ -269,21 +271,67 @@ typedef void (*ColorizeFunc)(QEColorizeContext *cp,
 /* begin to mmap files from this size */
 #define MIN_MMAP_SIZE  (2*1024*1024)
 #define MAX_LOAD_SIZE  (512*1024*1024)
+/* buffer offsets are qe_off_t: files are mapped in memory if they fit
+ * in the address space.
+ */
+#define MAX_BUFFER_SIZE  QE_OFF_MAX
 
+/* default page size: larger pages are split to this size where they
+ * are modified.
+ */
 #define MAX_PAGE_SIZE  4096
 //#define MAX_PAGE_SIZE 16
+/* page size of log and shell buffers, which are mostly appended to */
+#define LARGE_PAGE_SIZE  (64*1024)
+/* upper bound for the buffer page size */
+#define MAX_BUFFER_PAGE_SIZE  (1024*1024)
+/* mmapped files are described by one read-only extent per unmodified
+ * span, split into pages of at most MAX_PAGE_SIZE where they are
+ * modified.  Page sizes are int: larger files use several extents.
+ */
+#define MAX_EXTENT_SIZE  (1 << 30)
 
-#define NB_LOGS_MAX     100000  /* need better way to limit undo information */
+#define UNDO_OUTER_LIMIT  (24*1024*1024)  /* default undo memory per buffer */
 
 #define PG_READ_ONLY    0x0001 /* the page is read only */
 #define PG_VALID_POS    0x0002 /* set if the nb_lines / col fields are up to date */
 #define PG_VALID_CHAR   0x0004 /* nb_chars is valid */
 #define PG_VALID_COLORS 0x0008 /* color state is valid (unused) */
 
+/* A known position in a read-only extent of a file mapping: the
+ * statistics of the 'offset' bytes at 'data' in a given charset.
+ */
+typedef struct QEMapPos {
+    const u8 *data;
+    QECharset *charset;
+    int eol_type;
+    int flags;      /* PG_VALID_POS and / or PG_VALID_CHAR */
+    int offset;
+    int nb_lines;
+    int col;
+    int nb_chars;
+} QEMapPos;
+
+/* A memory mapped file, shared by the read-only pages that point into
+ * it, possibly from different buffers.  The file is unmapped when the
+ * last reference is released.
+ */
+typedef struct QEMapping {
+    void *address;
+    size_t length;
+    int ref_count;
+    /* recent positions in the extents, to avoid scanning them from
+     * their start for each lookup.
+     */
+    QEMapPos *pos_cache;
+    int pos_next;
+} QEMapping;
+
 typedef struct Page {   /* should pack this */
     int size;     /* data size */
     int flags;
     u8 *data;
+    QEMapping *map;   /* mapping for PG_READ_ONLY pages */
     /* the following are needed to handle line / column computation */
     int nb_lines; /* Number of EOL characters in data */
     int col;      /* Number of chars since the last EOL */
@@ -291,6 +339,17 @@ typedef struct Page {   /* should pack this */
     int nb_chars;
 } Page;
 
+/* Page index: a complete binary tree over the page table, stored as
+ * an array with the root at index 1 and leaf i at page_tree_cap + i.
+ * Each node holds the cumulative statistics of the pages below it.
+ */
+typedef struct PageNode {
+    qe_off_t size;     /* total data size */
+    int nb_lines;      /* total number of EOL characters */
+    int col;           /* number of chars since the last EOL */
+    qe_off_t nb_chars; /* total number of chars */
+} PageNode;
+
 #define DIR_LTR 0
 #define DIR_RTL 1
 
@@ -303,9 +362,22 @@ enum LogOperation {
     LOGOP_DELETE,
 };
 
+/* undo journal entry: the data of deletions and writes is kept in the
+ * log buffer, records of the same command are undone together.
+ */
+typedef struct UndoRecord {
+    u8 op;              /* enum LogOperation */
+    u8 was_modified;
+    int group;          /* serial number of the command */
+    qe_off_t offset;
+    qe_off_t size;
+    qe_off_t data_offset;   /* position of the data in the log buffer */
+    qe_off_t cost;          /* bytes of undo memory used by the record */
+} UndoRecord;
+
 /* Each buffer modification can be caught with this callback */
 typedef void (*EditBufferCallback)(EditBuffer *b, void *opaque, int arg,
-                                   enum LogOperation op, int offset, int size);
+                                   enum LogOperation op, qe_off_t offset, qe_off_t size);
 
 typedef struct EditBufferCallbackList {
     void *opaque;
@@ -318,7 +390,8 @@ typedef struct EditBufferCallbackList {
 typedef struct EditBufferDataType {
     const char *name; /* name of buffer data type (text, image, ...) */
     int (*buffer_load)(EditBuffer *b, FILE *f);
-    int (*buffer_save)(EditBuffer *b, int start, int end, const char *filename);
+    qe_off_t (*buffer_save)(EditBuffer *b, qe_off_t start, qe_off_t end,
+                            const char *filename);
     void (*buffer_close)(EditBuffer *b);
     struct EditBufferDataType *next;
 } EditBufferDataType;
@@ -339,27 +412,35 @@ typedef struct EditBufferDataType {
 #define BF_STYLE2    0x2000  /* buffer has 2 byte styles */
 #define BF_STYLE4    0x3000  /* buffer has 4 byte styles */
 #define BF_STYLE8    0x4000  /* buffer has 8 byte styles */
-#define BF_IS_STYLE  0x8000  /* buffer is a styles buffer */
 #define BF_IS_LOG    0x10000  /* buffer is a log buffer */
 #define BF_SHELL     0x20000  /* buffer is a shell buffer */
 
 struct EditBuffer {
     OWNED Page *page_table;
     int nb_pages;
-    int mark;       /* current mark (moved with text) */
-    int total_size; /* total size of the buffer */
+    qe_off_t mark;       /* current mark (moved with text) */
+    qe_off_t total_size; /* total size of the buffer */
     int modified;
     int linum_mode;   /* display line numbers in left gutter */
     int linum_mode_set;   /* linum_mode was set, ignore global_linum_mode */
 
     /* page cache */
     Page *cur_page;
-    int cur_offset;
+    qe_off_t cur_offset;
     int flags;
+    int page_size;  /* size of pages created by insertions */
+
+    /* page index for logarithmic offset lookups */
+    OWNED PageNode *page_tree;
+    int page_tree_cap;      /* number of leaves, a power of 2 */
+    int page_tree_lo;       /* range of pages to reindex */
+    int page_tree_hi;
+    int page_tree_flags;    /* PG_VALID_POS / PG_VALID_CHAR if indexed */
+    int page_stats_lo;      /* range of pages with stale line / char counts */
+    int page_stats_hi;
 
     /* mmap data, including file handle if kept open */
-    void *map_address;
-    int map_length;
+    QEMapping *mapping;
     int map_handle;
 
     /* buffer data type (default is raw) */
@@ -374,9 +455,9 @@ struct EditBuffer {
     unsigned short *colorize_states; /* state before line n, one per line */
     int colorize_nb_lines;
     int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to
+    /* maximum valid offset, QE_OFF_MAX if not modified. Needed to
      * invalidate 'colorize_states' */
-    int colorize_max_valid_offset;
+    qe_off_t colorize_max_valid_offset;
 
     /* charset handling */
     CharsetDecodeState charset_state;
@@ -385,25 +466,30 @@ struct EditBuffer {
 
     /* undo system */
     int save_log;    /* if true, each buffer operation is logged */
-    int log_new_index, log_current;
+    int log_current; /* 1 + number of the last record undone */
+    int undo_serial; /* cmd_serial after the last undo or redo step */
     enum LogOperation last_log;
     int last_log_char;
-    int nb_logs;
-    EditBuffer *log_buffer;
+    UndoRecord *undo_records;  /* ring of undo records, indexed by number */
+    int undo_mask;   /* size of the ring minus 1 */
+    int undo_first;  /* number of the oldest undo record */
+    int nb_logs;     /* number of undo records */
+    qe_off_t undo_size;  /* bytes of memory used by the undo records */
+    EditBuffer *log_buffer;  /* data of the deletions and writes */
 
     /* style system */
-    EditBuffer *b_styles;
+    OWNED QEStyleRuns *b_styles;  /* runs of styles, NULL if none */
     QETermStyle cur_style;  /* current style for buffer writing APIs */
     int style_bytes;  /* 0, 1, 2, 4 or 8 bytes per char */
     int style_shift;  /* 0, 0, 1, 2 or 3 */
 
     /* modification callbacks */
     OWNED EditBufferCallbackList *first_callback;
-    OWNED QEProperty *property_list;
+    OWNED QEProperty *property_list;  /* head of the property skip list */
 
-#if 0
-    /* asynchronous loading/saving support */
+    /* asynchronous loading support */
     struct BufferIOState *io_state;
+#if 0
     /* used during loading */
     int probed;
 #endif
@@ -421,7 +507,7 @@ struct EditBuffer {
     OWNED QEModeData *mode_data_list;
 
     /* default mode stuff when buffer is detached from window */
-    int offset;
+    qe_off_t offset;
 
     int tab_width;
     int fill_column;
@@ -439,28 +525,21 @@ struct EditBuffer {
      */
 };
 
-/* the log buffer is used for the undo operation */
-/* header of log operation */
-typedef struct LogBuffer {
-    u8 pad1, pad2;    /* for Log buffer readability */
-    u8 op;
-    u8 was_modified;
-    int offset;
-    int size;
-} LogBuffer;
 
 void eb_trace_bytes(const void *buf, int size, int state);
 
 void eb_init(void);
-int eb_read_one_byte(EditBuffer *b, int offset);
-int eb_read(EditBuffer *b, int offset, void *buf, int size);
-int eb_write(EditBuffer *b, int offset, const void *buf, int size);
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size);
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
-int eb_delete(EditBuffer *b, int offset, int size);
-int eb_replace(EditBuffer *b, int offset, int size, const void *buf, int size1);
+int eb_read_one_byte(EditBuffer *b, qe_off_t offset);
+int eb_read(EditBuffer *b, qe_off_t offset, void *buf, int size);
+int eb_write(EditBuffer *b, qe_off_t offset, const void *buf, int size);
+qe_off_t eb_search_bytes(EditBuffer *b, int dir, qe_off_t start, qe_off_t end,
+                         const u8 *pat, int len, const u8 *fold);
+qe_off_t eb_insert_buffer(EditBuffer *dest, qe_off_t dest_offset,
+                          EditBuffer *src, qe_off_t src_offset,
+                          qe_off_t size);
+int eb_insert(EditBuffer *b, qe_off_t offset, const void *buf, int size);
+qe_off_t eb_delete(EditBuffer *b, qe_off_t offset, qe_off_t size);
+int eb_replace(EditBuffer *b, qe_off_t offset, qe_off_t size, const void *buf, int size1);
 void eb_free_log_buffer(EditBuffer *b);
 EditBuffer *eb_new(const char *name, int flags);
 EditBuffer *eb_scratch(const char *name, int flags);
@@ -473,31 +552,31 @@ EditState *eb_find_window(EditBuffer *b, EditState *e);
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type);
 qe__attr_nonnull((3))
-char32_t eb_nextc(EditBuffer *b, int offset, int *next_ptr);
+char32_t eb_nextc(EditBuffer *b, qe_off_t offset, qe_off_t *next_ptr);
 qe__attr_nonnull((3))
-char32_t eb_prevc(EditBuffer *b, int offset, int *prev_ptr);
+char32_t eb_prevc(EditBuffer *b, qe_off_t offset, qe_off_t *prev_ptr);
 qe__attr_nonnull((3))
-char32_t eb_next_glyph(EditBuffer *b, int offset, int *next_ptr);
+char32_t eb_next_glyph(EditBuffer *b, qe_off_t offset, qe_off_t *next_ptr);
 qe__attr_nonnull((3))
-char32_t eb_prev_glyph(EditBuffer *b, int offset, int *prev_ptr);
-int eb_skip_accents(EditBuffer *b, int offset);
-int eb_skip_glyphs(EditBuffer *b, int offset, int n);
-int eb_skip_chars(EditBuffer *b, int offset, int n);
-int eb_delete_chars(EditBuffer *b, int offset, int n);
-int eb_delete_glyphs(EditBuffer *b, int offset, int n);
-int eb_goto_pos(EditBuffer *b, int line1, int col1);
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset);
-int eb_goto_char(EditBuffer *b, int pos);
-int eb_get_char_offset(EditBuffer *b, int offset);
-int eb_delete_range(EditBuffer *b, int p1, int p2);
-static inline int eb_at_bol(EditBuffer *b, int offset) {
+char32_t eb_prev_glyph(EditBuffer *b, qe_off_t offset, qe_off_t *prev_ptr);
+qe_off_t eb_skip_accents(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_skip_glyphs(EditBuffer *b, qe_off_t offset, int n);
+qe_off_t eb_skip_chars(EditBuffer *b, qe_off_t offset, int n);
+qe_off_t eb_delete_chars(EditBuffer *b, qe_off_t offset, int n);
+qe_off_t eb_delete_glyphs(EditBuffer *b, qe_off_t offset, int n);
+qe_off_t eb_goto_pos(EditBuffer *b, int line1, int col1);
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, qe_off_t offset);
+qe_off_t eb_goto_char(EditBuffer *b, qe_off_t pos);
+qe_off_t eb_get_char_offset(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_delete_range(EditBuffer *b, qe_off_t p1, qe_off_t p2);
+static inline int eb_at_bol(EditBuffer *b, qe_off_t offset) {
     return eb_prevc(b, offset, &offset) == '\n';
 }
-static inline int eb_next(EditBuffer *b, int offset) {
+static inline qe_off_t eb_next(EditBuffer *b, qe_off_t offset) {
     eb_nextc(b, offset, &offset);
     return offset;
 }
-static inline int eb_prev(EditBuffer *b, int offset) {
+static inline qe_off_t eb_prev(EditBuffer *b, qe_off_t offset) {
     eb_prevc(b, offset, &offset);
     return offset;
 }
@@ -506,11 +585,14 @@ static inline int eb_prev(EditBuffer *b, int offset) {
 void do_undo(EditState *s);
 void do_redo(EditState *s);
 
-int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+int eb_raw_buffer_load1(EditBuffer *b, FILE *f, qe_off_t offset);
+int eb_get_load_progress(EditBuffer *b);
+int eb_set_page_size(EditBuffer *b, int page_size);
 int eb_mmap_buffer(EditBuffer *b, const char *filename);
 void eb_munmap_buffer(EditBuffer *b);
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
-int eb_save_buffer(EditBuffer *b);
+qe_off_t eb_write_buffer(EditBuffer *b, qe_off_t start, qe_off_t end,
+                         const char *filename);
+qe_off_t eb_save_buffer(EditBuffer *b);
 
 int eb_set_buffer_name(EditBuffer *b, const char *name1);
 void eb_set_filename(EditBuffer *b, const char *filename);
@@ -518,59 +600,60 @@ void eb_set_filename(EditBuffer *b, const char *filename);
 int eb_add_callback(EditBuffer *b, EditBufferCallback cb, void *opaque, int arg);
 void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque);
 void eb_offset_callback(EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size);
+                        enum LogOperation op, qe_off_t offset, qe_off_t size);
 int eb_create_style_buffer(EditBuffer *b, int flags);
 void eb_free_style_buffer(EditBuffer *b);
-QETermStyle eb_get_style(EditBuffer *b, int offset);
+QETermStyle eb_get_style(EditBuffer *b, qe_off_t offset);
+QETermStyle eb_get_style_run(EditBuffer *b, qe_off_t offset, qe_off_t *endp);
 void eb_set_style(EditBuffer *b, QETermStyle style, enum LogOperation op,
-                  int offset, int size);
+                  qe_off_t offset, qe_off_t size);
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size);
-int eb_delete_char32(EditBuffer *b, int offset);
+                       enum LogOperation op, qe_off_t offset, qe_off_t size);
+int eb_delete_char32(EditBuffer *b, qe_off_t offset);
 int eb_encode_char32(EditBuffer *b, char *buf, char32_t c);
-int eb_insert_char32(EditBuffer *b, int offset, char32_t c);
-int eb_replace_char32(EditBuffer *b, int offset, char32_t c);
-int eb_insert_char32_n(EditBuffer *b, int offset, char32_t c, int n);
-static inline int eb_insert_spaces(EditBuffer *b, int offset, int n) {
+int eb_insert_char32(EditBuffer *b, qe_off_t offset, char32_t c);
+int eb_replace_char32(EditBuffer *b, qe_off_t offset, char32_t c);
+int eb_insert_char32_n(EditBuffer *b, qe_off_t offset, char32_t c, int n);
+static inline int eb_insert_spaces(EditBuffer *b, qe_off_t offset, int n) {
     return eb_insert_char32_n(b, offset, ' ', n);
 }
 
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len);
-int eb_insert_char32_buf(EditBuffer *b, int offset, const char32_t *buf, int len);
-int eb_insert_str(EditBuffer *b, int offset, const char *str);
-int eb_match_char32(EditBuffer *b, int offset, char32_t c, int *offsetp);
-int eb_match_str_utf8(EditBuffer *b, int offset, const char *str, int *offsetp);
-int eb_match_istr_utf8(EditBuffer *b, int offset, const char *str, int *offsetp);
+int eb_insert_utf8_buf(EditBuffer *b, qe_off_t offset, const char *buf, int len);
+int eb_insert_char32_buf(EditBuffer *b, qe_off_t offset, const char32_t *buf, int len);
+int eb_insert_str(EditBuffer *b, qe_off_t offset, const char *str);
+int eb_match_char32(EditBuffer *b, qe_off_t offset, char32_t c, qe_off_t *offsetp);
+int eb_match_str_utf8(EditBuffer *b, qe_off_t offset, const char *str, qe_off_t *offsetp);
+int eb_match_istr_utf8(EditBuffer *b, qe_off_t offset, const char *str, qe_off_t *offsetp);
 /* These functions insert contents at b->offset */
 int eb_vprintf(EditBuffer *b, const char *fmt, va_list ap) qe__attr_printf(2,0);
 int eb_printf(EditBuffer *b, const char *fmt, ...) qe__attr_printf(2,3);
 int eb_puts(EditBuffer *b, const char *s);
 int eb_putc(EditBuffer *b, char32_t c);
 
-void eb_line_pad(EditBuffer *b, int offset, int n);
-int eb_get_region_content_size(EditBuffer *b, int start, int stop);
-static inline int eb_get_content_size(EditBuffer *b) {
+void eb_line_pad(EditBuffer *b, qe_off_t offset, int n);
+qe_off_t eb_get_region_content_size(EditBuffer *b, qe_off_t start, qe_off_t stop);
+static inline qe_off_t eb_get_content_size(EditBuffer *b) {
     return eb_get_region_content_size(b, 0, b->total_size);
 }
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, qe_off_t start, qe_off_t stop,
                            char *buf, int buf_size, int encode_zero);
 static inline int eb_get_contents(EditBuffer *b, char *buf, int buf_size, int encode_zero) {
     return eb_get_region_contents(b, 0, b->total_size, buf, buf_size, encode_zero);
 }
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size);
+qe_off_t eb_insert_buffer_convert(EditBuffer *dest, qe_off_t dest_offset,
+                                  EditBuffer *src, qe_off_t src_offset,
+                                  qe_off_t size);
 int eb_get_line(EditBuffer *b, char32_t *buf, int buf_size,
-                int offset, int *offset_ptr);
+                qe_off_t offset, qe_off_t *offset_ptr);
 int eb_fgets(EditBuffer *b, char *buf, int buf_size,
-             int offset, int *offset_ptr);
-int eb_prev_line(EditBuffer *b, int offset);
-int eb_goto_bol(EditBuffer *b, int offset);
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp);
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1);
-int eb_is_in_indentation(EditBuffer *b, int offset);
-int eb_goto_eol(EditBuffer *b, int offset);
-int eb_next_line(EditBuffer *b, int offset);
+             qe_off_t offset, qe_off_t *offset_ptr);
+qe_off_t eb_prev_line(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_goto_bol(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_goto_bol2(EditBuffer *b, qe_off_t offset, int *countp);
+int eb_is_blank_line(EditBuffer *b, qe_off_t offset, qe_off_t *offset1);
+int eb_is_in_indentation(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_goto_eol(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_next_line(EditBuffer *b, qe_off_t offset);
 
 void eb_register_data_type(EditBufferDataType *bdt);
 EditBufferDataType *eb_probe_data_type(const char *filename, int st_mode,
@@ -579,18 +662,48 @@ void eb_set_data_type(EditBuffer *b, EditBufferDataType *bdt);
 void eb_invalidate_raw_data(EditBuffer *b);
 extern EditBufferDataType raw_data_type;
 
+/* Buffer properties are kept in a skip list ordered by offset. Links
+ * store the distance to the next property instead of absolute offsets
+ * so buffer modifications only update the links that span them.
+ */
+#define QE_PROP_MAX_LEVEL  16
+
+typedef struct QEPropertyLink {
+    QEProperty *next;
+    qe_off_t span;      /* offset of next minus offset of this property */
+} QEPropertyLink;
+
 struct QEProperty {
-    int offset;
 #define QE_PROP_FREE  1
 #define QE_PROP_TAG   3
     int type;
     void *data;
-    QEProperty *next;
+    QEProperty *prev;   /* previous property at level 0 */
+    int level;
+    QEPropertyLink link[];  /* level links, level 0 is the full list */
+};
+
+/* Styles are stored as a sorted array of runs: run i covers the bytes
+ * from runs[i].offset to runs[i + 1].offset (or size for the last run).
+ * Adjacent runs always have different styles.
+ */
+typedef struct QEStyleRun {
+    qe_off_t offset;
+    QETermStyle style;
+} QEStyleRun;
+
+struct QEStyleRuns {
+    QEStyleRun *runs;
+    int nb_runs, max_runs;
+    qe_off_t size;      /* number of bytes covered, same as b->total_size */
+    int cache;          /* index of the last run found */
+    QETermStyle mask;   /* style bits kept, from the style width */
 };
 
-void eb_add_property(EditBuffer *b, int offset, int type, void *data);
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type);
-void eb_delete_properties(EditBuffer *b, int offset, int offset2);
+void eb_add_property(EditBuffer *b, qe_off_t offset, int type, void *data);
+QEProperty *eb_find_property(EditBuffer *b, qe_off_t offset, qe_off_t offset2, int type);
+QEProperty *eb_next_property(EditBuffer *b, QEProperty *p, qe_off_t *offsetp);
+void eb_delete_properties(EditBuffer *b, qe_off_t offset, qe_off_t offset2);
 
 /* qe module handling */
 
@@ -619,9 +732,12 @@ void init_all_modules(void);
 /* qe.c */
 
 extern int disable_crc;      /* Prevent CRC based display cacheing */
+extern int disable_layout_cache;  /* Lay out lines again for each pass */
+extern int disable_window_skip;  /* Display unchanged windows again */
+extern int disable_mode_index;  /* Call all mode probes on each file */
 
-/* contains all the information necessary to uniquely identify a line,
-   to avoid displaying it */
+/* contains all the information necessary to uniquely identify a row
+   segment displayed in a window, to avoid displaying it again */
 typedef struct QELineShadow {
     uint64_t crc;
     int x;
@@ -629,6 +745,91 @@ typedef struct QELineShadow {
     short height;
 } QELineShadow;
 
+/* layout of a text line: the rows passed to flush_line() by
+   text_display_line(), replayed while the line and the window
+   settings are unchanged */
+typedef struct QELineLayout {
+    qe_off_t offset;    /* offset of the start of the line, -1 if unused */
+    qe_off_t end;       /* offset of the end of the line */
+    qe_off_t next;      /* display_line() result, -1 at end of buffer */
+    int line_num;       /* line number if the layout depends on it */
+    int cursor;         /* cursor position relative to offset if the
+                           layout depends on it, -1 otherwise */
+    int state;          /* colorization state before the line */
+    int stamp;          /* pass of the last use, for replacement */
+    int size;           /* size of the row data, -1 if too large */
+    int alloc_size;
+    OWNED u8 *data;     /* QELayoutRow records followed by their glyphs */
+} QELineLayout;
+
+/* window and buffer settings the line layouts depend on */
+typedef struct QELayoutKey {
+    EditBuffer *b;
+    ModeDef *mode;
+    ColorizeFunc colorize_func;
+    QECharset *charset;
+    int wrap, width, eol_width, tab_width, space_width, line_height;
+    int line_numbers, x_disp[2], bidir, eol_type, style_shift;
+    int show_unicode, show_selection, region_style, curline_style;
+    qe_off_t offset, mark;  /* for cursor dependent styles only */
+    int highlight;
+} QELayoutKey;
+
+typedef struct QELayoutCache {
+    QELayoutKey key;
+    int nb_entries;
+    int hint;           /* index of the entry after the last hit */
+    int stamp;          /* incremented for each display pass */
+    int hits, misses;   /* statistics */
+    OWNED QELineLayout *entries;
+} QELayoutCache;
+
+/* position of a step of a long line */
+typedef struct QELongLineStep {
+    qe_off_t offset;    /* offset of the first char relative to the line */
+    int x;              /* x position, not including x_disp */
+    int row;            /* row of the first char in wrap mode */
+    int state;          /* colorization state before the step */
+} QELongLineStep;
+
+/* the steps of a long line, measured up to the last displayed column
+   or the last row, to lay out only the visible part of the line */
+typedef struct QELongLine {
+    qe_off_t offset;    /* offset of the start of the line, -1 if unused */
+    qe_off_t end;       /* offset of the end of the line */
+    int stamp;          /* pass of the last use, for replacement */
+    int nb_steps;       /* the last step is the end of the measured part */
+    int alloc_steps;
+    OWNED QELongLineStep *steps;
+} QELongLine;
+
+#define LONG_LINE_CACHE_SIZE  4
+
+typedef struct QELongLineCache {
+    QECharset *charset;
+    int eol_type, tab_width, show_unicode;
+    int wrap_width;     /* width of the rows, 0 in truncate mode */
+    int stamp;
+    QELongLine lines[LONG_LINE_CACHE_SIZE];
+} QELongLineCache;
+
+/* window and buffer state the display of a text window depends on,
+   besides the buffer contents */
+typedef struct QEWindowKey {
+    EditBuffer *b;
+    ModeDef *mode;
+    ColorizeFunc colorize_func;
+    QECharset *charset;
+    QETermStyle default_style;
+    qe_off_t offset, offset_top, mark;
+    int y_disp, x_disp[2];
+    int xleft, ytop, width, height, flags, buffer_flags;
+    int wrap, wrap_cols, bidir, eol_type, tab_width, line_numbers;
+    int hex_mode, unihex_mode, hex_nibble, dump_width, overwrite;
+    int show_unicode, show_selection, region_style, curline_style;
+    int highlight;
+} QEWindowKey;
+
 enum WrapType {
     WRAP_AUTO = 0,
     WRAP_TRUNCATE,
@@ -641,10 +842,10 @@ enum WrapType {
 #define DIR_RTL 1
 
 struct EditState {
-    int offset;     /* offset of the cursor */
+    qe_off_t offset;     /* offset of the cursor */
     /* text display state */
-    int offset_top; /* offset of first character displayed in window */
-    int offset_bottom; /* offset of first character beyond window or -1
+    qe_off_t offset_top; /* offset of first character displayed in window */
+    qe_off_t offset_bottom; /* offset of first character beyond window or -1
                         * if end of file displayed */
     int y_disp;    /* virtual position of the displayed text */
     int x_disp[2]; /* position for LTR and RTL text resp. */
@@ -692,9 +893,21 @@ struct EditState {
     unsigned short *colorize_states;
     int colorize_nb_lines;
     int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to invalide
+    /* maximum valid offset, QE_OFF_MAX if not modified. Needed to invalide
        'colorize_states' */
-    int colorize_max_valid_offset;
+    qe_off_t colorize_max_valid_offset;
+    /* last guessed state for lines far from the valid states, and end
+       of the guessed lines to redisplay once colorized */
+    int colorize_guess_line;
+    int colorize_guess_state;
+    int colorize_guess_max;
+    /* size of the unmodified end of buffer and number of lines before
+       the modifications, to keep the states of the following lines */
+    qe_off_t colorize_tail_size;
+    int colorize_old_nb_lines;
+    /* range of the states kept from before the modifications */
+    int colorize_keep_start;
+    int colorize_keep_end;
 
     int busy; /* true if editing cannot be done if the window
                  (e.g. the parser HTML is parsing the buffer to
@@ -735,11 +948,16 @@ struct EditState {
     char modeline_shadow[MAX_SCREEN_WIDTH];
     OWNED QELineShadow *line_shadow; /* per window shadow CRC data */
     int shadow_nb_lines;
+    OWNED QELayoutCache *layout_cache; /* laid out lines, NULL if none */
+    OWNED QELongLineCache *long_lines; /* long line steps, NULL if none */
+    QEWindowKey display_key; /* state of the last display */
+    int display_dirty; /* true if the buffer was modified in or before
+                          the displayed range since the last display */
     /* compose state for input method */
     InputMethod *input_method; /* current input method */
     InputMethod *selected_input_method; /* selected input method (used to switch) */
     int compose_len;
-    int compose_start_offset;
+    qe_off_t compose_start_offset;
     char32_t compose_buf[20];
     OWNED EditState *next_window;
 };
@@ -755,7 +973,7 @@ struct ModeProbeData {
     int line_len;
     int st_errno;    /* errno from the stat system call */
     int st_mode;     /* unix file mode */
-    long total_size;
+    qe_off_t total_size;
     EOLType eol_type;
     CharsetDecodeState charset_state;
     QECharset *charset;
@@ -803,8 +1021,8 @@ struct ModeDef {
     void (*display)(EditState *);
 
     /* text related functions */
-    int (*display_line)(EditState *, DisplayState *, int);
-    int (*backward_offset)(EditState *, int);
+    qe_off_t (*display_line)(EditState *, DisplayState *, qe_off_t);
+    qe_off_t (*backward_offset)(EditState *, qe_off_t);
 
     ColorizeFunc colorize_func;
     int colorize_flags;
@@ -826,13 +1044,13 @@ struct ModeDef {
 
     /* Functions to insert and delete contents: */
     void (*write_char)(EditState *s, int c);
-    void (*delete_bytes)(EditState *s, int offset, int size);
+    void (*delete_bytes)(EditState *s, qe_off_t offset, qe_off_t size);
 
     EditBufferDataType *data_type; /* native buffer data type (NULL = raw) */
     void (*get_mode_line)(EditState *s, buf_t *out);
-    void (*indent_func)(EditState *s, int offset);
+    void (*indent_func)(EditState *s, qe_off_t offset);
     /* Get the current directory for the window, return NULL if none */
-    char *(*get_default_path)(EditBuffer *s, int offset,
+    char *(*get_default_path)(EditBuffer *s, qe_off_t offset,
                               char *buf, int buf_size);
 
     /* mode specific key bindings */
@@ -901,6 +1119,8 @@ struct QEmacsState {
     QEditScreen *screen;
     //struct QEDisplay *first_dpy;
     struct ModeDef *first_mode;
+    struct ModeIndex *mode_index; /* index of the mode extensions and
+                                     shell handlers, NULL if none */
     struct KeyDef *first_key;
     struct CmdDefArray *cmd_array;
     int cmd_array_count;
@@ -958,6 +1178,7 @@ struct QEmacsState {
     CmdFunc last_cmd_func; /* last executed command function call */
     CmdFunc this_cmd_func; /* current executing command */
     int cmd_start_time;
+    int cmd_serial;     /* incremented around each command, groups undo records */
     /* keyboard macros */
     int defining_macro;
     int executing_macro;
@@ -991,6 +1212,23 @@ struct QEmacsState {
     int ignore_case;    /* ignore case when comparing windows */
     int hilite_region;  /* hilite the current region when selecting */
     int mmap_threshold; /* minimum file size for mmap */
+    int undo_outer_limit;   /* maximum undo memory per buffer, 0 for none */
+    int process_frame_interval; /* minimum ms between process output redisplays */
+    int process_frames;     /* redisplays caused by process output */
+    int process_dropped_frames; /* process output reads coalesced into later frames */
+    int process_frame_rate; /* process output redisplays in the last second */
+    QETimer *process_display_timer; /* pending process output redisplay */
+    int process_display_time;   /* time of the last scheduled redisplay */
+    int process_rate_start;     /* start of the frame rate measurement */
+    int process_rate_frames;    /* redisplays since process_rate_start */
+    int display_frame_budget; /* ms of display before inactive windows are
+                                 deferred if input is pending */
+    QETimer *display_timer; /* pending display of deferred windows */
+    int display_frames;     /* calls to edit_display */
+    int display_windows;    /* windows displayed */
+    int display_skipped_windows;  /* unchanged windows not displayed */
+    int display_deferred_windows; /* windows deferred to an idle tick */
+    int64_t display_window_time;  /* us spent displaying windows */
     int max_load_size;  /* maximum file size for loading in memory */
     int default_tab_width;      /* DEFAULT_TAB_WIDTH */
     int default_fill_column;    /* DEFAULT_FILL_COLUMN */
@@ -1122,6 +1360,12 @@ typedef struct CmdDef {
 ModeDef *qe_find_mode(const char *name, int flags);
 ModeDef *qe_find_mode_filename(const char *filename, int flags);
 void qe_register_mode(ModeDef *m, int flags);
+int probe_mode(EditState *s, EditBuffer *b,
+               ModeDef **modes, int nb_modes,
+               int *scores, int min_score,
+               const char *filename, int st_errno, int st_mode,
+               qe_off_t total_size, const uint8_t *rawbuf, int len,
+               QECharset *charset, EOLType eol_type);
 void mode_complete(CompleteState *cp, CompleteFunc enumerate);
 int qe_register_commands(ModeDef *m, const CmdDef *cmds, int len);
 int qe_register_bindings(ModeDef *m, const char *cmd_name, const char *keys);
@@ -1172,12 +1416,13 @@ struct DisplayState {
     int x;              /* current x position */
     int y;              /* current y position */
     int line_num;       /* current text line number */
+    int shadow_index;   /* line shadow entry of the next row segment */
     int cur_hex_mode;   /* true if current char is in hex mode */
     int hex_mode;       /* hex mode from edit_state, -1 if all chars wanted */
     int line_numbers;   /* display line numbers if enough space */
     void *cursor_opaque;
     int (*cursor_func)(struct DisplayState *,
-                       int offset1, int offset2, int line_num,
+                       qe_off_t offset1, qe_off_t offset2, int line_num,
                        int x, int y, int w, int h, int hex_mode);
     int eod;            /* end of display requested */
     /* if base == RTL, then all x are equivalent to width - x */
@@ -1186,6 +1431,8 @@ struct DisplayState {
     int wrap;
     int eol_reached;
     EditState *edit_state;
+    QELayoutCache *layout;    /* layout cache of edit_state, or NULL */
+    QELineLayout *layout_rec; /* line layout being recorded, or NULL */
     QETermStyle style;   /* current style for display_printf... */
 
 #if 0
@@ -1202,13 +1449,13 @@ struct DisplayState {
     /* line char (in fact glyph) buffer */
     char32_t line_chars[MAX_SCREEN_WIDTH];
     short line_char_widths[MAX_SCREEN_WIDTH];
-    int line_offsets[MAX_SCREEN_WIDTH][2];
+    qe_off_t line_offsets[MAX_SCREEN_WIDTH][2];
     unsigned char line_hex_mode[MAX_SCREEN_WIDTH];
     int line_index;
 
     /* fragment temporary buffer */
     char32_t fragment_chars[MAX_WORD_SIZE];
-    int fragment_offsets[MAX_WORD_SIZE][2];
+    qe_off_t fragment_offsets[MAX_WORD_SIZE][2];
     unsigned char fragment_hex_mode[MAX_WORD_SIZE];
     int fragment_index;
     int last_space;
@@ -1225,22 +1472,22 @@ enum DisplayType {
 
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp,
                   int (*cursor_func)(DisplayState *,
-                                     int offset1, int offset2, int line_num,
+                                     qe_off_t offset1, qe_off_t offset2, int line_num,
                                      int x, int y, int w, int h, int hex_mode),
                   void *cursor_opaque);
 void display_close(DisplayState *s);
 void display_bol(DisplayState *s);
 void display_setcursor(DisplayState *s, DirType dir);
-int display_char_bidir(DisplayState *s, int offset1, int offset2,
+int display_char_bidir(DisplayState *s, qe_off_t offset1, qe_off_t offset2,
                        int embedding_level, char32_t ch);
-void display_eol(DisplayState *s, int offset1, int offset2);
+void display_eol(DisplayState *s, qe_off_t offset1, qe_off_t offset2);
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, qe_off_t offset1, qe_off_t offset2,
                     const char *fmt, ...) qe__attr_printf(4,5);
-void display_printhex(DisplayState *s, int offset1, int offset2,
+void display_printhex(DisplayState *s, qe_off_t offset1, qe_off_t offset2,
                       char32_t h, int n);
 
-static inline int display_char(DisplayState *s, int offset1, int offset2,
+static inline int display_char(DisplayState *s, qe_off_t offset1, qe_off_t offset2,
                                char32_t ch)
 {
     return display_char_bidir(s, offset1, offset2, 0, ch);
@@ -1303,7 +1550,7 @@ typedef struct CompletionDef {
     /* custom display for the completion string in the popup window */
     int (*print_entry)(CompleteState *cp, EditState *s, const char *name);
     /* get the entry string from the line in the popup window */
-    int (*get_entry)(EditState *s, char *dest, int size, int offset);
+    int (*get_entry)(EditState *s, char *dest, int size, qe_off_t offset);
     /* convert final string to a number */
     long (*convert_entry)(const char *s, const char **endp);
 #define CF_FILENAME        1
@@ -1331,7 +1578,7 @@ StringArray *qe_get_history(const char *name);
 void command_complete(CompleteState *cp, CompleteFunc enumerate);
 int eb_command_print_entry(EditBuffer *b, const CmdDef *d, EditState *s);
 int command_print_entry(CompleteState *cp, EditState *s, const char *name);
-int command_get_entry(EditState *s, char *dest, int size, int offset);
+int command_get_entry(EditState *s, char *dest, int size, qe_off_t offset);
 void file_complete(CompleteState *cp, CompleteFunc enumerate);
 int file_print_entry(CompleteState *cp, EditState *s, const char *name);
 void buffer_complete(CompleteState *cp, CompleteFunc enumerate);
@@ -1405,7 +1652,7 @@ void do_set_next_mode(EditState *s, int n);
 
 /* loading files */
 void do_exit_qemacs(EditState *s, int argval);
-char *get_default_path(EditBuffer *b, int offset, char *buf, int buf_size);
+char *get_default_path(EditBuffer *b, qe_off_t offset, char *buf, int buf_size);
 void do_find_file(EditState *s, const char *filename, int bflags);
 void do_load_from_path(EditState *s, const char *filename, int bflags);
 void do_find_file_other_window(EditState *s, const char *filename, int bflags);
@@ -1422,7 +1669,7 @@ void isearch_toggle_hex(EditState *s);
 void isearch_toggle_regexp(EditState *s);
 void isearch_toggle_word_match(EditState *s);
 void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
-                              QETermStyle *sbuf, int offset);
+                              QETermStyle *sbuf, qe_off_t offset);
 void do_isearch(EditState *s, int argval, int dir);
 void do_query_replace(EditState *s, const char *search_str,
                       const char *replace_str, int argval);
@@ -1438,13 +1685,13 @@ void qe_kill_buffer(EditBuffer *b);
 
 extern ModeDef text_mode;
 
-int text_backward_offset(EditState *s, int offset);
-int text_display_line(EditState *s, DisplayState *ds, int offset);
+qe_off_t text_backward_offset(EditState *s, qe_off_t offset);
+qe_off_t text_display_line(EditState *s, DisplayState *ds, qe_off_t offset);
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func, ModeDef *mode);
 int get_colorized_line(EditState *s, char32_t *buf, int buf_size,
                        QETermStyle *sbuf,
-                       int offset, int *offsetp, int line_num);
+                       qe_off_t offset, qe_off_t *offsetp, int line_num);
 
 int do_delete_selection(EditState *s);
 void do_char(EditState *s, int key, int argval);
@@ -1454,7 +1701,7 @@ void text_move_left_right_visual(EditState *s, int dir);
 void text_move_word_left_right(EditState *s, int dir);
 void text_move_up_down(EditState *s, int dir);
 void text_scroll_up_down(EditState *s, int dir);
-int text_screen_width(EditBuffer *b, int start, int stop, int tw);
+int text_screen_width(EditBuffer *b, qe_off_t start, qe_off_t stop, int tw);
 void text_write_char(EditState *s, int key);
 void do_newline(EditState *s);
 void do_open_line(EditState *s);
@@ -1463,7 +1710,7 @@ void do_delete_char(EditState *s, int argval);
 void do_tab(EditState *s, int argval);
 EditBuffer *new_yank_buffer(QEmacsState *qs, EditBuffer *base);
 void do_append_next_kill(EditState *s);
-void do_kill(EditState *s, int p1, int p2, int dir, int keep);
+void do_kill(EditState *s, qe_off_t p1, qe_off_t p2, int dir, int keep);
 void do_kill_region(EditState *s);
 void do_copy_region(EditState *s);
 void do_kill_line(EditState *s, int argval);
@@ -1474,10 +1721,10 @@ void text_move_bol(EditState *s);
 void text_move_eol(EditState *s);
 void text_move_bof(EditState *s);
 void text_move_eof(EditState *s);
-int word_right(EditState *s, int w);
-int word_left(EditState *s, int w);
+qe_off_t word_right(EditState *s, int w);
+qe_off_t word_left(EditState *s, int w);
 int qe_get_word(EditState *s, char *buf, int buf_size,
-                int offset, int *offset_ptr);
+                qe_off_t offset, qe_off_t *offset_ptr);
 void do_goto(EditState *s, const char *str, int unit);
 void do_goto_line(EditState *s, int line, int column);
 void do_up_down(EditState *s, int n);
@@ -1503,9 +1750,9 @@ void do_eof(EditState *s);
 void do_bol(EditState *s);
 void do_eol(EditState *s);
 void do_word_left_right(EditState *s, int n);
-void do_mark_region(EditState *s, int mark, int offset);
-int eb_next_paragraph(EditBuffer *b, int offset);
-int eb_prev_paragraph(EditBuffer *b, int offset);
+void do_mark_region(EditState *s, qe_off_t mark, qe_off_t offset);
+qe_off_t eb_next_paragraph(EditBuffer *b, qe_off_t offset);
+qe_off_t eb_prev_paragraph(EditBuffer *b, qe_off_t offset);
 void do_mark_paragraph(EditState *s, int n);
 void do_forward_paragraph(EditState *s, int n);
 void do_kill_paragraph(EditState *s, int n);
@@ -1514,7 +1761,7 @@ void do_changecase_word(EditState *s, int up);
 void do_changecase_region(EditState *s, int up);
 void do_delete_word(EditState *s, int dir);
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                qe_off_t offset1, qe_off_t offset2, int line_num,
                 int x, int y, int w, int h, int hex_mode);
 // should take argval
 void do_scroll_left_right(EditState *s, int n);
@@ -1744,7 +1991,7 @@ extern ModeDef list_mode;
 
 void list_toggle_selection(EditState *s, int dir);
 int list_get_pos(EditState *s);
-int list_get_offset(EditState *s);
+qe_off_t list_get_offset(EditState *s);
 
 /* dired.c */
 
@@ -1787,6 +2034,8 @@ void shell_colorize_line(QEColorizeContext *cp,
 #define SF_AUTO_CODING   0x08
 #define SF_AUTO_MODE     0x10
 #define SF_BUFED_MODE    0x20
+/* minimum delay between redisplays caused by process output */
+#define PROCESS_FRAME_INTERVAL  16  /* ms */
 EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
                              const char *bufname, const char *caption,
                              const char *path,
@@ -1100,16 +1100,16 @@ static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, const CmdDef *d) {
                 args[i].n = -1;
                 continue;
             case CMD_ARG_INT | CMD_ARG_USE_MARK:
-                args[i].n = s->b->mark;
+                args[i].n = min_offset(s->b->mark, INT_MAX);
                 continue;
             case CMD_ARG_INT | CMD_ARG_USE_POINT:
-                args[i].n = s->offset;
+                args[i].n = min_offset(s->offset, INT_MAX);
                 continue;
             case CMD_ARG_INT | CMD_ARG_USE_ZERO:
                 args[i].n = 0;
                 continue;
             case CMD_ARG_INT | CMD_ARG_USE_BSIZE:
-                args[i].n = s->b->total_size;
+                args[i].n = min_offset(s->b->total_size, INT_MAX);
                 continue;
             }
             /* CG: Could supply default arguments. */
@@ -1309,25 +1309,26 @@ void do_eval_expression(EditState *s, const char *expression, int argval)
 
 #define MAX_SCRIPT_LENGTH  (128 * 1024 - 1)
 
-static int do_eval_buffer_region(EditState *s, int start, int stop, int argval) {
+static int do_eval_buffer_region(EditState *s, qe_off_t start, qe_off_t stop, int argval) {
     QEmacsDataSource ds;
     char *buf;
-    int length, res = 0;
+    qe_off_t size;
+    int res = 0;
 
     qe_cfg_init(&ds);
 
     if (stop < start) {
-        int tmp = start;
+        qe_off_t tmp = start;
         start = stop;
         stop = tmp;
     }
     /* extract region as UTF-8 with a size limit */
-    length = eb_get_region_content_size(s->b, start, stop);
-    if (length > MAX_SCRIPT_LENGTH || !(buf = qe_malloc_array(char, length + 1))) {
+    size = eb_get_region_content_size(s->b, start, stop);
+    if (size > MAX_SCRIPT_LENGTH || !(buf = qe_malloc_array(char, size + 1))) {
         put_error(s, "buffer too large");
         return -1;
     }
-    length = eb_get_region_contents(s->b, start, stop, buf, length + 1, 0);
+    eb_get_region_contents(s->b, start, stop, buf, (int)size + 1, 0);
     ds.buf = ds.allocated_buf = buf;
     ds.filename = s->b->name;
     if (qe_parse_script(s, &ds) == TOK_ERR) {
@@ -37,6 +37,73 @@ BOOL lre_check_stack_overflow(void *opaque, size_t alloca_size) {
 void *lre_realloc(void *opaque, void *ptr, size_t size) {
     return qe_realloc(&ptr, size);
 }
+
+/* Compiled regexps are kept in a small cache because incremental search
+ * and match highlighting search the same pattern over and over.
+ */
+#define REGEX_CACHE_SIZE    8
+#define REGEX_PREFIX_LENGTH 64
+
+typedef struct RegexCacheEntry {
+    char *source;
+    int source_len;
+    int re_flags;
+    int capture_num;
+    uint8_t *regexp_bytes;
+    int prefix_len;     /* number of literal characters every match starts with */
+    char32_t prefix[REGEX_PREFIX_LENGTH];
+    unsigned int stamp; /* last use, for LRU replacement */
+} RegexCacheEntry;
+
+static RegexCacheEntry regex_cache[REGEX_CACHE_SIZE];
+static unsigned int regex_cache_stamp;
+
+/* Return a compiled regexp from the cache, compiling it if needed.
+ * Return NULL if the regexp cannot be compiled.
+ */
+static RegexCacheEntry *regex_cache_get(const char *source, int source_len,
+                                        int re_flags)
+{
+    char error_message[100];
+    RegexCacheEntry *re, *lru;
+    uint8_t *regexp_bytes;
+    int i, regexp_len;
+
+    lru = regex_cache;
+    for (i = 0; i < REGEX_CACHE_SIZE; i++) {
+        re = &regex_cache[i];
+        if (re->regexp_bytes && re->re_flags == re_flags
+        &&  re->source_len == source_len
+        &&  !memcmp(re->source, source, source_len)) {
+            re->stamp = ++regex_cache_stamp;
+            return re;
+        }
+        if (re->stamp < lru->stamp)
+            lru = re;
+    }
+    regexp_bytes = lre_compile(&regexp_len, error_message, sizeof(error_message),
+                               source, source_len, re_flags, NULL);
+    if (regexp_bytes == NULL) {
+        //put_status(NULL, "regexp compile error: %s", error_message);
+        return NULL;
+    }
+    re = lru;
+    qe_free(&re->source);
+    qe_free(&re->regexp_bytes);
+    re->source = qe_malloc_dup(source, source_len);
+    if (!re->source) {
+        qe_free(&regexp_bytes);
+        return NULL;
+    }
+    re->source_len = source_len;
+    re->re_flags = re_flags;
+    re->regexp_bytes = regexp_bytes;
+    re->capture_num = lre_get_capture_count(regexp_bytes);
+    re->prefix_len = lre_get_prefix(regexp_bytes, (uint32_t *)re->prefix,
+                                    REGEX_PREFIX_LENGTH);
+    re->stamp = ++regex_cache_stamp;
+    return re;
+}
 #endif
 
 /* Search stuff */
@@ -58,23 +125,23 @@ void *lre_realloc(void *opaque, void *ptr, size_t size) {
 /* should separate search string length and number of match positions */
 #define SEARCH_LENGTH  2048
 #define SEARCH_STEPS   512
-#define FOUND_TAG      0x80000000
-#define FOUND_REV      0x40000000
+#define FOUND_TAG      ((uint64_t)1 << 63)
+#define FOUND_REV      ((uint64_t)1 << 62)
 
 struct ISearchState {
     EditState *s;
     int search_flags;
-    int start_offset;
-    int found_offset, found_end;
+    qe_off_t start_offset;
+    qe_off_t found_offset, found_end;
     int search_u32_len;
     /* isearch */
     EditState *minibuffer;     /* set if delegated from minibuffer */
-    int saved_mark;
+    qe_off_t saved_mark;
     int start_dir;
     int quoting;
     int dir;
     int pos;  /* position in search_u32_steps */
-    unsigned int search_u32_steps[SEARCH_STEPS];
+    uint64_t search_u32_steps[SEARCH_STEPS];  /* chars and tagged match positions */
     /* common */
     char search_str[SEARCH_LENGTH * 3];     /* may be in hex */
     char32_t search_u32[SEARCH_LENGTH];
@@ -85,11 +152,125 @@ static ModeDef isearch_mode;
 /* XXX: should store to screen */
 static ISearchState global_isearch_state;
 
+/* Chunk of buffer searched between checks for search abort */
+#define SEARCH_CHUNK_SIZE  (1 << 20)
+
+/* Encode a search string for direct byte comparison with the buffer
+ * contents. Return the length of the encoded pattern or -1 if the
+ * buffer must be searched character by character.
+ */
+static int search_encode_literal(EditBuffer *b, int flags,
+                                 const char32_t *buf, int len,
+                                 u8 *pat, int size)
+{
+    QECharset *charset = b->charset;
+    u8 *q = pat, *q1;
+    char32_t c;
+    int pos;
+
+    /* only charsets where characters are self-synchronizing byte
+       sequences compare identically as bytes and as characters */
+    if (charset != &charset_utf8 && charset != &charset_8859_1
+    &&  charset != &charset_raw)
+        return -1;
+
+    for (pos = 0; pos < len; pos++) {
+        c = buf[pos];
+        if ((c == '\n' || c == '\r') && b->eol_type != EOL_UNIX)
+            return -1;
+        if (flags & SEARCH_FLAG_IGNORECASE) {
+            /* no character beyond ASCII folds into ASCII */
+            if (c >= 0x80)
+                return -1;
+            c = qe_toupper(c);
+        }
+        if (pat + size - q < 8)
+            return -1;
+        q1 = charset->encode_func(charset, q, c);
+        if (!q1)
+            return -1;
+        q = q1;
+    }
+    return q - pat;
+}
+
+/* Byte translation table for case insensitive literal search */
+static const u8 *search_fold_table(void)
+{
+    static u8 fold_table[256];
+    int i;
+
+    if (!fold_table['a']) {
+        for (i = 0; i < 256; i++)
+            fold_table[i] = qe_toupper(i);
+    }
+    return fold_table;
+}
+
+/* Search the buffer for an encoded pattern, a chunk at a time. */
+static int eb_search_literal(EditBuffer *b, int dir, int flags,
+                             qe_off_t start_offset, qe_off_t end_offset,
+                             const u8 *pat, int len,
+                             CSSAbortFunc *abort_func, void *abort_opaque,
+                             qe_off_t *found_offset, qe_off_t *found_end)
+{
+    const u8 *fold = NULL;
+    qe_off_t start, end, offset, offset3;
+
+    if (flags & SEARCH_FLAG_IGNORECASE)
+        fold = search_fold_table();
+    if (dir < 0) {
+        /* matches must end before the starting point */
+        start = 0;
+        end = start_offset - len + 1;
+    } else {
+        start = start_offset;
+        end = end_offset;
+    }
+    for (;;) {
+        if (start >= end)
+            return 0;
+        if (dir < 0) {
+            offset = eb_search_bytes(b, dir,
+                                     max_offset(start, end - SEARCH_CHUNK_SIZE),
+                                     end, pat, len, fold);
+        } else {
+            offset = eb_search_bytes(b, dir, start,
+                                     min_offset(end, start + SEARCH_CHUNK_SIZE),
+                                     pat, len, fold);
+        }
+        if (offset < 0) {
+            if (dir < 0)
+                end = max_offset(start, end - SEARCH_CHUNK_SIZE);
+            else
+                start = min_offset(end, start + SEARCH_CHUNK_SIZE);
+            /* check for search abort every chunk */
+            if (start < end && abort_func && abort_func(abort_opaque))
+                return -1;
+            continue;
+        }
+        if (flags & SEARCH_FLAG_WORD) {
+            /* check for word boundaries */
+            if (qe_isword(eb_prevc(b, offset, &offset3))
+            ||  qe_isword(eb_nextc(b, offset + len, &offset3))) {
+                if (dir < 0)
+                    end = offset;
+                else
+                    start = offset + 1;
+                continue;
+            }
+        }
+        *found_offset = offset;
+        *found_end = offset + len;
+        return 1;
+    }
+}
+
 static int eb_search(EditBuffer *b, int dir, int flags,
-                     int start_offset, int end_offset,
+                     qe_off_t start_offset, qe_off_t end_offset,
                      const char32_t *buf, int len,
                      CSSAbortFunc *abort_func, void *abort_opaque,
-                     int *found_offset, int *found_end)
+                     qe_off_t *found_offset, qe_off_t *found_end)
 {
     /*@API search
        Search a buffer for contents. Return true if contents was found.
@@ -111,9 +292,12 @@ static int eb_search(EditBuffer *b, int dir, int flags,
        Return `0` if search failed or `len` is zero.
        Return `-1` if search was aborted.
      */
-    int total_size = b->total_size;
-    int offset = start_offset, offset1, offset2, offset3, pos;
+    qe_off_t total_size = b->total_size;
+    qe_off_t offset = start_offset, offset1, offset2, offset3;
+    int pos;
     char32_t c, c2;
+    u8 pat[SEARCH_LENGTH * 4];
+    int pat_len;
 
     if (len == 0)
         return 0;
@@ -141,6 +325,16 @@ static int eb_search(EditBuffer *b, int dir, int flags,
     if (flags & SEARCH_FLAG_HEX) {
         /* handle buffer as single bytes */
         /* XXX: should handle ucs2 and ucs4 as words */
+        if (len <= countof(pat)) {
+            for (pos = 0; pos < len && buf[pos] <= 0xff; pos++)
+                pat[pos] = buf[pos];
+            if (pos == len) {
+                return eb_search_literal(b, dir, flags & ~SEARCH_FLAG_MASK,
+                                         start_offset, end_offset, pat, len,
+                                         abort_func, abort_opaque,
+                                         found_offset, found_end);
+            }
+        }
         if (dir >= 0)
               offset--;
         for (;;) {
@@ -179,13 +373,11 @@ static int eb_search(EditBuffer *b, int dir, int flags,
 
 #ifdef CONFIG_REGEX
     if (flags & SEARCH_FLAG_REGEX) {
-        char error_message[100];
         char source[SEARCH_LENGTH];
         int source_len;
-        uint8_t *regexp_bytes = NULL;
-        int regexp_len;
+        RegexCacheEntry *re;
+        const u8 *fold = NULL;
         uint8_t **capture = NULL;
-        int capture_num;
         int res = 0;
         int re_flags = 0;
         int found;
@@ -199,30 +391,78 @@ static int eb_search(EditBuffer *b, int dir, int flags,
         source_len = char32_to_utf8(source, countof(source), buf, len);
         if (source_len >= countof(source))
             return -1;
-        regexp_bytes = lre_compile(&regexp_len, error_message, sizeof(error_message),
-                                   source, source_len, re_flags, NULL);
-        if (regexp_bytes == NULL) {
-            //put_status(NULL, "regexp compile error: %s", error_message);
+        re = regex_cache_get(source, source_len, re_flags);
+        if (!re)
             return -1;
+
+        /* If all matches start with the same characters, scan the
+           buffer for them and only run the regexp at these offsets. */
+        pat_len = 0;
+        if (re->prefix_len > 0) {
+            pat_len = search_encode_literal(b, flags & SEARCH_FLAG_IGNORECASE,
+                                            re->prefix, re->prefix_len,
+                                            pat, countof(pat));
+        }
+        if (pat_len > 0) {
+            if (flags & SEARCH_FLAG_IGNORECASE)
+                fold = search_fold_table();
+            if (dir >= 0) {
+                /* candidate matches are tried one at a time */
+                re = regex_cache_get(source, source_len,
+                                     re_flags | LRE_FLAG_STICKY);
+                if (!re)
+                    return -1;
+            }
         }
-        capture_num = lre_get_capture_count(regexp_bytes);
-        capture = qe_malloc_array(uint8_t *, 2 * capture_num);
-        if (capture_num == 0 || capture == NULL) {
-            qe_free(&regexp_bytes);
+        capture = qe_malloc_array(uint8_t *, 2 * re->capture_num);
+        if (re->capture_num == 0 || capture == NULL) {
             qe_free(&capture);
-            //put_status(NULL, "cannot allocate capture array for %d entries", capture_num);
+            //put_status(NULL, "cannot allocate capture array for %d entries", re->capture_num);
             return -1;
         }
         for (offset1 = offset;;) {
             if (dir < 0) {
                 if (offset == 0)
                     break;
-                offset = eb_prev(b, offset);
+                if (pat_len > 0) {
+                    /* skip to the previous occurrence of the prefix */
+                    offset2 = max_offset(0, offset - SEARCH_CHUNK_SIZE);
+                    offset = eb_search_bytes(b, dir, offset2, offset,
+                                             pat, pat_len, fold);
+                    if (offset < 0) {
+                        offset = offset2;
+                        /* check for search abort every chunk */
+                        if (abort_func && abort_func(abort_opaque)) {
+                            res = -1;
+                            break;
+                        }
+                        continue;
+                    }
+                } else {
+                    offset = eb_prev(b, offset);
+                }
             } else {
                 offset = offset1;
                 if (offset >= end_offset)
                     break;
-                offset1 = eb_next(b, offset);
+                if (pat_len > 0) {
+                    /* skip to the next occurrence of the prefix */
+                    offset2 = min_offset(end_offset, offset + SEARCH_CHUNK_SIZE);
+                    offset = eb_search_bytes(b, dir, offset, offset2,
+                                             pat, pat_len, fold);
+                    if (offset < 0) {
+                        offset1 = offset2;
+                        /* check for search abort every chunk */
+                        if (abort_func && abort_func(abort_opaque)) {
+                            res = -1;
+                            break;
+                        }
+                        continue;
+                    }
+                    offset1 = offset + 1;
+                } else {
+                    offset1 = eb_next(b, offset);
+                }
             }
             if ((offset & 0xffff) == 0) {
                 /* check for search abort every 64K */
@@ -232,18 +472,18 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                 }
             }
             /* Pass boundary characters to match $ and \b or \B */
-            found = lre_exec(capture, regexp_bytes,
+            found = lre_exec(capture, re->regexp_bytes,
                              (const uint8_t *)b, offset, end_offset, 0, NULL,
                              eb_prevc(b, offset, &offset3), eb_nextc(b, end_offset, &offset3),
-                             (unsigned int (*)(const uint8_t *bc_buf, int offset, int *offsetp))eb_nextc,
-                             (unsigned int (*)(const uint8_t *bc_buf, int offset, int *offsetp))eb_prevc);
+                             (unsigned int (*)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp))eb_nextc,
+                             (unsigned int (*)(const uint8_t *bc_buf, int64_t offset, int64_t *offsetp))eb_prevc);
             if (found < 0) {
                 res = -1;
                 break;
             }
             if (found > 0) {
-                int start = capture[0] - (uint8_t *)(void *)b;
-                int end = capture[1] - (uint8_t *)(void *)b;
+                qe_off_t start = capture[0] - (uint8_t *)(void *)b;
+                qe_off_t end = capture[1] - (uint8_t *)(void *)b;
                 if ((dir >= 0 || end <= end_offset)
                 &&  (!(flags & SEARCH_FLAG_WORD) ||
                      (qe_isword(eb_prevc(b, start, &offset3)) &&
@@ -255,15 +495,22 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                     break;
                 }
             }
-            if (dir >= 0)
+            /* without a prefix, the regexp scanned the rest of the buffer */
+            if (dir >= 0 && pat_len <= 0)
                 break;
         }
-        qe_free(&regexp_bytes);
         qe_free(&capture);
         return res;
     }
 #endif
 
+    pat_len = search_encode_literal(b, flags, buf, len, pat, countof(pat));
+    if (pat_len > 0) {
+        return eb_search_literal(b, dir, flags, start_offset, end_offset,
+                                 pat, pat_len, abort_func, abort_opaque,
+                                 found_offset, found_end);
+    }
+
     for (offset1 = offset;;) {
         if (dir < 0) {
             if (offset == 0)
@@ -280,7 +527,6 @@ static int eb_search(EditBuffer *b, int dir, int flags,
                 return -1;
         }
 
-        /* CG: XXX: Should use buffer specific accelerator */
         /* Get first char separately to compute offset1 */
         c = eb_nextc(b, offset, &offset1);
 
@@ -406,8 +652,9 @@ static void isearch_run(ISearchState *is) {
     buf_t outbuf, *out;
     int i, len, hex_nibble, max_nibble, h;
     char32_t c, hc;
-    unsigned int v;
-    int search_offset, flags, dir;
+    uint64_t v;
+    int flags, dir;
+    qe_off_t search_offset;
     int start_time, elapsed_time;
     EditState *s = is->s;
 
@@ -536,10 +783,11 @@ static void isearch_run(ISearchState *is) {
     dpy_flush(s->screen);
 }
 
-static int isearch_grab(ISearchState *is, EditBuffer *b, int from, int to) {
+static int isearch_grab(ISearchState *is, EditBuffer *b, qe_off_t from, qe_off_t to) {
     /* Retrieve search bytes from the buffer contents */
     // XXX: should special case hex search modes
-    int offset, last = is->pos;
+    int last = is->pos;
+    qe_off_t offset;
     if (b) {
         if (to < 0 || to > b->total_size)
             to = b->total_size;
@@ -560,7 +808,7 @@ static void isearch_yank_word_or_char(EditState *s) {
     // XXX: does not work for hex search modes
     ISearchState *is = s->isearch_state;
     if (is) {
-        int offset0, offset1;
+        qe_off_t offset0, offset1;
         offset0 = s->offset;
         do_word_left_right(s, 1);
         offset1 = s->offset;
@@ -578,8 +826,8 @@ static void isearch_yank_char(EditState *s) {
     // XXX: does not work for hex search modes
     ISearchState *is = s->isearch_state;
     if (is) {
-        int offset0 = s->offset;
-        int offset1 = eb_next(s->b, offset0);
+        qe_off_t offset0 = s->offset;
+        qe_off_t offset1 = eb_next(s->b, offset0);
         isearch_grab(is, s->b, offset0, offset1);
     }
 }
@@ -593,7 +841,7 @@ static void isearch_yank_line(EditState *s) {
     // XXX: does not work for hex search modes
     ISearchState *is = s->isearch_state;
     if (is) {
-        int offset0, offset1;
+        qe_off_t offset0, offset1;
         offset0 = s->offset;
         if (eb_nextc(s->b, offset0, &offset1) == '\n')
             offset0 = offset1;
@@ -652,7 +900,7 @@ static void isearch_addpos(EditState *s, int dir) {
     } else
     if (is->pos < countof(is->search_u32_steps)) {
         /* add the match position, if any */
-        unsigned long v = (is->dir >= 0) ? FOUND_TAG : FOUND_TAG | FOUND_REV;
+        uint64_t v = (is->dir >= 0) ? FOUND_TAG : FOUND_TAG | FOUND_REV;
         if (is->found_offset < 0 && is->search_u32_len > 0) {
             is->search_flags |= SEARCH_FLAG_WRAPPED;
             if (is->dir < 0)
@@ -923,12 +1171,12 @@ static int search_to_u32(char32_t *buf, int size,
 }
 
 void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
-                              QETermStyle *sbuf, int offset_start)
+                              QETermStyle *sbuf, qe_off_t offset_start)
 {
     ISearchState *is = s->isearch_state;
     EditBuffer *b = s->b;
-    int offset, char_offset, found_offset, found_end, offset_end;
-    int search_flags;
+    qe_off_t offset, char_offset, found_offset, found_end, offset_end;
+    int search_flags, line, col_start;
 
     if (!is)
         return;
@@ -949,6 +1197,8 @@ void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
     if (is->search_u32_len <= 0)
         return;
 
+    /* buf may start in the middle of a long line */
+    eb_get_pos(b, &line, &col_start, offset_start);
     char_offset = eb_get_char_offset(b, offset_start);
     offset_end = eb_goto_char(b, char_offset + len);
     offset = 0;
@@ -958,7 +1208,7 @@ void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
     while (eb_search(b, 1, search_flags, offset, offset_end,
                      is->search_u32, is->search_u32_len, NULL, NULL,
                      &found_offset, &found_end) > 0) {
-        int line, start, stop, i;
+        int start, stop, i;
 
         if (found_offset >= offset_end)
             break;
@@ -973,11 +1223,14 @@ void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
         if (found_end > offset_start) {
             /* Compute character positions */
             start = 0;
-            if (found_offset > offset_start)
+            if (found_offset > offset_start) {
                 eb_get_pos(b, &line, &start, found_offset);
+                start -= col_start;
+            }
             stop = len;
             if (found_end < offset_end) {
                 eb_get_pos(b, &line, &stop, found_end);
+                stop -= col_start;
                 if (stop > len)
                     stop = len;
             }
@@ -992,15 +1245,15 @@ void isearch_colorize_matches(EditState *s, char32_t *buf, int len,
 typedef struct QueryReplaceState {
     EditState *s;
     int search_flags;
-    int start_offset;
-    int found_offset, found_end;
+    qe_off_t start_offset;
+    qe_off_t found_offset, found_end;
     int search_u32_len;
     /* query-replace */
     EditState *help_window;
     int replace_all;
     int nb_reps;
     int replace_u32_len;
-    int last_offset;
+    qe_off_t last_offset;
     /* common */
     char search_str[SEARCH_LENGTH * 3];   /* may be in hex */
     char32_t search_u32[SEARCH_LENGTH];   /* code points */
@@ -1317,10 +1570,10 @@ void do_search_string(EditState *s, const char *search_str, int mode)
 {
     char32_t search_u32[SEARCH_LENGTH];
     int search_u32_len;
-    int min_offset, max_offset;
-    int found_offset, found_end;
+    qe_off_t min_offset, max_offset, found_offset, found_end;
     int flags;
-    int offset, count = 0, p1 = 0, p2 = 0, p3, last, start = 0;
+    int count = 0;
+    qe_off_t offset, p1 = 0, p2 = 0, p3, last, start = 0;
     EditBuffer *b1 = NULL;
     EditState *e;
 
@@ -0,0 +1,594 @@
+/*
+ * Buffer core regression tests for QEmacs.
+ *
+ * Copyright (c) 2000-2023 Charlie Gordon.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* This program is linked with the editor objects and exercises the
+ * buffer functions without a display: run it with `make test`.
+ */
+
+#include "qe.h"
+
+static QEditScreen test_screen;
+static int nb_tests, nb_failed;
+
+#define check(cond)  check1(!!(cond), #cond, __FILE__, __LINE__)
+
+static int check1(int ok, const char *expr, const char *file, int line)
+{
+    nb_tests++;
+    if (!ok) {
+        nb_failed++;
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    }
+    return ok;
+}
+
+/* Create a temporary file with 'nb_lines' numbered lines of varying
+ * length, return its name in 'filename'.
+ */
+static int make_test_file(char *filename, int size, const char *tag, int nb_lines)
+{
+    static const char fill[] = "============================================================";
+    FILE *f;
+    int fd, i;
+
+    snprintf(filename, size, "/tmp/qe-test-%s-XXXXXX", tag);
+    fd = mkstemp(filename);
+    if (fd < 0 || !(f = fdopen(fd, "w"))) {
+        perror(filename);
+        return -1;
+    }
+    for (i = 0; i < nb_lines; i++)
+        fprintf(f, "%s line %d%.*s\n", tag, i, i % countof(fill), fill);
+    fclose(f);
+    return 0;
+}
+
+/* Check the line, column and char indexes of 'b' every 'step' bytes
+ * and lines against a plain scan of the buffer contents.
+ */
+static void check_positions(EditBuffer *b, int step)
+{
+    qe_off_t offset;
+    int line, col, line1, col1, c;
+
+    line = col = 0;
+    for (offset = 0;; offset++) {
+        if (offset % step == 0 || offset == b->total_size) {
+            eb_get_pos(b, &line1, &col1, offset);
+            if (!check(line1 == line && col1 == col)) {
+                fprintf(stderr, "  offset %lld: got %d:%d, expected %d:%d\n",
+                        (long long)offset, line1, col1, line, col);
+                return;
+            }
+            if (!check(eb_get_char_offset(b, offset) == offset)
+            ||  !check(eb_goto_char(b, offset) == offset))
+                return;
+        }
+        if (col == 0 && line % step == 0
+        &&  !check(eb_goto_pos(b, line, 0) == offset)) {
+            fprintf(stderr, "  line %d: expected offset %lld\n",
+                    line, (long long)offset);
+            return;
+        }
+        if (offset >= b->total_size)
+            break;
+        eb_read(b, offset, &c, 1);
+        c &= 0xFF;
+        if (c == '\n') {
+            line++;
+            col = 0;
+        } else {
+            col++;
+        }
+    }
+}
+
+/* Yank a large part of a mmapped file into the middle of another
+ * one: the part of the source extent is shared, and the extents split
+ * around the insertion point must not keep their whole statistics.
+ */
+static void test_shared_page_split(void)
+{
+    char name1[64], name2[64];
+    EditBuffer *b1, *b2;
+    QEMapping *m;
+    int line, col;
+
+    if (make_test_file(name1, sizeof(name1), "dest", 8000)
+    ||  make_test_file(name2, sizeof(name2), "src", 4000))
+        return;
+
+    b1 = eb_new("*test-dest*", BF_UTF8);
+    b2 = eb_new("*test-src*", BF_UTF8);
+    if (check(!eb_mmap_buffer(b1, name1) && !eb_mmap_buffer(b2, name2))) {
+        /* compute the statistics of all pages */
+        eb_get_pos(b1, &line, &col, b1->total_size);
+        eb_get_pos(b2, &line, &col, b2->total_size);
+        check(b2->nb_pages == 1 && b2->page_table[0].size == b2->total_size);
+        /* large parts of extents are shared, not copied */
+        m = b2->page_table[0].map;
+        eb_insert_buffer(b1, 2 * MAX_PAGE_SIZE + 1234, b2, 1000, 2 * MAX_PAGE_SIZE);
+        check(b1->nb_pages == 3);
+        check(b1->page_table[1].data == b2->page_table[0].data + 1000);
+        check(b1->page_table[1].map == m && m->ref_count == 3);
+        check_positions(b1, 97);
+        /* edits split the extents around the modified bytes only */
+        eb_delete(b1, 100000, 5000);
+        eb_insert(b1, 200000, "inserted\n", 9);
+        check(b1->nb_pages < 10);
+        check_positions(b1, 83);
+        /* the shared part stays valid when the source buffer is freed */
+        eb_free(&b2);
+        check(m->ref_count == 1);
+        check_positions(b1, 89);
+    }
+    eb_free(&b1);
+    eb_free(&b2);
+    unlink(name1);
+    unlink(name2);
+}
+
+/* Buffers with large pages: appending grows the last page up to the
+ * buffer page size, edits split the pages they modify.
+ */
+static void test_page_size(void)
+{
+    char line[80], buf[80];
+    EditBuffer *b;
+    qe_off_t offset;
+    int i, len;
+
+    b = eb_new("*test-page-size*", BF_UTF8);
+    check(eb_set_page_size(b, 1) == MAX_PAGE_SIZE);
+    check(eb_set_page_size(b, INT_MAX) == MAX_BUFFER_PAGE_SIZE);
+    check(eb_set_page_size(b, LARGE_PAGE_SIZE) == LARGE_PAGE_SIZE);
+    for (i = 0; i < 20000; i++) {
+        len = snprintf(line, sizeof(line), "page size line %d\n", i);
+        eb_insert(b, b->total_size, line, len);
+    }
+    check(b->nb_pages == (b->total_size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE);
+    check(b->page_table[0].size == LARGE_PAGE_SIZE);
+    check_positions(b, 101);
+
+    /* an insertion only splits the page around the insertion point */
+    eb_insert(b, 100000, "inserted", 8);
+    for (i = 0, offset = 0; offset + b->page_table[i].size <= 100000; i++)
+        offset += b->page_table[i].size;
+    check(b->page_table[i].size <= 2 * MAX_PAGE_SIZE);
+    check(eb_read(b, 100000, buf, 8) == 8 && !memcmp(buf, "inserted", 8));
+    check(b->nb_pages < (b->total_size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE + 32);
+    check(eb_delete(b, 100000 - 5, 20000) == 20000);
+    check_positions(b, 97);
+    eb_free(&b);
+}
+
+/* Pseudo-random numbers for the tests, reproducible across runs */
+static unsigned int test_rand(void)
+{
+    static unsigned int seed = 12345;
+
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* Check the properties of 'b' against 'ref': tag "%d" must be at
+ * offset ref[%d], or absent if ref[%d] < 0.
+ */
+static int check_properties(EditBuffer *b, const qe_off_t *ref, int n)
+{
+    QEProperty *p;
+    qe_off_t offset = 0, last = 0;
+    int i, count = 0, live = 0;
+
+    for (p = eb_next_property(b, NULL, &offset); p;
+         p = eb_next_property(b, p, &offset)) {
+        i = strtol(p->data, NULL, 10);
+        if (!check(i >= 0 && i < n && ref[i] == offset && offset >= last)) {
+            fprintf(stderr, "  tag %s at %lld, expected %lld\n", (char *)p->data,
+                    (long long)offset, (long long)(i >= 0 && i < n ? ref[i] : -1));
+            return 0;
+        }
+        last = offset;
+        count++;
+    }
+    for (i = 0; i < n; i++)
+        live += (ref[i] >= 0);
+    return check(count == live);
+}
+
+/* Tags must keep their positions through insertions and deletions,
+ * and be removed with the text they are anchored in.
+ */
+static void test_properties(void)
+{
+    enum { NB_TAGS = 4000, NB_EDITS = 400 };
+    static qe_off_t ref[NB_TAGS];
+    char name[16], text[256];
+    EditBuffer *b;
+    qe_off_t offset, offset2;
+    int i, j, len;
+
+    b = eb_new("*test-properties*", BF_UTF8);
+    memset(text, 'a', sizeof(text));
+    for (i = 0; i < 400; i++)
+        eb_insert(b, b->total_size, text, sizeof(text));
+
+    for (i = 0; i < NB_TAGS; i++) {
+        ref[i] = test_rand() % b->total_size;
+        snprintf(name, sizeof(name), "%d", i);
+        eb_add_property(b, ref[i], QE_PROP_TAG, qe_strdup(name));
+    }
+    /* tag duplicates are ignored */
+    eb_add_property(b, ref[0], QE_PROP_TAG, qe_strdup("0"));
+    check_properties(b, ref, NB_TAGS);
+
+    for (j = 0; j < NB_EDITS; j++) {
+        offset = test_rand() % b->total_size;
+        len = 1 + test_rand() % sizeof(text);
+        if (j & 1) {
+            eb_insert(b, offset, text, len);
+            for (i = 0; i < NB_TAGS; i++) {
+                if (ref[i] >= offset)
+                    ref[i] += len;
+            }
+        } else {
+            len = eb_delete(b, offset, len);
+            for (i = 0; i < NB_TAGS; i++) {
+                if (ref[i] >= offset + len)
+                    ref[i] -= len;
+                else
+                if (ref[i] >= offset)
+                    ref[i] = -1;
+            }
+        }
+    }
+    check_properties(b, ref, NB_TAGS);
+
+    /* find the last tag in a range */
+    for (j = 0; j < 100; j++) {
+        offset = test_rand() % b->total_size;
+        offset2 = offset + test_rand() % 1000;
+        for (i = 0; i < NB_TAGS; i++) {
+            if (ref[i] >= offset && ref[i] < offset2)
+                break;
+        }
+        if (!check((eb_find_property(b, offset, offset2, QE_PROP_TAG) != NULL)
+                   == (i < NB_TAGS)))
+            break;
+    }
+
+    offset = b->total_size / 3;
+    offset2 = 2 * offset;
+    eb_delete_properties(b, offset, offset2);
+    for (i = 0; i < NB_TAGS; i++) {
+        if (ref[i] >= offset && ref[i] < offset2)
+            ref[i] = -1;
+    }
+    check_properties(b, ref, NB_TAGS);
+    eb_delete_properties(b, 0, b->total_size + 1);
+    check(b->property_list == NULL);
+    eb_free(&b);
+}
+
+/* Check the style runs of 'b' against the style of each byte in 'ref':
+ * runs must be maximal and cover the buffer.
+ */
+static int check_styles(EditBuffer *b, const QETermStyle *ref)
+{
+    QETermStyle style;
+    qe_off_t offset, end, i;
+    int nb_runs = 0;
+
+    for (offset = 0; offset < b->total_size; offset = end) {
+        style = eb_get_style_run(b, offset, &end);
+        nb_runs++;
+        if (!check(end > offset && end <= b->total_size
+                   && (end == b->total_size || ref[end] != style)))
+            return 0;
+        for (i = offset; i < end; i++) {
+            if (ref[i] != style || eb_get_style(b, i) != style)
+                break;
+        }
+        if (!check(i == end)) {
+            fprintf(stderr, "  offset %lld: got style %d, expected %d\n",
+                    (long long)i, (int)style, (int)ref[i]);
+            return 0;
+        }
+    }
+    return check(b->b_styles->nb_runs == nb_runs);
+}
+
+/* Styles must follow insertions, writes and deletions, with adjacent
+ * runs of the same style merged.
+ */
+static void test_style_runs(void)
+{
+    enum { MAX_SIZE = 32768, NB_EDITS = 3000 };
+    static QETermStyle ref[MAX_SIZE];
+    char text[64];
+    EditBuffer *b;
+    qe_off_t offset;
+    int i, j, len, op;
+
+    b = eb_new("*test-styles*", BF_UTF8 | BF_STYLE4);
+    memset(text, 'a', sizeof(text));
+    for (i = 0; i < 256; i++)
+        eb_insert(b, b->total_size, text, sizeof(text));
+    memset(ref, 0, sizeof(ref));
+    check_styles(b, ref);
+
+    for (j = 0; j < NB_EDITS; j++) {
+        offset = test_rand() % b->total_size;
+        len = 1 + test_rand() % sizeof(text);
+        op = test_rand() % 3;
+        if (op == 0 && b->total_size + len > MAX_SIZE)
+            op = 2;
+        b->cur_style = test_rand() % 4;
+        switch (op) {
+        case 0:
+            eb_insert(b, offset, text, len);
+            memmove(ref + offset + len, ref + offset,
+                    (b->total_size - len - offset) * sizeof(*ref));
+            for (i = 0; i < len; i++)
+                ref[offset + i] = b->cur_style;
+            break;
+        case 1:
+            len = min_offset(len, b->total_size - offset);
+            eb_write(b, offset, text, len);
+            for (i = 0; i < len; i++)
+                ref[offset + i] = b->cur_style;
+            break;
+        default:
+            len = eb_delete(b, offset, len);
+            memmove(ref + offset, ref + offset + len,
+                    (b->total_size - offset) * sizeof(*ref));
+            break;
+        }
+        if ((j % 500 == 0 || j == NB_EDITS - 1) && !check_styles(b, ref)) {
+            fprintf(stderr, "  after edit %d\n", j);
+            break;
+        }
+    }
+    eb_free(&b);
+}
+
+/* Run 'func' as a command repeated 'rep_count' times, the way
+ * exec_command() does.
+ */
+static void test_command(EditState *s, void (*func)(EditState *s),
+                         int rep_count)
+{
+    QEmacsState *qs = s->qe_state;
+
+    qs->this_cmd_func = (CmdFunc)func;
+    qs->cmd_serial++;
+    while (rep_count --> 0)
+        func(s);
+    qs->last_cmd_func = qs->this_cmd_func;
+    qs->cmd_serial++;
+}
+
+static const char *test_text;
+
+static void test_insert(EditState *s)
+{
+    eb_insert_utf8_buf(s->b, 0, test_text, strlen(test_text));
+}
+
+static void test_overwrite(EditState *s)
+{
+    char buf[LARGE_PAGE_SIZE];
+
+    memset(buf, 'x', sizeof(buf));
+    eb_write(s->b, 0, buf, sizeof(buf));
+}
+
+static int check_contents(EditBuffer *b, const char *str)
+{
+    char buf[64];
+    int len = eb_get_contents(b, buf, sizeof(buf), 0);
+
+    if (!check(len == (int)strlen(str) && !strcmp(buf, str))) {
+        fprintf(stderr, "  got \"%s\", expected \"%s\"\n", buf, str);
+        return 0;
+    }
+    return 1;
+}
+
+/* Return 0 if buffers 'b1' and 'b2' have the same contents */
+static int compare_buffers(EditBuffer *b1, EditBuffer *b2)
+{
+    char buf1[4096], buf2[4096];
+    qe_off_t offset;
+    int len;
+
+    if (b1->total_size != b2->total_size)
+        return 1;
+    for (offset = 0; offset < b1->total_size; offset += len) {
+        len = eb_read(b1, offset, buf1, sizeof(buf1));
+        if (eb_read(b2, offset, buf2, len) != len || memcmp(buf1, buf2, len))
+            return 1;
+    }
+    return 0;
+}
+
+/* Undo several commands with a repeat count, then redo them one by
+ * one: each undo step must be recorded as a separate command.
+ */
+static void test_repeated_undo(void)
+{
+    EditState *s = qe_mallocz(EditState);
+    EditBuffer *b = eb_new("*test-undo*", BF_UTF8 | BF_SAVELOG);
+
+    s->qe_state = &qe_state;
+    s->b = b;
+    eb_insert_utf8_buf(b, 0, "base", 4);
+    test_text = "A";
+    test_command(s, test_insert, 1);
+    test_text = "B";
+    test_command(s, test_insert, 1);
+    test_text = "C";
+    test_command(s, test_insert, 1);
+    test_text = "D";
+    test_command(s, test_insert, 1);
+    check_contents(b, "DCBAbase");
+
+    test_command(s, do_undo, 3);
+    check_contents(b, "Abase");
+    test_command(s, do_undo, 1);
+    check_contents(b, "base");
+    test_command(s, do_redo, 1);
+    check_contents(b, "Abase");
+    test_command(s, do_redo, 2);
+    check_contents(b, "CBAbase");
+    test_command(s, do_undo, 2);
+    check_contents(b, "Abase");
+    test_command(s, do_redo, 3);
+    check_contents(b, "DCBAbase");
+    check(b->log_current == 0);
+    test_command(s, do_redo, 1);
+    check_contents(b, "DCBAbase");
+
+    /* undo the undo sequence after another command */
+    test_command(s, do_undo, 2);
+    check_contents(b, "BAbase");
+    test_text = "E";
+    test_command(s, test_insert, 1);
+    test_command(s, do_undo, 3);
+    check_contents(b, "DCBAbase");
+
+    eb_free(&b);
+    qe_free(&s);
+}
+
+/* Undo a write over shared mmapped pages: logging the inverse write
+ * copies the private bytes and exceeds the undo budget.
+ */
+static void test_undo_shared_write(void)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *s = qe_mallocz(EditState);
+    EditBuffer *b, *b1;
+    char name[64];
+
+    if (make_test_file(name, sizeof(name), "undo", 4000))
+        return;
+
+    b = eb_new("*test-undo-write*", BF_UTF8 | BF_SAVELOG);
+    b1 = eb_new("*test-undo-orig*", BF_UTF8);
+    s->qe_state = qs;
+    s->b = b;
+    if (check(!eb_mmap_buffer(b, name) && !eb_mmap_buffer(b1, name))) {
+        qs->undo_outer_limit = LARGE_PAGE_SIZE / 2;
+        test_command(s, test_overwrite, 1);
+        check(b->log_buffer != NULL && eb_read_one_byte(b, 0) == 'x');
+        test_command(s, do_undo, 1);
+        check(b->log_buffer == NULL && b->total_size == b1->total_size);
+        check(!compare_buffers(b, b1));
+        test_command(s, do_undo, 1);
+        qs->undo_outer_limit = UNDO_OUTER_LIMIT;
+    }
+    eb_free(&b);
+    eb_free(&b1);
+    qe_free(&s);
+    unlink(name);
+}
+
+/* Map a sparse file larger than 4GB: offsets beyond INT_MAX must be
+ * readable and editable.
+ */
+static void test_large_file(void)
+{
+    static const char marker[] = "large file marker";
+    static const char text[] = "inserted";
+    const qe_off_t file_size = (qe_off_t)5 << 30;
+    const qe_off_t pos = (qe_off_t)9 << 29;
+    char name[64], buf[64];
+    EditBuffer *b;
+    qe_off_t end;
+    int fd, len = strlen(marker), text_len = strlen(text);
+
+    if (sizeof(size_t) < sizeof(qe_off_t))
+        return;
+
+    pstrcpy(name, sizeof(name), "/tmp/qe-test-large-XXXXXX");
+    fd = mkstemp(name);
+    if (fd < 0) {
+        perror(name);
+        return;
+    }
+    if (ftruncate(fd, file_size)
+    ||  pwrite(fd, marker, len, pos) != len
+    ||  pwrite(fd, marker, len, file_size - len) != len) {
+        /* the file system does not support large sparse files */
+        close(fd);
+        unlink(name);
+        return;
+    }
+    close(fd);
+
+    b = eb_new("*test-large*", BF_UTF8);
+    if (check(!eb_mmap_buffer(b, name))) {
+        check(b->total_size == file_size && b->total_size > INT_MAX);
+        check(eb_read(b, pos, buf, len) == len && !memcmp(buf, marker, len));
+        end = b->total_size;
+        check(eb_read(b, end - len, buf, sizeof(buf)) == len
+              && !memcmp(buf, marker, len));
+
+        /* edit the buffer beyond 4GB */
+        eb_insert(b, pos, text, text_len);
+        check(b->total_size == end + text_len);
+        check(eb_read(b, pos, buf, text_len + len) == text_len + len
+              && !memcmp(buf, text, text_len)
+              && !memcmp(buf + text_len, marker, len));
+        check(eb_delete(b, pos, text_len) == text_len);
+        check(b->total_size == end);
+        check(eb_read(b, pos, buf, len) == len && !memcmp(buf, marker, len));
+    }
+    eb_free(&b);
+    unlink(name);
+}
+
+int main(int argc, char **argv)
+{
+    QEmacsState *qs = &qe_state;
+
+    qs->screen = &test_screen;
+    qs->default_tab_width = DEFAULT_TAB_WIDTH;
+    qs->default_fill_column = DEFAULT_FILL_COLUMN;
+    qs->mmap_threshold = MIN_MMAP_SIZE;
+    eb_init();
+    charset_init();
+
+    test_shared_page_split();
+    test_page_size();
+    test_properties();
+    test_style_runs();
+    test_repeated_undo();
+    test_undo_shared_write();
+    test_large_file();
+
+    printf("%d tests, %d failed\n", nb_tests, nb_failed);
+    return nb_failed != 0;
+}
@@ -142,6 +142,8 @@ typedef struct TTYState {
 #define USE_BLINK_AS_BRIGHT_BG  0x08
 #define USE_256_COLORS          0x10
 #define USE_TRUE_COLORS         0x20
+#define USE_SCROLL_REGION       0x40
+#define USE_INSERT_DELETE_LINE  0x80
     /* number of colors supported by the actual terminal */
     const QEColor *term_colors;
     int term_fg_colors_count;
@@ -153,11 +155,34 @@ typedef struct TTYState {
     /* cache for glyph combinations */
     // XXX: should keep track of max_comb and max_max_comb
     char32_t comb_cache[COMB_CACHE_SIZE];
+    /* frame output buffer, sent with a single write() per frame */
+    int out_fd;
+    u8 *out_buf;
+    int out_len, out_size;
+    /* actual terminal state, -1 for unknown */
+    int term_x, term_y;
+    int term_fg, term_bg;
+    int term_sgr;
+#define SGR_BOLD                0x01
+#define SGR_UNDERLINE           0x02
+#define SGR_BLINK               0x04
+#define SGR_ITALIC              0x08
+    int term_cursor_shown;
+    int term_reset;     /* charset and attributes must be reset */
+    int term_region;    /* a scroll region is set */
+    /* hashes of the shadow rows for scroll detection */
+    unsigned int *row_hash;
+    int *lcs;
+    int lcs_size;
+    /* output statistics */
+    int last_frame_bytes, max_frame_bytes;
+    int scroll_count;
 } TTYState;
 
 static QEditScreen *tty_screen;   /* for tty_term_exit and tty_term_resize */
 
 static void tty_dpy_invalidate(QEditScreen *s);
+static unsigned int tty_row_hash(const TTYChar *p, int width);
 
 static void tty_term_resize(int sig);
 static void tty_term_exit(void);
@@ -186,6 +211,7 @@ static int tty_dpy_init(QEditScreen *s,
     s->STDOUT = stdout;
     s->priv_data = ts;
     s->media = CSS_MEDIA_TTY;
+    ts->out_fd = fileno(s->STDOUT);
 
     /* Derive some settings from the TERM environment variable */
     ts->term_code = TERM_UNKNOWN;
@@ -201,21 +227,27 @@ static int tty_dpy_init(QEditScreen *s,
          */
         if (strstart(ts->term_name, "ansi", NULL)) {
             ts->term_code = TERM_ANSI;
-            ts->term_flags |= KBS_CONTROL_H;
+            ts->term_flags |= KBS_CONTROL_H | USE_INSERT_DELETE_LINE;
         } else
         if (strstart(ts->term_name, "vt100", NULL)) {
             ts->term_code = TERM_VT100;
-            ts->term_flags |= KBS_CONTROL_H;
+            ts->term_flags |= KBS_CONTROL_H | USE_SCROLL_REGION;
         } else
         if (strstart(ts->term_name, "xterm", NULL)) {
             ts->term_code = TERM_XTERM;
+            ts->term_flags |= USE_SCROLL_REGION | USE_INSERT_DELETE_LINE;
         } else
         if (strstart(ts->term_name, "linux", NULL)) {
             ts->term_code = TERM_LINUX;
+            ts->term_flags |= USE_SCROLL_REGION | USE_INSERT_DELETE_LINE;
+        } else
+        if (strstart(ts->term_name, "screen", NULL)
+        ||  strstart(ts->term_name, "tmux", NULL)) {
+            ts->term_flags |= USE_SCROLL_REGION | USE_INSERT_DELETE_LINE;
         } else
         if (strstart(ts->term_name, "cygwin", NULL)) {
             ts->term_code = TERM_CYGWIN;
-            ts->term_flags |= KBS_CONTROL_H |
+            ts->term_flags |= KBS_CONTROL_H | USE_INSERT_DELETE_LINE |
                               USE_BOLD_AS_BRIGHT_FG | USE_BLINK_AS_BRIGHT_BG;
         } else
         if (strstart(ts->term_name, "tw100", NULL)) {
@@ -453,6 +485,9 @@ static void tty_dpy_close(QEditScreen *s)
 
     qe_free(&ts->screen);
     qe_free(&ts->line_updated);
+    qe_free(&ts->out_buf);
+    qe_free(&ts->row_hash);
+    qe_free(&ts->lcs);
     qe_free(&s->priv_data);
 }
 
@@ -520,6 +555,7 @@ static void tty_dpy_invalidate(QEditScreen *s)
     /* screen buffer + shadow buffer + extra slot for loop guard */
     qe_realloc(&ts->screen, size * 2 + sizeof(TTYChar));
     qe_realloc(&ts->line_updated, s->height);
+    qe_realloc(&ts->row_hash, s->height * sizeof(*ts->row_hash));
     ts->screen_size = count;
 
     /* Erase shadow buffer to impossible value */
@@ -531,6 +567,13 @@ static void tty_dpy_invalidate(QEditScreen *s)
     }
     /* All rows need refresh */
     memset(ts->line_updated, 1, s->height);
+    ts->row_hash[0] = tty_row_hash(ts->screen + count, s->width);
+    for (i = 1; i < s->height; i++) {
+        ts->row_hash[i] = ts->row_hash[0];
+    }
+    /* Terminal state is unknown */
+    ts->term_x = ts->term_y = -1;
+    ts->term_reset = 1;
 
     s->clip_x1 = 0;
     s->clip_y1 = 0;
@@ -1028,13 +1071,15 @@ static void comb_cache_describe(QEditScreen *s, EditBuffer *b) {
               ts->term_code == TERM_CYGWIN ? "CYGWIN" :
               ts->term_code == TERM_TW100 ? "TW100" :
               "");
-    eb_printf(b, "%*s: %#x %s%s%s%s%s%s\n", w, "term_flags", ts->term_flags,
+    eb_printf(b, "%*s: %#x %s%s%s%s%s%s%s%s\n", w, "term_flags", ts->term_flags,
               ts->term_flags & KBS_CONTROL_H ? " KBS_CONTROL_H" : "",
               ts->term_flags & USE_ERASE_END_OF_LINE ? " USE_ERASE_END_OF_LINE" : "",
               ts->term_flags & USE_BOLD_AS_BRIGHT_FG ? " USE_BOLD_AS_BRIGHT_FG" : "",
               ts->term_flags & USE_BLINK_AS_BRIGHT_BG ? " USE_BLINK_AS_BRIGHT_BG" : "",
               ts->term_flags & USE_256_COLORS ? " USE_256_COLORS" : "",
-              ts->term_flags & USE_TRUE_COLORS ? " USE_TRUE_COLORS" : "");
+              ts->term_flags & USE_TRUE_COLORS ? " USE_TRUE_COLORS" : "",
+              ts->term_flags & USE_SCROLL_REGION ? " USE_SCROLL_REGION" : "",
+              ts->term_flags & USE_INSERT_DELETE_LINE ? " USE_INSERT_DELETE_LINE" : "");
     eb_printf(b, "%*s: fg:%d, bg:%d\n", w, "terminal colors",
               ts->term_fg_colors_count, ts->term_bg_colors_count);
     eb_printf(b, "%*s: fg:%d, bg:%d\n", w, "virtual tty colors",
@@ -1161,37 +1206,525 @@ static void tty_dpy_set_clip(qe__unused__ QEditScreen *s,
 {
 }
 
-static void tty_dpy_flush(QEditScreen *s)
+/*---------------- frame output ----------------*/
+
+static void tty_write_fully(int fd, const u8 *buf, int len)
 {
-    TTYState *ts = s->priv_data;
-    TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, cc, blankcc;
-    int y, shadow, ch, bgcolor, fgcolor, shifted, gotopos, attr;
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        buf += n;
+        len -= n;
+    }
+}
 
-    /* CG: Should optimize output by computing it in a temporary buffer
-     * and flushing it in one call to fwrite()
-     */
+static void tty_out_flush(TTYState *ts)
+{
+    tty_write_fully(ts->out_fd, ts->out_buf, ts->out_len);
+    ts->out_len = 0;
+}
+
+static void tty_out_write(TTYState *ts, const void *buf, int len)
+{
+    if (ts->out_len + len > ts->out_size) {
+        int size = max_int(ts->out_size * 2, ts->out_len + len + 4096);
+        if (qe_realloc(&ts->out_buf, size)) {
+            ts->out_size = size;
+        } else {
+            /* out of memory: send the frame in pieces */
+            tty_out_flush(ts);
+            if (len > ts->out_size) {
+                tty_write_fully(ts->out_fd, buf, len);
+                return;
+            }
+        }
+    }
+    memcpy(ts->out_buf + ts->out_len, buf, len);
+    ts->out_len += len;
+}
+
+static inline void tty_out_putc(TTYState *ts, int c)
+{
+    if (ts->out_len < ts->out_size) {
+        ts->out_buf[ts->out_len++] = c;
+    } else {
+        u8 b = c;
+        tty_out_write(ts, &b, 1);
+    }
+}
+
+static inline void tty_out_puts(TTYState *ts, const char *str)
+{
+    tty_out_write(ts, str, strlen(str));
+}
+
+static void tty_out_printf(TTYState *ts, const char *fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    tty_out_write(ts, buf, min_int(len, ssizeof(buf) - 1));
+}
+
+/* Move the terminal cursor to column `x` of row `y` using the shortest
+ * of an absolute or a relative cursor movement.
+ */
+static void tty_out_goto(QEditScreen *s, TTYState *ts, int x, int y)
+{
+    char buf[24], rel[24];
+    int len, rlen, n;
+
+    if (ts->term_x == x && ts->term_y == y)
+        return;
+
+    if (x == 0 && y == 0)
+        len = snprintf(buf, sizeof(buf), "\033[H");
+    else
+    if (x == 0)
+        len = snprintf(buf, sizeof(buf), "\033[%dH", y + 1);
+    else
+        len = snprintf(buf, sizeof(buf), "\033[%d;%dH", y + 1, x + 1);
+
+    if (ts->term_x >= 0 && ts->term_y >= 0) {
+        rlen = 0;
+        if (y == ts->term_y) {
+            if (x == 0) {
+                rlen = snprintf(rel, sizeof(rel), "\r");
+            } else
+            if (x > ts->term_x) {
+                n = x - ts->term_x;
+                rlen = (n == 1) ? snprintf(rel, sizeof(rel), "\033[C") :
+                    snprintf(rel, sizeof(rel), "\033[%dC", n);
+            } else {
+                n = ts->term_x - x;
+                rlen = (n == 1) ? snprintf(rel, sizeof(rel), "\b") :
+                    snprintf(rel, sizeof(rel), "\033[%dD", n);
+            }
+        } else
+        if (x == 0 && y == ts->term_y + 1) {
+            /* OPOST is disabled: LF does not return to column 0 */
+            rlen = snprintf(rel, sizeof(rel), "\r\n");
+        } else
+        if (x == ts->term_x) {
+            n = y - ts->term_y;
+            rlen = (n > 0) ? snprintf(rel, sizeof(rel), "\033[%dB", n) :
+                snprintf(rel, sizeof(rel), "\033[%dA", -n);
+        }
+        if (rlen > 0 && rlen < len) {
+            memcpy(buf, rel, rlen);
+            len = rlen;
+        }
+    }
+    tty_out_write(ts, buf, len);
+    ts->term_x = x;
+    ts->term_y = y;
+}
+
+/* Compute the SGR parameters for foreground color `fgcolor` */
+static int tty_fg_param(TTYState *ts, char *buf, int size, int fgcolor)
+{
+#if TTY_STYLE_BITS == 32
+    if (ts->term_fg_colors_count > 256 && fgcolor >= 256) {
+        QEColor rgb = qe_unmap_color(fgcolor, ts->tty_fg_colors_count);
+        return snprintf(buf, size, ";38;2;%d;%d;%d",
+                        (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
+    }
+#endif
+    if (ts->term_fg_colors_count > 16 && fgcolor >= 16)
+        return snprintf(buf, size, ";38;5;%d", fgcolor);
+    if (ts->term_flags & USE_BOLD_AS_BRIGHT_FG)
+        return snprintf(buf, size, ";%d", 30 + (fgcolor & 7));
+    return snprintf(buf, size, ";%d",
+                    fgcolor > 7 ? 90 + fgcolor - 8 : 30 + fgcolor);
+}
+
+/* Compute the SGR parameters for background color `bgcolor` */
+static int tty_bg_param(TTYState *ts, char *buf, int size, int bgcolor)
+{
+#if TTY_STYLE_BITS == 32
+    if (ts->term_bg_colors_count > 256 && bgcolor >= 256) {
+        /* XXX: should special case dynamic palette */
+        QEColor rgb = qe_unmap_color(bgcolor, ts->tty_bg_colors_count);
+        return snprintf(buf, size, ";48;2;%d;%d;%d",
+                        (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
+    }
+#endif
+    if (ts->term_bg_colors_count > 16 && bgcolor >= 16)
+        return snprintf(buf, size, ";48;5;%d", bgcolor);
+    if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG)
+        return snprintf(buf, size, ";%d", 40 + (bgcolor & 7));
+    return snprintf(buf, size, ";%d",
+                    bgcolor > 7 ? 100 + bgcolor - 8 : 40 + bgcolor);
+}
 
-    /* Hide cursor, goto home, reset attributes */
-    TTY_FPUTS("\033[?25l\033[H\033[0m", s->STDOUT);
+/* Select the colors and attributes of `cc` with a single SGR sequence,
+ * either as a delta from the current terminal state or from a reset,
+ * whichever is shorter.
+ */
+static void tty_out_style(TTYState *ts, TTYChar cc)
+{
+    static const char sgr_on[4][3] = { "1", "4", "5", "3" };
+    static const char sgr_off[4][3] = { "22", "24", "25", "23" };
+    char fgbuf[24], bgbuf[24], delta[80], reset[80];
+    int fgcolor, bgcolor, attr, sgr, dlen, rlen, fglen, bglen, i;
+
+    fgcolor = TTY_CHAR_GET_FG(cc);
+    bgcolor = TTY_CHAR_GET_BG(cc);
+    attr = TTY_CHAR_GET_ATTR(cc);
+    sgr = 0;
+    if (attr & TTY_BOLD)
+        sgr |= SGR_BOLD;
+    if (attr & TTY_UNDERLINE)
+        sgr |= SGR_UNDERLINE;
+    if (attr & TTY_BLINK)
+        sgr |= SGR_BLINK;
+    if (attr & TTY_ITALIC)
+        sgr |= SGR_ITALIC;
+    /* bright colors may be emulated with bold and blink */
+    if ((ts->term_flags & USE_BOLD_AS_BRIGHT_FG) && fgcolor > 7
+    &&  !(ts->term_fg_colors_count > 16 && fgcolor >= 16))
+        sgr |= SGR_BOLD;
+    if ((ts->term_flags & USE_BLINK_AS_BRIGHT_BG) && bgcolor > 7
+    &&  !(ts->term_bg_colors_count > 16 && bgcolor >= 16))
+        sgr |= SGR_BLINK;
+
+    if (fgcolor == ts->term_fg && bgcolor == ts->term_bg
+    &&  sgr == ts->term_sgr)
+        return;
 
-    if (ts->term_code != TERM_CYGWIN) {
-        TTY_FPUTS("\033(B\033)0", s->STDOUT);
+    fglen = tty_fg_param(ts, fgbuf, sizeof(fgbuf), fgcolor);
+    bglen = tty_bg_param(ts, bgbuf, sizeof(bgbuf), bgcolor);
+
+    /* parameters are accumulated with a leading ';' that is skipped */
+    dlen = rlen = 0;
+    reset[rlen++] = ';';
+    reset[rlen++] = '0';
+    for (i = 0; i < 4; i++) {
+        if (sgr & (1 << i)) {
+            rlen += snprintf(reset + rlen, 4, ";%s", sgr_on[i]);
+            if (!(ts->term_sgr & (1 << i)))
+                dlen += snprintf(delta + dlen, 4, ";%s", sgr_on[i]);
+        } else
+        if (ts->term_sgr & (1 << i)) {
+            dlen += snprintf(delta + dlen, 4, ";%s", sgr_off[i]);
+        }
+    }
+    memcpy(reset + rlen, bgbuf, bglen);
+    rlen += bglen;
+    memcpy(reset + rlen, fgbuf, fglen);
+    rlen += fglen;
+    if (bgcolor != ts->term_bg) {
+        memcpy(delta + dlen, bgbuf, bglen);
+        dlen += bglen;
     }
+    if (fgcolor != ts->term_fg) {
+        memcpy(delta + dlen, fgbuf, fglen);
+        dlen += fglen;
+    }
+    tty_out_puts(ts, "\033[");
+    if (dlen <= rlen)
+        tty_out_write(ts, delta + 1, dlen - 1);
+    else
+        tty_out_write(ts, reset + 1, rlen - 1);
+    tty_out_putc(ts, 'm');
+    ts->term_fg = fgcolor;
+    ts->term_bg = bgcolor;
+    ts->term_sgr = sgr;
+}
+
+static inline void tty_out_hide_cursor(TTYState *ts, int *hidden)
+{
+    if (!*hidden) {
+        tty_out_puts(ts, "\033[?25l");
+        *hidden = 1;
+    }
+}
+
+static unsigned int tty_row_hash(const TTYChar *p, int width)
+{
+    unsigned int h = 0;
+    while (width-- > 0) {
+        h = h * 31 + (unsigned int)*p;
+#if TTY_STYLE_BITS == 32
+        h = h * 31 + (unsigned int)(*p >> 32);
+#endif
+        p++;
+    }
+    return h;
+}
+
+/* Move the terminal rows `top` to `bot` up by `n` rows (down if `n` is
+ * negative) and update the shadow rows and hashes accordingly.  The
+ * exposed rows are blank in the shadow and get redrawn.
+ */
+static void tty_out_scroll(QEditScreen *s, TTYState *ts,
+                           int top, int bot, int n, int *hidden)
+{
+    TTYChar *shadow = ts->screen + ts->screen_size;
+    TTYChar cc, blankcc;
+    int w = s->width;
+    int i, k = abs(n);
+    int start = (n > 0) ? bot + 1 - k : top;
+    size_t rowsize = w * sizeof(TTYChar);
+
+    tty_out_hide_cursor(ts, hidden);
+    /* exposed rows are erased with the current background color:
+     * select the colors of the end of the first exposed row */
+    cc = ts->screen[start * w + w - 1];
+    tty_out_style(ts, TTY_CHAR(' ', TTY_CHAR_GET_FG(cc), TTY_CHAR_GET_BG(cc)));
+    blankcc = ts->term_sgr ? (TTYChar)-1 :
+        TTY_CHAR(' ', ts->term_fg, ts->term_bg);
+    if (ts->term_flags & USE_SCROLL_REGION) {
+        /* setting the scroll region homes the cursor, relative
+         * movements are clipped by the margins: force absolute
+         * cursor positioning */
+        tty_out_printf(ts, "\033[%d;%dr", top + 1, bot + 1);
+        ts->term_x = ts->term_y = -1;
+        ts->term_region = 1;
+        if (ts->term_code == TERM_XTERM && k > 1) {
+            tty_out_printf(ts, "\033[%d%c", k, n > 0 ? 'S' : 'T');
+        } else
+        if (n > 0) {
+            tty_out_goto(s, ts, 0, bot);
+            for (i = 0; i < k; i++)
+                tty_out_putc(ts, '\n');
+        } else {
+            tty_out_goto(s, ts, 0, top);
+            for (i = 0; i < k; i++)
+                tty_out_puts(ts, "\033M");
+        }
+        ts->term_x = ts->term_y = -1;
+    } else {
+        /* delete lines then insert lines to leave the rows below
+         * `bot` in place */
+        tty_out_goto(s, ts, 0, n > 0 ? top : bot + 1 - k);
+        tty_out_printf(ts, "\033[%dM", k);
+        tty_out_goto(s, ts, 0, n > 0 ? bot + 1 - k : top);
+        tty_out_printf(ts, "\033[%dL", k);
+    }
+    if (n > 0) {
+        memmove(shadow + top * w, shadow + (top + k) * w,
+                (bot + 1 - top - k) * rowsize);
+        memmove(ts->row_hash + top, ts->row_hash + top + k,
+                (bot + 1 - top - k) * sizeof(*ts->row_hash));
+    } else {
+        memmove(shadow + (top + k) * w, shadow + top * w,
+                (bot + 1 - top - k) * rowsize);
+        memmove(ts->row_hash + top + k, ts->row_hash + top,
+                (bot + 1 - top - k) * sizeof(*ts->row_hash));
+    }
+    for (i = 0; i < k * w; i++) {
+        shadow[start * w + i] = blankcc;
+    }
+    for (i = start; i < start + k; i++) {
+        ts->row_hash[i] = tty_row_hash(shadow + i * w, w);
+        ts->line_updated[i] = 1;
+    }
+    ts->scroll_count++;
+}
 
-    bgcolor = -1;
-    fgcolor = -1;
-    attr = 0;
+/* Detect rows moved vertically between the shadow and the screen and
+ * move them on the terminal with scroll regions or insert and delete
+ * line sequences instead of redrawing them.
+ * `nh` holds the hashes of the screen rows, ts->row_hash those of the
+ * shadow rows.  Moved blocks of rows are found as a longest common
+ * subsequence of the old and new rows, weighted by the estimated cost
+ * of redrawing them.  The last row is never moved, so the bottom right
+ * cell is stable.
+ */
+static void tty_dpy_scroll(QEditScreen *s, TTYState *ts,
+                           const unsigned int *nh, int *hidden)
+{
+    const unsigned int *oh = ts->row_hash;
+    int src[MAX_SCREEN_LINES];
+    int drawcost[MAX_SCREEN_LINES], diffcost[MAX_SCREEN_LINES];
+    int hunk_i[MAX_SCREEN_LINES], hunk_j[MAX_SCREEN_LINES];
+    int hunk_len[MAX_SCREEN_LINES];
+    int w = s->width, h = s->height - 1;
+    int lo, hi, n, i, j, k, x, y, len, nb_hunks, score;
+    int *L;
+    const TTYChar *p, *q;
+
+    /* trim the common prefix and suffix */
+    for (lo = 0; lo < h && nh[lo] == oh[lo]; lo++)
+        continue;
+    for (hi = h; hi > lo && nh[hi - 1] == oh[hi - 1]; hi--)
+        continue;
+    n = hi - lo;
+    if (n < 2)
+        return;
+
+    if (ts->lcs_size < (n + 1) * (n + 1)) {
+        if (!qe_realloc(&ts->lcs, (n + 1) * (n + 1) * sizeof(*ts->lcs)))
+            return;
+        ts->lcs_size = (n + 1) * (n + 1);
+    }
+    L = ts->lcs;
+
+    /* estimate the cost of drawing each row on a blank row and over
+     * the current contents of the terminal row */
+    for (j = lo; j < hi; j++) {
+        p = ts->screen + j * w;
+        q = p + ts->screen_size;
+        drawcost[j] = diffcost[j] = 1;
+        for (x = 0; x < w; x++) {
+            drawcost[j] += (TTY_CHAR_GET_CH(p[x]) != ' ');
+            diffcost[j] += (p[x] != q[x]);
+        }
+    }
+
+    /* L[(i - lo) * (n + 1) + (j - lo)] is the weight of the best
+     * common subsequence of old rows from i and new rows from j.
+     * Moving a row saves redrawing it over the current row, keeping
+     * a row in place saves redrawing it after it is scrolled away.
+     */
+#define LCS(i, j)  L[((i) - lo) * (n + 1) + ((j) - lo)]
+#define WEIGHT(i, j)  ((i) == (j) ? drawcost[j] : diffcost[j])
+    /* rows with the same hash must be compared: a moved row that is
+     * not updated is not redrawn */
+#define SAME(i, j)  (oh[i] == nh[j] \
+                     && !memcmp(ts->screen + ts->screen_size + (i) * w, \
+                                ts->screen + (j) * w, w * sizeof(TTYChar)))
+    for (i = hi; i >= lo; i--) {
+        for (j = hi; j >= lo; j--) {
+            if (i == hi || j == hi) {
+                LCS(i, j) = 0;
+            } else
+            if (SAME(i, j)) {
+                LCS(i, j) = max_int(WEIGHT(i, j) + LCS(i + 1, j + 1),
+                                    max_int(LCS(i + 1, j), LCS(i, j + 1)));
+            } else {
+                LCS(i, j) = max_int(LCS(i + 1, j), LCS(i, j + 1));
+            }
+        }
+    }
+    for (j = lo; j < hi; j++)
+        src[j] = -1;
+    for (i = j = lo; i < hi && j < hi;) {
+        if (SAME(i, j) && LCS(i, j) == WEIGHT(i, j) + LCS(i + 1, j + 1)) {
+            src[j++] = i++;
+        } else
+        if (LCS(i + 1, j) >= LCS(i, j + 1)) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+#undef SAME
+#undef WEIGHT
+#undef LCS
+
+    /* group matched rows into blocks moved by the same offset, ignore
+     * blocks that are cheaper to redraw than to move: the rows exposed
+     * by the move must be drawn on blank rows. */
+    nb_hunks = 0;
+    for (j = lo; j < hi;) {
+        if (src[j] < 0 || src[j] == j) {
+            j++;
+            continue;
+        }
+        i = src[j];
+        score = -12;
+        for (y = j; y < hi && src[y] == i + (y - j); y++)
+            score += diffcost[y];
+        len = y - j;
+        k = abs(i - j);
+        /* first exposed row */
+        x = (j < i) ? i + len - k : i;
+        for (y = x; y < x + k; y++)
+            score -= max_int(0, drawcost[y] - diffcost[y]);
+        if (score > 0) {
+            hunk_i[nb_hunks] = i;
+            hunk_j[nb_hunks] = j;
+            hunk_len[nb_hunks] = len;
+            nb_hunks++;
+        }
+        j += len;
+    }
+
+    /* Move blocks up from top to bottom, then blocks down from bottom
+     * to top: since the matching is monotonic, a move never disturbs
+     * the source of a pending move or the destination of a previous
+     * one. */
+    for (y = 0; y < nb_hunks; y++) {
+        if (hunk_j[y] < hunk_i[y]) {
+            tty_out_scroll(s, ts, hunk_j[y], hunk_i[y] + hunk_len[y] - 1,
+                           hunk_i[y] - hunk_j[y], hidden);
+        }
+    }
+    for (y = nb_hunks; y-- > 0;) {
+        if (hunk_j[y] > hunk_i[y]) {
+            tty_out_scroll(s, ts, hunk_i[y], hunk_j[y] + hunk_len[y] - 1,
+                           hunk_i[y] - hunk_j[y], hidden);
+        }
+    }
+    if (ts->term_region) {
+        /* reset the scroll region, this homes the cursor */
+        tty_out_puts(ts, "\033[r");
+        ts->term_region = 0;
+        ts->term_x = ts->term_y = 0;
+    }
+}
+
+static void tty_dpy_flush(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, *ptr5, cc, blankcc;
+    unsigned int nh[MAX_SCREEN_LINES];
+    int y, x, shadow, ch, shifted, hidden, start_len, count;
+
+    /* The whole frame is composed in ts->out_buf and sent to the
+     * terminal in a single write() call.  Unchanged cells, cursor
+     * position and attributes are tracked across frames to minimize
+     * the output.
+     */
+    fflush(s->STDOUT);
+    start_len = ts->out_len;
+    hidden = 0;
     shifted = 0;
-    gotopos = 0;
+
+    if (ts->term_reset) {
+        ts->term_reset = 0;
+        tty_out_puts(ts, "\033[0m");
+        if (ts->term_code != TERM_CYGWIN) {
+            tty_out_puts(ts, "\033(B\033)0");
+        }
+        ts->term_fg = ts->term_bg = -1;
+        ts->term_sgr = 0;
+        ts->term_cursor_shown = 0;
+    }
 
     shadow = ts->screen_size;
     /* We cannot print anything on the bottom right screen cell,
      * pretend it's OK: */
     ts->screen[shadow - 1] = ts->screen[2 * shadow - 1];
 
+    /* Hash the updated rows, try moving rows if enough have changed */
+    for (y = count = 0; y < s->height; y++) {
+        nh[y] = ts->row_hash[y];
+        if (ts->line_updated[y]) {
+            nh[y] = tty_row_hash(ts->screen + y * s->width, s->width);
+            count += (nh[y] != ts->row_hash[y]);
+        }
+    }
+    if (count >= 2
+    &&  (ts->term_flags & (USE_SCROLL_REGION | USE_INSERT_DELETE_LINE))) {
+        tty_dpy_scroll(s, ts, nh, &hidden);
+    }
+
     for (y = 0; y < s->height; y++) {
         if (ts->line_updated[y]) {
             ts->line_updated[y] = 0;
+            /* the shadow row will be identical to the screen row */
+            ts->row_hash[y] = nh[y];
             ptr = ptr1 = ts->screen + y * s->width;
             ptr3 = ptr2 = ptr1 + s->width;
 
@@ -1209,6 +1742,8 @@ static void tty_dpy_flush(QEditScreen *s)
             if (ptr1 == ptr2)
                 continue;
 
+            tty_out_hide_cursor(ts, &hidden);
+
             /* quickly scan for last difference on row:
              * the first difference on row at ptr1 is before ptr2
              * so we do not need a test on ptr2 > ptr1
@@ -1229,7 +1764,7 @@ static void tty_dpy_flush(QEditScreen *s)
              */
             if ((ts->term_flags & USE_ERASE_END_OF_LINE)
             &&  TTY_CHAR_GET_CH(ptr4[-1]) == ' '
-            &&  (/*!(ts->term_flags & USE_BLINK_AS_BRIGHT_BG) ||*/
+            &&  (!(ts->term_flags & USE_BLINK_AS_BRIGHT_BG) ||
                  TTY_CHAR_GET_BG(ptr4[-1]) < 8))
             {
                 /* find the last non blank char on row */
@@ -1253,151 +1788,63 @@ static void tty_dpy_flush(QEditScreen *s)
                 }
             }
 
-            /* Go to the first difference */
-            /* CG: this probably does not work if there are
-             * double-width glyphs on the row in front of this
-             * difference (actually it should)
-             */
-            gotopos = 1;
             while (ptr1 < ptr4) {
+                x = ptr1 - ptr;
                 cc = *ptr1;
+                if (cc == ptr1[shadow] && ts->term_x == x && ts->term_y == y) {
+                    /* Skip a run of unchanged cells if moving the
+                     * cursor is cheaper than rewriting them.
+                     */
+                    for (ptr5 = ptr1 + 1; ptr5 < ptr4 && *ptr5 == ptr5[shadow]; ptr5++)
+                        continue;
+                    if (ptr5 - ptr1 > 5) {
+                        ptr1 = ptr5;
+                        continue;
+                    }
+                }
                 ptr1[shadow] = cc;
                 ptr1++;
                 ch = TTY_CHAR_GET_CH(cc);
-                if ((char32_t)ch == TTY_CHAR_NONE)
+                if ((char32_t)ch == TTY_CHAR_NONE) {
+                    /* right half of a double width glyph */
+                    if (ts->term_x == x && ts->term_y == y)
+                        ts->term_x = (x + 1 < s->width) ? x + 1 : -1;
                     continue;
-                if (gotopos) {
-                    /* Move the cursor: row and col are 1 based
-                       but ptr1 has already been incremented */
-                    gotopos = 0;
-                    TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
-                                y + 1, (int)(ptr1 - ptr));
                 }
+                /* Move the cursor if needed */
+                tty_out_goto(s, ts, x, y);
                 /* output attributes */
-                if (bgcolor != (int)TTY_CHAR_GET_BG(cc)) {
-                    int lastbg = bgcolor;
-                    bgcolor = TTY_CHAR_GET_BG(cc);
-#if TTY_STYLE_BITS == 32
-                    if (ts->term_bg_colors_count > 256 && bgcolor >= 256) {
-                        /* XXX: should special case dynamic palette */
-                        QEColor rgb = qe_unmap_color(bgcolor, ts->tty_bg_colors_count);
-                        TTY_FPRINTF(s->STDOUT, "\033[48;2;%d;%d;%dm",
-                                    (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
-                    } else
-#endif
-                    if (ts->term_bg_colors_count > 16 && bgcolor >= 16) {
-                        TTY_FPRINTF(s->STDOUT, "\033[48;5;%dm", bgcolor);
-                    } else
-                    if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG) {
-                        if (bgcolor > 7) {
-                            if (lastbg <= 7) {
-                                TTY_FPUTS("\033[5m", s->STDOUT);
-                            }
-                        } else {
-                            if (lastbg > 7) {
-                                TTY_FPUTS("\033[25m", s->STDOUT);
-                            }
-                        }
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm", 40 + (bgcolor & 7));
-                    } else {
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm",
-                                    bgcolor > 7 ? 100 + bgcolor - 8 :
-                                    40 + bgcolor);
-                    }
-                }
-                /* do not special case SPC on fg color change
-                 * because of combining marks */
-                if (fgcolor != (int)TTY_CHAR_GET_FG(cc)) {
-                    int lastfg = fgcolor;
-                    fgcolor = TTY_CHAR_GET_FG(cc);
-#if TTY_STYLE_BITS == 32
-                    if (ts->term_fg_colors_count > 256 && fgcolor >= 256) {
-                        QEColor rgb = qe_unmap_color(fgcolor, ts->tty_fg_colors_count);
-                        TTY_FPRINTF(s->STDOUT, "\033[38;2;%d;%d;%dm",
-                                    (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
-                    } else
-#endif
-                    if (ts->term_fg_colors_count > 16 && fgcolor >= 16) {
-                        TTY_FPRINTF(s->STDOUT, "\033[38;5;%dm", fgcolor);
-                    } else
-                    if (ts->term_flags & USE_BOLD_AS_BRIGHT_FG) {
-                        if (fgcolor > 7) {
-                            if (lastfg <= 7) {
-                                TTY_FPUTS("\033[1m", s->STDOUT);
-                            }
-                        } else {
-                            if (lastfg > 7) {
-                                TTY_FPUTS("\033[22m", s->STDOUT);
-                            }
-                        }
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm", 30 + (fgcolor & 7));
-                    } else {
-                        TTY_FPRINTF(s->STDOUT, "\033[%dm",
-                                    fgcolor > 8 ? 90 + fgcolor - 8 :
-                                    30 + fgcolor);
-                    }
-                }
-                if (attr != (int)TTY_CHAR_GET_COL(cc)) {
-                    int lastattr = attr;
-                    attr = TTY_CHAR_GET_COL(cc);
-
-                    if ((attr ^ lastattr) & TTY_BOLD) {
-                        if (attr & TTY_BOLD) {
-                            TTY_FPUTS("\033[1m", s->STDOUT);
-                        } else {
-                            TTY_FPUTS("\033[22m", s->STDOUT);
-                        }
-                    }
-                    if ((attr ^ lastattr) & TTY_UNDERLINE) {
-                        if (attr & TTY_UNDERLINE) {
-                            TTY_FPUTS("\033[4m", s->STDOUT);
-                        } else {
-                            TTY_FPUTS("\033[24m", s->STDOUT);
-                        }
-                    }
-                    if ((attr ^ lastattr) & TTY_BLINK) {
-                        if (attr & TTY_BLINK) {
-                            TTY_FPUTS("\033[5m", s->STDOUT);
-                        } else {
-                            TTY_FPUTS("\033[25m", s->STDOUT);
-                        }
-                    }
-                    if ((attr ^ lastattr) & TTY_ITALIC) {
-                        if (attr & TTY_ITALIC) {
-                            TTY_FPUTS("\033[3m", s->STDOUT);
-                        } else {
-                            TTY_FPUTS("\033[23m", s->STDOUT);
-                        }
-                    }
-                }
+                tty_out_style(ts, cc);
                 if (shifted) {
                     /* Kludge for linedrawing chars */
                     if (ch < 128 || ch >= 128 + 32) {
-                        TTY_FPUTS("\033(B", s->STDOUT);
+                        tty_out_puts(ts, "\033(B");
                         shifted = 0;
                     }
                 }
+                /* the cursor is in an unspecified state after
+                 * writing to the last column */
+                ts->term_x = (x + 1 < s->width) ? x + 1 : -1;
 
                 /* do not display escape codes or invalid codes */
                 if (ch < 32 || ch == 127) {
-                    TTY_PUTC('.', s->STDOUT);
+                    tty_out_putc(ts, '.');
                 } else
                 if (ch < 127) {
-                    TTY_PUTC(ch, s->STDOUT);
+                    tty_out_putc(ts, ch);
                 } else
                 if (ch < 128 + 32) {
                     /* Kludges for linedrawing chars */
                     if (ts->term_code == TERM_CYGWIN) {
                         static const char unitab_xterm_poorman[32] =
                         "*#****o~**+++++-----++++|****L. ";
-                        TTY_PUTC(unitab_xterm_poorman[ch - 128],
-                                 s->STDOUT);
+                        tty_out_putc(ts, unitab_xterm_poorman[ch - 128]);
                     } else {
                         if (!shifted) {
-                            TTY_FPUTS("\033(0", s->STDOUT);
+                            tty_out_puts(ts, "\033(0");
                             shifted = 1;
                         }
-                        TTY_PUTC(ch - 32, s->STDOUT);
+                        tty_out_putc(ts, ch - 32);
                     }
                 } else
 #if COMB_CACHE_SIZE > 1
@@ -1414,25 +1861,25 @@ static void tty_dpy_flush(QEditScreen *s)
                         while (ncc-- > 1) {
                             q = s->charset->encode_func(s->charset, buf, *ip++);
                             if (q) {
-                                TTY_FWRITE(buf, 1, q - buf, s->STDOUT);
+                                tty_out_write(ts, buf, q - buf);
                                 // XXX: should check s->unicode_version for
                                 //      terminal support of non ASCII codepoint
                                 //      and force GOTOPOS if unsupported
                                 /* force cursor repositioning if glyph may have variants */
-                                gotopos |= qe_wcwidth_variant(ip[-1]);
+                                if (qe_wcwidth_variant(ip[-1]))
+                                    ts->term_x = -1;
                             } else {
-                                gotopos = 1;
+                                ts->term_x = -1;
                             }
                         }
                     } else {
                         /* invalid comb cache offset: must issue gotopos */
-                        gotopos = 1;
+                        ts->term_x = -1;
                     }
                 } else
 #endif
                 {
                     u8 buf[10], *q;
-                    int nc;
 
                     // was in qemacs-0.3.1.g2.gw/tty.c:
                     // if (cc == 0x2500)
@@ -1455,56 +1902,56 @@ static void tty_dpy_flush(QEditScreen *s)
                         //      terminal support of non ASCII codepoint
                         //      and force GOTOPOS if unsupported
                         /* force cursor repositioning if glyph may have variants */
-                        gotopos |= qe_wcwidth_variant(ch);
-                    }
-                    nc = q - buf;
-                    if (nc == 1) {
-                        TTY_PUTC(*buf, s->STDOUT);
-                    } else {
-                        TTY_FWRITE(buf, 1, nc, s->STDOUT);
+                        if (qe_wcwidth_variant(ch))
+                            ts->term_x = -1;
                     }
+                    tty_out_write(ts, buf, q - buf);
                 }
             }
             if (shifted) {
-                TTY_FPUTS("\033(B", s->STDOUT);
+                tty_out_puts(ts, "\033(B");
                 shifted = 0;
             }
             if (ptr1 < ptr2) {
                 /* More differences to synch in shadow, erase eol */
                 cc = *ptr1;
-                if (gotopos) {
-                    /* Move the cursor: row and col are 1 based
-                       but ptr1 has already been incremented */
-                    gotopos = 0;
-                    TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
-                                y + 1, (int)(ptr1 - ptr));
-                }
-                /* the current attribute is already set correctly */
-                TTY_FPUTS("\033[K", s->STDOUT);
+                tty_out_goto(s, ts, ptr1 - ptr, y);
+                /* erase with the background color of the blank cells */
+                tty_out_style(ts, cc);
+                tty_out_puts(ts, "\033[K");
                 while (ptr1 < ptr2) {
                     ptr1[shadow] = cc;
                     ptr1++;
                 }
             }
-            // XXX: should check if needed
-            //if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG)
-            {
-                if (bgcolor > 7) {
-                    TTY_FPUTS("\033[0m", s->STDOUT);
-                    fgcolor = bgcolor = -1;
-                    attr = 0;
-                }
+            if ((ts->term_flags & USE_BLINK_AS_BRIGHT_BG) && ts->term_bg > 7) {
+                /* do not leak the emulated bright background */
+                tty_out_puts(ts, "\033[0m");
+                ts->term_fg = ts->term_bg = -1;
+                ts->term_sgr = 0;
             }
         }
     }
 
-    // XXX: should check if needed
-    TTY_FPUTS("\033[0m", s->STDOUT);
     if (ts->cursor_y + 1 >= 0 && ts->cursor_x + 1 >= 0) {
-        TTY_FPRINTF(s->STDOUT, "\033[?25h\033[%d;%dH",
-                    ts->cursor_y + 1, ts->cursor_x + 1);
+        tty_out_goto(s, ts, max_int(ts->cursor_x, 0), max_int(ts->cursor_y, 0));
+        if (hidden || !ts->term_cursor_shown) {
+            tty_out_puts(ts, "\033[?25h");
+            ts->term_cursor_shown = 1;
+        }
+    } else
+    if (ts->term_cursor_shown) {
+        tty_out_hide_cursor(ts, &hidden);
+        ts->term_cursor_shown = 0;
     }
-    fflush(s->STDOUT);
+
+    if (ts->out_len > start_len) {
+        ts->last_frame_bytes = ts->out_len - start_len;
+        ts->max_frame_bytes = max_int(ts->max_frame_bytes, ts->last_frame_bytes);
+        s->frame_bytes += ts->last_frame_bytes;
+        tty_out_flush(ts);
+    }
+    s->frame_count++;
 
     /* Update combination cache from screen.
      * Shadow is identical to screen so no need to scan it.
@@ -1684,7 +2131,19 @@ static int tty_dpy_draw_picture(QEditScreen *s,
 
 static void tty_dpy_describe(QEditScreen *s, EditBuffer *b)
 {
+    TTYState *ts = s->priv_data;
+    int w = 16;
+
     comb_cache_describe(s, b);
+
+    eb_printf(b, "\nTerminal output:\n\n");
+    eb_printf(b, "%*s: %d\n", w, "frames", s->frame_count);
+    eb_printf(b, "%*s: %lld\n", w, "bytes", (long long)s->frame_bytes);
+    eb_printf(b, "%*s: %lld\n", w, "bytes/frame",
+              s->frame_count ? (long long)(s->frame_bytes / s->frame_count) : 0LL);
+    eb_printf(b, "%*s: %d\n", w, "last frame", ts->last_frame_bytes);
+    eb_printf(b, "%*s: %d\n", w, "largest frame", ts->max_frame_bytes);
+    eb_printf(b, "%*s: %d\n", w, "scrolls", ts->scroll_count);
 }
 
 static QEDisplay tty_dpy = {
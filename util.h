@@ -90,10 +90,28 @@ void splitpath(char *dirname, int dirname_size,
 
 /*---- Buffer offset functions ----*/
 
-/* buffer offsets are 32-bit signed integers */
-#define min_offset(a, b)  min_int(a, b)
-#define max_offset(a, b)  max_int(a, b)
-#define clamp_offset(a, b, c)  clamp_int(a, b, c)
+/* buffer offsets are 64-bit signed integers: files larger than 2 GB
+ * can be mapped in memory.  Page sizes, line and column numbers are
+ * still int.
+ */
+typedef int64_t qe_off_t;
+#define QE_OFF_MAX  INT64_MAX
+
+static inline qe_off_t min_offset(qe_off_t a, qe_off_t b) {
+    return a < b ? a : b;
+}
+
+static inline qe_off_t max_offset(qe_off_t a, qe_off_t b) {
+    return a > b ? a : b;
+}
+
+static inline qe_off_t clamp_offset(qe_off_t a, qe_off_t b, qe_off_t c) {
+    return a < b ? b : a > c ? c : a;
+}
+
+static inline qe_off_t align_offset(qe_off_t a, int n) {
+    return (a / n) * n;
+}
 
 /*---- Character classification functions ----*/
 
@@ -29,6 +29,8 @@ static QVarType qe_variable_set_value_offset(EditState *s, VarDef *vp, void *ptr
                                              const char *value, int num);
 static QVarType qe_variable_set_value_generic(EditState *s, VarDef *vp, void *ptr,
                                               const char *value, int num);
+static QVarType qe_variable_set_value_page_size(EditState *s, VarDef *vp, void *ptr,
+                                                const char *value, int num);
 
 const char * const var_domain[] = {
     "global",   /* VAR_GLOBAL */
@@ -70,6 +72,29 @@ static VarDef var_table[] = {
            "Size from which files are mmapped instead of loaded in memory." )
     S_VAR( "max-load-size", max_load_size, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Maximum size for files to be loaded or mmapped into a buffer." )
+    S_VAR( "undo-outer-limit", undo_outer_limit, VAR_NUMBER, VAR_RW_SAVE,
+           "Maximum number of bytes of undo information kept for a buffer, "
+           "0 for no limit." )
+    S_VAR( "process-frame-interval", process_frame_interval, VAR_NUMBER, VAR_RW_SAVE,
+           "Minimum number of milliseconds between redisplays caused by "
+           "process output, 0 to redisplay after every read." )
+    S_VAR( "process-frames", process_frames, VAR_NUMBER, VAR_RO,
+           "Number of redisplays caused by process output." )
+    S_VAR( "process-dropped-frames", process_dropped_frames, VAR_NUMBER, VAR_RO,
+           "Number of process output reads coalesced into a later redisplay." )
+    S_VAR( "process-frame-rate", process_frame_rate, VAR_NUMBER, VAR_RO,
+           "Number of redisplays caused by process output in the last second." )
+    S_VAR( "display-frame-budget", display_frame_budget, VAR_NUMBER, VAR_RW_SAVE,
+           "Number of milliseconds of display after which the windows other "
+           "than the current one are deferred while input is pending." )
+    S_VAR( "display-frames", display_frames, VAR_NUMBER, VAR_RO,
+           "Number of screen redisplays." )
+    S_VAR( "display-windows", display_windows, VAR_NUMBER, VAR_RO,
+           "Number of windows displayed by screen redisplays." )
+    S_VAR( "display-skipped-windows", display_skipped_windows, VAR_NUMBER, VAR_RO,
+           "Number of unchanged windows not displayed by screen redisplays." )
+    S_VAR( "display-deferred-windows", display_deferred_windows, VAR_NUMBER, VAR_RO,
+           "Number of windows deferred to an idle time while input was pending." )
     S_VAR( "show-unicode", show_unicode, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
            "Set to show non-ASCII characters as unicode escape sequences." )
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW_SAVE,   // XXX: need set_value function
@@ -95,6 +120,8 @@ static VarDef var_table[] = {
            "Distance between tab stops (for display of tab characters), in columns." )
     B_VAR( "fill-column", fill_column, VAR_NUMBER, VAR_RW,   // XXX: need set_value function
            "Column beyond which automatic line-wrapping should happen." )
+    B_VAR_F( "page-size", page_size, VAR_NUMBER, VAR_RW, qe_variable_set_value_page_size,
+           "Size of the buffer pages created by insertions, in bytes." )
 
     W_VAR_F( "point", offset, VAR_NUMBER, VAR_RW, qe_variable_set_value_offset,    /* should be window-point */
            "Current value of point in this window." )
@@ -131,6 +158,13 @@ static VarDef var_table[] = {
            "Set to prevent graphics display." )
     G_VAR( "disable-crc", disable_crc, VAR_NUMBER, VAR_RW_SAVE,
            "Set to prevent CRC based display cache." )
+    G_VAR( "disable-layout-cache", disable_layout_cache, VAR_NUMBER, VAR_RW_SAVE,
+           "Set to lay out the lines of text windows again for each display pass." )
+    G_VAR( "disable-window-skip", disable_window_skip, VAR_NUMBER, VAR_RW_SAVE,
+           "Set to display the unchanged windows again for each redisplay." )
+    G_VAR( "disable-mode-index", disable_mode_index, VAR_NUMBER, VAR_RW_SAVE,
+           "Set to call the probe functions of all modes to select the mode "
+           "of a file." )
     G_VAR( "use-html", use_html, VAR_NUMBER, VAR_RW, NULL )
     G_VAR( "is-player", is_player, VAR_NUMBER, VAR_RW, NULL )
     G_VAR( "full-version", use_full_version, VAR_NUMBER, VAR_RW, NULL )
@@ -250,7 +284,18 @@ QVarType qe_get_variable(EditState *s, const char *name,
             pstrcpy(buf, size, str);
         break;
     case VAR_NUMBER:
-        memcpy(&num, ptr, sizeof(num));
+        if (vp->size == sizeof(qe_off_t)) {
+            /* buffer offsets and sizes */
+            qe_off_t offset;
+            memcpy(&offset, ptr, sizeof(offset));
+            if (!pnum) {
+                snprintf(buf, size, "%lld", (long long)offset);
+                break;
+            }
+            num = (int)min_offset(offset, INT_MAX);
+        } else {
+            memcpy(&num, ptr, sizeof(num));
+        }
         if (pnum)
             *pnum = num;
         else
@@ -271,8 +316,19 @@ static QVarType qe_variable_set_value_offset(EditState *s, VarDef *vp, void *ptr
         /* XXX: should have default, min and max values */
         return VAR_INVALID;
     } else {
-        int *pnum = (int *)ptr;
-        *pnum = clamp_offset(num, 0, s->b->total_size);
+        qe_off_t *poffset = (qe_off_t *)ptr;
+        *poffset = clamp_offset(num, 0, s->b->total_size);
+        return VAR_NUMBER;
+    }
+}
+
+static QVarType qe_variable_set_value_page_size(EditState *s, VarDef *vp, void *ptr,
+                                                const char *value, int num)
+{
+    if (value) {
+        return VAR_INVALID;
+    } else {
+        eb_set_page_size(s->b, num);
         return VAR_NUMBER;
     }
 }
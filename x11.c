@@ -1213,7 +1213,7 @@ static void selection_send(X11State *xs, XSelectionRequestEvent *rq)
 
         /* get qemacs yank buffer */
         b = qs->yank_buffers[qs->yank_current];
-        if (!b)
+        if (!b || b->total_size > INT_MAX)
             return;
         buf = qe_malloc_array(unsigned char, b->total_size);
         if (!buf)
@@ -1228,6 +1228,7 @@ static void selection_send(X11State *xs, XSelectionRequestEvent *rq)
     if (rq->target == xa_formats[0]
     ||  rq->target == xa_formats[1]
     ||  rq->target == xa_formats[2]) {
+        qe_off_t content_size;
         int len, size;
 
         /* get qemacs yank buffer */
@@ -1236,7 +1237,10 @@ static void selection_send(X11State *xs, XSelectionRequestEvent *rq)
             return;
 
         /* Get buffer contents encoded in utf-8-unix */
-        size = eb_get_content_size(b) + 1;
+        content_size = eb_get_content_size(b);
+        if (content_size >= INT_MAX)
+            return;
+        size = (int)content_size + 1;
         buf = qe_malloc_array(unsigned char, size);
         if (!buf)
             return;